@@ -0,0 +1,631 @@
+/*
+ * End-to-end benchmark: creates, modifies and deletes files at a given rate
+ * across N directories, subscribes to the messages dir_mon publishes for
+ * them and measures the time from write() to receipt of the message naming
+ * the file. Results are printed as JSON.
+ *
+ * dir_mon is either started by the benchmark (-x) or already running (-P);
+ * the directories are handed to it with a start_dir_monitoring command.
+ * With -i the monitors run in the benchmark process instead and messages
+ * are read in place from the ring sink, no broker involved.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <json-c/json.h>
+#include <mosquitto.h>
+
+#include "dir-monitor.h"
+#include "dm-config.h"
+#include "dm-sink.h"
+#include "dm-ring.h"
+
+
+#define DEFAULT_DIRS		16
+#define DEFAULT_RATE		10000
+#define DEFAULT_SECONDS		10
+#define DEFAULT_BASE		"/tmp/dm-bench"
+/* Time for dir_mon to set up the watches */
+#define DEFAULT_SETTLE_MS	1000
+/* Time for the last messages to come in */
+#define DRAIN_MS		3000
+
+#define TOPIC_PREFIX		"DIR_MONITOR/"
+#define CONFIG_TOPIC		TOPIC_PREFIX "config"
+#define STATS_TOPIC		TOPIC_PREFIX "stats"
+#define ACK_TOPIC		TOPIC_PREFIX "ack"
+
+/* Share of operations in percent; creates make up the rest */
+#define DEFAULT_MODIFY		30
+#define DEFAULT_DELETE		20
+
+/* State of a file; times are written by the load thread, cleared by the
+ * subscriber thread once the matching message arrived.
+ */
+struct file_slot {
+	/* Earliest unreported write, 0 if none */
+	uint64_t mod_ns;
+	/* Unreported delete, 0 if none */
+	uint64_t del_ns;
+};
+
+struct bench {
+	const char *base;
+	const char *host;
+	int port;
+	unsigned int nr_dirs;
+	unsigned int rate;
+	unsigned int seconds;
+	unsigned int settle_ms;
+	unsigned int modify_pct;
+	unsigned int delete_pct;
+	pid_t pid;
+	/* Monitors run in this process */
+	unsigned int local : 1;
+	/* Files by sequence number */
+	struct file_slot *files;
+	size_t nr_files;
+	size_t max_files;
+	/* Sequence numbers of existing files */
+	unsigned int *live;
+	size_t nr_live;
+	/* Counters of the load thread */
+	unsigned long ops;
+	unsigned long events;
+	unsigned long coalesced;
+	/* Counters of the subscriber thread */
+	unsigned long messages;
+	unsigned long reported;
+	uint32_t *lat_us;
+	size_t nr_lat;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_ms(unsigned int ms)
+{
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+		;
+}
+
+static void file_path(const struct bench *b, unsigned int seq, char *buff,
+		      size_t size)
+{
+	snprintf(buff, size, "%s/d%u/f%u", b->base, seq % b->nr_dirs, seq);
+}
+
+/* Record a pending report unless one is pending already */
+static void mark(struct bench *b, uint64_t *slot, uint64_t t)
+{
+	uint64_t zero = 0;
+
+	b->events++;
+	if (!__atomic_compare_exchange_n(slot, &zero, t, 0, __ATOMIC_RELEASE,
+					 __ATOMIC_RELAXED))
+		b->coalesced++;
+}
+
+static void op_write(struct bench *b, unsigned int seq, int flags)
+{
+	char path[256];
+	int fd;
+
+	file_path(b, seq, path, sizeof(path));
+	fd = open(path, O_WRONLY | O_APPEND | flags, 0644);
+	if (fd == -1)
+		return;
+	mark(b, &b->files[seq].mod_ns, now_ns());
+	if (write(fd, "benchmark\n", 10) < 0)
+		perror("write");
+	close(fd);
+}
+
+static void op_delete(struct bench *b, size_t idx)
+{
+	unsigned int seq = b->live[idx];
+	char path[256];
+
+	file_path(b, seq, path, sizeof(path));
+	mark(b, &b->files[seq].del_ns, now_ns());
+	if (unlink(path) != 0)
+		perror("unlink");
+	b->live[idx] = b->live[--b->nr_live];
+}
+
+static void one_op(struct bench *b)
+{
+	unsigned int r = rand() % 100;
+
+	b->ops++;
+	if (b->nr_live && r < b->delete_pct) {
+		op_delete(b, rand() % b->nr_live);
+	} else if (b->nr_live && r < b->delete_pct + b->modify_pct) {
+		op_write(b, b->live[rand() % b->nr_live], 0);
+	} else if (b->nr_files < b->max_files) {
+		unsigned int seq = b->nr_files++;
+
+		b->live[b->nr_live++] = seq;
+		op_write(b, seq, O_CREAT);
+	}
+}
+
+static void report(struct bench *b, const char *name, int deleted)
+{
+	uint64_t *slot, t;
+	unsigned long seq;
+	char *end;
+
+	/* Names are f<seq> */
+	if (name[0] != 'f')
+		return;
+	seq = strtoul(name + 1, &end, 10);
+	if (*end || seq >= b->max_files)
+		return;
+
+	slot = deleted ? &b->files[seq].del_ns : &b->files[seq].mod_ns;
+	t = __atomic_exchange_n(slot, 0, __ATOMIC_ACQUIRE);
+	if (!t)
+		return;
+
+	b->reported++;
+	if (b->nr_lat < b->max_files)
+		b->lat_us[b->nr_lat++] = (now_ns() - t) / 1000;
+}
+
+static void consume(struct bench *b, json_tokener *tok, const char *payload,
+		    size_t size)
+{
+	json_object *root, *status, *files;
+	int i, len, deleted;
+
+	json_tokener_reset(tok);
+	root = json_tokener_parse_ex(tok, payload, size);
+	if (root == NULL)
+		return;
+
+	b->messages++;
+	if (json_object_object_get_ex(root, "Status", &status) &&
+	    json_object_object_get_ex(root, "Files", &files)) {
+		deleted = !strcmp(json_object_get_string(status), "deleted");
+		len = json_object_array_length(files);
+		for (i = 0; i < len; i++)
+			report(b, json_object_get_string(
+				       json_object_array_get_idx(files, i)),
+			       deleted);
+	}
+	json_object_put(root);
+}
+
+static void on_message(struct mosquitto *mosq, void *obj,
+		       const struct mosquitto_message *msg)
+{
+	static json_tokener *tok;
+
+	if (!strcmp(msg->topic, CONFIG_TOPIC) ||
+	    !strcmp(msg->topic, STATS_TOPIC) ||
+	    !strcmp(msg->topic, ACK_TOPIC))
+		return;
+	/* Network loop thread only */
+	if (tok == NULL && (tok = json_tokener_new()) == NULL)
+		return;
+	consume((struct bench *)obj, tok, (const char *)msg->payload,
+		msg->payloadlen);
+}
+
+/* In-process mode: monitors of this process publish to the ring sink */
+struct local {
+	struct bench *b;
+	struct dir_monitor_list *list;
+	struct dm_ring_reader reader;
+	pthread_t tid;
+	volatile int stop;
+};
+
+static void *ring_thread(void *arg)
+{
+	struct local *l = (struct local *)arg;
+	json_tokener *tok = json_tokener_new();
+
+	while (!l->stop) {
+		const struct dm_ring_record *rec;
+
+		if (!dm_ring_reader_wait(&l->reader, 100))
+			continue;
+		/* Payloads are parsed straight out of the ring */
+		while ((rec = dm_ring_reader_peek(&l->reader)) != NULL) {
+			consume(l->b, tok, rec->data + rec->topic_len,
+				rec->payload_len);
+			dm_ring_reader_next(&l->reader);
+		}
+	}
+	json_tokener_free(tok);
+	return NULL;
+}
+
+static int local_start(struct bench *b, struct local *l)
+{
+	struct dm_config cfg;
+	struct dm_sink *sink;
+	unsigned int i;
+
+	dm_config_init(&cfg);
+	cfg.monitor.sinks = DM_SINK_BIT(DM_SINK_RING);
+
+	l->b = b;
+	l->list = dir_monitor_list_create(&cfg);
+	if (l->list == NULL)
+		return -1;
+	sink = dir_monitor_list_sink(l->list, DM_SINK_RING);
+	if (sink == NULL ||
+	    dm_ring_reader_open(&l->reader, dm_ring_sink_fd(sink, NULL)) != 0)
+		goto exit_destroy;
+	if (pthread_create(&l->tid, NULL, ring_thread, l) != 0)
+		goto exit_close;
+
+	for (i = 0; i < b->nr_dirs; i++) {
+		char path[256];
+
+		snprintf(path, sizeof(path), "%s/d%u", b->base, i);
+		dir_monitor_list_add(l->list, path, NULL);
+	}
+	return 0;
+
+ exit_close:
+	dm_ring_reader_close(&l->reader);
+ exit_destroy:
+	dir_monitor_list_destroy(l->list);
+	return -1;
+}
+
+static void local_stop(struct local *l)
+{
+	l->stop = 1;
+	pthread_join(l->tid, NULL);
+	if (l->reader.nr_lost)
+		fprintf(stderr, "Ring reader fell behind %lu times\n",
+			l->reader.nr_lost);
+	dm_ring_reader_close(&l->reader);
+	dir_monitor_list_destroy(l->list);
+}
+
+/* CPU seconds and RSS of a process from /proc */
+static int proc_usage(pid_t pid, double *cpu_s, long *rss_kb, long *hwm_kb)
+{
+	unsigned long utime, stime;
+	char path[64], line[256];
+	FILE *fp;
+	char *p;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+	p = fgets(line, sizeof(line), fp);
+	fclose(fp);
+	/* Fields after the command name, which may hold blanks */
+	if (p == NULL || (p = strrchr(line, ')')) == NULL ||
+	    sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+		   &utime, &stime) != 2)
+		return -1;
+	*cpu_s = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), fp)) {
+		sscanf(line, "VmRSS: %ld", rss_kb);
+		sscanf(line, "VmHWM: %ld", hwm_kb);
+	}
+	fclose(fp);
+	return 0;
+}
+
+static void send_command(struct mosquitto *mosq, const char *cmd,
+			 const struct bench *b)
+{
+	json_object *root = json_object_new_object();
+	json_object *msg = json_object_new_object();
+	json_object *dirs = json_object_new_array();
+	const char *s;
+	unsigned int i;
+
+	for (i = 0; i < b->nr_dirs; i++) {
+		char path[256];
+
+		snprintf(path, sizeof(path), "%s/d%u", b->base, i);
+		json_object_array_add(dirs, json_object_new_string(path));
+	}
+	json_object_object_add(msg, "directories", dirs);
+	json_object_object_add(root, "cmd_code", json_object_new_string(cmd));
+	json_object_object_add(root, "msg", msg);
+
+	s = json_object_to_json_string(root);
+	mosquitto_publish(mosq, NULL, CONFIG_TOPIC, strlen(s), s, 1, false);
+	json_object_put(root);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const uint32_t *v, size_t n, double pct)
+{
+	size_t i;
+
+	if (!n)
+		return 0;
+	i = (size_t)(pct / 100.0 * (n - 1) + 0.5);
+	return v[i];
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] [-- dir_mon options]\n"
+		"  -n <num>   Directories (default %u)\n"
+		"  -r <num>   File operations per second (default %u)\n"
+		"  -t <sec>   Load duration (default %u)\n"
+		"  -m <pct>   Share of modifications (default %u)\n"
+		"  -d <pct>   Share of deletions (default %u)\n"
+		"  -b <path>  Base directory (default %s)\n"
+		"  -s <ms>    Settle time before the load (default %u)\n"
+		"  -H <host>  Broker host (default localhost)\n"
+		"  -p <port>  Broker port (default 1883)\n"
+		"  -x <path>  Start dir_mon from path\n"
+		"  -P <pid>   Measure running dir_mon process\n"
+		"  -i         Run the monitors in process, read the ring sink\n",
+		prog, DEFAULT_DIRS, DEFAULT_RATE, DEFAULT_SECONDS,
+		DEFAULT_MODIFY, DEFAULT_DELETE, DEFAULT_BASE,
+		DEFAULT_SETTLE_MS);
+}
+
+static pid_t spawn(const char *exe, char **args, int nr_args)
+{
+	char **argv = calloc(nr_args + 2, sizeof(char *));
+	pid_t pid;
+
+	if (argv == NULL)
+		return -1;
+	argv[0] = (char *)exe;
+	memcpy(argv + 1, args, nr_args * sizeof(char *));
+
+	pid = fork();
+	if (pid == 0) {
+		/* Keep the JSON output clean */
+		int fd = open("/dev/null", O_WRONLY);
+
+		if (fd != -1) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+		}
+		execv(exe, argv);
+		_exit(127);
+	}
+	free(argv);
+	return pid;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench b;
+	struct mosquitto *mosq = NULL;
+	struct local local;
+	const char *exe = NULL;
+	double cpu0 = 0, cpu1 = 0, elapsed;
+	long rss = 0, hwm = 0;
+	uint64_t start, t;
+	unsigned int i;
+	int opt, have_usage = 0;
+
+	memset(&b, 0, sizeof(b));
+	b.base = DEFAULT_BASE;
+	b.host = "localhost";
+	b.port = 1883;
+	b.nr_dirs = DEFAULT_DIRS;
+	b.rate = DEFAULT_RATE;
+	b.seconds = DEFAULT_SECONDS;
+	b.settle_ms = DEFAULT_SETTLE_MS;
+	b.modify_pct = DEFAULT_MODIFY;
+	b.delete_pct = DEFAULT_DELETE;
+
+	while ((opt = getopt(argc, argv, "n:r:t:m:d:b:s:H:p:x:P:ih")) != -1) {
+		switch (opt) {
+		case 'n':
+			b.nr_dirs = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			b.rate = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			b.seconds = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			b.modify_pct = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			b.delete_pct = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			b.base = optarg;
+			break;
+		case 's':
+			b.settle_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'H':
+			b.host = optarg;
+			break;
+		case 'p':
+			b.port = strtoul(optarg, NULL, 0);
+			break;
+		case 'x':
+			exe = optarg;
+			break;
+		case 'P':
+			b.pid = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			b.local = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (!b.nr_dirs || !b.rate || !b.seconds ||
+	    b.modify_pct + b.delete_pct > 100) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	b.max_files = (size_t)b.rate * b.seconds;
+	b.files = calloc(b.max_files, sizeof(struct file_slot));
+	b.live = calloc(b.max_files, sizeof(unsigned int));
+	b.lat_us = calloc(b.max_files, sizeof(uint32_t));
+	if (b.files == NULL || b.live == NULL || b.lat_us == NULL) {
+		fprintf(stderr, "Memory allocation failure\n");
+		return 1;
+	}
+
+	mkdir(b.base, 0755);
+	for (i = 0; i < b.nr_dirs; i++) {
+		char path[256];
+
+		snprintf(path, sizeof(path), "%s/d%u", b.base, i);
+		if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+			perror(path);
+			return 1;
+		}
+	}
+
+	if (b.local) {
+		memset(&local, 0, sizeof(local));
+		if (local_start(&b, &local) != 0) {
+			fprintf(stderr, "Failed to start monitors\n");
+			return 1;
+		}
+		b.pid = getpid();
+		exe = NULL;
+	} else {
+		if (exe) {
+			b.pid = spawn(exe, argv + optind, argc - optind);
+			if (b.pid == -1) {
+				perror("fork");
+				return 1;
+			}
+			/* Let it connect and subscribe */
+			sleep_ms(500);
+		}
+
+		mosquitto_lib_init();
+		mosq = mosquitto_new(NULL, true, &b);
+		if (mosq == NULL || mosquitto_connect(mosq, b.host, b.port, 60) !=
+					    MOSQ_ERR_SUCCESS) {
+			fprintf(stderr, "Failed to connect to %s:%d\n", b.host,
+				b.port);
+			return 1;
+		}
+		mosquitto_message_callback_set(mosq, on_message);
+		mosquitto_subscribe(mosq, NULL, TOPIC_PREFIX "+", 0);
+		mosquitto_loop_start(mosq);
+
+		send_command(mosq, "start_dir_monitoring", &b);
+	}
+	sleep_ms(b.settle_ms);
+
+	srand(1);
+	if (b.pid)
+		have_usage = proc_usage(b.pid, &cpu0, &rss, &hwm) == 0;
+
+	/* Paced load: catch up with the schedule, then sleep a tick */
+	start = now_ns();
+	for (;;) {
+		uint64_t due;
+
+		t = now_ns() - start;
+		if (t >= (uint64_t)b.seconds * 1000000000)
+			break;
+		due = t * b.rate / 1000000000;
+		while (b.ops < due)
+			one_op(&b);
+		sleep_ms(1);
+	}
+	elapsed = (now_ns() - start) / 1e9;
+
+	sleep_ms(DRAIN_MS);
+	if (b.pid && have_usage)
+		have_usage = proc_usage(b.pid, &cpu1, &rss, &hwm) == 0;
+
+	if (b.local)
+		local_stop(&local);
+	else
+		send_command(mosq, "stop_dir_monitoring", &b);
+	sleep_ms(100);
+	for (i = 0; i < b.nr_live; i++) {
+		char path[256];
+
+		file_path(&b, b.live[i], path, sizeof(path));
+		unlink(path);
+	}
+	if (exe) {
+		const char *kill_cmd = "{\"cmd_code\":\"kill_dir_monitoring\"}";
+
+		mosquitto_publish(mosq, NULL, CONFIG_TOPIC, strlen(kill_cmd),
+				  kill_cmd, 1, false);
+		sleep_ms(500);
+		kill(b.pid, SIGTERM);
+		waitpid(b.pid, NULL, 0);
+	}
+	if (mosq) {
+		mosquitto_loop_stop(mosq, true);
+		mosquitto_destroy(mosq);
+		mosquitto_lib_cleanup();
+	}
+
+	qsort(b.lat_us, b.nr_lat, sizeof(uint32_t), cmp_u32);
+
+	printf("{\"mode\":\"%s\",\"dirs\":%u,\"rate\":%u,\"duration_s\":%.3f,"
+	       "\"events\":%lu,\"coalesced\":%lu,\"reported\":%lu,"
+	       "\"dropped\":%lu,\"events_per_sec\":%.1f,"
+	       "\"messages\":%lu,\"messages_per_sec\":%.1f,"
+	       "\"latency_us\":{\"p50\":%u,\"p99\":%u,\"p999\":%u,\"max\":%u}",
+	       b.local ? "ring" : "mqtt", b.nr_dirs, b.rate, elapsed, b.events, b.coalesced, b.reported,
+	       b.events - b.coalesced - b.reported, b.events / elapsed,
+	       b.messages, b.messages / elapsed,
+	       percentile(b.lat_us, b.nr_lat, 50),
+	       percentile(b.lat_us, b.nr_lat, 99),
+	       percentile(b.lat_us, b.nr_lat, 99.9),
+	       b.nr_lat ? b.lat_us[b.nr_lat - 1] : 0);
+	if (have_usage)
+		/* In process: benchmark and monitors together */
+		printf(",\"%s\":{\"cpu_s\":%.2f,\"cpu_pct\":%.1f,"
+		       "\"rss_kb\":%ld,\"max_rss_kb\":%ld}",
+		       b.local ? "process" : "dir_mon", cpu1 - cpu0,
+		       (cpu1 - cpu0) * 100.0 / elapsed, rss, hwm);
+	printf("}\n");
+
+	free(b.files);
+	free(b.live);
+	free(b.lat_us);
+	return 0;
+}
@@ -0,0 +1,161 @@
+/*
+ * Micro-benchmark of the event engine read path: system calls per kernel
+ * event and wall time per event of read() on epoll readiness against
+ * io_uring reads, for growing bursts of events. Each burst is written
+ * only once the previous one was delivered, so every burst costs at
+ * least one wakeup of the engine.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "dm-engine.h"
+#include "dm-stats.h"
+
+
+#define NR_FILES	512
+#define MIN_BURST	1
+#define MAX_BURST	512
+/* Events delivered per measurement */
+#define NR_EVENTS	(64 * 1024)
+#define DEFAULT_BASE	"/tmp/dm-bench-engine"
+
+struct counter {
+	struct dm_source src;
+	unsigned long events;
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void counter_event(struct dm_source *src,
+			  const struct inotify_event *event
+			  __attribute__((unused)))
+{
+	struct counter *c = (struct counter *)src;
+
+	__atomic_store_n(&c->events, c->events + 1, __ATOMIC_RELEASE);
+}
+
+static void counter_timeout(struct dm_source *src __attribute__((unused)))
+{
+}
+
+static const struct dm_source_ops counter_ops = {
+	.event = counter_event,
+	.timeout = counter_timeout,
+};
+
+static uint64_t stat_total(enum dm_stat id)
+{
+	struct dm_stats st;
+
+	memset(&st, 0, sizeof(st));
+	dm_stats_collect(&st);
+	return st.counters[id];
+}
+
+/* Returns 0 and fills the results, or -1 when the engine fails */
+static int run(const char *base, int *fds, unsigned int flags,
+	       unsigned int burst, const char **backend, double *calls,
+	       double *reads, double *ns)
+{
+	struct dm_engine *eng = NULL;
+	struct counter c;
+	unsigned int i, k, rounds = NR_EVENTS / burst, next = 0;
+	uint64_t calls0, reads0;
+	double t0, t1;
+
+	if (dm_engine_create(&eng, flags) != 0)
+		return -1;
+
+	memset(&c, 0, sizeof(c));
+	c.src.ops = &counter_ops;
+	if (dm_engine_attach(eng, &c.src, base, IN_MODIFY) != 0) {
+		dm_engine_destroy(eng);
+		return -1;
+	}
+	*backend = dm_engine_backend(eng);
+
+	calls0 = stat_total(DM_STAT_SYSCALLS);
+	reads0 = stat_total(DM_STAT_READS);
+	t0 = now_ns();
+	for (i = 0; i < rounds; i++) {
+		unsigned long expected = (unsigned long)(i + 1) * burst;
+
+		/* Distinct files: inotify merges repeats of the last event */
+		for (k = 0; k < burst; k++) {
+			if (write(fds[next], "x", 1) != 1)
+				perror("write");
+			next = (next + 1) % NR_FILES;
+		}
+		while (__atomic_load_n(&c.events, __ATOMIC_ACQUIRE) < expected)
+			sched_yield();
+	}
+	t1 = now_ns();
+
+	*calls = (double)(stat_total(DM_STAT_SYSCALLS) - calls0) / c.events;
+	*reads = (double)(stat_total(DM_STAT_READS) - reads0) / c.events;
+	*ns = (t1 - t0) / c.events;
+
+	dm_engine_detach(&c.src);
+	dm_engine_destroy(eng);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *base = argc > 1 ? argv[1] : DEFAULT_BASE;
+	static const unsigned int modes[] = { 0, DM_ENGINE_IO_URING };
+	char path[4096];
+	int fds[NR_FILES];
+	unsigned int burst, i, m;
+
+	if (mkdir(base, 0755) != 0 && access(base, W_OK) != 0) {
+		perror(base);
+		return 1;
+	}
+	for (i = 0; i < NR_FILES; i++) {
+		snprintf(path, sizeof(path), "%s/file-%04u", base, i);
+		fds[i] = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fds[i] == -1) {
+			perror(path);
+			return 1;
+		}
+	}
+
+	printf("%10s %10s %14s %14s %12s\n", "backend", "burst",
+	       "syscalls/ev", "reads/ev", "ns/ev");
+	for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+		for (burst = MIN_BURST; burst <= MAX_BURST; burst *= 8) {
+			const char *backend = "";
+			double calls, reads, ns;
+
+			if (run(base, fds, modes[m], burst, &backend, &calls,
+				&reads, &ns) != 0) {
+				fprintf(stderr, "Engine setup failed\n");
+				return 1;
+			}
+			printf("%10s %10u %14.3f %14.3f %12.1f\n", backend,
+			       burst, calls, reads, ns);
+		}
+	}
+
+	for (i = 0; i < NR_FILES; i++) {
+		close(fds[i]);
+		snprintf(path, sizeof(path), "%s/file-%04u", base, i);
+		unlink(path);
+	}
+	rmdir(base);
+	return 0;
+}
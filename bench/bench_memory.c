@@ -0,0 +1,191 @@
+/*
+ * Memory benchmark of the monitors: starts N monitors in process on empty
+ * directories and prints the RSS each one costs while idle, then after
+ * every directory handled a batch of events, which shows what a monitor
+ * keeps once its batch is published. Messages go to the file sink,
+ * written to /dev/null, so no broker is involved.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "dir-monitor.h"
+#include "dm-config.h"
+#include "dm-stats.h"
+
+
+#define DEFAULT_DIRS		2000
+#define DEFAULT_FILES		64
+#define DEFAULT_WORKERS		1
+#define DEFAULT_BASE		"/tmp/dm-bench-memory"
+/* Time for the engines to publish the batches */
+#define DRAIN_MS		1000
+
+/* Resident set size of the process in KB */
+static long rss_kb(void)
+{
+	char line[256];
+	long rss = -1;
+	FILE *f;
+
+	f = fopen("/proc/self/status", "r");
+	if (f == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "VmRSS: %ld", &rss) == 1)
+			break;
+	fclose(f);
+	return rss;
+}
+
+static uint64_t messages(void)
+{
+	struct dm_stats st;
+	uint64_t n;
+
+	memset(&st, 0, sizeof(st));
+	dm_stats_collect(&st);
+	n = st.counters[DM_STAT_MESSAGES];
+	dm_stats_release(&st);
+	return n;
+}
+
+/* Writes the files of every directory, one batch per directory */
+static int write_files(const char *base, unsigned int nr_dirs,
+		       unsigned int nr_files)
+{
+	char path[4096];
+	unsigned int i, j;
+	int fd;
+
+	for (i = 0; i < nr_dirs; i++) {
+		for (j = 0; j < nr_files; j++) {
+			snprintf(path, sizeof(path),
+				 "%s/d%u/a-fairly-long-file-name-%06u.dat",
+				 base, i, j);
+			fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd == -1 || write(fd, "x", 1) != 1) {
+				perror(path);
+				return -1;
+			}
+			close(fd);
+		}
+	}
+	return 0;
+}
+
+static void cleanup(const char *base, unsigned int nr_dirs,
+		    unsigned int nr_files)
+{
+	char path[4096];
+	unsigned int i, j;
+
+	for (i = 0; i < nr_dirs; i++) {
+		for (j = 0; j < nr_files; j++) {
+			snprintf(path, sizeof(path),
+				 "%s/d%u/a-fairly-long-file-name-%06u.dat",
+				 base, i, j);
+			unlink(path);
+		}
+		snprintf(path, sizeof(path), "%s/d%u", base, i);
+		rmdir(path);
+	}
+	rmdir(base);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -n <num>   Directories (default %u)\n"
+		"  -f <num>   Files written per directory (default %u)\n"
+		"  -N <num>   Engines (default %u)\n"
+		"  -s         Do not keep directory snapshots\n"
+		"  -b <path>  Base directory (default %s)\n",
+		prog, DEFAULT_DIRS, DEFAULT_FILES, DEFAULT_WORKERS,
+		DEFAULT_BASE);
+}
+
+int main(int argc, char **argv)
+{
+	const char *base = DEFAULT_BASE;
+	unsigned int nr_dirs = DEFAULT_DIRS, nr_files = DEFAULT_FILES;
+	struct dir_monitor_list *list;
+	struct dm_config cfg;
+	long rss0, rss1, rss2;
+	char path[4096];
+	unsigned int i;
+	int opt, rc = 1;
+
+	dm_config_init(&cfg);
+	cfg.workers = DEFAULT_WORKERS;
+	cfg.sink_file = "/dev/null";
+	cfg.monitor.sinks = DM_SINK_BIT(DM_SINK_FILE);
+	while ((opt = getopt(argc, argv, "n:f:N:sb:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_dirs = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			nr_files = strtoul(optarg, NULL, 0);
+			break;
+		case 'N':
+			cfg.workers = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			cfg.monitor.snapshot = 0;
+			break;
+		case 'b':
+			base = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (!nr_dirs) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	mkdir(base, 0755);
+	for (i = 0; i < nr_dirs; i++) {
+		snprintf(path, sizeof(path), "%s/d%u", base, i);
+		mkdir(path, 0755);
+	}
+
+	list = dir_monitor_list_create(&cfg);
+	if (list == NULL)
+		goto exit;
+	rss0 = rss_kb();
+	for (i = 0; i < nr_dirs; i++) {
+		snprintf(path, sizeof(path), "%s/d%u", base, i);
+		if (dir_monitor_list_add(list, path, NULL) != 0) {
+			fprintf(stderr, "Failed to start monitors\n");
+			goto destroy;
+		}
+	}
+	rss1 = rss_kb();
+
+	if (write_files(base, nr_dirs, nr_files) != 0)
+		goto destroy;
+	usleep(DRAIN_MS * 1000);
+	rss2 = rss_kb();
+
+	printf("{\"monitors\":%u,\"files\":%u,\"messages\":%llu,"
+	       "\"base_rss_kb\":%ld,\"idle_kb_per_monitor\":%.2f,"
+	       "\"active_kb_per_monitor\":%.2f}\n",
+	       nr_dirs, nr_files, (unsigned long long)messages(), rss0,
+	       (double)(rss1 - rss0) / nr_dirs,
+	       (double)(rss2 - rss0) / nr_dirs);
+	rc = 0;
+destroy:
+	dir_monitor_list_destroy(list);
+exit:
+	cleanup(base, nr_dirs, nr_files);
+	return rc;
+}
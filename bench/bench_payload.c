@@ -0,0 +1,109 @@
+/*
+ * Micro-benchmark of event message construction: cost per event of the
+ * former snprintf()/strlen() builder against the dm_payload writer, JSON
+ * and binary, and message bytes per event, for growing batch sizes.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "dm-payload.h"
+
+
+#define NR_NAMES	1024
+#define MIN_BATCH	16
+#define MAX_BATCH	(64 * 1024)
+/* Events built per measurement */
+#define NR_EVENTS	(1024 * 1024)
+
+static char names[NR_NAMES][32];
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Builder as it was in dir-monitor.c */
+static void legacy_build(char *buff, size_t size, unsigned int batch)
+{
+	unsigned int i;
+	size_t len;
+
+	snprintf(buff, size, "{\"DirName\":\"%s\",\"Status\":\"%s\",\"Files\":[",
+		 "bench", "modified");
+	for (i = 0; i < batch; i++) {
+		len = strlen(buff);
+		snprintf(buff + len, size - len, "\"%s\",", names[i % NR_NAMES]);
+	}
+	len = strlen(buff);
+	snprintf(buff + len - 1, size - len, "%s", "]}");
+}
+
+static size_t payload_build(struct dm_payload *pl, unsigned int batch)
+{
+	unsigned int i;
+	size_t len;
+
+	dm_payload_begin(pl, "bench", "modified");
+	for (i = 0; i < batch; i++) {
+		const char *name = names[i % NR_NAMES];
+		dm_payload_add(pl, name, strlen(name));
+	}
+	dm_payload_finish(pl, &len);
+	return len;
+}
+
+int main(void)
+{
+	struct dm_payload pl, bin;
+	unsigned int batch, i;
+	size_t size = MAX_BATCH * 40;
+	char *buff = malloc(size);
+
+	if (buff == NULL)
+		return 1;
+
+	for (i = 0; i < NR_NAMES; i++)
+		snprintf(names[i], sizeof(names[i]), "file-%06u.dat", i * 7919);
+
+	dm_payload_init(&pl, size, DM_PAYLOAD_JSON);
+
+	dm_payload_init(&bin, size, DM_PAYLOAD_BINARY);
+
+	printf("%10s %14s %14s %14s %12s %12s\n", "batch", "legacy ns/ev",
+	       "json ns/ev", "binary ns/ev", "json B/ev", "binary B/ev");
+	for (batch = MIN_BATCH; batch <= MAX_BATCH; batch *= 4) {
+		unsigned int rounds = NR_EVENTS / batch;
+		size_t json_len = 0, bin_len = 0;
+		double t0, t1, t2, t3;
+
+		/* Legacy builder is quadratic, keep its run time bounded */
+		unsigned int legacy_rounds = rounds > 64 ? rounds / 16 : 4;
+
+		t0 = now_ns();
+		for (i = 0; i < legacy_rounds; i++)
+			legacy_build(buff, size, batch);
+		t1 = now_ns();
+		for (i = 0; i < rounds; i++)
+			json_len = payload_build(&pl, batch);
+		t2 = now_ns();
+		for (i = 0; i < rounds; i++)
+			bin_len = payload_build(&bin, batch);
+		t3 = now_ns();
+
+		printf("%10u %14.1f %14.1f %14.1f %12.1f %12.1f\n", batch,
+		       (t1 - t0) / ((double)legacy_rounds * batch),
+		       (t2 - t1) / ((double)rounds * batch),
+		       (t3 - t2) / ((double)rounds * batch),
+		       (double)json_len / batch, (double)bin_len / batch);
+	}
+
+	dm_payload_release(&pl);
+	dm_payload_release(&bin);
+	free(buff);
+	return 0;
+}
@@ -0,0 +1,239 @@
+/*
+ * Scaling benchmark of the event engines: writer threads modify files as
+ * fast as they can across N directories while the monitors run in process
+ * on 1, 2, 4, ... engines, each pinned to a CPU. Prints the events and
+ * messages handled per second for each number of engines. Messages go to
+ * the file sink, written to /dev/null, so no broker is involved; with -m
+ * they go to the MQTT sink instead, through the hand-off of the engines to
+ * the publisher, and the messages dropped on a full queue are counted too.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "dir-monitor.h"
+#include "dm-config.h"
+#include "dm-stats.h"
+
+
+#define DEFAULT_DIRS		64
+#define DEFAULT_WRITERS		2
+#define DEFAULT_SECONDS		5
+#define DEFAULT_BASE		"/tmp/dm-bench-workers"
+/* Files per directory written in turn; inotify merges repeats */
+#define FILES_PER_DIR		16
+/* Time for the engines to catch up after the load */
+#define DRAIN_MS		500
+
+struct writer {
+	pthread_t tid;
+	/* Descriptors of the files of the writer's directories */
+	int *fds;
+	unsigned int nr_fds;
+	volatile int *stop;
+};
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *writer_thread(void *arg)
+{
+	struct writer *w = (struct writer *)arg;
+	unsigned int i = 0;
+
+	while (!*w->stop) {
+		if (write(w->fds[i], "x", 1) != 1)
+			perror("write");
+		i = (i + 1) % w->nr_fds;
+	}
+	return NULL;
+}
+
+static void stat_totals(uint64_t *events, uint64_t *messages,
+			uint64_t *drops)
+{
+	struct dm_stats st;
+
+	memset(&st, 0, sizeof(st));
+	dm_stats_collect(&st);
+	*events = st.counters[DM_STAT_EV_MODIFY];
+	*messages = st.counters[DM_STAT_MESSAGES];
+	*drops = st.counters[DM_STAT_QUEUE_DROPS];
+	dm_stats_release(&st);
+}
+
+static int run(const char *base, unsigned int nr_dirs, struct writer *writers,
+	       unsigned int nr_writers, unsigned int seconds,
+	       unsigned int workers, int mqtt)
+{
+	struct dir_monitor_list *list;
+	struct dm_config cfg;
+	volatile int stop = 0;
+	uint64_t ev0, msg0, drop0, ev1, msg1, drop1, t0, t1;
+	unsigned int i;
+
+	dm_config_init(&cfg);
+	cfg.workers = workers;
+	cfg.pin_workers = 1;
+	cfg.sink_file = "/dev/null";
+	cfg.monitor.sinks = mqtt ? DM_SINK_BIT(DM_SINK_MQTT) :
+				   DM_SINK_BIT(DM_SINK_FILE);
+	cfg.monitor.snapshot = 0;
+
+	list = dir_monitor_list_create(&cfg);
+	if (list == NULL)
+		return -1;
+	for (i = 0; i < nr_dirs; i++) {
+		char path[4096];
+
+		snprintf(path, sizeof(path), "%s/d%u", base, i);
+		if (dir_monitor_list_add(list, path, NULL) != 0) {
+			dir_monitor_list_destroy(list);
+			return -1;
+		}
+	}
+
+	stat_totals(&ev0, &msg0, &drop0);
+	t0 = now_ms();
+	for (i = 0; i < nr_writers; i++) {
+		writers[i].stop = &stop;
+		pthread_create(&writers[i].tid, NULL, writer_thread,
+			       &writers[i]);
+	}
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i < nr_writers; i++)
+		pthread_join(writers[i].tid, NULL);
+	usleep(DRAIN_MS * 1000);
+	stat_totals(&ev1, &msg1, &drop1);
+	t1 = now_ms();
+
+	printf("%8u %16.0f %16.0f %16.0f\n", workers,
+	       (ev1 - ev0) * 1000.0 / (t1 - t0),
+	       (msg1 - msg0) * 1000.0 / (t1 - t0),
+	       (drop1 - drop0) * 1000.0 / (t1 - t0));
+	fflush(stdout);
+	dir_monitor_list_destroy(list);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -n <num>   Directories (default %u)\n"
+		"  -w <num>   Writer threads (default %u)\n"
+		"  -N <num>   Most engines (default number of CPUs)\n"
+		"  -t <sec>   Load duration per run (default %u)\n"
+		"  -b <path>  Base directory (default %s)\n"
+		"  -m         Publish to the MQTT broker instead of /dev/null\n",
+		prog, DEFAULT_DIRS, DEFAULT_WRITERS, DEFAULT_SECONDS,
+		DEFAULT_BASE);
+}
+
+int main(int argc, char **argv)
+{
+	const char *base = DEFAULT_BASE;
+	unsigned int nr_dirs = DEFAULT_DIRS, nr_writers = DEFAULT_WRITERS;
+	unsigned int seconds = DEFAULT_SECONDS, max_workers;
+	unsigned int i, j, workers;
+	struct writer *writers;
+	char path[4096];
+	int opt, mqtt = 0;
+
+	max_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "n:w:N:t:b:mh")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_dirs = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			nr_writers = strtoul(optarg, NULL, 0);
+			break;
+		case 'N':
+			max_workers = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			seconds = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			base = optarg;
+			break;
+		case 'm':
+			mqtt = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (!nr_dirs || !nr_writers || nr_writers > nr_dirs) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* Each writer gets its share of the directories */
+	writers = calloc(nr_writers, sizeof(struct writer));
+	if (writers == NULL)
+		return 1;
+	mkdir(base, 0755);
+	for (i = 0; i < nr_dirs; i++) {
+		struct writer *w = &writers[i % nr_writers];
+
+		snprintf(path, sizeof(path), "%s/d%u", base, i);
+		mkdir(path, 0755);
+		w->fds = realloc(w->fds, (w->nr_fds + FILES_PER_DIR) *
+					 sizeof(int));
+		if (w->fds == NULL)
+			return 1;
+		for (j = 0; j < FILES_PER_DIR; j++) {
+			snprintf(path, sizeof(path), "%s/d%u/f%u", base, i, j);
+			w->fds[w->nr_fds] = open(path, O_WRONLY | O_CREAT |
+						 O_TRUNC, 0644);
+			if (w->fds[w->nr_fds] == -1) {
+				perror(path);
+				return 1;
+			}
+			w->nr_fds++;
+		}
+	}
+
+	printf("%8s %16s %16s %16s\n", "engines", "events/s", "messages/s",
+	       "drops/s");
+	for (workers = 1; workers <= (max_workers ? max_workers : 1);
+	     workers *= 2) {
+		if (run(base, nr_dirs, writers, nr_writers, seconds,
+			workers, mqtt) != 0) {
+			fprintf(stderr, "Failed to start monitors\n");
+			return 1;
+		}
+	}
+
+	for (i = 0; i < nr_dirs; i++) {
+		for (j = 0; j < FILES_PER_DIR; j++) {
+			snprintf(path, sizeof(path), "%s/d%u/f%u", base, i, j);
+			unlink(path);
+		}
+		snprintf(path, sizeof(path), "%s/d%u", base, i);
+		rmdir(path);
+	}
+	rmdir(base);
+	for (i = 0; i < nr_writers; i++) {
+		for (j = 0; j < writers[i].nr_fds; j++)
+			close(writers[i].fds[j]);
+		free(writers[i].fds);
+	}
+	free(writers);
+	return 0;
+}
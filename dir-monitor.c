@@ -4,245 +4,1543 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <limits.h>
+#include <fcntl.h>
 #include <pthread.h>
-#include <mosquitto.h>
-#include <sys/time.h>
 #include <sys/inotify.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #include "dir-monitor.h"
+#include "dm-engine.h"
+#include "dm-sink.h"
+#include "dm-publisher.h"
+#include "dm-stats.h"
+#include "dm-payload.h"
+#include "dm-tree.h"
+#include "dm-coalesce.h"
+#include "dm-snapshot.h"
+#include "dm-fingerprint.h"
+#include "dm-metadata.h"
+#include "dm-filter.h"
+#include "dm-fanotify.h"
+#include "dm-config.h"
 #include "internals.h"
 #include "debug.h"
 
 
-#define READ_TIMEOUT	1000
-#define NAME_LEN	64
-#define EVENT_LEN	(sizeof(struct inotify_event))
-#define NR_EVENTS	4096
-#define EVENT_BUFF_SIZE	(NR_EVENTS * (NAME_LEN + EVENT_LEN + 1))
-#define BUFF_SIZE	(NR_EVENTS * NAME_LEN)
+/* Watch for delete and modify and exclude linked.
+ * IN_CREATE not needed because we would not have to monitor
+ * only empty file created in the directory.
+ * Non-empty file created will also generate IN_MODIFY. So,
+ * IN_CREATE not needed to watch..!!
+ */
+#define WATCH_MASK	(IN_DELETE | IN_MODIFY | IN_EXCL_UNLINK)
+/* Completed writes only: files closed after writing or moved in */
+#define WATCH_MASK_COMPLETED	(IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_TO | \
+				 IN_EXCL_UNLINK)
+/* Recursive monitors also follow directories coming and going */
+#define WATCH_MASK_TREE	(IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO | \
+			 IN_DELETE_SELF | IN_ONLYDIR)
+/* Files created and moved, to pair the two ends of a rename */
+#define WATCH_MASK_MOVES	(IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO)
+
+/* Keep the names of each status apart in the name set */
+#define KEY_DELETED	0x9e3779b97f4a7c15ull
+#define KEY_CREATED	0xc2b2ae3d27d4eb4full
+#define KEY_MOVED_FROM	0x165667b19e3779f9ull
+#define KEY_MOVED_TO	0xd6e8feb86659fd93ull
+
+/* Idle batches an engine keeps for its monitors */
+#define BATCH_POOL_MAX		64
+/* Buffers grown past this size are freed when their batch is given back */
+#define BATCH_KEEP_BYTES	65536
+
+/* Status of the messages, by enum dm_storm_kind */
+static const char *const status_names[DM_STORM_KINDS] = {
+	[DM_STORM_RENAMED] = "renamed",
+	[DM_STORM_DELETED] = "deleted",
+	[DM_STORM_MOVED_FROM] = "moved_from",
+	[DM_STORM_CREATED] = "created",
+	[DM_STORM_MOVED_TO] = "moved_to",
+	[DM_STORM_MODIFIED] = "modified",
+};
+
+/**
+ * Scratch of a pending batch: the messages under construction, one per
+ * status indexed by enum dm_storm_kind, which lists them in the order they
+ * are published, the names waiting for the flush and the names seen.
+ * A monitor borrows one from its engine with the first name of a batch and
+ * gives it back once the batch is published, so idle monitors hold none
+ * and the buffers are shared by the monitors of the engine.
+ */
+struct dm_batch {
+	struct dm_payload pl[DM_STORM_KINDS];
+	/* Summary message of a storm */
+	struct dm_payload pl_summary;
+	/* Names waiting for their metadata or fingerprint */
+	struct dm_namelist deferred[DM_STORM_KINDS];
+	/* Names in the batch */
+	struct dm_nameset names;
+	/* Link in the pool */
+	struct dm_batch *next;
+};
+
+/* Idle batches of an engine, only used from its thread */
+struct dm_batch_pool {
+	struct dm_batch *head;
+	unsigned int nr;
+};
+
+struct dir_monitor {
+	/* Shared services */
+	const struct dir_monitor_env *env;
+	/* Dynamically allocated string for directory name */
+	char *dir_path;
+	/* Directory name used in messages */
+	char *dir_name;
+	/* MQTT topic of the directory */
+	char topic[64];
+	/* Destinations of the messages */
+	struct dm_sink *sinks[DM_SINK_MAX];
+	unsigned int nr_sinks;
+	/* Counters reported by dir_monitor_list_stats() */
+	struct dm_monitor_stats stats;
+	/* Event source attached to the engine */
+	struct dm_source src;
+	/* Batching policy */
+	struct dir_monitor_config cfg;
+	/* inotify mask of the watches */
+	uint32_t mask;
+	/* Number of events in the pending batch */
+	unsigned int nr_events;
+	/* Arrival time of the first event of the pending batch */
+	uint64_t first_event;
+	/* Publish time of the pending batch, UINT64_MAX if none */
+	uint64_t batch_deadline;
+	/* Scratch of the pending batch, NULL if none */
+	struct dm_batch *batch;
+	/* Modified files waiting to settle */
+	struct dm_debounce debounce;
+	/* Files moved away waiting for the other end of the rename */
+	struct dm_moves moves;
+	/* Rate limit, with the names of a storm counted for its summary */
+	struct dm_storm storm;
+	/* Files of the directory as last seen, for rescans */
+	struct dm_snapshot snap;
+	/* First snapshot still being taken by the starting thread, with the
+	 * names reported meanwhile, looked up again once it is installed
+	 */
+	int snap_scanning;
+	struct dm_namelist snap_touched;
+	/* File the snapshot is saved to across restarts, NULL = none */
+	char *index_path;
+	/* Next save of the snapshot, UINT64_MAX if none */
+	uint64_t checkpoint;
+	/* Snapshot changed since last saved */
+	int index_dirty;
+	/* Fingerprints of the files reported modified */
+	struct dm_fpcache fp;
+	/* Metadata of the files reported */
+	struct dm_metacache meta;
+	/* Events dropped by each filter rule */
+	uint64_t *filter_drops;
+	/* Directory the size and type rules look files up in, -1 if none */
+	int filter_dirfd;
+	/* Watched subdirectories of a recursive monitor */
+	struct dm_tree tree;
+	/* Filesystem wide watch of the fanotify backend, NULL for inotify */
+	struct dm_fanotify *fan;
+	/* Registry entry: canonical path and identity of the directory */
+	char *key;
+	uint64_t key_hash;
+	dev_t dev;
+	ino_t ino;
+	/* Device and inode are known, the monitor is on the inode chain */
+	unsigned int has_inode : 1;
+	/* Hash chains of the registry */
+	struct dir_monitor *path_next;
+	struct dir_monitor *inode_next;
+};
+
+static void publish_message(struct dir_monitor *dm, struct dm_payload *pl)
+{
+	size_t len;
+	const char *msg = dm_payload_finish(pl, &len);
+	unsigned int i;
+
+	if (msg == NULL) {
+		DEBUG("Message on '%s' dropped", dm->topic);
+		goto exit;
+	}
+
+	__stats_add(&dm->stats.messages, 1);
+	dm_stat_inc(DM_STAT_MESSAGES);
+	dm_stat_add(DM_STAT_MESSAGE_BYTES, len);
+
+	/* Sinks copy what they keep; none waits on the network */
+	for (i = 0; i < dm->nr_sinks; i++) {
+		if (dm_sink_write(dm->sinks[i], dm->topic, msg, len) != 0) {
+			DEBUG("Message on '%s' dropped", dm->topic);
+			__stats_add(&dm->stats.drops, 1);
+			dm_stat_inc(DM_STAT_SINK_DROPS);
+		}
+	}
+ exit:
+	dm_payload_reset(pl);
+}
+
+static void __batch_free(struct dm_batch *b)
+{
+	unsigned int i;
+
+	for (i = 0; i < DM_STORM_KINDS; i++) {
+		dm_payload_release(&b->pl[i]);
+		dm_namelist_release(&b->deferred[i]);
+	}
+	dm_payload_release(&b->pl_summary);
+	dm_nameset_release(&b->names);
+	free(b);
+}
+
+/**
+ * This function returns the scratch of the pending batch, borrowing it
+ * from the engine's pool when the batch has none yet.
+ *
+ * @param: dm	A valid monitor.
+ * @return: Scratch of the batch or NULL on failure.
+ */
+static struct dm_batch *__batch(struct dir_monitor *dm)
+{
+	struct dm_batch_pool *pool = dm->env->batches;
+	struct dm_batch *b = dm->batch;
+	unsigned int i;
+
+	if (b)
+		return b;
+
+	if (pool && pool->head) {
+		b = pool->head;
+		pool->head = b->next;
+		pool->nr--;
+	} else {
+		b = calloc(1, sizeof(struct dm_batch));
+		if (b == NULL) {
+			ERROR("Memory allocation failure.");
+			return NULL;
+		}
+		dm_nameset_init(&b->names);
+	}
+
+	/* Last used by any monitor of the engine */
+	for (i = 0; i < DM_STORM_KINDS; i++) {
+		dm_payload_reuse(&b->pl[i], dm->cfg.max_payload,
+				 dm->cfg.format);
+		dm_namelist_clear(&b->deferred[i]);
+	}
+	dm_payload_reuse(&b->pl_summary, dm->cfg.max_payload, dm->cfg.format);
+	dm->batch = b;
+	return b;
+}
+
+/**
+ * This function gives the scratch of a published batch back to the pool.
+ * Buffers which grew large for this batch are freed rather than kept.
+ *
+ * @param: dm	A valid monitor.
+ * @return: No return.
+ */
+static void __batch_put(struct dir_monitor *dm)
+{
+	struct dm_batch_pool *pool = dm->env->batches;
+	struct dm_batch *b = dm->batch;
+	unsigned int i;
+
+	if (b == NULL)
+		return;
+	dm->batch = NULL;
+	dm_nameset_clear(&b->names);
+
+	if (pool == NULL || pool->nr == BATCH_POOL_MAX) {
+		__batch_free(b);
+		return;
+	}
+	for (i = 0; i < DM_STORM_KINDS; i++) {
+		if (dm_payload_footprint(&b->pl[i]) > BATCH_KEEP_BYTES)
+			dm_payload_release(&b->pl[i]);
+		if (b->deferred[i].size > BATCH_KEEP_BYTES)
+			dm_namelist_release(&b->deferred[i]);
+	}
+	if (dm_payload_footprint(&b->pl_summary) > BATCH_KEEP_BYTES)
+		dm_payload_release(&b->pl_summary);
+	if (dm_nameset_footprint(&b->names) > BATCH_KEEP_BYTES)
+		dm_nameset_release(&b->names);
+	b->next = pool->head;
+	pool->head = b;
+	pool->nr++;
+}
+
+/**
+ * This function writes a file name or a move record into the message. A
+ * message reaching the payload cap is published and the entry goes to a
+ * new one.
+ *
+ * @param: dm		A monitor with a pending batch.
+ * @param: kind		Status of the file, enum dm_storm_kind.
+ * @param: name		File name, old name of a move record.
+ * @param: to		New name of a move record or NULL.
+ * @param: meta		Metadata when the message carries it, else NULL.
+ * @return: 1 if the entry was added, 0 otherwise.
+ */
+static int __payload_put(struct dir_monitor *dm, unsigned int kind,
+			 const char *name, const char *to,
+			 const struct dm_file_meta *meta)
+{
+	struct dm_payload *pl = &dm->batch->pl[kind];
+	const char *status = status_names[kind];
+	size_t len = strlen(name), to_len = to ? strlen(to) : 0;
+	int rc, retry;
+
+	if (!pl->len && dm_payload_begin(pl, dm->dir_name, status) != 0)
+		return 0;
+
+	for (retry = 0; ; retry++) {
+		if (to)
+			rc = dm_payload_add_move(pl, name, len, to, to_len,
+						 meta);
+		else if (dm->cfg.metadata && kind != DM_STORM_DELETED &&
+			 kind != DM_STORM_MOVED_FROM)
+			rc = dm_payload_add_meta(pl, name, len, meta);
+		else
+			rc = dm_payload_add(pl, name, len);
+		if (rc != 1 || retry)
+			break;
+		publish_message(dm, pl);
+		if (dm_payload_begin(pl, dm->dir_name, status) != 0)
+			return 0;
+	}
+	if (rc != 0) {
+		ERROR("Failed to add '%s' to message", to ? to : name);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Names of the message waiting for the flush, NULL if they are written
+ * right away: metadata is looked up and modified files are fingerprinted
+ * once per batch, however many events came for them.
+ */
+static struct dm_namelist *__deferred_list(struct dir_monitor *dm,
+					   unsigned int kind)
+{
+	if ((!dm->cfg.metadata || kind == DM_STORM_DELETED ||
+	     kind == DM_STORM_MOVED_FROM) &&
+	    (!dm->cfg.fingerprint || kind != DM_STORM_MODIFIED))
+		return NULL;
+	return &dm->batch->deferred[kind];
+}
+
+/* Entries of the message, written or waiting for the flush */
+static inline unsigned int __message_names(struct dir_monitor *dm,
+					   unsigned int kind)
+{
+	struct dm_namelist *nl;
+
+	if (dm->batch == NULL)
+		return 0;
+	nl = __deferred_list(dm, kind);
+	return dm->batch->pl[kind].nr_names + (nl ? nl->nr : 0);
+}
+
+/* Report a storm starting or passing */
+static void __storm_changed(struct dir_monitor *dm, unsigned int active)
+{
+	if (dm->storm.active == active)
+		return;
+
+	if (dm->storm.active) {
+		WARN("Event storm on '%s', reporting summaries",
+		     dm->dir_path);
+		__stats_add(&dm->stats.storms, 1);
+		dm_stat_inc(DM_STAT_STORMS);
+	} else {
+		INFO("Event storm on '%s' passed", dm->dir_path);
+	}
+	__atomic_store_n(&dm->stats.summary, dm->storm.active,
+			 __ATOMIC_RELAXED);
+}
+
+/**
+ * This function takes a token of the rate limit for a name, or counts the
+ * name into the storm summary when there is none.
+ *
+ * @param: dm	A valid monitor with a rate limit.
+ * @param: kind	Status of the name, enum dm_storm_kind.
+ * @param: name	File name.
+ * @return: 1 if the name goes into its message, 0 if it was summarized.
+ */
+static int __admit(struct dir_monitor *dm, unsigned int kind,
+		   const char *name)
+{
+	unsigned int active = dm->storm.active;
+	int rc = dm_storm_admit(&dm->storm, dm_engine_now());
+
+	__storm_changed(dm, active);
+	if (rc)
+		return 1;
+
+	dm_storm_add(&dm->storm, kind, name);
+	__stats_add(&dm->stats.summarized, 1);
+	dm_stat_inc(DM_STAT_SUMMARIZED);
+	return 0;
+}
+
+/**
+ * This function adds a file name to the pending message of the given
+ * status. A message reaching the payload cap is published and the name
+ * goes to a new one. Names already in the batch are left out. Names
+ * needing metadata or a fingerprint wait till the batch is published.
+ * During a storm the name is only counted for the summary.
+ *
+ * @param: dm		A valid monitor.
+ * @param: kind		Status of the file, enum dm_storm_kind.
+ * @param: name		File name.
+ * @return: 1 if the name was added, 0 otherwise.
+ */
+static int __batch_add(struct dir_monitor *dm, unsigned int kind,
+		       const char *name)
+{
+	struct dm_batch *b = __batch(dm);
+	struct dm_namelist *nl;
+	size_t len = strlen(name);
+
+	if (b == NULL)
+		return 0;
+
+	if (dm->cfg.coalesce) {
+		uint64_t key = hash_str64(name, len);
+
+		if (kind == DM_STORM_DELETED)
+			key ^= KEY_DELETED;
+		else if (kind == DM_STORM_CREATED)
+			key ^= KEY_CREATED;
+		else if (kind == DM_STORM_MOVED_FROM)
+			key ^= KEY_MOVED_FROM;
+		else if (kind == DM_STORM_MOVED_TO)
+			key ^= KEY_MOVED_TO;
+		if (!dm_nameset_add(&b->names, key))
+			return 0;
+	}
+
+	if (dm->cfg.rate_limit && !__admit(dm, kind, name))
+		return 1;
+
+	nl = __deferred_list(dm, kind);
+	if (nl)
+		return dm_namelist_add(nl, name, NULL) == 0;
+	return __payload_put(dm, kind, name, NULL, NULL);
+}
+
+/**
+ * This function adds a move record to the pending rename message. Records
+ * are never coalesced: each one tells where a name went. A storm summary
+ * samples the new names.
+ *
+ * @param: dm		A valid monitor.
+ * @param: from		Old file name.
+ * @param: to		New file name.
+ * @return: 1 if the record was added, 0 otherwise.
+ */
+static int __batch_add_move(struct dir_monitor *dm, const char *from,
+			    const char *to)
+{
+	struct dm_namelist *nl;
+
+	if (__batch(dm) == NULL)
+		return 0;
+	if (dm->cfg.rate_limit && !__admit(dm, DM_STORM_RENAMED, to))
+		return 1;
+	nl = __deferred_list(dm, DM_STORM_RENAMED);
+	if (nl)
+		return dm_namelist_add(nl, from, to) == 0;
+	return __payload_put(dm, DM_STORM_RENAMED, from, to, NULL);
+}
+
+/**
+ * This function tells whether a modified file is worth reporting, i.e.
+ * whether its fingerprint changed since it was last reported.
+ *
+ * @param: dm	A valid monitor.
+ * @param: name	File name relative to the monitored directory.
+ * @return: 1 if so, 0 otherwise.
+ */
+static int __changed(struct dir_monitor *dm, const char *name)
+{
+	char path[PATH_MAX];
+	int rc;
+
+	if (!dm->cfg.fingerprint ||
+	    snprintf(path, sizeof(path), "%s/%s", dm->dir_path,
+		     name) >= (int)sizeof(path))
+		return 1;
+
+	/* Gone already: the delete event follows */
+	rc = dm_fpcache_update(&dm->fp, path, hash_str64(name, strlen(name)));
+	if (rc <= 0)
+		dm_stat_inc(DM_STAT_UNCHANGED);
+	return rc > 0;
+}
+
+/**
+ * This function writes the names waiting for the flush into their messages,
+ * one message after the other: modified files whose fingerprint did not
+ * change are left out, the others get their metadata.
+ *
+ * @param: dm	A monitor with a pending batch.
+ * @return: No return.
+ */
+static void __fill_deferred(struct dir_monitor *dm)
+{
+	uint64_t now = dm_engine_now();
+	unsigned int i, k;
+
+	for (i = 0; i < DM_STORM_KINDS; i++) {
+		struct dm_namelist *nl = __deferred_list(dm, i);
+		const char *name, *to;
+		struct dm_file_meta meta;
+		int rc;
+
+		if (nl == NULL)
+			continue;
+		name = nl->buff;
+		for (k = 0; k < nl->nr; k++) {
+			to = NULL;
+			if (i == DM_STORM_RENAMED)
+				to = name + strlen(name) + 1;
+
+			/* Unchanged files leave the batch alone */
+			if (i != DM_STORM_MODIFIED || __changed(dm, name)) {
+				rc = -1;
+				if (dm->cfg.metadata)
+					rc = dm_metacache_get(&dm->meta,
+							      to ? to : name,
+							      now, &meta);
+				__payload_put(dm, i, name, to,
+					      rc == 0 ? &meta : NULL);
+			}
+
+			name = (to ? to : name);
+			name += strlen(name) + 1;
+		}
+		dm_namelist_clear(nl);
+	}
+}
+
+static uint64_t __now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * This function publishes one summary message per status counted during
+ * the storm: the number of files with a sample of their names.
+ *
+ * @param: dm	A monitor with a pending batch.
+ * @return: No return.
+ */
+static void __publish_summary(struct dir_monitor *dm)
+{
+	struct dm_payload *pl = &dm->batch->pl_summary;
+	unsigned int i, k;
+
+	for (i = 0; i < DM_STORM_KINDS; i++) {
+		const struct dm_storm_count *c = &dm->storm.counts[i];
+
+		if (!c->count)
+			continue;
+		if (dm_payload_begin_summary(pl, dm->dir_name, status_names[i],
+					     c->count) != 0) {
+			dm_payload_reset(pl);
+			continue;
+		}
+		/* Sample is cut short at the payload cap */
+		for (k = 0; k < c->nr_sample; k++)
+			if (dm_payload_add(pl, c->sample[k],
+					   strlen(c->sample[k])) != 0)
+				break;
+		publish_message(dm, pl);
+	}
+	dm_storm_clear(&dm->storm);
+}
+
+/* Names and move records in the pending batch, summarized ones included */
+static inline unsigned int __batch_names(const struct dir_monitor *dm)
+{
+	const struct dm_batch *b = dm->batch;
+	unsigned int i, n = dm->storm.pending;
+
+	for (i = 0; b && i < DM_STORM_KINDS; i++)
+		n += b->pl[i].nr_names + b->deferred[i].nr;
+	return n;
+}
+
+/* Bytes written into the messages of the pending batch */
+static inline size_t __batch_bytes(const struct dir_monitor *dm)
+{
+	const struct dm_batch *b = dm->batch;
+	size_t len = 0;
+	unsigned int i;
+
+	for (i = 0; b && i < DM_STORM_KINDS; i++)
+		len += b->pl[i].len + b->deferred[i].len;
+	return len;
+}
+
+static void __flush_events(struct dir_monitor *dm)
+{
+	uint64_t start;
+	unsigned int i;
+
+	/* Publish only on update */
+	if (__batch_names(dm)) {
+		start = __now_us();
+		if (dm->cfg.metadata || dm->cfg.fingerprint)
+			__fill_deferred(dm);
+		/*
+		 * Renames go first, events which came before them were
+		 * flushed already; what follows may use the new names.
+		 */
+		for (i = 0; i < DM_STORM_KINDS; i++)
+			if (dm->batch->pl[i].nr_names)
+				publish_message(dm, &dm->batch->pl[i]);
+		if (dm->storm.pending)
+			__publish_summary(dm);
+
+		__stats_add(&dm->stats.batches, 1);
+		dm_stat_inc(DM_STAT_BATCHES);
+		dm_hist_add(DM_HIST_BATCH_BUILD_US, __now_us() - start);
+		dm_hist_add(DM_HIST_BATCH_EVENTS, dm->nr_events);
+		if (dm->nr_events)
+			dm_hist_add(DM_HIST_BATCH_DELAY_US,
+				    (dm_engine_now() - dm->first_event) * 1000);
+	}
+
+	dm->nr_events = 0;
+	dm->batch_deadline = UINT64_MAX;
+	__batch_put(dm);
+}
+
+/* Arm the timer for the batch or the first settled file, whichever is due */
+static void __rearm(struct dir_monitor *dm)
+{
+	uint64_t deadline = dm_debounce_next(&dm->debounce);
+
+	if (deadline > dm_moves_next(&dm->moves))
+		deadline = dm_moves_next(&dm->moves);
+	if (deadline > dm->batch_deadline)
+		deadline = dm->batch_deadline;
+	if (deadline > dm->checkpoint)
+		deadline = dm->checkpoint;
+	if (deadline > dm_storm_next(&dm->storm))
+		deadline = dm_storm_next(&dm->storm);
+
+	if (deadline == UINT64_MAX)
+		dm_engine_disarm(&dm->src);
+	else
+		dm_engine_arm(&dm->src, deadline);
+}
+
+/**
+ * This function decides when the pending batch goes out. A batch is
+ * published once the directory was quiet for quiet_ms, or max_delay_ms
+ * after its first event, or right away when it reached its size limits.
+ * A repeated name does not grow the batch but still keeps it open. During
+ * a storm the size limits do not apply: the summary is published once per
+ * batch.
+ *
+ * @param: dm		Monitor with an event just reported.
+ * @param: added	Event added a name to the batch.
+ * @return: No return.
+ */
+static void __schedule_flush(struct dir_monitor *dm, int added)
+{
+	uint64_t now = dm_engine_now();
+	uint64_t deadline;
+
+	/* Nothing went into an empty batch, its scratch goes back */
+	if (!dm->nr_events && !added) {
+		__batch_put(dm);
+		return;
+	}
+
+	if (added && dm->nr_events++ == 0)
+		dm->first_event = now;
+
+	if (!dm->storm.active &&
+	    (dm->nr_events >= dm->cfg.max_events ||
+	     __batch_bytes(dm) >= dm->cfg.max_bytes)) {
+		__flush_events(dm);
+		__rearm(dm);
+		return;
+	}
+
+	deadline = now + dm->cfg.quiet_ms;
+	if (deadline > dm->first_event + dm->cfg.max_delay_ms)
+		deadline = dm->first_event + dm->cfg.max_delay_ms;
+	dm->batch_deadline = deadline;
+	__rearm(dm);
+}
+
+/* Count a name added outside of event handling; the caller flushes */
+static inline void __batch_count(struct dir_monitor *dm, int added)
+{
+	if (added && dm->nr_events++ == 0)
+		dm->first_event = dm_engine_now();
+}
+
+/**
+ * This function keeps the snapshot in line with a reported file, so that a
+ * rescan reports only what was missed.
+ *
+ * @param: dm		A valid monitor.
+ * @param: name		File name relative to the monitored directory.
+ * @param: deleted	File was reported deleted.
+ * @return: No return.
+ */
+static void __snapshot_file(struct dir_monitor *dm, const char *name,
+			    int deleted)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	if (!dm->cfg.snapshot)
+		return;
+
+	if (dm->snap_scanning) {
+		dm_namelist_add(&dm->snap_touched, name, NULL);
+		return;
+	}
+
+	dm->index_dirty = 1;
+	if (!deleted &&
+	    snprintf(path, sizeof(path), "%s/%s", dm->dir_path,
+		     name) < (int)sizeof(path) &&
+	    fstatat(AT_FDCWD, path, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+	    !S_ISDIR(st.st_mode))
+		dm_snapshot_set(&dm->snap, name, &st);
+	else
+		dm_snapshot_remove(&dm->snap, name);
+}
+
+static void __report(struct dir_monitor *dm, unsigned int kind,
+		     const char *name)
+{
+	int added = __batch_add(dm, kind, name);
+
+	if (added)
+		__snapshot_file(dm, name, kind == DM_STORM_DELETED ||
+				     kind == DM_STORM_MOVED_FROM);
+	__schedule_flush(dm, added);
+}
+
+/* Name is gone: nothing left to settle or to compare with */
+static void __forget(struct dir_monitor *dm, const char *name)
+{
+	if (dm->cfg.debounce_ms)
+		dm_debounce_remove(&dm->debounce, name);
+	if (dm->cfg.fingerprint)
+		dm_fpcache_remove(&dm->fp, hash_str64(name, strlen(name)));
+	if (dm->cfg.metadata)
+		dm_metacache_remove(&dm->meta, name);
+}
+
+static inline void __report_deleted(struct dir_monitor *dm, const char *name)
+{
+	__forget(dm, name);
+	__report(dm, DM_STORM_DELETED, name);
+}
+
+static inline void __report_modified(struct dir_monitor *dm, const char *name)
+{
+	/* Reported from the timer once the file settled */
+	if (!dm->cfg.debounce_ms ||
+	    dm_debounce_touch(&dm->debounce, name, dm_engine_now()) != 0)
+		__report(dm, DM_STORM_MODIFIED, name);
+	else
+		__rearm(dm);
+}
+
+/* File moved away whose pair never came goes to the pending batch */
+static void __moved_away(const char *name, void *arg)
+{
+	struct dir_monitor *dm = (struct dir_monitor *)arg;
+	int added;
+
+	__forget(dm, name);
+	added = __batch_add(dm, DM_STORM_MOVED_FROM, name);
+	if (added)
+		__snapshot_file(dm, name, 1);
+	__batch_count(dm, added);
+}
+
+/**
+ * This function reports both ends of a rename as one record.
+ *
+ * @param: dm	A valid monitor.
+ * @param: from	Old file name.
+ * @param: to	New file name.
+ * @return: No return.
+ */
+static void __report_renamed(struct dir_monitor *dm, const char *from,
+			     const char *to)
+{
+	int added;
+
+	/* Events on the old name go out before the rename */
+	if (__batch_names(dm) != __message_names(dm, DM_STORM_RENAMED))
+		__flush_events(dm);
+
+	/* Writes in flight settle under the new name */
+	if (dm->cfg.debounce_ms && dm_debounce_remove(&dm->debounce, from))
+		dm_debounce_touch(&dm->debounce, to, dm_engine_now());
+	if (dm->cfg.fingerprint)
+		dm_fpcache_remove(&dm->fp, hash_str64(from, strlen(from)));
+	if (dm->cfg.metadata)
+		dm_metacache_remove(&dm->meta, from);
+
+	added = __batch_add_move(dm, from, to);
+	if (added) {
+		__snapshot_file(dm, from, 1);
+		__snapshot_file(dm, to, 0);
+	}
+	__schedule_flush(dm, added);
+}
+
+/**
+ * This function reports a file created or moved. A file moved away waits
+ * for the file moved in with the same cookie, which makes a rename; the
+ * ends which stay alone are reported as moved away or moved in.
+ *
+ * @param: dm		A valid monitor.
+ * @param: mask		IN_CREATE, IN_MOVED_FROM or IN_MOVED_TO.
+ * @param: cookie	Cookie of a move, 0 if the backend has none.
+ * @param: name		File name relative to the monitored directory.
+ * @return: No return.
+ */
+static void __report_moved(struct dir_monitor *dm, uint32_t mask,
+			   uint32_t cookie, const char *name)
+{
+	char *from;
+
+	if (mask & IN_CREATE) {
+		__report(dm, DM_STORM_CREATED, name);
+		return;
+	}
+
+	if (mask & IN_MOVED_FROM) {
+		if (!cookie ||
+		    dm_moves_add(&dm->moves, cookie, name,
+				 dm_engine_now()) != 0) {
+			__forget(dm, name);
+			__report(dm, DM_STORM_MOVED_FROM, name);
+		} else {
+			__rearm(dm);
+		}
+		return;
+	}
+
+	from = cookie ? dm_moves_take(&dm->moves, cookie) : NULL;
+	if (from) {
+		__report_renamed(dm, from, name);
+		free(from);
+	} else {
+		__report(dm, DM_STORM_MOVED_TO, name);
+	}
+}
+
+/* Settled file goes to the pending batch */
+static void __settled(const char *name, void *arg)
+{
+	struct dir_monitor *dm = (struct dir_monitor *)arg;
+	int added;
+
+	added = __batch_add(dm, DM_STORM_MODIFIED, name);
+	if (added)
+		__snapshot_file(dm, name, 0);
+	__batch_count(dm, added);
+}
+
+/* Watches placed by the walker threads when a tree is set up */
+struct tree_walk {
+	struct dir_monitor *dm;
+	pthread_mutex_t lock;
+	int *wds;
+	char **relpaths;
+	size_t nr;
+	size_t size;
+};
+
+static int __tree_collect(void *arg, const char *path, const char *relpath,
+			  int is_dir)
+{
+	struct tree_walk *tw = (struct tree_walk *)arg;
+	int wd, rc = -1;
+
+	if (!is_dir)
+		return -1;
+
+	wd = dm_engine_watch(tw->dm->env->engine, path,
+			     tw->dm->mask | IN_DONT_FOLLOW);
+	if (wd == -1)
+		return -1;
+
+	pthread_mutex_lock(&tw->lock);
+	if (tw->nr == tw->size) {
+		size_t size = tw->size ? tw->size * 2 : 64;
+		int *wds = realloc(tw->wds, size * sizeof(int));
+		char **relpaths;
+
+		if (wds)
+			tw->wds = wds;
+		relpaths = realloc(tw->relpaths, size * sizeof(char *));
+		if (relpaths)
+			tw->relpaths = relpaths;
+		if (wds && relpaths)
+			tw->size = size;
+	}
+	if (tw->nr < tw->size &&
+	    (tw->relpaths[tw->nr] = strdup(relpath)) != NULL) {
+		tw->wds[tw->nr++] = wd;
+		rc = 0;
+	}
+	pthread_mutex_unlock(&tw->lock);
+
+	if (rc != 0)
+		ERROR("Memory allocation failure.");
+	return rc;
+}
+
+static int __tree_install(void *arg)
+{
+	struct tree_walk *tw = (struct tree_walk *)arg;
+	struct dir_monitor *dm = tw->dm;
+	size_t i;
+
+	for (i = 0; i < tw->nr; i++) {
+		if (dm_engine_bind(&dm->src, tw->wds[i]) != 0)
+			continue;
+		if (dm_tree_insert(&dm->tree, tw->wds[i],
+				   tw->relpaths[i]) != 0)
+			dm_engine_unbind(&dm->src, tw->wds[i]);
+	}
+	return 0;
+}
+
+/**
+ * This function places watches on all the subdirectories of a recursive
+ * monitor. The tree is walked from the calling thread, in parallel for
+ * large trees, and the watches are handed over to the engine at the end.
+ *
+ * @param: dm	A monitor attached to the engine.
+ * @return: 0 on success or -1 on failure.
+ */
+static int __tree_setup(struct dir_monitor *dm)
+{
+	struct tree_walk tw;
+	size_t i;
+	int rc;
+
+	memset(&tw, 0, sizeof(tw));
+	tw.dm = dm;
+	pthread_mutex_init(&tw.lock, NULL);
+
+	rc = dm_tree_walk(dm->dir_path, "", dm->env->walk_threads,
+			  __tree_collect, &tw);
+	if (rc == 0)
+		dm_engine_call(dm->env->engine, __tree_install, &tw);
+
+	for (i = 0; i < tw.nr; i++)
+		free(tw.relpaths[i]);
+	free(tw.relpaths);
+	free(tw.wds);
+	pthread_mutex_destroy(&tw.lock);
+
+	DEBUG("'%s': %zu subdirectories watched", dm->dir_path,
+	      dm->tree.nr_used);
+	return rc;
+}
+
+/**
+ * This function matches a name against the filter of the monitor, before
+ * anything is done about the event.
+ *
+ * @param: dm	A valid monitor.
+ * @param: name	Path relative to the monitored directory.
+ * @param: gone	File does not exist any more.
+ * @return: 1 if the event is dropped, 0 otherwise.
+ */
+static int __filtered(struct dir_monitor *dm, const char *name, int gone)
+{
+	struct stat st;
+	int rule;
+
+	if (dm->cfg.filter == NULL)
+		return 0;
+
+	/*
+	 * Names are matched first, files are only looked at when no name
+	 * rule dropped them; size and type rules pass files which cannot be.
+	 */
+	rule = dm_filter_match_name(dm->cfg.filter, name);
+	if (rule == -1 && !gone && dm->filter_dirfd != -1 &&
+	    fstatat(dm->filter_dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+		rule = dm_filter_match_stat(dm->cfg.filter, &st);
+	if (rule == -1)
+		return 0;
+
+	__stats_add(&dm->filter_drops[rule], 1);
+	__stats_add(&dm->stats.filtered, 1);
+	dm_stat_inc(DM_STAT_FILTERED);
+	return 1;
+}
+
+/* Visitor for a directory that showed up at run time; engine thread */
+static int __tree_grow(void *arg, const char *path, const char *relpath,
+		       int is_dir)
+{
+	struct dir_monitor *dm = (struct dir_monitor *)arg;
+	int wd;
+
+	/* Files got there before the watch did */
+	if (!is_dir) {
+		if (!__filtered(dm, relpath, 0))
+			__report_modified(dm, relpath);
+		return 0;
+	}
+
+	wd = dm_engine_watch(dm->env->engine, path,
+			     dm->mask | IN_DONT_FOLLOW);
+	if (wd == -1)
+		return -1;
+
+	if (dm_engine_bind(&dm->src, wd) != 0)
+		return -1;
+	if (dm_tree_insert(&dm->tree, wd, relpath) != 0) {
+		dm_engine_unbind(&dm->src, wd);
+		return -1;
+	}
+	return 0;
+}
+
+static void __tree_add(struct dir_monitor *dm, const char *relpath)
+{
+	char path[PATH_MAX];
+
+	if (snprintf(path, sizeof(path), "%s/%s", dm->dir_path,
+		     relpath) >= (int)sizeof(path))
+		return;
+
+	/* The directory itself and then what is in there already */
+	if (__tree_grow(dm, path, relpath, 1) == 0)
+		dm_tree_walk(dm->dir_path, relpath, 1, __tree_grow, dm);
+}
+
+static void __tree_unbind(int wd, void *arg)
+{
+	struct dir_monitor *dm = (struct dir_monitor *)arg;
+
+	dm_engine_unbind(&dm->src, wd);
+}
+
+static int __tree_release(void *arg)
+{
+	struct dir_monitor *dm = (struct dir_monitor *)arg;
+
+	dm_tree_remove_subtree(&dm->tree, "", __tree_unbind, dm);
+	dm_tree_release(&dm->tree);
+	return 0;
+}
+
+/**
+ * This function gives the path of the event relative to the monitored
+ * directory.
+ *
+ * @param: dm		A valid monitor.
+ * @param: event	Event with a name.
+ * @param: buff		Buffer to build the path in.
+ * @param: size		Size of the buffer.
+ * @return: Relative path or NULL if the watch is unknown.
+ */
+static const char *__event_path(struct dir_monitor *dm,
+				const struct inotify_event *event,
+				char *buff, size_t size)
+{
+	const char *dir;
+
+	if (event->wd == dm->src.wd)
+		return event->name;
+
+	dir = dm_tree_lookup(&dm->tree, event->wd);
+	if (dir == NULL ||
+	    snprintf(buff, size, "%s/%s", dir, event->name) >= (int)size)
+		return NULL;
+	return buff;
+}
+
+/* Visitor for a directory moved into a fanotify watched tree */
+static int __tree_moved_in(void *arg,
+			   const char *path __attribute__((unused)),
+			   const char *relpath, int is_dir)
+{
+	struct dir_monitor *dm = (struct dir_monitor *)arg;
+
+	if (!is_dir && !__filtered(dm, relpath, 0))
+		__report_modified(dm, relpath);
+	return 0;
+}
+
+/**
+ * This function handles a change below the monitored directory, whatever
+ * the backend it came from.
+ *
+ * @param: dm		A valid monitor.
+ * @param: mask		inotify event mask.
+ * @param: cookie	inotify cookie of a move, 0 if none.
+ * @param: name		Path relative to the monitored directory.
+ * @return: No return.
+ */
+static void __handle_change(struct dir_monitor *dm, uint32_t mask,
+			    uint32_t cookie, const char *name)
+{
+	/* Directories are only followed by recursive monitors */
+	if (mask & IN_ISDIR) {
+		if (!dm->cfg.recursive)
+			return;
+		if (dm->fan) {
+			/* Whole filesystem is watched, only report content */
+			if (mask & IN_MOVED_TO)
+				dm_tree_walk(dm->dir_path, name, 1,
+					     __tree_moved_in, dm);
+			return;
+		}
+		if (mask & (IN_CREATE | IN_MOVED_TO))
+			__tree_add(dm, name);
+		else if (mask & IN_MOVED_FROM)
+			dm_tree_remove_subtree(&dm->tree, name,
+					       __tree_unbind, dm);
+		return;
+	}
+
+	if (__filtered(dm, name, mask & (IN_DELETE | IN_MOVED_FROM)))
+		return;
+
+	if (mask & IN_DELETE)
+		__report_deleted(dm, name);
+	else if (dm->cfg.moves && (mask & WATCH_MASK_MOVES))
+		__report_moved(dm, mask, cookie, name);
+	/* Masks of watches shared with other monitors add up, filter here */
+	else if (mask & (dm->cfg.completed ? IN_CLOSE_WRITE | IN_MOVED_TO :
+					      IN_MODIFY))
+		__report_modified(dm, name);
+}
+
+static void __handle_event(struct dm_source *src,
+			   const struct inotify_event *event)
+{
+	struct dir_monitor *dm = container_of(src, struct dir_monitor, src);
+	char buff[PATH_MAX];
+	const char *name;
+
+	/* Subdirectory removed or moved away */
+	if (event->mask & IN_IGNORED) {
+		if (event->wd != src->wd)
+			dm_tree_remove(&dm->tree, event->wd);
+		return;
+	}
+
+	if (!event->len)
+		return;
+
+	__stats_add(&dm->stats.events, 1);
+	name = __event_path(dm, event, buff, sizeof(buff));
+	if (name == NULL)
+		return;
+
+	__handle_change(dm, event->mask, event->cookie, name);
+}
 
-struct dir_monitor {
-	/* MQTT client */
-	struct mosquitto *client;
-	/* Dynamically allocated string for directory name */
-	char *dir_path;
-	/* File descriptor associated with monitor */
-	int fd;
-	/* Thread ID */
-	pthread_t tid;
-	/* Thread alive flag */
-	unsigned int is_alive : 1;
-	/* Buffer to store events read from fd */
-	char buff_event[EVENT_BUFF_SIZE];
-	/* Buffer to construct modify mqtt message */
-	char buff_modify[BUFF_SIZE];
-	/* Buffer to construct delete mqtt message */
-	char buff_delete[BUFF_SIZE];
-	struct dir_monitor *next;
+/* Save the snapshot when it changed since last saved */
+static void __index_save(struct dir_monitor *dm)
+{
+	uint64_t start = dm_engine_now();
+
+	if (dm->index_path == NULL || !dm->index_dirty)
+		return;
+
+	if (dm_snapshot_save(&dm->snap, dm->index_path) != 0) {
+		WARN("Failed to save index of '%s'", dm->dir_path);
+		return;
+	}
+	dm->index_dirty = 0;
+	DEBUG("'%s' index saved in %llu ms", dm->dir_path,
+	      (unsigned long long)(dm_engine_now() - start));
+}
+
+static void __handle_timeout(struct dm_source *src)
+{
+	struct dir_monitor *dm = container_of(src, struct dir_monitor, src);
+	uint64_t now = dm_engine_now();
+	unsigned int nr_events = dm->nr_events;
+
+	/* Settled files do not wait for the batch quiet period */
+	dm_debounce_expire(&dm->debounce, now, __settled, dm);
+	dm_moves_expire(&dm->moves, now, __moved_away, dm);
+
+	if (dm->batch_deadline <= now || dm->nr_events != nr_events)
+		__flush_events(dm);
+	if (dm->storm.active) {
+		dm_storm_settle(&dm->storm, now);
+		__storm_changed(dm, 1);
+	}
+	if (dm->checkpoint <= now) {
+		__index_save(dm);
+		dm->checkpoint = now + dm->env->index_checkpoint_ms;
+	}
+	__rearm(dm);
+}
+
+/* State of a snapshot being taken */
+struct rescan {
+	struct dir_monitor *dm;
+	struct dm_snapshot snap;
+	/* Monitored directory */
+	int rootfd;
+	/* Subdirectories found, to catch up with the tree */
+	char **dirs;
+	size_t nr_dirs;
+	size_t size;
+	/* Result of the first snapshot */
+	int rc;
+	/* Collect the subdirectories */
+	unsigned int collect : 1;
+	/* Scan the subdirectories found rather than the watched tree, which
+	 * belongs to the engine thread
+	 */
+	unsigned int walk : 1;
 };
 
-static inline void __event_message_create(char *buff, int size,
-					  const char *tag, const char *status)
+static void __rescan_found_dir(void *arg, const char *relpath)
 {
-	snprintf(buff, size, "{\"DirName\":\"%s\",\"Status\":\"%s\",\"Files\":[",
-		 tag, status);
+	struct rescan *rs = (struct rescan *)arg;
+
+	if (rs->nr_dirs == rs->size) {
+		size_t size = rs->size ? rs->size * 2 : 64;
+		char **dirs = realloc(rs->dirs, size * sizeof(char *));
+
+		if (dirs == NULL) {
+			ERROR("Memory allocation failure.");
+			return;
+		}
+		rs->dirs = dirs;
+		rs->size = size;
+	}
+	if ((rs->dirs[rs->nr_dirs] = strdup(relpath)) != NULL)
+		rs->nr_dirs++;
 }
 
-static inline void __event_message_update(char *buff, int size,
-					  int len, const char *txt)
+static void __rescan_subdir(struct rescan *rs, const char *relpath)
 {
-	snprintf(buff + len, size - len, "\"%s\",", txt);
+	int fd = openat(rs->rootfd, relpath,
+			O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+	if (fd == -1)
+		return;
+	dm_snapshot_scan(&rs->snap, fd, relpath,
+			 rs->collect ? __rescan_found_dir : NULL, rs);
+	close(fd);
 }
 
-static void __event_message_finalize(char *buff, int size, int len)
+static void __rescan_tree_dir(int wd __attribute__((unused)),
+			      const char *relpath, void *arg)
 {
-	/* Remove last comma */
-	if (buff[len - 1] == ',')
-		snprintf(buff + len - 1, size - len, "%s", "]}");
-	else
-		snprintf(buff + len, size - len, "%s", "]}");
+	__rescan_subdir((struct rescan *)arg, relpath);
 }
 
-static void publish_message(struct mosquitto *mosq, const char *topic,
-			    char *buff, int size)
+/**
+ * This function takes a snapshot of the monitored directory, and of all
+ * the subdirectories for a recursive monitor: the watched ones with
+ * inotify, all the ones found with fanotify or when walking.
+ *
+ * @param: rs	Rescan state with dm, collect and walk set.
+ * @return: 0 on success or -1 on failure.
+ */
+static int __snapshot_take(struct rescan *rs)
 {
+	struct dir_monitor *dm = rs->dm;
 	int rc;
 
-	__event_message_finalize(buff, size, strlen(buff));
+	dm_snapshot_init(&rs->snap);
+	rs->rootfd = open(dm->dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (rs->rootfd == -1) {
+		DEBUG("open('%s') failed : %s", dm->dir_path, strerror(errno));
+		return -1;
+	}
+
+	rc = dm_snapshot_scan(&rs->snap, rs->rootfd, "",
+			      rs->collect ? __rescan_found_dir : NULL, rs);
+	if (rc == 0 && dm->cfg.recursive) {
+		size_t i;
+
+		if (dm->fan == NULL && !rs->walk)
+			dm_tree_foreach(&dm->tree, __rescan_tree_dir, rs);
+		/* Grows while subdirectories are found */
+		for (i = 0; (dm->fan || rs->walk) && i < rs->nr_dirs; i++)
+			__rescan_subdir(rs, rs->dirs[i]);
+	}
 
-	/* Publish to broker */
-	rc = mosquitto_publish(mosq, NULL, topic, strlen(buff),
-			       buff, 0, false);
-	if (rc != MOSQ_ERR_SUCCESS)
-		ERROR("Failed to send to broker : %s",
-		      mosquitto_strerror(rc));
+	close(rs->rootfd);
+	if (rc != 0)
+		dm_snapshot_release(&rs->snap);
+	return rc;
 }
 
-static int event_read(int fd, int timeout, char *buff,
-		      size_t size, size_t *actual)
+static void __rescan_change(void *arg, const char *name,
+			    enum dm_snap_change change)
 {
-	size_t nbytes = 0;
-	struct timeval tve; /* The absolute target time. */
-	int init = 1;
-	int retval = -1;
-
-	while (nbytes < size) {
-		fd_set fds;
-		struct timeval tvt;
+	struct dir_monitor *dm = (struct dir_monitor *)arg;
+	int added;
 
-		/* Clear file descriptor set */
-		FD_ZERO(&fds);
-		FD_SET(fd, &fds);
+	dm->index_dirty = 1;
+	if (__filtered(dm, name, change == DM_SNAP_DELETED))
+		return;
 
-		if (timeout > 0) {
-			struct timeval now;
-			if (gettimeofday(&now, NULL) != 0) {
-				DEBUG("gettimeofday() failed.");
-				goto exit;
-			}
-			if (init) {
-				/* Calculate the initial timeout. */
-				tvt.tv_sec  = (timeout / 1000);
-				tvt.tv_usec = (timeout % 1000) * 1000;
-				timeradd(&now, &tvt, &tve); /* Calculate the target time. */
-			} else {
-				/* Calculate the remaining timeout. */
-				if (timercmp(&now, &tve, <))
-					timersub(&tve, &now, &tvt);
-				else
-					timerclear(&tvt);
-			}
-			init = 0;
-		} else if (timeout == 0) {
-			timerclear(&tvt);
-		}
+	/* Reported now, no need to wait for it to settle */
+	if (dm->cfg.debounce_ms)
+		dm_debounce_remove(&dm->debounce, name);
 
-		/* wait for data on file descriptor */
-		int rc = select(fd + 1, &fds, NULL, NULL,
-				timeout >= 0 ? &tvt : NULL);
-		if (rc < 0) {
-			if (errno == EINTR)
-				continue; /* Retry. */
-			ERROR("select() error.");
-			goto exit;
-		} else if (rc == 0) {
-			break; /* Timeout. */
-		}
+	if (change == DM_SNAP_CREATED)
+		added = __batch_add(dm, DM_STORM_CREATED, name);
+	else if (change == DM_SNAP_MODIFIED)
+		added = __batch_add(dm, DM_STORM_MODIFIED, name);
+	else
+		added = __batch_add(dm, DM_STORM_DELETED, name);
+	__batch_count(dm, added);
+}
 
-		ssize_t n = read(fd, buff + nbytes, size - nbytes);
-		if (n < 0) {
-			if (errno == EINTR || errno == EAGAIN)
-				continue; /* retry reading. */
-			ERROR("read() error.");
-			goto exit;
-		} else if (n == 0) {
-			break;	/* EOF */
-		}
-		nbytes += n;
+/**
+ * This function installs the first snapshot of the directory, taken by the
+ * starting thread. Files reported while it was taken are looked up again.
+ * With a saved index, the changes made while no monitor ran are reported
+ * first, the same way as after a rescan.
+ *
+ * @param: arg	Rescan state of the first snapshot, rc set.
+ * @return: 0 on success or -1 on failure.
+ */
+static int __snapshot_init(void *arg)
+{
+	struct rescan *rs = (struct rescan *)arg;
+	struct dir_monitor *dm = rs->dm;
+	struct dm_snapshot saved;
+	uint64_t start = dm_engine_now();
+	const char *name;
+	unsigned int i;
+
+	dm->snap_scanning = 0;
+	if (rs->rc == 0) {
+		dm_snapshot_release(&dm->snap);
+		dm->snap = rs->snap;
+		for (i = 0, name = dm->snap_touched.buff;
+		     i < dm->snap_touched.nr; i++, name += strlen(name) + 1)
+			__snapshot_file(dm, name, 0);
 	}
-	retval = 0;
+	dm_namelist_release(&dm->snap_touched);
+
+	if (rs->rc != 0 || dm->index_path == NULL)
+		return rs->rc;
+
+	if (dm_snapshot_load(&saved, dm->index_path) != 0) {
+		dm->index_dirty = 1;
+	} else {
+		dm_snapshot_diff(&saved, &dm->snap, __rescan_change, dm);
+		dm_snapshot_release(&saved);
+		__flush_events(dm);
+		DEBUG("'%s' caught up with its index in %llu ms", dm->dir_path,
+		      (unsigned long long)(dm_engine_now() - start));
+	}
+	if (dm->env->index_checkpoint_ms)
+		dm->checkpoint = dm_engine_now() + dm->env->index_checkpoint_ms;
+	__rearm(dm);
+	return 0;
+}
 
- exit:
-	if (actual)
-		*actual = nbytes;
-	return retval;
+/**
+ * This function takes the first snapshot of the directory on the calling
+ * thread, so that a large or slow directory holds up neither the other
+ * monitors of the engine nor the monitors started in parallel, then has
+ * the engine install it.
+ *
+ * @param: dm	A monitor keeping a snapshot, attached to its engine.
+ * @return: 0 on success or -1 on failure.
+ */
+static int __snapshot_start(struct dir_monitor *dm)
+{
+	struct rescan rs;
+	int rc;
+
+	memset(&rs, 0, sizeof(rs));
+	rs.dm = dm;
+	rs.collect = dm->cfg.recursive;
+	rs.walk = 1;
+	rs.rc = __snapshot_take(&rs);
+
+	rc = dm_engine_call(dm->env->engine, __snapshot_init, &rs);
+
+	while (rs.nr_dirs)
+		free(rs.dirs[--rs.nr_dirs]);
+	free(rs.dirs);
+	return rc;
 }
 
-static void __handle_events(struct dir_monitor *dm)
+/**
+ * This function compares the directory with its snapshot and reports the
+ * differences as events. Subdirectories of a recursive monitor which came
+ * in unnoticed are watched and reported as well.
+ *
+ * @param: dm	A monitor keeping a snapshot.
+ * @return: 0 on success or -1 on failure.
+ */
+static int __rescan(struct dir_monitor *dm)
 {
-	char topic[64] = "";
-	/* Only directory name needed */
-	char *dir_name = basename(dm->dir_path);
+	struct rescan rs;
+	uint64_t start = dm_engine_now();
+	size_t i;
+	int rc = -1;
+
+	/* The first snapshot, still being taken, finds it all */
+	if (dm->snap_scanning)
+		return -1;
+
+	memset(&rs, 0, sizeof(rs));
+	rs.dm = dm;
+	rs.collect = dm->cfg.recursive;
 
-	snprintf(topic, 64, "%s%s", TOPIC_PREFIX, dir_name);
+	if (__snapshot_take(&rs) != 0)
+		goto exit;
 
-	/* Loop while events can be read from inotify file descriptor. */
-	for (;;) {
-		size_t actual = 0;
-		register int i = 0;
-		unsigned int buff_delete_dirty = 0;
-		unsigned int buff_modify_dirty = 0;
+	dm_snapshot_diff(&dm->snap, &rs.snap, __rescan_change, dm);
+	dm_snapshot_release(&dm->snap);
+	dm->snap = rs.snap;
 
-		/* Clear the buffers */
-		memset(dm->buff_event, 0, EVENT_BUFF_SIZE);
-		memset(dm->buff_modify, 0, BUFF_SIZE);
-		memset(dm->buff_delete, 0, BUFF_SIZE);
+	for (i = 0; dm->fan == NULL && i < rs.nr_dirs; i++) {
+		char path[PATH_MAX];
+		int wd;
 
-		/* Read some events. */
-		if (event_read(dm->fd, READ_TIMEOUT, dm->buff_event,
-			       EVENT_BUFF_SIZE, &actual) != 0 || actual <= 0)
+		if (snprintf(path, sizeof(path), "%s/%s", dm->dir_path,
+			     rs.dirs[i]) >= (int)sizeof(path))
 			continue;
+		/* Watched already or new to us */
+		wd = dm_engine_watch(dm->env->engine, path,
+				     dm->mask | IN_DONT_FOLLOW);
+		if (wd != -1 && dm_tree_lookup(&dm->tree, wd) == NULL)
+			__tree_add(dm, rs.dirs[i]);
+	}
 
-		while (i < actual) {
-			const struct inotify_event *event =
-			(const struct inotify_event *)&(dm->buff_event[i]);
+	DEBUG("'%s' rescanned in %llu ms", dm->dir_path,
+	      (unsigned long long)(dm_engine_now() - start));
+	rc = 0;
+ exit:
+	for (i = 0; i < rs.nr_dirs; i++)
+		free(rs.dirs[i]);
+	free(rs.dirs);
+	return rc;
+}
 
-			i += sizeof(struct inotify_event) + event->len;
+/**
+ * This function brings consumers back in sync after events were lost.
+ * Monitors with a snapshot report what changed; others can only tell that
+ * something did, with an "overflow" message.
+ *
+ * @param: dm	A valid monitor.
+ * @return: No return.
+ */
+static void __resync(struct dir_monitor *dm)
+{
+	struct dm_payload pl;
 
-			/* Not interested in directory events */
-			if (!event->len || (event->mask & IN_ISDIR))
-				continue;
+	dm_stat_inc(DM_STAT_RESCANS);
 
-			if (event->mask & IN_DELETE) {
-				if (!buff_delete_dirty)
-					__event_message_create(dm->buff_delete,
-							       BUFF_SIZE,
-							       dir_name,
-							       "deleted");
-				__event_message_update(dm->buff_delete,
-						       BUFF_SIZE,
-						       strlen(dm->buff_delete),
-						       event->name);
-				buff_delete_dirty = 1;
-
-			} else if (event->mask & IN_MODIFY) {
-				if (!buff_modify_dirty)
-					__event_message_create(dm->buff_modify,
-							       BUFF_SIZE,
-							       dir_name,
-							       "modified");
-				__event_message_update(dm->buff_modify,
-						       BUFF_SIZE,
-						       strlen(dm->buff_modify),
-						       event->name);
-				buff_modify_dirty = 1;
-			}
-		}
+	if (dm->cfg.snapshot && __rescan(dm) == 0) {
+		__flush_events(dm);
+		__rearm(dm);
+		return;
+	}
 
-		/* Publish only on update */
-		if (buff_delete_dirty)
-			publish_message(dm->client, topic,
-					dm->buff_delete, BUFF_SIZE);
-		if (buff_modify_dirty)
-			publish_message(dm->client, topic,
-					dm->buff_modify, BUFF_SIZE);
+	/* What is known goes out first */
+	__flush_events(dm);
+	__rearm(dm);
+
+	dm_payload_init(&pl, dm->cfg.max_payload, dm->cfg.format);
+	if (dm_payload_begin(&pl, dm->dir_name, "overflow") == 0)
+		publish_message(dm, &pl);
+	dm_payload_release(&pl);
+}
+
+static void __handle_overflow(struct dm_source *src)
+{
+	struct dir_monitor *dm = container_of(src, struct dir_monitor, src);
+
+	/* inotify queue is not ours */
+	if (dm->fan == NULL) {
+		__stats_add(&dm->stats.overflows, 1);
+		__resync(dm);
 	}
 }
 
-static void monitor_thread_cleanup_handler(void *arg)
+static void __fan_event(void *arg, uint32_t mask, const char *relpath)
 {
 	struct dir_monitor *dm = (struct dir_monitor *)arg;
-	/* Remove mqtt client */
-	mosquitto_disconnect(dm->client);
-	mosquitto_destroy(dm->client);
-	close(dm->fd);
+
+	__stats_add(&dm->stats.events, 1);
+	/* fanotify has no cookie, moves stay unpaired */
+	__handle_change(dm, mask, 0, relpath);
 }
 
-static void *monitor_thread(void *arg)
+static void __fan_overflow(void *arg)
 {
 	struct dir_monitor *dm = (struct dir_monitor *)arg;
 
-	/* Defer thread cancellation till pushing handler */
-	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-	pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
+	__stats_add(&dm->stats.overflows, 1);
+	__resync(dm);
+}
+
+static const struct dm_fanotify_ops fanotify_ops = {
+	.event = __fan_event,
+	.overflow = __fan_overflow,
+};
+
+/* Publish everything pending and drop the subdirectory watches */
+static int __monitor_release(void *arg)
+{
+	struct dir_monitor *dm = (struct dir_monitor *)arg;
 
-	/* Push cleanup handler */
-	pthread_cleanup_push(monitor_thread_cleanup_handler, dm);
-	__handle_events(dm);
-	pthread_cleanup_pop(1);
-	pthread_exit(NULL);
+	dm_debounce_expire(&dm->debounce, UINT64_MAX, __settled, dm);
+	dm_moves_expire(&dm->moves, UINT64_MAX, __moved_away, dm);
+	__flush_events(dm);
+	__index_save(dm);
+	dm_engine_disarm(&dm->src);
+	return __tree_release(dm);
 }
 
+static const struct dm_source_ops dir_monitor_ops = {
+	.event = __handle_event,
+	.timeout = __handle_timeout,
+	.overflow = __handle_overflow,
+};
+
 static int check_dir_access(const char *dir_path)
 {
 	if (access(dir_path, F_OK) != 0) {
@@ -252,10 +1550,31 @@ static int check_dir_access(const char *dir_path)
 	return 0;
 }
 
-int dir_monitor_start(struct dir_monitor **out, const char *dir_path)
+/* Index file of the directory, named after a hash of its canonical path */
+static int __index_path(struct dir_monitor *dm, const char *index_dir)
+{
+	/* '/', 16 hex digits, ".idx" and NUL */
+	size_t size = strlen(index_dir) + 22;
+	char path[PATH_MAX];
+
+	if (realpath(dm->dir_path, path) == NULL)
+		snprintf(path, sizeof(path), "%s", dm->dir_path);
+	dm->index_path = malloc(size);
+	if (dm->index_path == NULL) {
+		ERROR("Memory allocation failure.");
+		return -1;
+	}
+	snprintf(dm->index_path, size, "%s/%016llx.idx", index_dir,
+		 (unsigned long long)hash_str64(path, strlen(path)));
+	return 0;
+}
+
+int dir_monitor_start(struct dir_monitor **out,
+		      const struct dir_monitor_env *env, const char *dir_path,
+		      const struct dir_monitor_config *cfg)
 {
-	int wd;
 	struct dir_monitor *dm = NULL;
+	unsigned int i;
 
 	if (check_dir_access(dir_path) != 0) {
 		ERROR("Failed to access directory.");
@@ -268,64 +1587,109 @@ int dir_monitor_start(struct dir_monitor **out, const char *dir_path)
 		goto exit;
 	}
 
-	dm->is_alive = 0;
 	/* dir name for mqtt topic */
 	dm->dir_path = strdup(dir_path);
-	dm->fd = -1;
-	dm->next = NULL;
-
-	/* Create the file descriptor for accessing the inotify API
-	 * 0-blocking; IN_NONBLOCK-non-blocking
-	 */
-	dm->fd = inotify_init1(IN_NONBLOCK);
-	if (dm->fd == -1) {
-		ERROR("inotify_init1() failed.");
+	dm->dir_name = basename(dm->dir_path);
+	snprintf(dm->topic, sizeof(dm->topic), "%s%s%s", TOPIC_PREFIX,
+		 dm->dir_name,
+		 cfg->format == DM_PAYLOAD_BINARY ? TOPIC_SUFFIX_BINARY : "");
+	dm->src.ops = &dir_monitor_ops;
+	dm->env = env;
+	dm->cfg = *cfg;
+	dm->cfg.filter = dm_filter_get(cfg->filter);
+	dm->filter_dirfd = -1;
+	if (cfg->metadata &&
+	    dm_metacache_init(&dm->meta, dm->dir_path,
+			      cfg->metadata_ttl_ms) != 0)
 		goto exit_free;
+	if (cfg->filter) {
+		dm->filter_drops = calloc(dm_filter_nr_rules(cfg->filter),
+					  sizeof(uint64_t));
+		if (dm->filter_drops == NULL) {
+			ERROR("Memory allocation failure.");
+			goto exit_free;
+		}
 	}
-
-	/* Watch for delete and modify and exclude linked.
-	 * IN_CREATE not needed because we would not have to monitor
-	 * only empty file created in the directory.
-	 * Non-empty file created will also generate IN_MODIFY. So,
-	 * IN_CREATE not needed to watch..!!
-	 */
-	wd = inotify_add_watch(dm->fd, dm->dir_path,
-			       IN_DELETE | IN_MODIFY | IN_EXCL_UNLINK);
-	if (wd == -1) {
-		ERROR("Failed to setup watch on '%s'", dir_path);
-		goto exit_close;
+	if (cfg->filter && dm_filter_needs_stat(cfg->filter)) {
+		dm->filter_dirfd = open(dm->dir_path,
+					O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dm->filter_dirfd == -1) {
+			SYSERR("Failed to open '%s'", dir_path);
+			goto exit_free;
+		}
 	}
 
-	/* Initialize mqtt client */
-	dm->client = mosquitto_new(basename(dm->dir_path), true, NULL);
-	if (dm->client == NULL) {
-		ERROR("mosquitto_new() failed.");
-		goto exit_close;
+	for (i = 0; i < DM_SINK_MAX; i++) {
+		if (!(cfg->sinks & DM_SINK_BIT(i)))
+			continue;
+		dm->sinks[dm->nr_sinks] = dm_sinks_get(env->sinks, i);
+		if (dm->sinks[dm->nr_sinks] == NULL) {
+			ERROR("Failed to create sink for '%s'", dir_path);
+			goto exit_free;
+		}
+		dm->nr_sinks++;
 	}
-
-	/* Connect to broker */
-	if (mosquitto_connect(dm->client, HOST_ADDRESS, MQTT_PORT,
-			      MQTT_CONNECTION_TIMEOUT) != MOSQ_ERR_SUCCESS) {
-		ERROR("Failed to connect to broker");
-		goto exit_destroy;
+	dm_snapshot_init(&dm->snap);
+	dm_tree_init(&dm->tree);
+	dm_debounce_init(&dm->debounce, cfg->debounce_ms, cfg->debounce_max_ms);
+	dm_fpcache_init(&dm->fp, cfg->fingerprint_max_size);
+	dm_moves_init(&dm->moves, cfg->move_timeout_ms);
+	dm_storm_init(&dm->storm, cfg->rate_limit, cfg->rate_burst,
+		      cfg->summary_sample);
+	dm->stats.rate_limit = cfg->rate_limit;
+	dm->batch_deadline = UINT64_MAX;
+	dm->checkpoint = UINT64_MAX;
+	if (cfg->snapshot && env->index_dir &&
+	    __index_path(dm, env->index_dir) != 0)
+		goto exit_free;
+	/* Reported files wait for the first snapshot, see __snapshot_start() */
+	dm->snap_scanning = cfg->snapshot;
+	dm->mask = cfg->completed ? WATCH_MASK_COMPLETED : WATCH_MASK;
+	if (cfg->recursive)
+		dm->mask |= WATCH_MASK_TREE;
+	if (cfg->moves)
+		dm->mask |= WATCH_MASK_MOVES;
+
+	if (cfg->backend == DM_BACKEND_FANOTIFY) {
+		/* Timers only, events come from the fanotify watch */
+		if (dm_engine_attach(env->engine, &dm->src, NULL, 0) != 0 ||
+		    dm_fanotify_start(&dm->fan, env->engine, dm->dir_path,
+				      cfg->recursive, cfg->completed,
+				      &fanotify_ops, dm) != 0) {
+			ERROR("Failed to setup fanotify watch on '%s'",
+			      dir_path);
+			goto exit_detach;
+		}
+	} else if (dm_engine_attach(env->engine, &dm->src, dm->dir_path,
+				    dm->mask) != 0) {
+		ERROR("Failed to setup watch on '%s'", dir_path);
+		goto exit_free;
 	}
 
-	if (pthread_create(&dm->tid, NULL, monitor_thread, dm) != 0) {
-		ERROR("Failed to create thread.");
-		goto exit_disconnect;
+	if (cfg->recursive && !dm->fan && __tree_setup(dm) != 0) {
+		ERROR("Failed to setup watches below '%s'", dir_path);
+		goto exit_detach;
 	}
-	dm->is_alive = 1;
+
+	/* Events missed from here on are found by a rescan */
+	if (cfg->snapshot && __snapshot_start(dm) != 0)
+		WARN("Failed to take snapshot of '%s'", dir_path);
 
 	*out = dm;
 	return 0;
 
- exit_disconnect:
-	mosquitto_disconnect(dm->client);
- exit_destroy:
-	mosquitto_destroy(dm->client);
- exit_close:
-	close(dm->fd);
+ exit_detach:
+	dm_engine_call(env->engine, __tree_release, dm);
+	dm_engine_detach(&dm->src);
  exit_free:
+	if (cfg->metadata)
+		dm_metacache_release(&dm->meta);
+	dm_namelist_release(&dm->snap_touched);
+	if (dm->filter_dirfd != -1)
+		close(dm->filter_dirfd);
+	dm_filter_put(dm->cfg.filter);
+	free(dm->filter_drops);
+	free(dm->index_path);
 	free(dm->dir_path);
 	free(dm);
  exit:
@@ -337,116 +1701,661 @@ void dir_monitor_stop(struct dir_monitor *dm)
 	if (dm == NULL)
 		return;
 
-	/* Cancel and join thread */
-	if (dm->is_alive) {
-		pthread_cancel(dm->tid);
-		pthread_join(dm->tid, NULL);
-	}
+	/* Remove watches; pending batch is published on the way */
+	dm_fanotify_stop(dm->fan);
+	dm_engine_call(dm->env->engine, __monitor_release, dm);
+	dm_engine_detach(&dm->src);
+
+	/* Given back when the last batch was published */
+	if (dm->batch)
+		__batch_free(dm->batch);
+	dm_snapshot_release(&dm->snap);
+	dm_debounce_release(&dm->debounce);
+	dm_fpcache_release(&dm->fp);
+	dm_moves_release(&dm->moves);
+	dm_storm_release(&dm->storm);
+	if (dm->cfg.metadata)
+		dm_metacache_release(&dm->meta);
+	if (dm->filter_dirfd != -1)
+		close(dm->filter_dirfd);
+	dm_filter_put(dm->cfg.filter);
+	free(dm->filter_drops);
+	free(dm->index_path);
+
 	if (dm->dir_path)
 		free(dm->dir_path);
+	free(dm->key);
 	free(dm);
 	dm = NULL;
 }
 
+/* Initial number of registry buckets (power of 2) */
+#define LIST_MIN_BUCKETS	64
+
+/**
+ * Registry of the running monitors. Monitors are hashed by canonical path
+ * and by device/inode of the directory, so a directory reached through a
+ * symlink or a bind mount is recognized as monitored already.
+ */
 struct dir_monitor_list {
-	struct dir_monitor *head;
+	/* Protects the hash tables; monitors start and stop outside of it */
+	pthread_rwlock_t lock;
+	struct dir_monitor **by_path;
+	struct dir_monitor **by_inode;
+	size_t nr_buckets;
+	size_t nr_monitors;
+	/* Sinks and settings shared by all monitors of the list */
+	struct dir_monitor_env env;
+	/* Same with the engine of each worker; a directory goes to the
+	 * worker picked by the hash of its canonical path
+	 */
+	struct dir_monitor_env *workers;
+	unsigned int nr_workers;
+	/* Settings of monitors added without own settings */
+	struct dir_monitor_config defaults;
 };
 
-struct dir_monitor_list *dir_monitor_list_create(void)
+/* Runs on the engine thread, which publishes the events of its monitors */
+static int __claim_lane(void *arg __attribute__((unused)))
+{
+	dm_publisher_claim_lane();
+	return 0;
+}
+
+struct dir_monitor_list *dir_monitor_list_create(const struct dm_config *cfg)
 {
 	struct dir_monitor_list *dm_list = NULL;
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int i;
+
+	if (nr_cpus < 1)
+		nr_cpus = 1;
 
-	if ((dm_list = malloc(sizeof(struct dir_monitor_list))) == NULL) {
+	if ((dm_list = calloc(1, sizeof(struct dir_monitor_list))) == NULL) {
 		ERROR("Memory allocation failure");
 		return NULL;
 	}
-	dm_list->head = NULL;
+	dm_list->defaults = cfg->monitor;
+	dm_list->env.walk_threads = cfg->walk_threads;
+	dm_list->env.index_dir = cfg->index_dir;
+	dm_list->env.index_checkpoint_ms = cfg->index_checkpoint_ms;
+	if (cfg->index_dir && mkdir(cfg->index_dir, 0755) == -1 &&
+	    errno != EEXIST) {
+		SYSERR("Failed to create index directory '%s'.",
+		       cfg->index_dir);
+		free(dm_list);
+		return NULL;
+	}
+
+	dm_list->nr_buckets = LIST_MIN_BUCKETS;
+	dm_list->by_path = calloc(LIST_MIN_BUCKETS, sizeof(struct dir_monitor *));
+	dm_list->by_inode = calloc(LIST_MIN_BUCKETS, sizeof(struct dir_monitor *));
+	if (dm_list->by_path == NULL || dm_list->by_inode == NULL) {
+		ERROR("Memory allocation failure");
+		goto exit_free;
+	}
+
+	if (dm_sinks_create(&dm_list->env.sinks, cfg) != 0) {
+		ERROR("Failed to create sinks");
+		goto exit_free;
+	}
+
+	dm_list->workers = calloc(cfg->workers ? cfg->workers : 1,
+				  sizeof(struct dir_monitor_env));
+	if (dm_list->workers == NULL) {
+		ERROR("Memory allocation failure");
+		goto exit_destroy_sinks;
+	}
+	for (i = 0; i < (cfg->workers ? cfg->workers : 1); i++) {
+		struct dir_monitor_env *w = &dm_list->workers[i];
+
+		*w = dm_list->env;
+		w->batches = calloc(1, sizeof(struct dm_batch_pool));
+		if (w->batches == NULL) {
+			ERROR("Memory allocation failure");
+			goto exit_destroy_engines;
+		}
+		if (dm_engine_create(&w->engine, cfg->io_uring ?
+				     DM_ENGINE_IO_URING : 0) != 0) {
+			ERROR("Failed to create event engine");
+			free(w->batches);
+			goto exit_destroy_engines;
+		}
+		dm_list->nr_workers++;
+		dm_engine_call(w->engine, __claim_lane, NULL);
+		/* Spread over the CPUs we may run on */
+		if (cfg->pin_workers)
+			dm_engine_set_cpu(w->engine, i % nr_cpus);
+	}
+	INFO("Reading kernel events with %s on %u engine(s)",
+	     dm_engine_backend(dm_list->workers[0].engine),
+	     dm_list->nr_workers);
+
+	pthread_rwlock_init(&dm_list->lock, NULL);
+	dm_filter_get(dm_list->defaults.filter);
 	return dm_list;
+
+ exit_destroy_engines:
+	while (dm_list->nr_workers) {
+		struct dir_monitor_env *w = &dm_list->workers[--dm_list->nr_workers];
+
+		dm_engine_destroy(w->engine);
+		free(w->batches);
+	}
+	free(dm_list->workers);
+ exit_destroy_sinks:
+	dm_sinks_destroy(dm_list->env.sinks);
+ exit_free:
+	free(dm_list->by_path);
+	free(dm_list->by_inode);
+	free(dm_list);
+	return NULL;
 }
 
-static int __if_present(struct dir_monitor_list *dm_list, const char *dir_path)
-{
-	struct dir_monitor **pp = &dm_list->head;
+/* Registry key of a directory */
+struct dir_key {
+	char path[PATH_MAX];
+	uint64_t hash;
+	dev_t dev;
+	ino_t ino;
+	/* Device and inode are known */
+	unsigned int has_inode : 1;
+};
 
-	while (*pp) {
-		if (!strcmp((*pp)->dir_path, dir_path))
-			return 1;
-		pp = &(*pp)->next;
+/**
+ * This function computes the registry key of a directory. A path which
+ * cannot be resolved (e.g. the directory is gone already) is taken as
+ * given and has no inode.
+ *
+ * @param: dir_path	Path of the directory.
+ * @param: key		Key to fill in.
+ * @return: No return.
+ */
+static void __dir_key(const char *dir_path, struct dir_key *key)
+{
+	struct stat st;
+
+	key->dev = 0;
+	key->ino = 0;
+	key->has_inode = 0;
+	if (realpath(dir_path, key->path) == NULL) {
+		snprintf(key->path, sizeof(key->path), "%s", dir_path);
+	} else if (stat(key->path, &st) == 0) {
+		key->dev = st.st_dev;
+		key->ino = st.st_ino;
+		key->has_inode = 1;
 	}
-	return 0;
+	key->hash = hash_str64(key->path, strlen(key->path));
+}
+
+static inline size_t __inode_bucket(dev_t dev, ino_t ino, size_t nr_buckets)
+{
+	return hash_32(ino ^ (ino >> 32) ^ dev) & (nr_buckets - 1);
+}
+
+/* Inode of the monitor still is the directory of its key, not reused */
+static int __same_inode(const struct dir_monitor *dm)
+{
+	struct stat st;
+
+	return stat(dm->key, &st) == 0 && st.st_dev == dm->dev &&
+	       st.st_ino == dm->ino;
+}
+
+/* Monitor registered under the key; lock held */
+static struct dir_monitor *__lookup(struct dir_monitor_list *dm_list,
+				    const struct dir_key *key)
+{
+	struct dir_monitor *dm;
+
+	dm = dm_list->by_path[key->hash & (dm_list->nr_buckets - 1)];
+	for (; dm; dm = dm->path_next)
+		if (dm->key_hash == key->hash && !strcmp(dm->key, key->path))
+			return dm;
+
+	if (!key->has_inode)
+		return NULL;
+
+	dm = dm_list->by_inode[__inode_bucket(key->dev, key->ino,
+					      dm_list->nr_buckets)];
+	for (; dm; dm = dm->inode_next)
+		if (dm->dev == key->dev && dm->ino == key->ino &&
+		    __same_inode(dm))
+			return dm;
+	return NULL;
+}
+
+/**
+ * This function finds the monitor a command names. A directory deleted or
+ * renamed since it was added no longer resolves to its key, so the path
+ * the monitor was started with is looked for as well.
+ *
+ * @param: dm_list	A valid list, lock held.
+ * @param: key		Key of the path.
+ * @param: dir_path	Path as given in the command.
+ * @return: Monitor or NULL if there is none.
+ */
+static struct dir_monitor *__find(struct dir_monitor_list *dm_list,
+				  const struct dir_key *key,
+				  const char *dir_path)
+{
+	struct dir_monitor *dm = __lookup(dm_list, key);
+	size_t i;
+
+	for (i = 0; dm == NULL && i < dm_list->nr_buckets; i++)
+		for (dm = dm_list->by_path[i]; dm; dm = dm->path_next)
+			if (!strcmp(dm->dir_path, dir_path))
+				break;
+	return dm;
 }
 
-static void __add_to_list(struct dir_monitor **head_ptr,
-			  struct dir_monitor *prev,
-			  struct dir_monitor *new)
+static void __link(struct dir_monitor **by_path, struct dir_monitor **by_inode,
+		   size_t nr_buckets, struct dir_monitor *dm)
 {
-	struct dir_monitor **pp = head_ptr;
+	struct dir_monitor **pp = &by_path[dm->key_hash & (nr_buckets - 1)];
+
+	dm->path_next = *pp;
+	*pp = dm;
+
+	if (!dm->has_inode)
+		return;
+	pp = &by_inode[__inode_bucket(dm->dev, dm->ino, nr_buckets)];
+	dm->inode_next = *pp;
+	*pp = dm;
+}
+
+/* Double the tables once they hold as many monitors as buckets; lock held */
+static void __grow(struct dir_monitor_list *dm_list)
+{
+	size_t i, nr_buckets = dm_list->nr_buckets * 2;
+	struct dir_monitor **by_path, **by_inode;
+
+	by_path = calloc(nr_buckets, sizeof(struct dir_monitor *));
+	by_inode = calloc(nr_buckets, sizeof(struct dir_monitor *));
+	if (by_path == NULL || by_inode == NULL) {
+		/* Longer chains, still correct */
+		free(by_path);
+		free(by_inode);
+		return;
+	}
 
-	while (*pp && *pp != prev)
-		pp = &(*pp)->next;
+	for (i = 0; i < dm_list->nr_buckets; i++) {
+		struct dir_monitor *dm = dm_list->by_path[i];
 
-	new->next = *pp;
-	*pp = new;
+		while (dm) {
+			struct dir_monitor *next = dm->path_next;
+
+			__link(by_path, by_inode, nr_buckets, dm);
+			dm = next;
+		}
+	}
+	free(dm_list->by_path);
+	free(dm_list->by_inode);
+	dm_list->by_path = by_path;
+	dm_list->by_inode = by_inode;
+	dm_list->nr_buckets = nr_buckets;
+}
+
+/* Take the monitor out of the tables; lock held */
+static void __unlink(struct dir_monitor_list *dm_list, struct dir_monitor *dm)
+{
+	struct dir_monitor **pp;
+
+	pp = &dm_list->by_path[dm->key_hash & (dm_list->nr_buckets - 1)];
+	while (*pp != dm)
+		pp = &(*pp)->path_next;
+	*pp = dm->path_next;
+
+	if (dm->has_inode) {
+		pp = &dm_list->by_inode[__inode_bucket(dm->dev, dm->ino,
+						       dm_list->nr_buckets)];
+		while (*pp != dm)
+			pp = &(*pp)->inode_next;
+		*pp = dm->inode_next;
+	}
+
+	dm_list->nr_monitors--;
 }
 
-static inline void add_to_dir_mon_list(struct dir_monitor **head_ptr,
-				       struct dir_monitor *new)
+static int __if_present(struct dir_monitor_list *dm_list,
+			const struct dir_key *key)
 {
-	/* Add to the tail */
-	__add_to_list(head_ptr, NULL, new);
+	int present;
+
+	pthread_rwlock_rdlock(&dm_list->lock);
+	present = __lookup(dm_list, key) != NULL;
+	pthread_rwlock_unlock(&dm_list->lock);
+	return present;
 }
 
 int dir_monitor_list_add(struct dir_monitor_list *dm_list,
-			 const char *dir_path)
+			 const char *dir_path,
+			 const struct dir_monitor_config *cfg)
 {
 	struct dir_monitor *dm = NULL;
+	struct dir_monitor_config tmp;
+	struct dir_key key;
 
-	if (__if_present(dm_list, dir_path)) {
+	__dir_key(dir_path, &key);
+	if (__if_present(dm_list, &key)) {
 		WARN("'%s' already in the dir monitor list. Not adding...!!",
 		     dir_path);
 		return -1;
 	}
 
-	if (dir_monitor_start(&dm, dir_path) != 0) {
+	tmp = cfg ? *cfg : dm_list->defaults;
+	if (dir_monitor_config_check(&tmp) != 0) {
+		WARN("Invalid settings for '%s'", dir_path);
+		return -1;
+	}
+
+	if (dir_monitor_start(&dm, &dm_list->workers[key.hash %
+						      dm_list->nr_workers],
+			      dir_path, &tmp) != 0) {
 		DEBUG("Failed to monitor %s directory.", dir_path);
 		return -1;
 	}
 
+	dm->key = strdup(key.path);
+	if (dm->key == NULL) {
+		ERROR("Memory allocation failure");
+		dir_monitor_stop(dm);
+		return -1;
+	}
+	dm->key_hash = key.hash;
+	dm->dev = key.dev;
+	dm->ino = key.ino;
+	dm->has_inode = key.has_inode;
+
+	/* Set up without the lock held; somebody may have been faster */
+	pthread_rwlock_wrlock(&dm_list->lock);
+	if (__lookup(dm_list, &key)) {
+		pthread_rwlock_unlock(&dm_list->lock);
+		WARN("'%s' already in the dir monitor list. Not adding...!!",
+		     dir_path);
+		dir_monitor_stop(dm);
+		return -1;
+	}
+	if (dm_list->nr_monitors >= dm_list->nr_buckets)
+		__grow(dm_list);
+	__link(dm_list->by_path, dm_list->by_inode, dm_list->nr_buckets, dm);
+	dm_list->nr_monitors++;
+	pthread_rwlock_unlock(&dm_list->lock);
+
 	INFO("'%s' added to the dir monitor list", dir_path);
-	add_to_dir_mon_list(&dm_list->head, dm);
 	return 0;
 }
 
 int dir_monitor_list_remove(struct dir_monitor_list *dm_list,
 			    const char *dir_path)
 {
-	struct dir_monitor **pp = &dm_list->head;
+	struct dir_monitor *dm;
+	struct dir_key key;
 
-	while (*pp) {
-		if (!strcmp((*pp)->dir_path, dir_path)) {
-			struct dir_monitor *tmp = *pp;
-			INFO("Removing '%s' from dir monitor list", dir_path);
-			*pp = tmp->next;
-			tmp->next = NULL;
-			dir_monitor_stop(tmp);
-			return 0;
+	__dir_key(dir_path, &key);
+
+	pthread_rwlock_wrlock(&dm_list->lock);
+	dm = __find(dm_list, &key, dir_path);
+	if (dm)
+		__unlink(dm_list, dm);
+	pthread_rwlock_unlock(&dm_list->lock);
+
+	if (dm == NULL) {
+		WARN("'%s' not present in dir monitor list", dir_path);
+		return -1;
+	}
+
+	INFO("Removing '%s' from dir monitor list", dm->dir_path);
+	dir_monitor_stop(dm);
+	return 0;
+}
+
+static int __rescan_cmd(void *arg)
+{
+	__resync((struct dir_monitor *)arg);
+	return 0;
+}
+
+int dir_monitor_list_rescan(struct dir_monitor_list *dm_list,
+			    const char *dir_path)
+{
+	struct dir_monitor *dm;
+	struct dir_key key;
+	size_t i;
+
+	/* Monitors cannot go away while the lock is held */
+	pthread_rwlock_rdlock(&dm_list->lock);
+	if (dir_path == NULL) {
+		for (i = 0; i < dm_list->nr_buckets; i++)
+			for (dm = dm_list->by_path[i]; dm; dm = dm->path_next)
+				dm_engine_call(dm->env->engine,
+					       __rescan_cmd, dm);
+		pthread_rwlock_unlock(&dm_list->lock);
+		return 0;
+	}
+
+	__dir_key(dir_path, &key);
+	dm = __find(dm_list, &key, dir_path);
+	if (dm)
+		dm_engine_call(dm->env->engine, __rescan_cmd, dm);
+	pthread_rwlock_unlock(&dm_list->lock);
+
+	if (dm == NULL) {
+		WARN("'%s' not present in dir monitor list", dir_path);
+		return -1;
+	}
+	return 0;
+}
+
+/* Listing of the files of a monitor, run on its engine */
+struct list_query {
+	struct dir_monitor *dm;
+	const char *prefix;
+	const char *after;
+	unsigned int limit;
+	struct dm_namelist *out;
+	unsigned int nr;
+	int more;
+};
+
+static int __list_name(void *arg, const char *name, size_t len)
+{
+	struct list_query *q = (struct list_query *)arg;
+	char buff[PATH_MAX];
+
+	if (q->nr == q->limit) {
+		q->more = 1;
+		return 1;
+	}
+	memcpy(buff, name, len);
+	buff[len] = '\0';
+	if (dm_namelist_add(q->out, buff, NULL) != 0)
+		return -1;
+	q->nr++;
+	return 0;
+}
+
+static int __list_cmd(void *arg)
+{
+	struct list_query *q = (struct list_query *)arg;
+
+	return dm_snapshot_list(&q->dm->snap, q->prefix, q->after,
+				__list_name, q);
+}
+
+int dir_monitor_list_files(struct dir_monitor_list *dm_list,
+			   const char *dir_path, const char *prefix,
+			   const char *after, unsigned int limit,
+			   struct dm_namelist *out, int *more)
+{
+	struct list_query q = {
+		.prefix = prefix,
+		.after = after,
+		.limit = limit,
+		.out = out,
+	};
+	struct dir_key key;
+	int rc = -1;
+
+	__dir_key(dir_path, &key);
+	pthread_rwlock_rdlock(&dm_list->lock);
+	q.dm = __find(dm_list, &key, dir_path);
+	if (q.dm == NULL)
+		WARN("'%s' not present in dir monitor list", dir_path);
+	else if (!q.dm->cfg.snapshot)
+		WARN("'%s' keeps no snapshot to list", dir_path);
+	else
+		rc = dm_engine_call(q.dm->env->engine, __list_cmd, &q);
+	pthread_rwlock_unlock(&dm_list->lock);
+
+	*more = q.more;
+	return rc;
+}
+
+static int __path_cmp(const void *a, const void *b)
+{
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+int dir_monitor_list_dirs(struct dir_monitor_list *dm_list,
+			  const char *prefix, const char *after,
+			  unsigned int limit, struct dm_namelist *out,
+			  int *more)
+{
+	size_t prefix_len = prefix ? strlen(prefix) : 0;
+	const char **paths = NULL;
+	size_t i, n = 0, size = 0;
+	struct dir_monitor *dm;
+	int rc = 0;
+
+	*more = 0;
+	pthread_rwlock_rdlock(&dm_list->lock);
+	for (i = 0; i < dm_list->nr_buckets && rc == 0; i++) {
+		for (dm = dm_list->by_path[i]; dm; dm = dm->path_next) {
+			if ((prefix_len && strncmp(dm->dir_path, prefix,
+						   prefix_len)) ||
+			    (after && strcmp(dm->dir_path, after) <= 0))
+				continue;
+			if (n == size) {
+				const char **tmp;
+
+				size = size ? size * 2 : 64;
+				tmp = realloc(paths, size * sizeof(char *));
+				if (tmp == NULL) {
+					ERROR("Memory allocation failure.");
+					rc = -1;
+					break;
+				}
+				paths = tmp;
+			}
+			paths[n++] = dm->dir_path;
 		}
-		pp = &(*pp)->next;
 	}
 
-	WARN("'%s' not present in dir monitor list", dir_path);
-	return -1;
+	/* Paths are only valid under the lock */
+	if (rc == 0) {
+		qsort(paths, n, sizeof(char *), __path_cmp);
+		for (i = 0; i < n && rc == 0; i++) {
+			if (i == limit) {
+				*more = 1;
+				break;
+			}
+			rc = dm_namelist_add(out, paths[i], NULL);
+		}
+	}
+	pthread_rwlock_unlock(&dm_list->lock);
+	free(paths);
+	return rc;
+}
+
+struct dm_sink *dir_monitor_list_sink(struct dir_monitor_list *dm_list,
+				      unsigned int type)
+{
+	return dm_sinks_get(dm_list->env.sinks, type);
+}
+
+int dir_monitor_list_stats(struct dir_monitor_list *dm_list,
+			   struct dm_stats *st)
+{
+	size_t i;
+	int rc = 0;
+
+	dm_stats_collect(st);
+	st->queued = dm_sinks_pending(dm_list->env.sinks);
+
+	pthread_rwlock_rdlock(&dm_list->lock);
+	for (i = 0; i < dm_list->nr_buckets && rc == 0; i++) {
+		struct dir_monitor *p;
+
+		for (p = dm_list->by_path[i]; p && rc == 0; p = p->path_next) {
+			unsigned int r;
+
+			rc = dm_stats_add_monitor(st, p->dir_path, &p->stats);
+			for (r = 0; rc == 0 && p->cfg.filter &&
+			     r < dm_filter_nr_rules(p->cfg.filter); r++)
+				rc = dm_stats_add_rule(st,
+					dm_filter_rule(p->cfg.filter, r),
+					__atomic_load_n(&p->filter_drops[r],
+							__ATOMIC_RELAXED));
+		}
+	}
+	pthread_rwlock_unlock(&dm_list->lock);
+	return rc;
+}
+
+int dir_monitor_list_publish(struct dir_monitor_list *dm_list,
+			     const char *topic, const void *payload,
+			     size_t len)
+{
+	struct dm_sink *sink;
+	unsigned int i;
+	int rc = 0;
+
+	for (i = 0; i < DM_SINK_MAX; i++) {
+		if (!(dm_list->defaults.sinks & DM_SINK_BIT(i)))
+			continue;
+		sink = dm_sinks_get(dm_list->env.sinks, i);
+		if (sink == NULL || dm_sink_write(sink, topic, payload, len) != 0)
+			rc = -1;
+	}
+	return rc;
 }
 
 void dir_monitor_list_destroy(struct dir_monitor_list *dm_list)
 {
-	struct dir_monitor *p = dm_list->head;
+	size_t i;
 
-	while (p != NULL) {
-		struct dir_monitor *tmp = p;
-		INFO("Removing '%s' from dir monitor list", tmp->dir_path);
-		p = tmp->next;
-		dir_monitor_stop(tmp);
+	pthread_rwlock_wrlock(&dm_list->lock);
+	for (i = 0; i < dm_list->nr_buckets; i++) {
+		struct dir_monitor *p = dm_list->by_path[i];
+
+		while (p != NULL) {
+			struct dir_monitor *tmp = p;
+			INFO("Removing '%s' from dir monitor list",
+			     tmp->dir_path);
+			p = tmp->path_next;
+			dir_monitor_stop(tmp);
+		}
+	}
+	pthread_rwlock_unlock(&dm_list->lock);
+
+	for (i = 0; i < dm_list->nr_workers; i++) {
+		struct dm_batch_pool *pool = dm_list->workers[i].batches;
+
+		dm_engine_destroy(dm_list->workers[i].engine);
+		while (pool->head) {
+			struct dm_batch *b = pool->head;
+
+			pool->head = b->next;
+			__batch_free(b);
+		}
+		free(pool);
 	}
+	free(dm_list->workers);
+	dm_sinks_destroy(dm_list->env.sinks);
+	pthread_rwlock_destroy(&dm_list->lock);
+	dm_filter_put(dm_list->defaults.filter);
+	free(dm_list->by_path);
+	free(dm_list->by_inode);
 	free(dm_list);
 }
@@ -1,21 +1,131 @@
 #ifndef DIR_MONITOR_H_INCLUDED
 #define DIR_MONITOR_H_INCLUDED
 
+#include <stddef.h>
+
 struct dir_monitor;
 struct dir_monitor_list;
+struct dm_engine;
+struct dm_sink;
+struct dm_sinks;
+struct dm_stats;
+struct dm_config;
+struct dir_monitor_config;
+struct dm_namelist;
+struct dm_batch_pool;
+
+/* Services of the monitors of one engine; sinks are shared by the list */
+struct dir_monitor_env {
+	struct dm_engine *engine;
+	struct dm_sinks *sinks;
+	/* Threads walking a large tree */
+	unsigned int walk_threads;
+	/* Directory of the saved snapshots, NULL = none */
+	const char *index_dir;
+	/* Interval of snapshot saves in milliseconds, 0 = on stop only */
+	unsigned int index_checkpoint_ms;
+	/* Scratch of the pending batches, lent by the engine; NULL = none */
+	struct dm_batch_pool *batches;
+};
 
-int dir_monitor_start(struct dir_monitor **out, const char *dirpath);
+int dir_monitor_start(struct dir_monitor **out,
+		      const struct dir_monitor_env *env, const char *dirpath,
+		      const struct dir_monitor_config *cfg);
 
 void dir_monitor_stop(struct dir_monitor *dm);
 
-struct dir_monitor_list *dir_monitor_list_create(void);
+struct dir_monitor_list *dir_monitor_list_create(const struct dm_config *cfg);
 
 int dir_monitor_list_add(struct dir_monitor_list *dm_list,
-			 const char *dirpath);
+			 const char *dirpath,
+			 const struct dir_monitor_config *cfg);
 
 int dir_monitor_list_remove(struct dir_monitor_list *dm_list,
 			    const char *dirpath);
 
+/**
+ * This function compares monitored directories with their snapshots and
+ * publishes what changed unnoticed. Directories without snapshot publish
+ * an "overflow" message.
+ *
+ * @param: dm_list	A valid list.
+ * @param: dirpath	Directory to rescan or NULL for all of them.
+ * @return: 0 on success or -1 when the directory is not monitored.
+ */
+int dir_monitor_list_rescan(struct dir_monitor_list *dm_list,
+			    const char *dirpath);
+
+/**
+ * This function lists files of a monitored directory in name order. The
+ * answer comes from the snapshot kept in memory, no directory is read.
+ *
+ * @param: dm_list	A valid list.
+ * @param: dirpath	Monitored directory.
+ * @param: prefix	Only names starting with it are listed, may be NULL.
+ * @param: after	Only names after it are listed, may be NULL.
+ * @param: limit	Names listed at most.
+ * @param: out		Names, appended to the list.
+ * @param: more		Set to 1 when names were left out for the limit.
+ * @return: 0 on success or -1 when the directory is not monitored or
+ *	    keeps no snapshot.
+ */
+int dir_monitor_list_files(struct dir_monitor_list *dm_list,
+			   const char *dirpath, const char *prefix,
+			   const char *after, unsigned int limit,
+			   struct dm_namelist *out, int *more);
+
+/**
+ * This function lists the monitored directories in name order.
+ *
+ * @param: dm_list	A valid list.
+ * @param: prefix	Only paths starting with it are listed, may be NULL.
+ * @param: after	Only paths after it are listed, may be NULL.
+ * @param: limit	Paths listed at most.
+ * @param: out		Paths, appended to the list.
+ * @param: more		Set to 1 when paths were left out for the limit.
+ * @return: 0 on success or -1 on failure.
+ */
+int dir_monitor_list_dirs(struct dir_monitor_list *dm_list,
+			  const char *prefix, const char *after,
+			  unsigned int limit, struct dm_namelist *out,
+			  int *more);
+
+/**
+ * This function returns a sink shared by the monitors of the list, for
+ * consumers running in the same process.
+ *
+ * @param: dm_list	A valid list.
+ * @param: type		enum dm_sink_type.
+ * @return: The sink or NULL on failure.
+ */
+struct dm_sink *dir_monitor_list_sink(struct dir_monitor_list *dm_list,
+				      unsigned int type);
+
+/**
+ * This function collects the counters of all threads and of every monitor
+ * of the list.
+ *
+ * @param: dm_list	A valid list.
+ * @param: st		Totals to fill, released with dm_stats_release().
+ * @return: 0 on success or -1 on failure.
+ */
+int dir_monitor_list_stats(struct dir_monitor_list *dm_list,
+			   struct dm_stats *st);
+
+/**
+ * This function writes a message to the sinks of monitors started without
+ * own settings, for messages not tied to one directory.
+ *
+ * @param: dm_list	A valid list.
+ * @param: topic	Topic of the message.
+ * @param: payload	Message payload.
+ * @param: len		Payload length in bytes.
+ * @return: 0 on success or -1 when a sink dropped the message.
+ */
+int dir_monitor_list_publish(struct dir_monitor_list *dm_list,
+			     const char *topic, const void *payload,
+			     size_t len);
+
 void dir_monitor_list_destroy(struct dir_monitor_list *dm_list);
 
 #endif /* DIR_MONITOR_H_INCLUDED */
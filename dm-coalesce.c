@@ -0,0 +1,565 @@
+#include <string.h>
+#include <stdlib.h>
+
+#include "dm-coalesce.h"
+#include "internals.h"
+#include "debug.h"
+
+
+/* Initial number of slots of a name set (power of 2) */
+#define SET_MIN_SLOTS		64
+/* Initial number of buckets of a debounce table (power of 2) */
+#define DEBOUNCE_MIN_BUCKETS	64
+
+struct set_slot {
+	uint64_t key;
+	/* Generation the slot was filled in; stale slots are empty */
+	unsigned int gen;
+};
+
+static void __set_place(struct set_slot *slots, size_t nr_slots,
+			uint64_t key, unsigned int gen)
+{
+	size_t i = key & (nr_slots - 1);
+
+	while (slots[i].gen == gen)
+		i = (i + 1) & (nr_slots - 1);
+	slots[i].key = key;
+	slots[i].gen = gen;
+}
+
+void dm_nameset_init(struct dm_nameset *set)
+{
+	set->slots = NULL;
+	set->nr_slots = 0;
+	set->nr_used = 0;
+	/* Zeroed slots belong to generation 0, start past it */
+	set->gen = 1;
+}
+
+void dm_nameset_release(struct dm_nameset *set)
+{
+	free(set->slots);
+	dm_nameset_init(set);
+}
+
+size_t dm_nameset_footprint(const struct dm_nameset *set)
+{
+	return set->nr_slots * sizeof(struct set_slot);
+}
+
+int dm_nameset_add(struct dm_nameset *set, uint64_t key)
+{
+	size_t i;
+
+	if (set->nr_slots) {
+		i = key & (set->nr_slots - 1);
+		while (set->slots[i].gen == set->gen) {
+			if (set->slots[i].key == key)
+				return 0;
+			i = (i + 1) & (set->nr_slots - 1);
+		}
+	}
+
+	/* Generation wrapped: stale slots could look live again */
+	if (set->gen == 0) {
+		memset(set->slots, 0, set->nr_slots * sizeof(struct set_slot));
+		set->gen = 1;
+	}
+
+	/* Keep load factor under 1/2 */
+	if ((set->nr_used + 1) * 2 > set->nr_slots) {
+		size_t nr_slots = set->nr_slots ? set->nr_slots * 2 :
+						  SET_MIN_SLOTS;
+		struct set_slot *slots = calloc(nr_slots, sizeof(*slots));
+
+		if (slots == NULL) {
+			ERROR("Memory allocation failure.");
+			/* Report it as new, a duplicate is harmless */
+			return 1;
+		}
+		for (i = 0; i < set->nr_slots; i++)
+			if (set->slots[i].gen == set->gen)
+				__set_place(slots, nr_slots, set->slots[i].key, 1);
+		free(set->slots);
+		set->slots = slots;
+		set->nr_slots = nr_slots;
+		set->gen = 1;
+	}
+
+	__set_place(set->slots, set->nr_slots, key, set->gen);
+	set->nr_used++;
+	return 1;
+}
+
+struct db_entry {
+	/* Hash chain */
+	struct db_entry *next;
+	/* Links in the by_last and by_first lists */
+	struct db_entry *last_prev, *last_next;
+	struct db_entry *first_prev, *first_next;
+	uint64_t hash;
+	uint64_t first_seen;
+	uint64_t last_seen;
+	char name[];
+};
+
+static struct db_entry **__bucket(const struct dm_debounce *db,
+				  const char *name, uint64_t hash)
+{
+	struct db_entry **pp = &db->buckets[hash & (db->nr_buckets - 1)];
+
+	while (*pp && ((*pp)->hash != hash || strcmp((*pp)->name, name)))
+		pp = &(*pp)->next;
+	return pp;
+}
+
+static void __last_unlink(struct dm_debounce *db, struct db_entry *e)
+{
+	if (e->last_prev)
+		e->last_prev->last_next = e->last_next;
+	else
+		db->by_last = e->last_next;
+	if (e->last_next)
+		e->last_next->last_prev = e->last_prev;
+	else
+		db->by_last_tail = e->last_prev;
+}
+
+static void __last_append(struct dm_debounce *db, struct db_entry *e)
+{
+	e->last_next = NULL;
+	e->last_prev = db->by_last_tail;
+	if (db->by_last_tail)
+		db->by_last_tail->last_next = e;
+	else
+		db->by_last = e;
+	db->by_last_tail = e;
+}
+
+static void __first_unlink(struct dm_debounce *db, struct db_entry *e)
+{
+	if (e->first_prev)
+		e->first_prev->first_next = e->first_next;
+	else
+		db->by_first = e->first_next;
+	if (e->first_next)
+		e->first_next->first_prev = e->first_prev;
+	else
+		db->by_first_tail = e->first_prev;
+}
+
+static void __first_append(struct dm_debounce *db, struct db_entry *e)
+{
+	e->first_next = NULL;
+	e->first_prev = db->by_first_tail;
+	if (db->by_first_tail)
+		db->by_first_tail->first_next = e;
+	else
+		db->by_first = e;
+	db->by_first_tail = e;
+}
+
+static void __entry_delete(struct dm_debounce *db, struct db_entry **pp)
+{
+	struct db_entry *e = *pp;
+
+	*pp = e->next;
+	__last_unlink(db, e);
+	__first_unlink(db, e);
+	db->nr_entries--;
+	free(e);
+}
+
+static int __grow(struct dm_debounce *db)
+{
+	size_t i, nr_buckets = db->nr_buckets ? db->nr_buckets * 2 :
+						DEBOUNCE_MIN_BUCKETS;
+	struct db_entry **buckets = calloc(nr_buckets, sizeof(*buckets));
+
+	if (buckets == NULL) {
+		ERROR("Memory allocation failure.");
+		return -1;
+	}
+
+	for (i = 0; i < db->nr_buckets; i++) {
+		struct db_entry *e = db->buckets[i];
+
+		while (e) {
+			struct db_entry *next = e->next;
+			size_t idx = e->hash & (nr_buckets - 1);
+
+			e->next = buckets[idx];
+			buckets[idx] = e;
+			e = next;
+		}
+	}
+	free(db->buckets);
+	db->buckets = buckets;
+	db->nr_buckets = nr_buckets;
+	return 0;
+}
+
+void dm_debounce_init(struct dm_debounce *db, unsigned int window_ms,
+		      unsigned int max_ms)
+{
+	memset(db, 0, sizeof(*db));
+	db->window_ms = window_ms;
+	db->max_ms = max_ms;
+}
+
+void dm_debounce_release(struct dm_debounce *db)
+{
+	struct db_entry *e = db->by_last;
+
+	while (e) {
+		struct db_entry *next = e->last_next;
+
+		free(e);
+		e = next;
+	}
+	free(db->buckets);
+	dm_debounce_init(db, db->window_ms, db->max_ms);
+}
+
+int dm_debounce_touch(struct dm_debounce *db, const char *name, uint64_t now)
+{
+	size_t len = strlen(name);
+	uint64_t hash = hash_str64(name, len);
+	struct db_entry **pp, *e;
+
+	if (db->nr_buckets) {
+		pp = __bucket(db, name, hash);
+		if (*pp) {
+			/* Move to the tail, last events stay ordered */
+			e = *pp;
+			e->last_seen = now;
+			__last_unlink(db, e);
+			__last_append(db, e);
+			return 0;
+		}
+	}
+
+	if (db->nr_entries >= db->nr_buckets && __grow(db) != 0)
+		return -1;
+
+	e = malloc(sizeof(*e) + len + 1);
+	if (e == NULL) {
+		ERROR("Memory allocation failure.");
+		return -1;
+	}
+	memcpy(e->name, name, len + 1);
+	e->hash = hash;
+	e->first_seen = e->last_seen = now;
+
+	pp = &db->buckets[hash & (db->nr_buckets - 1)];
+	e->next = *pp;
+	*pp = e;
+	__last_append(db, e);
+	__first_append(db, e);
+	db->nr_entries++;
+	return 0;
+}
+
+int dm_debounce_remove(struct dm_debounce *db, const char *name)
+{
+	struct db_entry **pp;
+
+	if (!db->nr_entries)
+		return 0;
+
+	pp = __bucket(db, name, hash_str64(name, strlen(name)));
+	if (*pp == NULL)
+		return 0;
+	__entry_delete(db, pp);
+	return 1;
+}
+
+uint64_t dm_debounce_next(const struct dm_debounce *db)
+{
+	uint64_t next = UINT64_MAX;
+
+	if (db->by_last)
+		next = db->by_last->last_seen + db->window_ms;
+	if (db->by_first && db->by_first->first_seen + db->max_ms < next)
+		next = db->by_first->first_seen + db->max_ms;
+	return next;
+}
+
+static inline int __due(const struct dm_debounce *db,
+			const struct db_entry *e, uint64_t now)
+{
+	return now == UINT64_MAX || e->last_seen + db->window_ms <= now ||
+	       e->first_seen + db->max_ms <= now;
+}
+
+void dm_debounce_expire(struct dm_debounce *db, uint64_t now,
+			void (*fn)(const char *name, void *arg), void *arg)
+{
+	for (;;) {
+		struct db_entry *e = db->by_last;
+
+		/* Either list head is the earliest due entry */
+		if (!e || !__due(db, e, now))
+			e = db->by_first;
+		if (!e || !__due(db, e, now))
+			break;
+
+		fn(e->name, arg);
+		__entry_delete(db, __bucket(db, e->name, e->hash));
+	}
+}
+
+struct mv_entry {
+	/* Hash chain */
+	struct mv_entry *next;
+	/* Arrival order */
+	struct mv_entry *prev_in, *next_in;
+	uint32_t cookie;
+	uint64_t deadline;
+	char name[];
+};
+
+static struct mv_entry **__mv_bucket(struct dm_moves *mv, uint32_t cookie)
+{
+	struct mv_entry **pp =
+		&mv->buckets[hash_32(cookie) & (DM_MOVES_BUCKETS - 1)];
+
+	while (*pp && (*pp)->cookie != cookie)
+		pp = &(*pp)->next;
+	return pp;
+}
+
+/* Unlink the entry at pp; the caller frees it */
+static struct mv_entry *__mv_unlink(struct dm_moves *mv,
+				    struct mv_entry **pp)
+{
+	struct mv_entry *e = *pp;
+
+	*pp = e->next;
+	if (e->prev_in)
+		e->prev_in->next_in = e->next_in;
+	else
+		mv->head = e->next_in;
+	if (e->next_in)
+		e->next_in->prev_in = e->prev_in;
+	else
+		mv->tail = e->prev_in;
+	mv->nr_entries--;
+	return e;
+}
+
+void dm_moves_init(struct dm_moves *mv, unsigned int timeout_ms)
+{
+	memset(mv, 0, sizeof(*mv));
+	mv->timeout_ms = timeout_ms;
+}
+
+void dm_moves_release(struct dm_moves *mv)
+{
+	struct mv_entry *e = mv->head;
+
+	while (e) {
+		struct mv_entry *next = e->next_in;
+
+		free(e);
+		e = next;
+	}
+	dm_moves_init(mv, mv->timeout_ms);
+}
+
+int dm_moves_add(struct dm_moves *mv, uint32_t cookie, const char *name,
+		 uint64_t now)
+{
+	size_t len = strlen(name);
+	struct mv_entry **pp, *e;
+
+	if (mv->nr_entries >= DM_MOVES_MAX)
+		return -1;
+
+	e = malloc(sizeof(*e) + len + 1);
+	if (e == NULL) {
+		ERROR("Memory allocation failure.");
+		return -1;
+	}
+	memcpy(e->name, name, len + 1);
+	e->cookie = cookie;
+	e->deadline = now + mv->timeout_ms;
+
+	pp = &mv->buckets[hash_32(cookie) & (DM_MOVES_BUCKETS - 1)];
+	e->next = *pp;
+	*pp = e;
+	e->next_in = NULL;
+	e->prev_in = mv->tail;
+	if (mv->tail)
+		mv->tail->next_in = e;
+	else
+		mv->head = e;
+	mv->tail = e;
+	mv->nr_entries++;
+	return 0;
+}
+
+char *dm_moves_take(struct dm_moves *mv, uint32_t cookie)
+{
+	struct mv_entry **pp, *e;
+	char *name;
+
+	if (!mv->nr_entries)
+		return NULL;
+
+	pp = __mv_bucket(mv, cookie);
+	if (*pp == NULL)
+		return NULL;
+
+	e = __mv_unlink(mv, pp);
+	name = strdup(e->name);
+	if (name == NULL)
+		ERROR("Memory allocation failure.");
+	free(e);
+	return name;
+}
+
+uint64_t dm_moves_next(const struct dm_moves *mv)
+{
+	return mv->head ? mv->head->deadline : UINT64_MAX;
+}
+
+void dm_moves_expire(struct dm_moves *mv, uint64_t now,
+		     void (*fn)(const char *name, void *arg), void *arg)
+{
+	while (mv->head && (now == UINT64_MAX || mv->head->deadline <= now)) {
+		struct mv_entry *e = __mv_unlink(mv,
+						 __mv_bucket(mv,
+							     mv->head->cookie));
+
+		fn(e->name, arg);
+		free(e);
+	}
+}
+
+/* Thousandths of a name a token holds */
+#define STORM_TOKEN	1000
+
+void dm_storm_init(struct dm_storm *st, unsigned int rate, unsigned int burst,
+		   unsigned int sample)
+{
+	uintptr_t addr = (uintptr_t)st;
+
+	memset(st, 0, sizeof(struct dm_storm));
+	st->rate = rate;
+	st->burst = burst ? burst : rate;
+	st->sample = sample;
+	st->tokens = (uint64_t)st->burst * STORM_TOKEN;
+	st->seed = hash_str64((const char *)&addr, sizeof(addr)) | 1;
+}
+
+void dm_storm_release(struct dm_storm *st)
+{
+	dm_storm_clear(st);
+	st->active = 0;
+}
+
+void dm_storm_settle(struct dm_storm *st, uint64_t now)
+{
+	uint64_t full = (uint64_t)st->burst * STORM_TOKEN;
+
+	/* rate names per second are rate thousandths per millisecond */
+	if (now > st->stamp) {
+		st->tokens += (now - st->stamp) * st->rate;
+		if (st->tokens > full)
+			st->tokens = full;
+		st->stamp = now;
+	}
+
+	if (st->active && !st->pending && st->tokens * 2 >= full)
+		st->active = 0;
+}
+
+uint64_t dm_storm_next(const struct dm_storm *st)
+{
+	uint64_t half = (uint64_t)st->burst * STORM_TOKEN / 2;
+
+	if (!st->active || st->pending || !st->rate)
+		return UINT64_MAX;
+	if (st->tokens >= half)
+		return st->stamp;
+	return st->stamp + (half - st->tokens + st->rate - 1) / st->rate;
+}
+
+int dm_storm_admit(struct dm_storm *st, uint64_t now)
+{
+	dm_storm_settle(st, now);
+	if (st->tokens < STORM_TOKEN) {
+		st->active = 1;
+		return 0;
+	}
+	st->tokens -= STORM_TOKEN;
+	return !st->active;
+}
+
+/* xorshift64 */
+static inline uint64_t __storm_rand(struct dm_storm *st)
+{
+	st->seed ^= st->seed << 13;
+	st->seed ^= st->seed >> 7;
+	st->seed ^= st->seed << 17;
+	return st->seed;
+}
+
+void dm_storm_add(struct dm_storm *st, unsigned int kind, const char *name)
+{
+	struct dm_storm_count *c = &st->counts[kind];
+	uint64_t slot;
+	char *copy;
+
+	st->pending++;
+	slot = c->count++;
+	if (!st->sample)
+		return;
+
+	if (c->sample == NULL) {
+		c->sample = calloc(st->sample, sizeof(char *));
+		if (c->sample == NULL) {
+			ERROR("Memory allocation failure.");
+			return;
+		}
+	}
+
+	/* Name n (from 0) replaces a sampled one with probability
+	 * sample / (n + 1)
+	 */
+	if (slot >= st->sample) {
+		slot = __storm_rand(st) % (slot + 1);
+		if (slot >= st->sample)
+			return;
+	} else {
+		slot = c->nr_sample;
+	}
+
+	copy = strdup(name);
+	if (copy == NULL) {
+		ERROR("Memory allocation failure.");
+		return;
+	}
+	if (slot < c->nr_sample)
+		free(c->sample[slot]);
+	else
+		c->nr_sample++;
+	c->sample[slot] = copy;
+}
+
+void dm_storm_clear(struct dm_storm *st)
+{
+	unsigned int i, k;
+
+	for (i = 0; i < DM_STORM_KINDS; i++) {
+		struct dm_storm_count *c = &st->counts[i];
+
+		for (k = 0; k < c->nr_sample; k++)
+			free(c->sample[k]);
+		free(c->sample);
+		memset(c, 0, sizeof(struct dm_storm_count));
+	}
+	st->pending = 0;
+}
@@ -0,0 +1,274 @@
+#ifndef DM_COALESCE_H_INCLUDED
+#define DM_COALESCE_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct set_slot;
+struct db_entry;
+struct mv_entry;
+
+/**
+ * Set of name hashes reported in the pending batch. Slots carry the
+ * generation they were filled in, so clearing the set is a counter
+ * increment and costs nothing per batch.
+ */
+struct dm_nameset {
+	struct set_slot *slots;
+	size_t nr_slots;
+	size_t nr_used;
+	unsigned int gen;
+};
+
+void dm_nameset_init(struct dm_nameset *set);
+
+void dm_nameset_release(struct dm_nameset *set);
+
+/**
+ * This function adds a key to the set.
+ *
+ * @param: set	A valid set.
+ * @param: key	Hash of the name.
+ * @return: 1 if the key was added, 0 if it was present already.
+ */
+int dm_nameset_add(struct dm_nameset *set, uint64_t key);
+
+/* Bytes allocated by the set */
+size_t dm_nameset_footprint(const struct dm_nameset *set);
+
+/* Empty the set in O(1) */
+static inline void dm_nameset_clear(struct dm_nameset *set)
+{
+	set->gen++;
+	set->nr_used = 0;
+}
+
+/**
+ * Files waiting for their writes to settle. A file is due once it saw no
+ * event for the debounce window, or once it has been pending for the
+ * maximum interval. Entries are kept on two lists ordered by last and
+ * first event so the next due time is always at a list head.
+ */
+struct dm_debounce {
+	struct db_entry **buckets;
+	size_t nr_buckets;
+	size_t nr_entries;
+	/* Ordered by last event, oldest first */
+	struct db_entry *by_last;
+	struct db_entry *by_last_tail;
+	/* Ordered by first event, oldest first */
+	struct db_entry *by_first;
+	struct db_entry *by_first_tail;
+	/* Quiet time before a file is due (ms) */
+	unsigned int window_ms;
+	/* Maximum time a file stays pending (ms) */
+	unsigned int max_ms;
+};
+
+void dm_debounce_init(struct dm_debounce *db, unsigned int window_ms,
+		      unsigned int max_ms);
+
+void dm_debounce_release(struct dm_debounce *db);
+
+/**
+ * This function records an event for the file.
+ *
+ * @param: db	A valid debounce table.
+ * @param: name	File name.
+ * @param: now	Current time in milliseconds.
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_debounce_touch(struct dm_debounce *db, const char *name, uint64_t now);
+
+/**
+ * This function forgets a pending file, e.g. because it was deleted.
+ *
+ * @param: db	A valid debounce table.
+ * @param: name	File name.
+ * @return: 1 if the file was pending, 0 otherwise.
+ */
+int dm_debounce_remove(struct dm_debounce *db, const char *name);
+
+/**
+ * This function tells when the next pending file is due.
+ *
+ * @param: db	A valid debounce table.
+ * @return: Time in milliseconds or UINT64_MAX when nothing is pending.
+ */
+uint64_t dm_debounce_next(const struct dm_debounce *db);
+
+/**
+ * This function removes the files due at the given time and passes their
+ * names to fn.
+ *
+ * @param: db	A valid debounce table.
+ * @param: now	Current time in milliseconds; UINT64_MAX takes all.
+ * @param: fn	Callback receiving the name of a due file.
+ * @param: arg	Argument passed to the callback.
+ * @return: No return.
+ */
+void dm_debounce_expire(struct dm_debounce *db, uint64_t now,
+			void (*fn)(const char *name, void *arg), void *arg);
+
+/* Buckets of a move table */
+#define DM_MOVES_BUCKETS	16
+/* Files moved away waiting for their pair at most */
+#define DM_MOVES_MAX		1024
+
+/**
+ * Files moved away (IN_MOVED_FROM) waiting for the IN_MOVED_TO with the
+ * same cookie. The kernel queues both events back to back, so few entries
+ * are ever pending; a file moved out of sight never gets its pair and is
+ * given up after the timeout. Entries are kept in arrival order, which is
+ * also the order they time out in.
+ */
+struct dm_moves {
+	struct mv_entry *buckets[DM_MOVES_BUCKETS];
+	/* Ordered by arrival, oldest first */
+	struct mv_entry *head, *tail;
+	size_t nr_entries;
+	/* Time a file waits for its pair (ms) */
+	unsigned int timeout_ms;
+};
+
+void dm_moves_init(struct dm_moves *mv, unsigned int timeout_ms);
+
+void dm_moves_release(struct dm_moves *mv);
+
+/**
+ * This function records a file moved away.
+ *
+ * @param: mv		A valid move table.
+ * @param: cookie	Cookie of the move.
+ * @param: name		File name.
+ * @param: now		Current time in milliseconds.
+ * @return: 0 on success or -1 when the table is full or on failure.
+ */
+int dm_moves_add(struct dm_moves *mv, uint32_t cookie, const char *name,
+		 uint64_t now);
+
+/**
+ * This function removes the file moved away with the given cookie.
+ *
+ * @param: mv		A valid move table.
+ * @param: cookie	Cookie of the move.
+ * @return: Name of the file, to be freed by the caller, or NULL if no file
+ *	    with that cookie is pending.
+ */
+char *dm_moves_take(struct dm_moves *mv, uint32_t cookie);
+
+/**
+ * This function tells when the oldest pending file times out.
+ *
+ * @param: mv	A valid move table.
+ * @return: Time in milliseconds or UINT64_MAX when nothing is pending.
+ */
+uint64_t dm_moves_next(const struct dm_moves *mv);
+
+/**
+ * This function removes the files timed out at the given time and passes
+ * their names to fn.
+ *
+ * @param: mv	A valid move table.
+ * @param: now	Current time in milliseconds; UINT64_MAX takes all.
+ * @param: fn	Callback receiving the name of a file moved away.
+ * @param: arg	Argument passed to the callback.
+ * @return: No return.
+ */
+void dm_moves_expire(struct dm_moves *mv, uint64_t now,
+		     void (*fn)(const char *name, void *arg), void *arg);
+
+/* Statuses counted by a storm summary, in the order they are published */
+enum dm_storm_kind {
+	DM_STORM_RENAMED,
+	DM_STORM_DELETED,
+	DM_STORM_MOVED_FROM,
+	DM_STORM_CREATED,
+	DM_STORM_MOVED_TO,
+	DM_STORM_MODIFIED,
+	DM_STORM_KINDS,
+};
+
+/* Names of one status folded into the summary */
+struct dm_storm_count {
+	uint64_t count;
+	/* Uniform sample of the names, summary_sample at most */
+	char **sample;
+	unsigned int nr_sample;
+};
+
+/**
+ * Rate limit of a directory: a token bucket refilled at rate names per
+ * second and holding burst names at most. A name finding the bucket empty
+ * starts a storm; till it passes names are only counted per status, with
+ * a reservoir sample kept of each, and the batch is published as one
+ * summary message per status. The storm passes once nothing is left to
+ * summarize and the bucket refilled to half of the burst.
+ *
+ * Tokens are kept in thousandths of a name so refills need no division.
+ */
+struct dm_storm {
+	/* Names per second, 0 = no limit */
+	unsigned int rate;
+	unsigned int burst;
+	/* Names sampled per status */
+	unsigned int sample;
+	/* Storm under way */
+	unsigned int active;
+	uint64_t tokens;
+	/* Time of the last refill in milliseconds */
+	uint64_t stamp;
+	/* Random state of the sampling */
+	uint64_t seed;
+	/* Names counted since the last summary */
+	uint64_t pending;
+	struct dm_storm_count counts[DM_STORM_KINDS];
+};
+
+void dm_storm_init(struct dm_storm *st, unsigned int rate, unsigned int burst,
+		   unsigned int sample);
+
+void dm_storm_release(struct dm_storm *st);
+
+/**
+ * This function takes a token for a name about to be reported.
+ *
+ * @param: st	A valid rate limit.
+ * @param: now	Current time in milliseconds.
+ * @return: 1 if the name is reported, 0 if it goes into the summary.
+ *	    The storm may start or pass on the call; compare st->active.
+ */
+int dm_storm_admit(struct dm_storm *st, uint64_t now);
+
+/**
+ * This function refills the bucket and ends the storm once it passed.
+ *
+ * @param: st	A valid rate limit.
+ * @param: now	Current time in milliseconds.
+ * @return: No return.
+ */
+void dm_storm_settle(struct dm_storm *st, uint64_t now);
+
+/**
+ * This function tells when the storm passes if no name comes meanwhile.
+ *
+ * @param: st	A valid rate limit.
+ * @return: Time in milliseconds or UINT64_MAX when there is no storm or
+ *	    its summary is still to be published.
+ */
+uint64_t dm_storm_next(const struct dm_storm *st);
+
+/**
+ * This function counts a name into the summary of its status.
+ *
+ * @param: st	A valid rate limit during a storm.
+ * @param: kind	Status, enum dm_storm_kind.
+ * @param: name	File name; copied when sampled.
+ * @return: No return.
+ */
+void dm_storm_add(struct dm_storm *st, unsigned int kind, const char *name);
+
+/* Forget the counted names once their summary is out; samples are freed */
+void dm_storm_clear(struct dm_storm *st);
+
+#endif /* DM_COALESCE_H_INCLUDED */
@@ -0,0 +1,72 @@
+#include <string.h>
+
+#include "dm-config.h"
+#include "dm-journal.h"
+#include "debug.h"
+
+
+void dm_config_init(struct dm_config *cfg)
+{
+	memset(cfg, 0, sizeof(struct dm_config));
+	cfg->mqtt_connections = CONFIG_MQTT_CONNECTIONS;
+	cfg->mqtt_queue_len = CONFIG_MQTT_QUEUE_LEN;
+	cfg->mqtt_max_inflight = CONFIG_MQTT_MAX_INFLIGHT;
+	cfg->sink_file = CONFIG_SINK_FILE;
+	cfg->ring_size = CONFIG_RING_SIZE;
+	cfg->stats_interval_ms = CONFIG_STATS_INTERVAL_MS;
+	cfg->journal_segment_size = CONFIG_JOURNAL_SEGMENT_SIZE;
+	cfg->journal_segments = CONFIG_JOURNAL_SEGMENTS;
+	cfg->journal_fsync = DM_FSYNC_INTERVAL;
+	cfg->journal_fsync_ms = CONFIG_JOURNAL_FSYNC_MS;
+	cfg->index_checkpoint_ms = CONFIG_INDEX_CHECKPOINT_MS;
+	cfg->walk_threads = CONFIG_WALK_THREADS;
+	cfg->control_workers = CONFIG_CONTROL_WORKERS;
+	cfg->io_uring = CONFIG_IO_URING;
+	cfg->workers = CONFIG_WORKERS;
+	cfg->pin_workers = CONFIG_PIN_WORKERS;
+
+	cfg->monitor.quiet_ms = CONFIG_BATCH_QUIET_MS;
+	cfg->monitor.max_delay_ms = CONFIG_BATCH_MAX_DELAY_MS;
+	cfg->monitor.max_events = CONFIG_BATCH_MAX_EVENTS;
+	cfg->monitor.max_bytes = CONFIG_BATCH_MAX_BYTES;
+	cfg->monitor.max_payload = CONFIG_MAX_PAYLOAD;
+	cfg->monitor.debounce_ms = CONFIG_DEBOUNCE_MS;
+	cfg->monitor.debounce_max_ms = CONFIG_DEBOUNCE_MAX_MS;
+	cfg->monitor.coalesce = CONFIG_COALESCE;
+	cfg->monitor.snapshot = CONFIG_SNAPSHOT;
+	cfg->monitor.sinks = CONFIG_SINKS;
+	cfg->monitor.completed = CONFIG_COMPLETED;
+	cfg->monitor.fingerprint = CONFIG_FINGERPRINT;
+	cfg->monitor.fingerprint_max_size = CONFIG_FINGERPRINT_MAX_SIZE;
+	cfg->monitor.moves = CONFIG_MOVES;
+	cfg->monitor.move_timeout_ms = CONFIG_MOVE_TIMEOUT_MS;
+	cfg->monitor.metadata = CONFIG_METADATA;
+	cfg->monitor.metadata_ttl_ms = CONFIG_METADATA_TTL_MS;
+	cfg->monitor.rate_limit = CONFIG_RATE_LIMIT;
+	cfg->monitor.rate_burst = CONFIG_RATE_BURST;
+	cfg->monitor.summary_sample = CONFIG_SUMMARY_SAMPLE;
+}
+
+int dir_monitor_config_check(struct dir_monitor_config *cfg)
+{
+	if (!cfg->max_events || !cfg->max_bytes || !cfg->max_payload) {
+		ERROR("Batch limits must be non-zero.");
+		return -1;
+	}
+
+	if (!cfg->sinks || cfg->sinks >= DM_SINK_BIT(DM_SINK_MAX)) {
+		ERROR("Invalid sinks.");
+		return -1;
+	}
+
+	/* Quiet period longer than the delay bound never fires */
+	if (cfg->quiet_ms > cfg->max_delay_ms)
+		cfg->quiet_ms = cfg->max_delay_ms;
+	/* Same for the debounce window */
+	if (cfg->debounce_max_ms < cfg->debounce_ms)
+		cfg->debounce_max_ms = cfg->debounce_ms;
+	/* Burst defaults to one second worth of names */
+	if (cfg->rate_limit && !cfg->rate_burst)
+		cfg->rate_burst = cfg->rate_limit;
+	return 0;
+}
@@ -0,0 +1,315 @@
+#ifndef DM_CONFIG_H_INCLUDED
+#define DM_CONFIG_H_INCLUDED
+
+#include <stddef.h>
+
+#include "dm-sink.h"
+
+struct dm_filter;
+
+/* Number of MQTT connections used for publishing */
+#ifndef CONFIG_MQTT_CONNECTIONS
+#define CONFIG_MQTT_CONNECTIONS	1
+#endif
+
+/* Number of messages the publish queue can hold */
+#ifndef CONFIG_MQTT_QUEUE_LEN
+#define CONFIG_MQTT_QUEUE_LEN	4096
+#endif
+
+/* Messages sent to the broker and not yet acknowledged, 0 = no limit */
+#ifndef CONFIG_MQTT_MAX_INFLIGHT
+#define CONFIG_MQTT_MAX_INFLIGHT	1024
+#endif
+
+/* Idle time in milliseconds after which a batch is published */
+#ifndef CONFIG_BATCH_QUIET_MS
+#define CONFIG_BATCH_QUIET_MS	5
+#endif
+
+/* Maximum time in milliseconds an event waits in a batch */
+#ifndef CONFIG_BATCH_MAX_DELAY_MS
+#define CONFIG_BATCH_MAX_DELAY_MS	1000
+#endif
+
+/* Maximum number of events in a batch */
+#ifndef CONFIG_BATCH_MAX_EVENTS
+#define CONFIG_BATCH_MAX_EVENTS	4096
+#endif
+
+/* Maximum payload bytes of a batch */
+#ifndef CONFIG_BATCH_MAX_BYTES
+#define CONFIG_BATCH_MAX_BYTES	(256 * 1024)
+#endif
+
+/* Maximum size of one published message, larger batches are split */
+#ifndef CONFIG_MAX_PAYLOAD
+#define CONFIG_MAX_PAYLOAD	(256 * 1024)
+#endif
+
+/* Report each file at most once per batch */
+#ifndef CONFIG_COALESCE
+#define CONFIG_COALESCE	1
+#endif
+
+/* Quiet time in milliseconds before a modified file is reported, 0 = off */
+#ifndef CONFIG_DEBOUNCE_MS
+#define CONFIG_DEBOUNCE_MS	0
+#endif
+
+/* Maximum time in milliseconds a modified file waits to settle */
+#ifndef CONFIG_DEBOUNCE_MAX_MS
+#define CONFIG_DEBOUNCE_MAX_MS	10000
+#endif
+
+/* Keep a snapshot of every directory to recover lost events */
+#ifndef CONFIG_SNAPSHOT
+#define CONFIG_SNAPSHOT	1
+#endif
+
+/* Interval in milliseconds at which directory indexes are saved, 0 = on
+ * stop only
+ */
+#ifndef CONFIG_INDEX_CHECKPOINT_MS
+#define CONFIG_INDEX_CHECKPOINT_MS	60000
+#endif
+
+/* Report files once closed after writing or moved in, not on every write */
+#ifndef CONFIG_COMPLETED
+#define CONFIG_COMPLETED	0
+#endif
+
+/* Leave out files whose fingerprint did not change since last reported */
+#ifndef CONFIG_FINGERPRINT
+#define CONFIG_FINGERPRINT	0
+#endif
+
+/* Content of files up to this size in bytes is part of the fingerprint */
+#ifndef CONFIG_FINGERPRINT_MAX_SIZE
+#define CONFIG_FINGERPRINT_MAX_SIZE	(1024 * 1024)
+#endif
+
+/* Report files created and moved, pairing both ends of a rename */
+#ifndef CONFIG_MOVES
+#define CONFIG_MOVES	0
+#endif
+
+/* Time in milliseconds a file moved away waits for its new name */
+#ifndef CONFIG_MOVE_TIMEOUT_MS
+#define CONFIG_MOVE_TIMEOUT_MS	50
+#endif
+
+/* Include file metadata in messages */
+#ifndef CONFIG_METADATA
+#define CONFIG_METADATA	0
+#endif
+
+/* Time file metadata is reused for (ms) */
+#ifndef CONFIG_METADATA_TTL_MS
+#define CONFIG_METADATA_TTL_MS	100
+#endif
+
+/* Names reported per second before a directory switches to summaries,
+ * 0 = no limit
+ */
+#ifndef CONFIG_RATE_LIMIT
+#define CONFIG_RATE_LIMIT	0
+#endif
+
+/* Names reported at once above the rate, 0 = one second worth */
+#ifndef CONFIG_RATE_BURST
+#define CONFIG_RATE_BURST	0
+#endif
+
+/* File names sampled into a summary message */
+#ifndef CONFIG_SUMMARY_SAMPLE
+#define CONFIG_SUMMARY_SAMPLE	16
+#endif
+
+/* Directory handles kept resolved by a fanotify group */
+#ifndef CONFIG_FANOTIFY_CACHE
+#define CONFIG_FANOTIFY_CACHE	4096
+#endif
+
+/* Sinks of directories without own settings, mask of DM_SINK_BIT()s */
+#ifndef CONFIG_SINKS
+#define CONFIG_SINKS	DM_SINK_BIT(DM_SINK_MQTT)
+#endif
+
+/* File written by the file sink */
+#ifndef CONFIG_SINK_FILE
+#define CONFIG_SINK_FILE	"dir_mon.events"
+#endif
+
+/* Data size of the shared memory ring in bytes */
+#ifndef CONFIG_RING_SIZE
+#define CONFIG_RING_SIZE	(4 * 1024 * 1024)
+#endif
+
+/* Interval in milliseconds of statistics messages, 0 = off */
+#ifndef CONFIG_STATS_INTERVAL_MS
+#define CONFIG_STATS_INTERVAL_MS	10000
+#endif
+
+/* Threads walking a large tree when recursive monitoring starts */
+#ifndef CONFIG_WALK_THREADS
+#define CONFIG_WALK_THREADS	4
+#endif
+
+/* Size of a journal segment in bytes */
+#ifndef CONFIG_JOURNAL_SEGMENT_SIZE
+#define CONFIG_JOURNAL_SEGMENT_SIZE	(16 * 1024 * 1024)
+#endif
+
+/* Journal segments kept at most */
+#ifndef CONFIG_JOURNAL_SEGMENTS
+#define CONFIG_JOURNAL_SEGMENTS	16
+#endif
+
+/* Interval in milliseconds at which the journal is forced to disk */
+#ifndef CONFIG_JOURNAL_FSYNC_MS
+#define CONFIG_JOURNAL_FSYNC_MS	1000
+#endif
+
+/* Threads executing control commands */
+#ifndef CONFIG_CONTROL_WORKERS
+#define CONFIG_CONTROL_WORKERS	4
+#endif
+
+/* Read kernel events through io_uring when available */
+#ifndef CONFIG_IO_URING
+#define CONFIG_IO_URING	0
+#endif
+
+/* Event engines sharing the monitored directories */
+#ifndef CONFIG_WORKERS
+#define CONFIG_WORKERS	1
+#endif
+
+/* Pin the thread of each event engine to a CPU of its own */
+#ifndef CONFIG_PIN_WORKERS
+#define CONFIG_PIN_WORKERS	0
+#endif
+
+/* Event sources of a monitored directory */
+enum dm_backend {
+	/* One inotify watch per directory */
+	DM_BACKEND_INOTIFY,
+	/* One fanotify mark for the whole filesystem */
+	DM_BACKEND_FANOTIFY,
+};
+
+/* Per-directory settings */
+struct dir_monitor_config {
+	/* Batch is published once no event arrived for this long (ms) */
+	unsigned int quiet_ms;
+	/* Batch is published at latest this long after its first event (ms) */
+	unsigned int max_delay_ms;
+	/* Batch is published when it holds this many events */
+	unsigned int max_events;
+	/* Batch is published when its payload reaches this many bytes */
+	unsigned int max_bytes;
+	/* Messages of a batch are split at this many bytes */
+	unsigned int max_payload;
+	/* Modified file is reported once it saw no event this long, 0 = off */
+	unsigned int debounce_ms;
+	/* Modified file is reported at latest this long after its first event */
+	unsigned int debounce_max_ms;
+	/* Message encoding, enum dm_payload_format */
+	unsigned int format;
+	/* Event source, enum dm_backend */
+	unsigned int backend;
+	/* Destinations of the messages, mask of DM_SINK_BIT()s */
+	unsigned int sinks;
+	/* File moved away is reported alone after this long (ms) */
+	unsigned int move_timeout_ms;
+	/* Files up to this size are fingerprinted by content */
+	unsigned int fingerprint_max_size;
+	/* Time file metadata is reused for (ms), 0 = looked up every time */
+	unsigned int metadata_ttl_ms;
+	/* Names reported per second before summaries are sent, 0 = off */
+	unsigned int rate_limit;
+	/* Names reported at once above the rate */
+	unsigned int rate_burst;
+	/* Names sampled into a summary message */
+	unsigned int summary_sample;
+	/* Include/exclude rules, NULL = none; copies share a reference */
+	struct dm_filter *filter;
+	/* Drop repeated names within a batch */
+	unsigned int coalesce : 1;
+	/* Keep a snapshot to find changes missed on queue overflow */
+	unsigned int snapshot : 1;
+	/* Monitor the whole tree below the directory */
+	unsigned int recursive : 1;
+	/* Report completed writes only: close after writing and move in */
+	unsigned int completed : 1;
+	/* Skip files reported before whose fingerprint is the same */
+	unsigned int fingerprint : 1;
+	/* Report created files, renames and moves */
+	unsigned int moves : 1;
+	/* Include size, mtime, inode and mode of files in messages */
+	unsigned int metadata : 1;
+};
+
+/* Global settings of the directory monitoring system */
+struct dm_config {
+	/* Publisher connection pool size */
+	unsigned int mqtt_connections;
+	/* Publisher queue length in messages */
+	unsigned int mqtt_queue_len;
+	/* Unacknowledged messages at most, 0 = no limit */
+	unsigned int mqtt_max_inflight;
+	/* Path of the file sink */
+	const char *sink_file;
+	/* Data size of the ring sink */
+	size_t ring_size;
+	/* Statistics interval in milliseconds, 0 = off */
+	unsigned int stats_interval_ms;
+	/* Prometheus text file written every interval, NULL = none */
+	const char *stats_file;
+	/* Directory of the MQTT journal, NULL = no journal */
+	const char *journal_dir;
+	/* Size of new journal segments in bytes */
+	size_t journal_segment_size;
+	/* Journal segments kept at most, the oldest is dropped beyond */
+	unsigned int journal_segments;
+	/* enum dm_fsync_policy */
+	unsigned int journal_fsync;
+	/* Interval of DM_FSYNC_INTERVAL in milliseconds */
+	unsigned int journal_fsync_ms;
+	/* Directory of the saved directory indexes, NULL = none */
+	const char *index_dir;
+	/* Interval of index saves in milliseconds, 0 = on stop only */
+	unsigned int index_checkpoint_ms;
+	/* Threads walking a large tree */
+	unsigned int walk_threads;
+	/* Threads executing control commands */
+	unsigned int control_workers;
+	/* Read kernel events through io_uring when available */
+	unsigned int io_uring;
+	/* Event engines, each with its own thread and inotify instance */
+	unsigned int workers;
+	/* Pin engine threads to CPUs */
+	unsigned int pin_workers;
+	/* Defaults of directories without own settings */
+	struct dir_monitor_config monitor;
+};
+
+/**
+ * This function fills the configuration with compile time defaults.
+ *
+ * @param: cfg	Configuration to initialize.
+ * @return: No return.
+ */
+void dm_config_init(struct dm_config *cfg);
+
+/**
+ * This function checks per-directory settings and fixes up values which
+ * cannot work together.
+ *
+ * @param: cfg	Settings to check.
+ * @return: 0 on success or -1 when settings are invalid.
+ */
+int dir_monitor_config_check(struct dir_monitor_config *cfg);
+
+#endif /* DM_CONFIG_H_INCLUDED */
@@ -0,0 +1,868 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+#include "dm-engine.h"
+#include "dm-stats.h"
+#include "dm-uring.h"
+#include "internals.h"
+#include "debug.h"
+
+
+/* Bytes drained from the inotify fd per read() */
+#define ENGINE_READ_SIZE	(64 * 1024)
+/* Buffers of io_uring reads, in flight and waiting to be parsed */
+#define ENGINE_URING_BUFFERS	8
+#define ENGINE_URING_BUFF_SIZE	(16 * 1024)
+/* Ready descriptors handled per loop iteration */
+#define ENGINE_MAX_EVENTS	16
+/* Initial number of slots in watch descriptor table (power of 2) */
+#define WD_TABLE_MIN		64
+/* Initial size of the timer heap */
+#define TIMER_HEAP_MIN		64
+
+struct wd_binding {
+	struct dm_source *src;
+	struct wd_binding *next;
+};
+
+struct wd_slot {
+	/* Watch descriptor; 0 marks an empty slot */
+	int wd;
+	/* Sources receiving events of the watch */
+	struct wd_binding *bindings;
+};
+
+struct engine_cmd {
+	int (*fn)(void *);
+	void *arg;
+	int retval;
+	unsigned int done : 1;
+	struct engine_cmd *next;
+};
+
+struct dm_engine {
+	/* inotify instance shared by all the sources */
+	int ifd;
+	/* epoll instance driving the loop */
+	int epfd;
+	/* eventfd to wake the loop for commands */
+	int efd;
+	/* io_uring reading the inotify fd and polling epfd, the loop waits
+	 * on it instead of epoll_wait(); NULL = read() on readiness
+	 */
+	struct dm_uring *uring;
+	/* epoll registrations of the two above */
+	struct dm_poll inotify_poll;
+	struct dm_poll cmd_poll;
+	/* Thread ID */
+	pthread_t tid;
+	/* wd -> sources lookup table, open addressing */
+	struct wd_slot *slots;
+	size_t nr_slots;
+	size_t nr_used;
+	/* Attached sources */
+	struct dm_source *sources;
+	/*
+	 * Sources with an armed deadline, a binary min-heap on the deadline
+	 * with room for every attached source, so arming never allocates
+	 */
+	struct dm_source **timers;
+	unsigned int nr_timers;
+	unsigned int timers_size;
+	unsigned int nr_sources;
+	/* Command queue protected by lock */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct engine_cmd *cmd_head;
+	struct engine_cmd **cmd_tail;
+	unsigned int stop : 1;
+	/* Buffer to store events read from inotify fd */
+	char buff[ENGINE_READ_SIZE]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+};
+
+uint64_t dm_engine_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline size_t __wd_hash(int wd, size_t nr_slots)
+{
+	return hash_32(wd) & (nr_slots - 1);
+}
+
+static struct wd_slot *__wd_lookup(struct dm_engine *eng, int wd)
+{
+	size_t i = __wd_hash(wd, eng->nr_slots);
+
+	while (eng->slots[i].wd) {
+		if (eng->slots[i].wd == wd)
+			return &eng->slots[i];
+		i = (i + 1) & (eng->nr_slots - 1);
+	}
+	return NULL;
+}
+
+static struct wd_slot *__wd_place(struct wd_slot *slots, size_t nr_slots,
+				  int wd, struct wd_binding *bindings)
+{
+	size_t i = __wd_hash(wd, nr_slots);
+
+	while (slots[i].wd)
+		i = (i + 1) & (nr_slots - 1);
+	slots[i].wd = wd;
+	slots[i].bindings = bindings;
+	return &slots[i];
+}
+
+static struct wd_slot *__wd_insert(struct dm_engine *eng, int wd)
+{
+	/* Keep load factor under 1/2 */
+	if ((eng->nr_used + 1) * 2 > eng->nr_slots) {
+		size_t i, nr_slots = eng->nr_slots * 2;
+		struct wd_slot *slots = calloc(nr_slots, sizeof(*slots));
+
+		if (slots == NULL) {
+			ERROR("Memory allocation failure.");
+			return NULL;
+		}
+		for (i = 0; i < eng->nr_slots; i++)
+			if (eng->slots[i].wd)
+				__wd_place(slots, nr_slots, eng->slots[i].wd,
+					   eng->slots[i].bindings);
+		free(eng->slots);
+		eng->slots = slots;
+		eng->nr_slots = nr_slots;
+	}
+	eng->nr_used++;
+	return __wd_place(eng->slots, eng->nr_slots, wd, NULL);
+}
+
+static void __wd_delete(struct dm_engine *eng, struct wd_slot *slot)
+{
+	size_t mask = eng->nr_slots - 1;
+	size_t i = slot - eng->slots;
+	size_t j = i;
+
+	/* Backward shift deletion keeps probe chains intact */
+	for (;;) {
+		size_t home;
+
+		j = (j + 1) & mask;
+		if (!eng->slots[j].wd)
+			break;
+		home = __wd_hash(eng->slots[j].wd, eng->nr_slots);
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			eng->slots[i] = eng->slots[j];
+			i = j;
+		}
+	}
+	eng->slots[i].wd = 0;
+	eng->slots[i].bindings = NULL;
+	eng->nr_used--;
+}
+
+static inline void __timer_place(struct dm_engine *eng, struct dm_source *src,
+				 unsigned int i)
+{
+	eng->timers[i] = src;
+	src->timer_idx = i;
+}
+
+/* Move the timer at i up or down the heap till its deadline fits */
+static void __timer_sift(struct dm_engine *eng, unsigned int i)
+{
+	struct dm_source *src = eng->timers[i];
+	unsigned int child;
+
+	while (i && eng->timers[(i - 1) / 2]->deadline > src->deadline) {
+		__timer_place(eng, eng->timers[(i - 1) / 2], i);
+		i = (i - 1) / 2;
+	}
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= eng->nr_timers)
+			break;
+		if (child + 1 < eng->nr_timers &&
+		    eng->timers[child + 1]->deadline <
+		    eng->timers[child]->deadline)
+			child++;
+		if (eng->timers[child]->deadline >= src->deadline)
+			break;
+		__timer_place(eng, eng->timers[child], i);
+		i = child;
+	}
+	__timer_place(eng, src, i);
+}
+
+/* Room in the timer heap for one more source; engine thread */
+static int __timers_reserve(struct dm_engine *eng)
+{
+	unsigned int size = eng->timers_size ? eng->timers_size * 2 :
+					       TIMER_HEAP_MIN;
+	struct dm_source **timers;
+
+	if (eng->nr_sources < eng->timers_size)
+		return 0;
+	timers = realloc(eng->timers, size * sizeof(*timers));
+	if (timers == NULL) {
+		ERROR("Memory allocation failure.");
+		return -1;
+	}
+	eng->timers = timers;
+	eng->timers_size = size;
+	return 0;
+}
+
+void dm_engine_arm(struct dm_source *src, uint64_t deadline)
+{
+	struct dm_engine *eng = src->engine;
+
+	src->deadline = deadline;
+	if (!src->armed) {
+		src->armed = 1;
+		src->timer_idx = eng->nr_timers++;
+		eng->timers[src->timer_idx] = src;
+	}
+	__timer_sift(eng, src->timer_idx);
+}
+
+void dm_engine_disarm(struct dm_source *src)
+{
+	struct dm_engine *eng = src->engine;
+	unsigned int i = src->timer_idx;
+
+	if (!src->armed)
+		return;
+
+	src->armed = 0;
+	if (i != --eng->nr_timers) {
+		__timer_place(eng, eng->timers[eng->nr_timers], i);
+		__timer_sift(eng, i);
+	}
+}
+
+/* Fire expired deadlines and return epoll timeout till the next one */
+static int __expire_timers(struct dm_engine *eng)
+{
+	struct dm_source *expired = NULL, **tail = &expired;
+	uint64_t now = dm_engine_now();
+
+	while (eng->nr_timers && eng->timers[0]->deadline <= now) {
+		struct dm_source *src = eng->timers[0];
+
+		dm_engine_disarm(src);
+		src->timer_next = NULL;
+		*tail = src;
+		tail = &src->timer_next;
+	}
+
+	/* Callbacks may re-arm, so run them after unlinking */
+	while (expired) {
+		struct dm_source *src = expired;
+
+		expired = src->timer_next;
+		src->timer_next = NULL;
+		src->ops->timeout(src);
+	}
+
+	if (!eng->nr_timers)
+		return -1;
+	now = dm_engine_now();
+	return eng->timers[0]->deadline > now ?
+	       (int)(eng->timers[0]->deadline - now) : 0;
+}
+
+/* Events were lost, every source has to catch up on its own */
+static void __queue_overflow(struct dm_engine *eng)
+{
+	struct dm_source *src, *next;
+
+	WARN("inotify event queue overflow");
+	for (src = eng->sources; src; src = next) {
+		next = src->src_next;
+		if (src->ops->overflow)
+			src->ops->overflow(src);
+	}
+}
+
+static int __epoll_add(int epfd, struct dm_poll *p)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = p;
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, p->fd, &ev);
+}
+
+/* Dispatch the events of one read to the sources */
+static void __parse_events(void *arg, const char *buff, size_t n)
+{
+	struct dm_engine *eng = (struct dm_engine *)arg;
+	size_t i = 0;
+
+	dm_stat_inc(DM_STAT_READS);
+	dm_stat_add(DM_STAT_READ_BYTES, n);
+	dm_hist_add(DM_HIST_READ_BYTES, n);
+
+	while (i < n) {
+		const struct inotify_event *event =
+			(const struct inotify_event *)&buff[i];
+		struct wd_slot *slot;
+		struct wd_binding *b;
+		unsigned int idx;
+
+		i += sizeof(struct inotify_event) + event->len;
+
+		if (event->mask & IN_Q_OVERFLOW) {
+			dm_stat_inc(DM_STAT_OVERFLOWS);
+			__queue_overflow(eng);
+			continue;
+		}
+		if (event->wd <= 0)
+			continue;
+		dm_stats_event(event->mask);
+
+		/* Callbacks may change the table, so look up again
+		 * for every source bound to the watch.
+		 */
+		for (idx = 0; ; idx++) {
+			unsigned int k = idx;
+
+			slot = __wd_lookup(eng, event->wd);
+			if (slot == NULL)
+				break;	/* Stale event of removed watch */
+			for (b = slot->bindings; b && k; k--)
+				b = b->next;
+			if (b == NULL)
+				break;
+			b->src->ops->event(b->src, event);
+		}
+
+		/* Watch removed by kernel: directory gone */
+		if ((event->mask & IN_IGNORED) &&
+		    (slot = __wd_lookup(eng, event->wd)) != NULL) {
+			while ((b = slot->bindings) != NULL) {
+				slot->bindings = b->next;
+				if (b->src->wd == event->wd)
+					b->src->wd = -1;
+				free(b);
+			}
+			__wd_delete(eng, slot);
+		}
+	}
+}
+
+static void __read_events(struct dm_engine *eng)
+{
+	for (;;) {
+		ssize_t n = read(eng->ifd, eng->buff, ENGINE_READ_SIZE);
+
+		dm_stat_inc(DM_STAT_SYSCALLS);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				SYSERR("read() error.");
+			return;
+		} else if (n == 0) {
+			return;
+		}
+		__parse_events(eng, eng->buff, n);
+	}
+}
+
+/* Go back to read() on readiness, e.g. when io_uring reads fail */
+static void __uring_fallback(struct dm_engine *eng)
+{
+	WARN("io_uring reads failed, reading inotify events with epoll");
+	dm_uring_destroy(eng->uring);
+	eng->uring = NULL;
+	if (__epoll_add(eng->epfd, &eng->inotify_poll) != 0)
+		SYSERR("epoll_ctl() failed.");
+	/* Events may be waiting already, readiness is not signalled again */
+	__read_events(eng);
+}
+
+/* Wait on the ring; returns 1 when descriptors of epfd may be ready */
+static int __uring_wait(struct dm_engine *eng, int timeout)
+{
+	int ready = 0;
+	int calls = dm_uring_wait(eng->uring, timeout, __parse_events, eng,
+				  &ready);
+
+	if (calls < 0) {
+		__uring_fallback(eng);
+		return 1;
+	}
+	dm_stat_add(DM_STAT_SYSCALLS, calls);
+	return ready;
+}
+
+/* Run queued commands; returns 1 when the engine has to stop */
+static int __run_commands(struct dm_engine *eng)
+{
+	uint64_t val;
+	int stop;
+
+	if (read(eng->efd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		SYSERR("eventfd read() error.");
+
+	pthread_mutex_lock(&eng->lock);
+	while (eng->cmd_head) {
+		struct engine_cmd *cmd = eng->cmd_head;
+
+		eng->cmd_head = cmd->next;
+		if (eng->cmd_head == NULL)
+			eng->cmd_tail = &eng->cmd_head;
+
+		pthread_mutex_unlock(&eng->lock);
+		cmd->retval = cmd->fn(cmd->arg);
+		pthread_mutex_lock(&eng->lock);
+
+		cmd->done = 1;
+		pthread_cond_broadcast(&eng->cond);
+	}
+	stop = eng->stop;
+	pthread_mutex_unlock(&eng->lock);
+
+	return stop;
+}
+
+static void *engine_thread(void *arg)
+{
+	struct dm_engine *eng = (struct dm_engine *)arg;
+	/* epfd had ready descriptors at the last look */
+	int pending = 0;
+
+	/* Completions are posted to the thread queueing the requests */
+	if (eng->uring && dm_uring_start(eng->uring) != 0)
+		__uring_fallback(eng);
+
+	for (;;) {
+		struct epoll_event evs[ENGINE_MAX_EVENTS];
+		int i, n, timeout, commands = 0;
+
+		timeout = __expire_timers(eng);
+
+		/* The poll on epfd only reports new readiness, so it is
+		 * looked at again till it has nothing left.
+		 */
+		if (eng->uring) {
+			if (!__uring_wait(eng, pending ? 0 : timeout) &&
+			    !pending)
+				continue;
+			timeout = 0;
+		}
+
+		n = epoll_wait(eng->epfd, evs, ENGINE_MAX_EVENTS, timeout);
+		dm_stat_inc(DM_STAT_SYSCALLS);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			SYSERR("epoll_wait() error.");
+			break;
+		}
+		pending = n > 0;
+
+		for (i = 0; i < n; i++) {
+			struct dm_poll *p = (struct dm_poll *)evs[i].data.ptr;
+
+			if (p == &eng->inotify_poll)
+				__read_events(eng);
+			else if (p == &eng->cmd_poll)
+				commands = 1;
+			else
+				p->ready(p);
+		}
+
+		/* Commands last: they may remove descriptors returned above */
+		if (commands && __run_commands(eng))
+			return NULL;
+	}
+	return NULL;
+}
+
+int dm_engine_poll(struct dm_engine *eng, struct dm_poll *p)
+{
+	if (__epoll_add(eng->epfd, p) != 0) {
+		SYSERR("epoll_ctl() failed.");
+		return -1;
+	}
+	return 0;
+}
+
+struct unpoll_args {
+	struct dm_engine *eng;
+	struct dm_poll *p;
+};
+
+static int __unpoll(void *arg)
+{
+	struct unpoll_args *args = (struct unpoll_args *)arg;
+
+	return epoll_ctl(args->eng->epfd, EPOLL_CTL_DEL, args->p->fd, NULL);
+}
+
+void dm_engine_unpoll(struct dm_engine *eng, struct dm_poll *p)
+{
+	struct unpoll_args args = {
+		.eng = eng,
+		.p = p,
+	};
+
+	/* On the engine thread nothing of the current wakeup is pending */
+	dm_engine_call(eng, __unpoll, &args);
+}
+
+int dm_engine_create(struct dm_engine **out, unsigned int flags)
+{
+	struct dm_engine *eng = NULL;
+
+	eng = calloc(1, sizeof(struct dm_engine));
+	if (eng == NULL) {
+		ERROR("Memory allocation failure.");
+		goto exit;
+	}
+
+	eng->ifd = eng->epfd = eng->efd = -1;
+	eng->cmd_head = NULL;
+	eng->cmd_tail = &eng->cmd_head;
+	pthread_mutex_init(&eng->lock, NULL);
+	pthread_cond_init(&eng->cond, NULL);
+
+	eng->nr_slots = WD_TABLE_MIN;
+	eng->slots = calloc(eng->nr_slots, sizeof(struct wd_slot));
+	if (eng->slots == NULL) {
+		ERROR("Memory allocation failure.");
+		goto exit_free;
+	}
+
+	eng->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (eng->ifd == -1) {
+		SYSERR("inotify_init1() failed.");
+		goto exit_close;
+	}
+
+	eng->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (eng->efd == -1) {
+		SYSERR("eventfd() failed.");
+		goto exit_close;
+	}
+
+	eng->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (eng->epfd == -1) {
+		SYSERR("epoll_create1() failed.");
+		goto exit_close;
+	}
+
+	if ((flags & DM_ENGINE_IO_URING) &&
+	    dm_uring_create(&eng->uring, eng->ifd, eng->epfd,
+			    ENGINE_URING_BUFFERS, ENGINE_URING_BUFF_SIZE) != 0) {
+		WARN("io_uring not available, reading inotify events with epoll");
+		eng->uring = NULL;
+	}
+
+	eng->inotify_poll.fd = eng->ifd;
+	eng->cmd_poll.fd = eng->efd;
+	if ((eng->uring == NULL &&
+	     __epoll_add(eng->epfd, &eng->inotify_poll) != 0) ||
+	    __epoll_add(eng->epfd, &eng->cmd_poll) != 0) {
+		SYSERR("epoll_ctl() failed.");
+		goto exit_close;
+	}
+
+	if (pthread_create(&eng->tid, NULL, engine_thread, eng) != 0) {
+		ERROR("Failed to create thread.");
+		goto exit_close;
+	}
+
+	*out = eng;
+	return 0;
+
+ exit_close:
+	dm_uring_destroy(eng->uring);
+	if (eng->epfd != -1)
+		close(eng->epfd);
+	if (eng->efd != -1)
+		close(eng->efd);
+	if (eng->ifd != -1)
+		close(eng->ifd);
+	free(eng->slots);
+ exit_free:
+	pthread_cond_destroy(&eng->cond);
+	pthread_mutex_destroy(&eng->lock);
+	free(eng);
+ exit:
+	return -1;
+}
+
+static void __wakeup(struct dm_engine *eng)
+{
+	uint64_t val = 1;
+
+	if (write(eng->efd, &val, sizeof(val)) < 0)
+		SYSERR("eventfd write() error.");
+}
+
+void dm_engine_destroy(struct dm_engine *eng)
+{
+	size_t i;
+
+	if (eng == NULL)
+		return;
+
+	pthread_mutex_lock(&eng->lock);
+	eng->stop = 1;
+	pthread_mutex_unlock(&eng->lock);
+	__wakeup(eng);
+	pthread_join(eng->tid, NULL);
+
+	if (eng->nr_used)
+		WARN("Engine destroyed with %zu watches attached", eng->nr_used);
+	for (i = 0; i < eng->nr_slots; i++) {
+		struct wd_binding *b = eng->slots[i].bindings;
+
+		while (b) {
+			struct wd_binding *next = b->next;
+			free(b);
+			b = next;
+		}
+	}
+
+	dm_uring_destroy(eng->uring);
+	close(eng->epfd);
+	close(eng->efd);
+	close(eng->ifd);
+	free(eng->slots);
+	free(eng->timers);
+	pthread_cond_destroy(&eng->cond);
+	pthread_mutex_destroy(&eng->lock);
+	free(eng);
+}
+
+const char *dm_engine_backend(const struct dm_engine *eng)
+{
+	return eng->uring ? "io_uring" : "epoll";
+}
+
+int dm_engine_set_cpu(struct dm_engine *eng, int cpu)
+{
+	cpu_set_t set;
+	int rc;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	rc = pthread_setaffinity_np(eng->tid, sizeof(set), &set);
+	if (rc != 0) {
+		WARN("Failed to pin engine thread to CPU %d : %s", cpu,
+		     strerror(rc));
+		return -1;
+	}
+	return 0;
+}
+
+int dm_engine_call(struct dm_engine *eng, int (*fn)(void *), void *arg)
+{
+	struct engine_cmd cmd;
+
+	if (pthread_equal(pthread_self(), eng->tid))
+		return fn(arg);
+
+	cmd.fn = fn;
+	cmd.arg = arg;
+	cmd.retval = -1;
+	cmd.done = 0;
+	cmd.next = NULL;
+
+	pthread_mutex_lock(&eng->lock);
+	*eng->cmd_tail = &cmd;
+	eng->cmd_tail = &cmd.next;
+	pthread_mutex_unlock(&eng->lock);
+
+	__wakeup(eng);
+
+	pthread_mutex_lock(&eng->lock);
+	while (!cmd.done)
+		pthread_cond_wait(&eng->cond, &eng->lock);
+	pthread_mutex_unlock(&eng->lock);
+
+	return cmd.retval;
+}
+
+int dm_engine_watch(struct dm_engine *eng, const char *path, uint32_t mask)
+{
+	/* Masks of watches shared by several sources only grow */
+	int wd = inotify_add_watch(eng->ifd, path, mask | IN_MASK_ADD);
+
+	if (wd == -1)
+		DEBUG("inotify_add_watch('%s') failed : %s",
+		      path, strerror(errno));
+	return wd;
+}
+
+int dm_engine_bind(struct dm_source *src, int wd)
+{
+	struct dm_engine *eng = src->engine;
+	struct wd_slot *slot = __wd_lookup(eng, wd);
+	struct wd_binding *b;
+
+	if (slot == NULL) {
+		slot = __wd_insert(eng, wd);
+		if (slot == NULL)
+			return -1;
+	}
+
+	for (b = slot->bindings; b; b = b->next)
+		if (b->src == src)
+			return 0;
+
+	b = malloc(sizeof(struct wd_binding));
+	if (b == NULL) {
+		ERROR("Memory allocation failure.");
+		if (slot->bindings == NULL) {
+			__wd_delete(eng, slot);
+			inotify_rm_watch(eng->ifd, wd);
+		}
+		return -1;
+	}
+	b->src = src;
+	b->next = slot->bindings;
+	slot->bindings = b;
+	return 0;
+}
+
+void dm_engine_unbind(struct dm_source *src, int wd)
+{
+	struct dm_engine *eng = src->engine;
+	struct wd_slot *slot = __wd_lookup(eng, wd);
+	struct wd_binding **pp;
+
+	if (slot == NULL)
+		return;
+
+	for (pp = &slot->bindings; *pp; pp = &(*pp)->next) {
+		if ((*pp)->src == src) {
+			struct wd_binding *b = *pp;
+			*pp = b->next;
+			free(b);
+			break;
+		}
+	}
+
+	/* Last source gone, drop the watch */
+	if (slot->bindings == NULL) {
+		__wd_delete(eng, slot);
+		inotify_rm_watch(eng->ifd, wd);
+	}
+}
+
+struct attach_args {
+	struct dm_engine *eng;
+	struct dm_source *src;
+	const char *path;
+	uint32_t mask;
+};
+
+static int __attach(void *arg)
+{
+	struct attach_args *args = (struct attach_args *)arg;
+	struct dm_source *src = args->src;
+	int wd;
+
+	src->engine = args->eng;
+	src->armed = 0;
+	src->timer_next = NULL;
+	src->wd = -1;
+	if (__timers_reserve(args->eng) != 0)
+		goto exit;
+
+	if (args->path == NULL)
+		goto link;
+
+	wd = dm_engine_watch(args->eng, args->path, args->mask);
+	if (wd == -1) {
+		SYSERR("Failed to setup watch on '%s'", args->path);
+		goto exit;
+	}
+
+	if (dm_engine_bind(src, wd) != 0)
+		goto exit;
+
+	src->wd = wd;
+ link:
+	src->src_prev = NULL;
+	src->src_next = args->eng->sources;
+	if (src->src_next)
+		src->src_next->src_prev = src;
+	args->eng->sources = src;
+	args->eng->nr_sources++;
+	return 0;
+
+ exit:
+	src->engine = NULL;
+	src->wd = -1;
+	return -1;
+}
+
+int dm_engine_attach(struct dm_engine *eng, struct dm_source *src,
+		     const char *path, uint32_t mask)
+{
+	struct attach_args args = {
+		.eng = eng,
+		.src = src,
+		.path = path,
+		.mask = mask,
+	};
+
+	return dm_engine_call(eng, __attach, &args);
+}
+
+static int __detach(void *arg)
+{
+	struct dm_source *src = (struct dm_source *)arg;
+
+	/* Flush pending work of the source */
+	if (src->armed) {
+		dm_engine_disarm(src);
+		src->ops->timeout(src);
+		dm_engine_disarm(src);
+	}
+
+	if (src->wd > 0) {
+		dm_engine_unbind(src, src->wd);
+		src->wd = -1;
+	}
+
+	if (src->src_prev)
+		src->src_prev->src_next = src->src_next;
+	else
+		src->engine->sources = src->src_next;
+	if (src->src_next)
+		src->src_next->src_prev = src->src_prev;
+	src->src_prev = src->src_next = NULL;
+	src->engine->nr_sources--;
+	return 0;
+}
+
+void dm_engine_detach(struct dm_source *src)
+{
+	if (src->engine == NULL)
+		return;
+	dm_engine_call(src->engine, __detach, src);
+	src->engine = NULL;
+}
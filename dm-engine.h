@@ -0,0 +1,205 @@
+#ifndef DM_ENGINE_H_INCLUDED
+#define DM_ENGINE_H_INCLUDED
+
+#include <stdint.h>
+#include <sys/inotify.h>
+
+struct dm_engine;
+struct dm_source;
+
+/* Callbacks invoked from the engine thread for an attached source. */
+struct dm_source_ops {
+	/* An inotify event arrived on the watch owned by the source */
+	void (*event)(struct dm_source *src, const struct inotify_event *event);
+	/* Deadline armed with dm_engine_arm() expired */
+	void (*timeout)(struct dm_source *src);
+	/* Kernel event queue overflowed, events were lost; optional */
+	void (*overflow)(struct dm_source *src);
+};
+
+/**
+ * Event source embedded by every watcher attached to an engine. All the
+ * fields are owned by the engine once the source is attached.
+ */
+struct dm_source {
+	const struct dm_source_ops *ops;
+	/* Engine the source is attached to */
+	struct dm_engine *engine;
+	/* Watch descriptor of the root on the engine's inotify instance */
+	int wd;
+	/* Absolute expiry time in milliseconds, valid when armed */
+	uint64_t deadline;
+	/* Position in the engine's timer heap, valid when armed */
+	unsigned int timer_idx;
+	/* Link in the list of expired timers being fired */
+	struct dm_source *timer_next;
+	/* Links in the engine's list of attached sources */
+	struct dm_source *src_prev;
+	struct dm_source *src_next;
+	/* Timer armed flag */
+	unsigned int armed : 1;
+};
+
+/**
+ * Additional file descriptor served by the engine loop, for event sources
+ * other than the shared inotify instance.
+ */
+struct dm_poll {
+	int fd;
+	/* The descriptor is readable; called from the engine thread */
+	void (*ready)(struct dm_poll *p);
+};
+
+/* Flags of dm_engine_create() */
+enum {
+	/* Read inotify events through io_uring when the kernel allows */
+	DM_ENGINE_IO_URING = 1 << 0,
+};
+
+/**
+ * This function creates an event engine: one inotify instance carrying the
+ * watches of all attached sources, driven by a single epoll loop running on
+ * its own thread.
+ * By default the loop read()s the inotify fd whenever it polls readable,
+ * till it runs dry. With DM_ENGINE_IO_URING a read stays queued on it in an
+ * io_uring instead and the loop waits on the ring, which also polls the
+ * epoll instance: a wakeup for kernel events costs one system call instead
+ * of an epoll_wait() and two read()s. Without io_uring support the default
+ * is used.
+ *
+ * @param: out		Storage location to keep allocated engine object.
+ * @param: flags	DM_ENGINE_* flags.
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_engine_create(struct dm_engine **out, unsigned int flags);
+
+/* Way kernel events are read: "io_uring" or "epoll" */
+const char *dm_engine_backend(const struct dm_engine *eng);
+
+/**
+ * This function pins the engine thread to a CPU, so that engines sharing
+ * the load each keep a core and its caches.
+ *
+ * @param: eng	A valid engine object.
+ * @param: cpu	CPU number.
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_engine_set_cpu(struct dm_engine *eng, int cpu);
+
+/**
+ * This function stops the engine thread and releases the engine. All the
+ * sources must have been detached before.
+ *
+ * @param: eng	A valid engine object.
+ * @return: No return.
+ */
+void dm_engine_destroy(struct dm_engine *eng);
+
+/**
+ * This function runs the given function on the engine thread and waits
+ * for it to complete. Called from the engine thread itself, it runs inline.
+ *
+ * @param: eng	A valid engine object.
+ * @param: fn	Function to run.
+ * @param: arg	Argument passed to the function.
+ * @return: Return value of the function.
+ */
+int dm_engine_call(struct dm_engine *eng, int (*fn)(void *), void *arg);
+
+/**
+ * This function attaches the source to the engine, places a watch on the
+ * given path and routes its events to the source. A source attached without
+ * path gets timers and overflow notifications only.
+ *
+ * @param: eng	A valid engine object.
+ * @param: src	Source with ops initialized.
+ * @param: path	Path to watch or NULL.
+ * @param: mask	inotify event mask.
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_engine_attach(struct dm_engine *eng, struct dm_source *src,
+		     const char *path, uint32_t mask);
+
+/**
+ * This function removes the root watch of the source from the engine. An
+ * armed deadline is fired before removal so that pending work is not lost.
+ * Other watches bound to the source must be unbound before.
+ *
+ * @param: src	An attached source.
+ * @return: No return.
+ */
+void dm_engine_detach(struct dm_source *src);
+
+/**
+ * This function places a watch on the engine's inotify instance without
+ * routing its events anywhere yet. Safe to call from any thread. A watch
+ * on an inode watched already returns the same descriptor.
+ *
+ * @param: eng	A valid engine object.
+ * @param: path	Path to watch.
+ * @param: mask	inotify event mask, added to the mask of an existing watch.
+ * @return: Watch descriptor or -1 on failure.
+ */
+int dm_engine_watch(struct dm_engine *eng, const char *path, uint32_t mask);
+
+/**
+ * This function routes events of the watch to the source as well. Several
+ * sources may be bound to one watch. Engine thread only.
+ *
+ * @param: src	An attached source.
+ * @param: wd	Watch descriptor from dm_engine_watch().
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_engine_bind(struct dm_source *src, int wd);
+
+/**
+ * This function stops routing events of the watch to the source. The
+ * watch is removed once no source is bound to it. Engine thread only.
+ *
+ * @param: src	An attached source.
+ * @param: wd	Watch descriptor bound to the source.
+ * @return: No return.
+ */
+void dm_engine_unbind(struct dm_source *src, int wd);
+
+/**
+ * This function arms (or re-arms) the source deadline. Engine thread only.
+ *
+ * @param: src		An attached source.
+ * @param: deadline	Absolute time in milliseconds, see dm_engine_now().
+ * @return: No return.
+ */
+void dm_engine_arm(struct dm_source *src, uint64_t deadline);
+
+/**
+ * This function disarms the source deadline. Engine thread only.
+ *
+ * @param: src	An attached source.
+ * @return: No return.
+ */
+void dm_engine_disarm(struct dm_source *src);
+
+/**
+ * This function adds a file descriptor to the engine loop.
+ *
+ * @param: eng	A valid engine object.
+ * @param: p	Descriptor and callback, must stay valid till removed.
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_engine_poll(struct dm_engine *eng, struct dm_poll *p);
+
+/**
+ * This function removes a file descriptor from the engine loop. Once it
+ * returns the callback is not running and will not be called anymore.
+ * Must not be called from a dm_poll callback.
+ *
+ * @param: eng	A valid engine object.
+ * @param: p	Descriptor added with dm_engine_poll().
+ * @return: No return.
+ */
+void dm_engine_unpoll(struct dm_engine *eng, struct dm_poll *p);
+
+/* Monotonic clock in milliseconds */
+uint64_t dm_engine_now(void);
+
+#endif /* DM_ENGINE_H_INCLUDED */
@@ -0,0 +1,594 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+
+#include "dm-fanotify.h"
+#include "dm-engine.h"
+#include "dm-config.h"
+#include "dm-stats.h"
+#include "internals.h"
+#include "debug.h"
+
+
+/* Bytes drained from the fanotify fd per read() */
+#define FANOTIFY_READ_SIZE	(64 * 1024)
+
+/* Events of interest on the marked filesystem */
+#define FANOTIFY_MASK	(FAN_DELETE | FAN_CREATE | FAN_MOVED_FROM | \
+			 FAN_MOVED_TO | FAN_ONDIR)
+
+/* Resolved directory handle */
+struct fan_dir {
+	uint64_t hash;
+	/* Absolute path of the directory */
+	char *path;
+	/* Hash chain */
+	struct fan_dir *next;
+	/* LRU list, most recently used first */
+	struct fan_dir *lru_prev, *lru_next;
+	int handle_type;
+	unsigned int handle_bytes;
+	unsigned char handle[];
+};
+
+/*
+ * fanotify group and filesystem mark shared by the watches of one engine
+ * on one filesystem, so every event is read and resolved once.
+ */
+struct fan_group {
+	/* fanotify descriptor served by the engine */
+	struct dm_poll poll;
+	struct dm_engine *eng;
+	dev_t dev;
+	/* Directory on the filesystem, for open_by_handle_at() and marks */
+	int mountfd;
+	/* FAN_MODIFY and/or FAN_CLOSE_WRITE, as the watches want */
+	uint64_t events;
+	/* Watches, changed on the engine thread under groups_lock */
+	struct dm_fanotify *watches;
+	unsigned int nr_watches;
+	/* Registry of the groups */
+	struct fan_group *next;
+	/* Directory handle cache */
+	struct fan_dir **buckets;
+	size_t nr_buckets;
+	size_t nr_dirs;
+	struct fan_dir *lru_head, *lru_tail;
+	/* Buffer to store events read from fanotify fd */
+	char buff[FANOTIFY_READ_SIZE]
+		__attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+};
+
+struct dm_fanotify {
+	struct fan_group *grp;
+	/* Root directory */
+	char *root;
+	size_t root_len;
+	unsigned int recursive : 1;
+	/* FAN_MODIFY or FAN_CLOSE_WRITE */
+	uint64_t events;
+	const struct dm_fanotify_ops *ops;
+	void *arg;
+	/* Next watch of the group */
+	struct dm_fanotify *next;
+};
+
+/* Groups of all engines, looked up by engine and filesystem */
+static struct fan_group *groups;
+static pthread_mutex_t groups_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint64_t __handle_hash(const struct file_handle *fh)
+{
+	return hash_str64((const char *)fh->f_handle, fh->handle_bytes) ^
+	       (unsigned int)fh->handle_type;
+}
+
+static void __lru_unlink(struct fan_group *grp, struct fan_dir *d)
+{
+	if (d->lru_prev)
+		d->lru_prev->lru_next = d->lru_next;
+	else
+		grp->lru_head = d->lru_next;
+	if (d->lru_next)
+		d->lru_next->lru_prev = d->lru_prev;
+	else
+		grp->lru_tail = d->lru_prev;
+}
+
+static void __lru_push(struct fan_group *grp, struct fan_dir *d)
+{
+	d->lru_prev = NULL;
+	d->lru_next = grp->lru_head;
+	if (grp->lru_head)
+		grp->lru_head->lru_prev = d;
+	else
+		grp->lru_tail = d;
+	grp->lru_head = d;
+}
+
+static void __cache_delete(struct fan_group *grp, struct fan_dir *d)
+{
+	struct fan_dir **pp = &grp->buckets[d->hash & (grp->nr_buckets - 1)];
+
+	while (*pp != d)
+		pp = &(*pp)->next;
+	*pp = d->next;
+	__lru_unlink(grp, d);
+	grp->nr_dirs--;
+	free(d->path);
+	free(d);
+}
+
+/* Forget all paths */
+static void __cache_flush(struct fan_group *grp)
+{
+	while (grp->lru_head)
+		__cache_delete(grp, grp->lru_head);
+}
+
+/* Path of name in dir, -1 when too long */
+static int __join(char *buf, size_t size, const char *dir, const char *name)
+{
+	/* Root directory "/" ends with the separator already */
+	if (snprintf(buf, size, "%s/%s", dir[1] ? dir : "", name) >= (int)size)
+		return -1;
+	return 0;
+}
+
+/**
+ * This function forgets the paths of the directory name in dir and of all
+ * directories below it, e.g. after it was renamed. Without dir, the parent
+ * could not be resolved and all paths are forgotten.
+ *
+ * @param: grp	A valid group.
+ * @param: dir	Parent directory from the cache, or NULL.
+ * @param: name	Name of the directory in its parent.
+ * @return: No return.
+ */
+static void __cache_flush_below(struct fan_group *grp,
+				const struct fan_dir *dir, const char *name)
+{
+	struct fan_dir *d, *next;
+	char path[PATH_MAX];
+	size_t len;
+
+	if (dir == NULL || __join(path, sizeof(path), dir->path, name) != 0) {
+		__cache_flush(grp);
+		return;
+	}
+	len = strlen(path);
+	for (d = grp->lru_head; d; d = next) {
+		next = d->lru_next;
+		if (!strncmp(d->path, path, len) &&
+		    (d->path[len] == '\0' || d->path[len] == '/'))
+			__cache_delete(grp, d);
+	}
+}
+
+/**
+ * This function finds the absolute path of the directory with the given
+ * handle. Directories outside of every root are cached as well so that
+ * events elsewhere on the filesystem are dropped cheaply.
+ *
+ * @param: grp	A valid group.
+ * @param: fh	Directory handle from the event.
+ * @return: Cache entry or NULL when the directory cannot be resolved.
+ */
+static struct fan_dir *__resolve(struct fan_group *grp,
+				 struct file_handle *fh)
+{
+	uint64_t hash = __handle_hash(fh);
+	struct fan_dir **pp = &grp->buckets[hash & (grp->nr_buckets - 1)];
+	char link[64], path[PATH_MAX];
+	struct fan_dir *d;
+	ssize_t len;
+	int fd;
+
+	for (d = *pp; d; d = d->next) {
+		if (d->hash == hash && d->handle_type == fh->handle_type &&
+		    d->handle_bytes == fh->handle_bytes &&
+		    !memcmp(d->handle, fh->f_handle, fh->handle_bytes)) {
+			__lru_unlink(grp, d);
+			__lru_push(grp, d);
+			return d;
+		}
+	}
+
+	/* Directory removed meanwhile: ESTALE */
+	fd = open_by_handle_at(grp->mountfd, fh, O_PATH | O_CLOEXEC);
+	if (fd == -1) {
+		DEBUG("open_by_handle_at() failed : %s", strerror(errno));
+		return NULL;
+	}
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+	len = readlink(link, path, sizeof(path) - 1);
+	close(fd);
+	if (len < 0)
+		return NULL;
+	path[len] = '\0';
+
+	d = malloc(sizeof(*d) + fh->handle_bytes);
+	if (d == NULL || (d->path = strdup(path)) == NULL) {
+		ERROR("Memory allocation failure.");
+		free(d);
+		return NULL;
+	}
+	d->hash = hash;
+	d->handle_type = fh->handle_type;
+	d->handle_bytes = fh->handle_bytes;
+	memcpy(d->handle, fh->f_handle, fh->handle_bytes);
+
+	if (grp->nr_dirs >= CONFIG_FANOTIFY_CACHE)
+		__cache_delete(grp, grp->lru_tail);
+
+	d->next = *pp;
+	*pp = d;
+	__lru_push(grp, d);
+	grp->nr_dirs++;
+	return d;
+}
+
+static uint32_t __inotify_mask(uint64_t mask)
+{
+	uint32_t in_mask = 0;
+
+	if (mask & FAN_MODIFY)
+		in_mask |= IN_MODIFY;
+	if (mask & FAN_CLOSE_WRITE)
+		in_mask |= IN_CLOSE_WRITE;
+	if (mask & FAN_DELETE)
+		in_mask |= IN_DELETE;
+	if (mask & FAN_CREATE)
+		in_mask |= IN_CREATE;
+	if (mask & FAN_MOVED_FROM)
+		in_mask |= IN_MOVED_FROM;
+	if (mask & FAN_MOVED_TO)
+		in_mask |= IN_MOVED_TO;
+	if (mask & FAN_ONDIR)
+		in_mask |= IN_ISDIR;
+	return in_mask;
+}
+
+/* Path of dir relative to the root of the watch, NULL when outside */
+static const char *__relpath(const struct dm_fanotify *fan, const char *dir)
+{
+	if (fan->root_len == 1)
+		return dir + 1;
+	if (strncmp(dir, fan->root, fan->root_len))
+		return NULL;
+	if (dir[fan->root_len] == '\0')
+		return dir + fan->root_len;
+	if (dir[fan->root_len] == '/')
+		return dir + fan->root_len + 1;
+	return NULL;
+}
+
+/* Hand the event on name in dir to the watches it is below the root of */
+static void __dispatch(struct fan_group *grp, uint64_t mask,
+		       const char *dir, const char *name)
+{
+	struct dm_fanotify *fan;
+	char path[PATH_MAX];
+
+	for (fan = grp->watches; fan; fan = fan->next) {
+		uint64_t fan_mask = mask & (FANOTIFY_MASK | fan->events);
+		const char *relpath;
+
+		if (!(fan_mask & ~FAN_ONDIR))
+			continue;
+		relpath = __relpath(fan, dir);
+		if (relpath == NULL || (!fan->recursive && *relpath))
+			continue;
+
+		if (*relpath) {
+			if (snprintf(path, sizeof(path), "%s/%s", relpath,
+				     name) >= (int)sizeof(path))
+				continue;
+			fan->ops->event(fan->arg, __inotify_mask(fan_mask),
+					path);
+		} else {
+			fan->ops->event(fan->arg, __inotify_mask(fan_mask),
+					name);
+		}
+	}
+}
+
+static void __handle_event(struct fan_group *grp,
+			   const struct fanotify_event_metadata *meta)
+{
+	const char *p = (const char *)meta + meta->metadata_len;
+	const char *end = (const char *)meta + meta->event_len;
+
+	dm_stats_event(__inotify_mask(meta->mask));
+
+	while (p < end) {
+		const struct fanotify_event_info_fid *fid =
+			(const struct fanotify_event_info_fid *)p;
+		struct file_handle *fh;
+		struct fan_dir *d;
+		const char *name;
+
+		p += fid->hdr.len;
+		if (fid->hdr.len == 0)
+			break;
+		if (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+			continue;
+
+		fh = (struct file_handle *)fid->handle;
+		name = (const char *)fh->f_handle + fh->handle_bytes;
+		if (!strcmp(name, "."))
+			continue;
+
+		d = __resolve(grp, fh);
+		if (d != NULL)
+			__dispatch(grp, meta->mask, d->path, name);
+
+		/* Cached paths below a moved or removed directory are wrong now */
+		if ((meta->mask & FAN_ONDIR) &&
+		    (meta->mask & (FAN_MOVED_FROM | FAN_MOVED_TO | FAN_DELETE)))
+			__cache_flush_below(grp, d, name);
+	}
+}
+
+static void __read_events(struct dm_poll *poll)
+{
+	struct fan_group *grp = container_of(poll, struct fan_group, poll);
+	struct dm_fanotify *fan;
+
+	for (;;) {
+		const struct fanotify_event_metadata *meta;
+		ssize_t n = read(grp->poll.fd, grp->buff, FANOTIFY_READ_SIZE);
+
+		dm_stat_inc(DM_STAT_SYSCALLS);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				SYSERR("read() error.");
+			return;
+		} else if (n == 0) {
+			return;
+		}
+
+		dm_stat_inc(DM_STAT_READS);
+		dm_stat_add(DM_STAT_READ_BYTES, n);
+		dm_hist_add(DM_HIST_READ_BYTES, n);
+
+		meta = (const struct fanotify_event_metadata *)grp->buff;
+		for (; FAN_EVENT_OK(meta, n); meta = FAN_EVENT_NEXT(meta, n)) {
+			if (meta->vers != FANOTIFY_METADATA_VERSION) {
+				ERROR("fanotify ABI version mismatch");
+				return;
+			}
+			if (meta->mask & FAN_Q_OVERFLOW) {
+				WARN("fanotify event queue overflow");
+				dm_stat_inc(DM_STAT_OVERFLOWS);
+				for (fan = grp->watches; fan; fan = fan->next)
+					if (fan->ops->overflow)
+						fan->ops->overflow(fan->arg);
+				continue;
+			}
+			__handle_event(grp, meta);
+		}
+	}
+}
+
+static int __watch_add(void *arg)
+{
+	struct dm_fanotify *fan = (struct dm_fanotify *)arg;
+
+	fan->next = fan->grp->watches;
+	fan->grp->watches = fan;
+	return 0;
+}
+
+static int __watch_del(void *arg)
+{
+	struct dm_fanotify *fan = (struct dm_fanotify *)arg;
+	struct dm_fanotify **pp = &fan->grp->watches;
+
+	while (*pp != fan)
+		pp = &(*pp)->next;
+	*pp = fan->next;
+	return 0;
+}
+
+/**
+ * This function finds the group of the engine on the filesystem of root,
+ * or creates it. Called with groups_lock held.
+ *
+ * @param: eng	Engine serving the fanotify descriptor.
+ * @param: dev	Device of the filesystem.
+ * @param: root	Directory on the filesystem.
+ * @return: Group with a reference taken or NULL on failure.
+ */
+static struct fan_group *__group_get(struct dm_engine *eng, dev_t dev,
+				     const char *root)
+{
+	struct fan_group *grp;
+
+	for (grp = groups; grp; grp = grp->next) {
+		if (grp->eng == eng && grp->dev == dev) {
+			grp->nr_watches++;
+			return grp;
+		}
+	}
+
+	grp = calloc(1, sizeof(struct fan_group));
+	if (grp == NULL) {
+		ERROR("Memory allocation failure.");
+		goto exit;
+	}
+	grp->poll.fd = grp->mountfd = -1;
+	grp->poll.ready = __read_events;
+	grp->eng = eng;
+	grp->dev = dev;
+
+	/* Power of 2 at least the cache size */
+	for (grp->nr_buckets = 64; grp->nr_buckets < CONFIG_FANOTIFY_CACHE;
+	     grp->nr_buckets *= 2)
+		;
+	grp->buckets = calloc(grp->nr_buckets, sizeof(struct fan_dir *));
+	if (grp->buckets == NULL) {
+		ERROR("Memory allocation failure.");
+		goto exit_free;
+	}
+
+	grp->mountfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (grp->mountfd == -1) {
+		SYSERR("open('%s') failed.", root);
+		goto exit_free;
+	}
+
+	grp->poll.fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC |
+				     FAN_NONBLOCK | FAN_REPORT_DFID_NAME,
+				     O_RDONLY | O_LARGEFILE);
+	if (grp->poll.fd == -1) {
+		SYSERR("fanotify_init() failed.");
+		goto exit_close;
+	}
+
+	if (dm_engine_poll(eng, &grp->poll) != 0)
+		goto exit_close;
+
+	grp->nr_watches = 1;
+	grp->next = groups;
+	groups = grp;
+	return grp;
+
+ exit_close:
+	if (grp->poll.fd != -1)
+		close(grp->poll.fd);
+	close(grp->mountfd);
+ exit_free:
+	free(grp->buckets);
+	free(grp);
+ exit:
+	return NULL;
+}
+
+/**
+ * This function drops a reference to the group, removing it with the last
+ * one, else dropping the events no watch left wants from the mark. Called
+ * with groups_lock held, once the watch left the group.
+ *
+ * @param: grp	A valid group.
+ * @return: No return.
+ */
+static void __group_put(struct fan_group *grp)
+{
+	struct fan_group **pp = &groups;
+	struct dm_fanotify *fan;
+	uint64_t events = 0;
+
+	if (--grp->nr_watches) {
+		for (fan = grp->watches; fan; fan = fan->next)
+			events |= fan->events;
+		if ((grp->events & ~events) &&
+		    fanotify_mark(grp->poll.fd, FAN_MARK_REMOVE |
+				  FAN_MARK_FILESYSTEM, grp->events & ~events,
+				  grp->mountfd, NULL) != 0)
+			SYSERR("fanotify_mark() failed.");
+		grp->events = events;
+		return;
+	}
+
+	while (*pp != grp)
+		pp = &(*pp)->next;
+	*pp = grp->next;
+
+	dm_engine_unpoll(grp->eng, &grp->poll);
+	close(grp->poll.fd);
+	close(grp->mountfd);
+	__cache_flush(grp);
+	free(grp->buckets);
+	free(grp);
+}
+
+int dm_fanotify_start(struct dm_fanotify **out, struct dm_engine *eng,
+		      const char *root, int recursive, int completed,
+		      const struct dm_fanotify_ops *ops, void *arg)
+{
+	struct dm_fanotify *fan = NULL;
+	struct fan_group *grp;
+	char path[PATH_MAX];
+	struct stat st;
+
+	if (realpath(root, path) == NULL) {
+		SYSERR("realpath('%s') failed.", root);
+		goto exit;
+	}
+	if (stat(path, &st) != 0) {
+		SYSERR("stat('%s') failed.", path);
+		goto exit;
+	}
+
+	fan = calloc(1, sizeof(struct dm_fanotify));
+	if (fan == NULL) {
+		ERROR("Memory allocation failure.");
+		goto exit;
+	}
+	fan->root = strdup(path);
+	if (fan->root == NULL) {
+		ERROR("Memory allocation failure.");
+		goto exit_free;
+	}
+	fan->root_len = strlen(fan->root);
+	fan->recursive = !!recursive;
+	fan->events = completed ? FAN_CLOSE_WRITE : FAN_MODIFY;
+	fan->ops = ops;
+	fan->arg = arg;
+
+	pthread_mutex_lock(&groups_lock);
+	grp = __group_get(eng, st.st_dev, fan->root);
+	if (grp == NULL)
+		goto exit_unlock;
+
+	/* One mark for the whole filesystem, whatever the size of the tree */
+	if (fanotify_mark(grp->poll.fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+			  FANOTIFY_MASK | fan->events, grp->mountfd,
+			  NULL) != 0) {
+		SYSERR("fanotify_mark('%s') failed.", fan->root);
+		__group_put(grp);
+		goto exit_unlock;
+	}
+	grp->events |= fan->events;
+	fan->grp = grp;
+	dm_engine_call(eng, __watch_add, fan);
+	pthread_mutex_unlock(&groups_lock);
+
+	*out = fan;
+	return 0;
+
+ exit_unlock:
+	pthread_mutex_unlock(&groups_lock);
+ exit_free:
+	free(fan->root);
+	free(fan);
+ exit:
+	return -1;
+}
+
+void dm_fanotify_stop(struct dm_fanotify *fan)
+{
+	if (fan == NULL)
+		return;
+
+	pthread_mutex_lock(&groups_lock);
+	dm_engine_call(fan->grp->eng, __watch_del, fan);
+	__group_put(fan->grp);
+	pthread_mutex_unlock(&groups_lock);
+
+	free(fan->root);
+	free(fan);
+}
@@ -0,0 +1,55 @@
+#ifndef DM_FANOTIFY_H_INCLUDED
+#define DM_FANOTIFY_H_INCLUDED
+
+#include <stdint.h>
+
+struct dm_fanotify;
+struct dm_engine;
+
+/**
+ * Callbacks of a fanotify watch, invoked from the engine thread.
+ */
+struct dm_fanotify_ops {
+	/**
+	 * A file or directory changed below the watched root.
+	 *
+	 * @param: arg		Argument given to dm_fanotify_start().
+	 * @param: mask		inotify style mask (IN_MODIFY, IN_DELETE,
+	 *			IN_CREATE, IN_MOVED_FROM, IN_MOVED_TO, IN_ISDIR).
+	 * @param: relpath	Path relative to the root.
+	 */
+	void (*event)(void *arg, uint32_t mask, const char *relpath);
+	/* Event queue overflowed, events were lost */
+	void (*overflow)(void *arg);
+};
+
+/**
+ * This function watches the whole tree below root with a single fanotify
+ * filesystem mark, whatever the size of the tree. Watches of one engine on
+ * the same filesystem share the fanotify group and its mark. Events carry
+ * the file handle of the parent directory, which is resolved to a path
+ * once through a LRU cache and handed to the watches whose root it is
+ * below. Needs CAP_SYS_ADMIN and CAP_DAC_READ_SEARCH.
+ *
+ * @param: out		Storage location to keep allocated watch.
+ * @param: eng		Engine serving the fanotify descriptor.
+ * @param: root		Root directory of the tree.
+ * @param: recursive	Report the whole tree, else direct children only.
+ * @param: completed	Report files closed after writing, not every write.
+ * @param: ops		Callbacks.
+ * @param: arg		Argument passed to the callbacks.
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_fanotify_start(struct dm_fanotify **out, struct dm_engine *eng,
+		      const char *root, int recursive, int completed,
+		      const struct dm_fanotify_ops *ops, void *arg);
+
+/**
+ * This function removes the watch. No callback runs once it returns.
+ *
+ * @param: fan	A valid watch.
+ * @return: No return.
+ */
+void dm_fanotify_stop(struct dm_fanotify *fan);
+
+#endif /* DM_FANOTIFY_H_INCLUDED */
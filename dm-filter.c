@@ -0,0 +1,485 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fnmatch.h>
+#include <regex.h>
+
+#include "dm-filter.h"
+#include "debug.h"
+
+
+/* File types of DM_RULE_TYPES */
+#define TYPE_FILE	0x1
+#define TYPE_SYMLINK	0x2
+#define TYPE_OTHER	0x4
+
+/* Trie node; node 0 is the root, so 0 also ends child and sibling lists */
+struct trie_node {
+	int child;
+	int sibling;
+	/* Rule matching the names starting (ending) with this node, or -1 */
+	int rule;
+	/* Rule matching the names equal to this node, or -1 */
+	int exact;
+	unsigned char c;
+};
+
+struct trie {
+	struct trie_node *nodes;
+	int nr_nodes;
+	int size;
+};
+
+struct rule {
+	unsigned int type;
+	/* "<type> <argument>" */
+	char *desc;
+	/* Glob left to fnmatch() */
+	const char *glob;
+	/* Glob applies to the relative path, not the last component */
+	unsigned int path : 1;
+	unsigned int has_regex : 1;
+	regex_t regex;
+};
+
+/* Include or exclude rules */
+struct matcher {
+	/* Literal names and "<prefix>*" globs */
+	struct trie prefix;
+	/* "*<suffix>" globs, stored reversed */
+	struct trie suffix;
+	/* Rules matched one by one */
+	unsigned int *slow;
+	unsigned int nr_slow;
+	/* Number of rules of the matcher */
+	unsigned int nr_rules;
+};
+
+struct dm_filter {
+	int refs;
+	struct rule *rules;
+	unsigned int nr_rules;
+	struct matcher exclude;
+	struct matcher include;
+	/* Pseudo rule counting names no include rule matched, or -1 */
+	int not_included;
+	/* Size and type rules, -1 if none */
+	int min_rule;
+	int max_rule;
+	int types_rule;
+	uint64_t min_size;
+	uint64_t max_size;
+	unsigned int types;
+};
+
+static int __trie_node(struct trie *t, unsigned char c)
+{
+	if (t->nr_nodes == t->size) {
+		int size = t->size ? t->size * 2 : 64;
+		struct trie_node *nodes = realloc(t->nodes,
+						  size * sizeof(*nodes));
+
+		if (nodes == NULL) {
+			ERROR("Memory allocation failure.");
+			return -1;
+		}
+		t->nodes = nodes;
+		t->size = size;
+	}
+	t->nodes[t->nr_nodes].child = 0;
+	t->nodes[t->nr_nodes].sibling = 0;
+	t->nodes[t->nr_nodes].rule = -1;
+	t->nodes[t->nr_nodes].exact = -1;
+	t->nodes[t->nr_nodes].c = c;
+	return t->nr_nodes++;
+}
+
+/**
+ * This function inserts a literal into a trie.
+ *
+ * @param: t		A valid trie.
+ * @param: s		Literal.
+ * @param: len		Length of the literal.
+ * @param: reverse	Insert the literal backwards, for suffixes.
+ * @param: exact	Match the literal only, not what it starts.
+ * @param: rule		Rule number.
+ * @return: 0 on success or -1 on failure.
+ */
+static int __trie_insert(struct trie *t, const char *s, size_t len,
+			 int reverse, int exact, int rule)
+{
+	int n = 0;
+	size_t i;
+
+	if (!t->nr_nodes && __trie_node(t, 0) != 0)
+		return -1;
+
+	for (i = 0; i < len; i++) {
+		unsigned char c = reverse ? s[len - 1 - i] : s[i];
+		int m;
+
+		for (m = t->nodes[n].child; m && t->nodes[m].c != c;
+		     m = t->nodes[m].sibling)
+			;
+		if (!m) {
+			m = __trie_node(t, c);
+			if (m == -1)
+				return -1;
+			t->nodes[m].sibling = t->nodes[n].child;
+			t->nodes[n].child = m;
+		}
+		n = m;
+	}
+
+	/* First rule wins, the others would never count a drop */
+	if (exact && t->nodes[n].exact == -1)
+		t->nodes[n].exact = rule;
+	else if (!exact && t->nodes[n].rule == -1)
+		t->nodes[n].rule = rule;
+	return 0;
+}
+
+/* Rule of the shortest literal the string starts (ends) with, or -1 */
+static int __trie_walk(const struct trie *t, const char *s, size_t len,
+		       int reverse)
+{
+	int n = 0;
+	size_t i;
+
+	if (!t->nr_nodes)
+		return -1;
+
+	for (i = 0;; i++) {
+		const struct trie_node *node = &t->nodes[n];
+		unsigned char c;
+
+		if (node->rule != -1)
+			return node->rule;
+		if (i == len)
+			return node->exact;
+
+		c = reverse ? s[len - 1 - i] : s[i];
+		for (n = node->child; n && t->nodes[n].c != c;
+		     n = t->nodes[n].sibling)
+			;
+		if (!n)
+			return -1;
+	}
+}
+
+static inline int __is_literal(const char *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (s[i] == '*' || s[i] == '?' || s[i] == '[' || s[i] == '\\')
+			return 0;
+	return 1;
+}
+
+/**
+ * This function places a glob or regex rule in the fastest structure which
+ * can match it.
+ *
+ * @param: f	A valid filter.
+ * @param: m	Matcher of the rule.
+ * @param: n	Rule number.
+ * @return: 0 on success or -1 on failure.
+ */
+static int __matcher_add(struct dm_filter *f, struct matcher *m,
+			 unsigned int n)
+{
+	struct rule *r = &f->rules[n];
+	size_t len = r->glob ? strlen(r->glob) : 0;
+	unsigned int *slow;
+
+	m->nr_rules++;
+	if (r->glob && !r->path) {
+		if (__is_literal(r->glob, len))
+			return __trie_insert(&m->prefix, r->glob, len, 0, 1, n);
+		if (r->glob[0] == '*' && __is_literal(r->glob + 1, len - 1))
+			return __trie_insert(&m->suffix, r->glob + 1, len - 1,
+					     1, 0, n);
+		if (r->glob[len - 1] == '*' && __is_literal(r->glob, len - 1))
+			return __trie_insert(&m->prefix, r->glob, len - 1, 0, 0,
+					     n);
+	}
+
+	slow = realloc(m->slow, (m->nr_slow + 1) * sizeof(*slow));
+	if (slow == NULL) {
+		ERROR("Memory allocation failure.");
+		return -1;
+	}
+	m->slow = slow;
+	m->slow[m->nr_slow++] = n;
+	return 0;
+}
+
+static int __matcher_match(const struct dm_filter *f, const struct matcher *m,
+			   const char *name, const char *base, size_t base_len)
+{
+	unsigned int i;
+	int rule;
+
+	rule = __trie_walk(&m->prefix, base, base_len, 0);
+	if (rule != -1)
+		return rule;
+	rule = __trie_walk(&m->suffix, base, base_len, 1);
+	if (rule != -1)
+		return rule;
+
+	for (i = 0; i < m->nr_slow; i++) {
+		const struct rule *r = &f->rules[m->slow[i]];
+
+		if (r->has_regex ?
+		    regexec(&r->regex, name, 0, NULL, 0) == 0 :
+		    fnmatch(r->glob, r->path ? name : base,
+			    r->path ? FNM_PATHNAME : 0) == 0)
+			return m->slow[i];
+	}
+	return -1;
+}
+
+static void __matcher_release(struct matcher *m)
+{
+	free(m->prefix.nodes);
+	free(m->suffix.nodes);
+	free(m->slow);
+}
+
+/* Append a rule; its description keeps the argument */
+static struct rule *__rule_new(struct dm_filter *f, unsigned int type,
+			       const char *name, const char *arg)
+{
+	struct rule *rules, *r;
+	size_t len = strlen(name) + strlen(arg) + 2;
+
+	rules = realloc(f->rules, (f->nr_rules + 1) * sizeof(*rules));
+	if (rules == NULL)
+		goto exit_nomem;
+	f->rules = rules;
+
+	r = &f->rules[f->nr_rules];
+	memset(r, 0, sizeof(*r));
+	r->type = type;
+	r->desc = malloc(len);
+	if (r->desc == NULL)
+		goto exit_nomem;
+	snprintf(r->desc, len, *arg ? "%s %s" : "%s", name, arg);
+	f->nr_rules++;
+	return r;
+
+ exit_nomem:
+	ERROR("Memory allocation failure.");
+	return NULL;
+}
+
+static int __parse_types(const char *list, unsigned int *types)
+{
+	unsigned int bits = 0;
+	const char *p = list;
+
+	while (*p) {
+		size_t len = strcspn(p, ",");
+
+		if (len == 4 && !strncmp(p, "file", 4))
+			bits |= TYPE_FILE;
+		else if (len == 7 && !strncmp(p, "symlink", 7))
+			bits |= TYPE_SYMLINK;
+		else if (len == 5 && !strncmp(p, "other", 5))
+			bits |= TYPE_OTHER;
+		else
+			return -1;
+
+		p += len;
+		if (*p == ',')
+			p++;
+	}
+	if (!bits)
+		return -1;
+	*types = bits;
+	return 0;
+}
+
+static inline unsigned int __type_bit(mode_t mode)
+{
+	if (S_ISREG(mode))
+		return TYPE_FILE;
+	if (S_ISLNK(mode))
+		return TYPE_SYMLINK;
+	return TYPE_OTHER;
+}
+
+static const char *const rule_names[] = {
+	[DM_RULE_EXCLUDE] = "exclude",
+	[DM_RULE_EXCLUDE_REGEX] = "exclude_regex",
+	[DM_RULE_INCLUDE] = "include",
+	[DM_RULE_INCLUDE_REGEX] = "include_regex",
+	[DM_RULE_MIN_SIZE] = "min_size",
+	[DM_RULE_MAX_SIZE] = "max_size",
+	[DM_RULE_TYPES] = "types",
+};
+
+int dm_filter_create(struct dm_filter **out)
+{
+	struct dm_filter *f = calloc(1, sizeof(struct dm_filter));
+
+	if (f == NULL) {
+		ERROR("Memory allocation failure.");
+		return -1;
+	}
+	f->refs = 1;
+	f->not_included = -1;
+	f->min_rule = f->max_rule = f->types_rule = -1;
+	*out = f;
+	return 0;
+}
+
+int dm_filter_add(struct dm_filter *f, unsigned int type, const char *arg)
+{
+	unsigned int types = 0;
+	unsigned long long size = 0;
+	struct rule *r;
+	char *end;
+	int n;
+
+	if (type > DM_RULE_TYPES)
+		return -1;
+
+	/* Checked before anything is added */
+	switch (type) {
+	case DM_RULE_MIN_SIZE:
+	case DM_RULE_MAX_SIZE:
+		size = strtoull(arg, &end, 0);
+		if (!*arg || *end)
+			goto exit_invalid;
+		break;
+	case DM_RULE_TYPES:
+		if (__parse_types(arg, &types) != 0)
+			goto exit_invalid;
+		break;
+	case DM_RULE_INCLUDE:
+	case DM_RULE_INCLUDE_REGEX:
+		if (f->not_included == -1) {
+			if (__rule_new(f, type, "not included", "") == NULL)
+				return -1;
+			f->not_included = f->nr_rules - 1;
+		}
+		break;
+	}
+
+	r = __rule_new(f, type, rule_names[type], arg);
+	if (r == NULL)
+		return -1;
+	n = f->nr_rules - 1;
+
+	switch (type) {
+	case DM_RULE_EXCLUDE:
+	case DM_RULE_INCLUDE:
+		r->glob = r->desc + strlen(rule_names[type]) + 1;
+		r->path = strchr(r->glob, '/') != NULL;
+		break;
+	case DM_RULE_EXCLUDE_REGEX:
+	case DM_RULE_INCLUDE_REGEX:
+		if (regcomp(&r->regex, arg, REG_EXTENDED | REG_NOSUB) != 0) {
+			f->nr_rules--;
+			free(r->desc);
+			goto exit_invalid;
+		}
+		r->has_regex = 1;
+		break;
+	case DM_RULE_MIN_SIZE:
+		f->min_size = size;
+		f->min_rule = n;
+		return 0;
+	case DM_RULE_MAX_SIZE:
+		f->max_size = size;
+		f->max_rule = n;
+		return 0;
+	case DM_RULE_TYPES:
+		f->types = types;
+		f->types_rule = n;
+		return 0;
+	}
+
+	if (type == DM_RULE_EXCLUDE || type == DM_RULE_EXCLUDE_REGEX)
+		return __matcher_add(f, &f->exclude, n);
+	return __matcher_add(f, &f->include, n);
+
+ exit_invalid:
+	ERROR("Invalid filter rule %s '%s'.", rule_names[type], arg);
+	return -1;
+}
+
+struct dm_filter *dm_filter_get(struct dm_filter *f)
+{
+	if (f)
+		__atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+	return f;
+}
+
+void dm_filter_put(struct dm_filter *f)
+{
+	unsigned int i;
+
+	if (f == NULL || __atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	for (i = 0; i < f->nr_rules; i++) {
+		if (f->rules[i].has_regex)
+			regfree(&f->rules[i].regex);
+		free(f->rules[i].desc);
+	}
+	free(f->rules);
+	__matcher_release(&f->exclude);
+	__matcher_release(&f->include);
+	free(f);
+}
+
+int dm_filter_needs_stat(const struct dm_filter *f)
+{
+	return f->min_rule != -1 || f->max_rule != -1 || f->types_rule != -1;
+}
+
+unsigned int dm_filter_nr_rules(const struct dm_filter *f)
+{
+	return f->nr_rules;
+}
+
+const char *dm_filter_rule(const struct dm_filter *f, unsigned int rule)
+{
+	return f->rules[rule].desc;
+}
+
+int dm_filter_match_name(const struct dm_filter *f, const char *name)
+{
+	const char *base = strrchr(name, '/');
+	size_t base_len;
+	int rule;
+
+	base = base ? base + 1 : name;
+	base_len = strlen(base);
+
+	if (f->exclude.nr_rules) {
+		rule = __matcher_match(f, &f->exclude, name, base, base_len);
+		if (rule != -1)
+			return rule;
+	}
+	if (f->include.nr_rules &&
+	    __matcher_match(f, &f->include, name, base, base_len) == -1)
+		return f->not_included;
+	return -1;
+}
+
+int dm_filter_match_stat(const struct dm_filter *f, const struct stat *st)
+{
+	if (f->types_rule != -1 && !(f->types & __type_bit(st->st_mode)))
+		return f->types_rule;
+	if (S_ISREG(st->st_mode)) {
+		if (f->min_rule != -1 && (uint64_t)st->st_size < f->min_size)
+			return f->min_rule;
+		if (f->max_rule != -1 && (uint64_t)st->st_size > f->max_size)
+			return f->max_rule;
+	}
+	return -1;
+}
@@ -0,0 +1,111 @@
+#ifndef DM_FILTER_H_INCLUDED
+#define DM_FILTER_H_INCLUDED
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+/* Filter rules */
+enum dm_rule_type {
+	/* Glob; names matching it are dropped */
+	DM_RULE_EXCLUDE,
+	/* POSIX extended regular expression; same */
+	DM_RULE_EXCLUDE_REGEX,
+	/* Glob; once there is one, names matching none are dropped */
+	DM_RULE_INCLUDE,
+	/* POSIX extended regular expression; same */
+	DM_RULE_INCLUDE_REGEX,
+	/* Files smaller than this many bytes are dropped */
+	DM_RULE_MIN_SIZE,
+	/* Files larger than this many bytes are dropped */
+	DM_RULE_MAX_SIZE,
+	/* Comma separated list of file types kept: file, symlink, other */
+	DM_RULE_TYPES,
+};
+
+struct dm_filter;
+
+/**
+ * Compiled include/exclude rules of a directory. Globs without '/' apply
+ * to the last path component, globs with '/' and regular expressions to
+ * the path relative to the monitored directory.
+ * Literal names, "*<suffix>" and "<prefix>*" globs, the usual editor and
+ * download leftovers, are looked up in prefix and suffix tries walked once
+ * per name; other globs go to fnmatch() and regular expressions to
+ * regexec(). Size and type rules only apply to files which still exist.
+ *
+ * A filter is immutable once rules are added and shared by reference
+ * between the settings copied around and the monitors using it.
+ */
+
+/**
+ * This function creates an empty filter, which lets every name pass.
+ *
+ * @param: out	Storage location to keep allocated filter.
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_filter_create(struct dm_filter **out);
+
+/**
+ * This function compiles a rule into the filter. Rules must all be added
+ * before the filter is shared.
+ *
+ * @param: f	A valid filter.
+ * @param: type	enum dm_rule_type.
+ * @param: arg	Pattern, size or type list of the rule.
+ * @return: 0 on success or -1 when the rule is invalid or on failure.
+ */
+int dm_filter_add(struct dm_filter *f, unsigned int type, const char *arg);
+
+/* Take a reference; NULL is passed through */
+struct dm_filter *dm_filter_get(struct dm_filter *f);
+
+/* Drop a reference, freeing the filter with the last one; NULL is ignored */
+void dm_filter_put(struct dm_filter *f);
+
+/**
+ * This function tells whether size or type rules need the file status.
+ *
+ * @param: f	A valid filter.
+ * @return: 1 if so, 0 otherwise.
+ */
+int dm_filter_needs_stat(const struct dm_filter *f);
+
+/**
+ * This function returns the number of rules drops are counted for: the
+ * rules added and, with include rules, one for names none of them matched.
+ *
+ * @param: f	A valid filter.
+ * @return: Number of rules.
+ */
+unsigned int dm_filter_nr_rules(const struct dm_filter *f);
+
+/**
+ * This function describes a rule, e.g. "exclude *.swp".
+ *
+ * @param: f	A valid filter.
+ * @param: rule	Rule number below dm_filter_nr_rules().
+ * @return: Description, valid as long as the filter.
+ */
+const char *dm_filter_rule(const struct dm_filter *f, unsigned int rule);
+
+/**
+ * This function matches a name against the include and exclude rules,
+ * which need no file status.
+ *
+ * @param: f	A valid filter.
+ * @param: name	Path relative to the monitored directory.
+ * @return: -1 if the name passes, else the number of the rule dropping it.
+ */
+int dm_filter_match_name(const struct dm_filter *f, const char *name);
+
+/**
+ * This function matches the status of a file whose name passed against
+ * the size and type rules.
+ *
+ * @param: f	A valid filter.
+ * @param: st	Status of the file.
+ * @return: -1 if the file passes, else the number of the rule dropping it.
+ */
+int dm_filter_match_stat(const struct dm_filter *f, const struct stat *st);
+
+#endif /* DM_FILTER_H_INCLUDED */
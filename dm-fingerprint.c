@@ -0,0 +1,363 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <sys/stat.h>
+
+#include "dm-fingerprint.h"
+#include "internals.h"
+#include "debug.h"
+
+
+/* Initial number of slots of a cache (power of 2) */
+#define FP_MIN_SLOTS	64
+/* Read size of the digest */
+#define FP_BUFF_SIZE	(64 * 1024)
+
+#define XXH_P1	11400714785074694791ull
+#define XXH_P2	14029467366897019727ull
+#define XXH_P3	1609587929392839161ull
+#define XXH_P4	9650029242287828579ull
+#define XXH_P5	2870177450012600261ull
+
+struct fp_slot {
+	/* Name hash, 0 marks a free slot */
+	uint64_t key;
+	uint64_t ino;
+	uint64_t size;
+	/* Modification time in nanoseconds */
+	uint64_t mtime;
+	uint64_t digest;
+	/* Digest is valid */
+	unsigned int hashed : 1;
+};
+
+/* XXH64 of data coming in pieces */
+struct xxh64_state {
+	uint64_t v[4];
+	uint64_t total;
+	unsigned char mem[32];
+	unsigned int memsize;
+};
+
+static inline uint64_t __rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t __read64(const unsigned char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le64toh(v);
+}
+
+static inline uint32_t __read32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
+
+static inline uint64_t __xxh_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_P2;
+	acc = __rotl64(acc, 31);
+	return acc * XXH_P1;
+}
+
+static inline uint64_t __xxh_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= __xxh_round(0, val);
+	return acc * XXH_P1 + XXH_P4;
+}
+
+static void __xxh64_init(struct xxh64_state *s, uint64_t seed)
+{
+	memset(s, 0, sizeof(*s));
+	s->v[0] = seed + XXH_P1 + XXH_P2;
+	s->v[1] = seed + XXH_P2;
+	s->v[2] = seed;
+	s->v[3] = seed - XXH_P1;
+}
+
+static inline void __xxh64_stripe(struct xxh64_state *s,
+				  const unsigned char *p)
+{
+	s->v[0] = __xxh_round(s->v[0], __read64(p));
+	s->v[1] = __xxh_round(s->v[1], __read64(p + 8));
+	s->v[2] = __xxh_round(s->v[2], __read64(p + 16));
+	s->v[3] = __xxh_round(s->v[3], __read64(p + 24));
+}
+
+static void __xxh64_update(struct xxh64_state *s, const void *data,
+			   size_t len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	const unsigned char *end = p + len;
+
+	s->total += len;
+
+	if (s->memsize + len < 32) {
+		memcpy(s->mem + s->memsize, p, len);
+		s->memsize += len;
+		return;
+	}
+
+	/* Complete the stripe left over by the previous piece */
+	if (s->memsize) {
+		memcpy(s->mem + s->memsize, p, 32 - s->memsize);
+		p += 32 - s->memsize;
+		__xxh64_stripe(s, s->mem);
+		s->memsize = 0;
+	}
+
+	for (; p + 32 <= end; p += 32)
+		__xxh64_stripe(s, p);
+
+	if (p < end) {
+		memcpy(s->mem, p, end - p);
+		s->memsize = end - p;
+	}
+}
+
+static uint64_t __xxh64_digest(const struct xxh64_state *s, uint64_t seed)
+{
+	const unsigned char *p = s->mem;
+	const unsigned char *end = p + s->memsize;
+	uint64_t h;
+
+	if (s->total >= 32) {
+		h = __rotl64(s->v[0], 1) + __rotl64(s->v[1], 7) +
+		    __rotl64(s->v[2], 12) + __rotl64(s->v[3], 18);
+		h = __xxh_merge(h, s->v[0]);
+		h = __xxh_merge(h, s->v[1]);
+		h = __xxh_merge(h, s->v[2]);
+		h = __xxh_merge(h, s->v[3]);
+	} else {
+		h = seed + XXH_P5;
+	}
+	h += s->total;
+
+	for (; p + 8 <= end; p += 8) {
+		h ^= __xxh_round(0, __read64(p));
+		h = __rotl64(h, 27) * XXH_P1 + XXH_P4;
+	}
+	if (p + 4 <= end) {
+		h ^= (uint64_t)__read32(p) * XXH_P1;
+		h = __rotl64(h, 23) * XXH_P2 + XXH_P3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= *p * XXH_P5;
+		h = __rotl64(h, 11) * XXH_P1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+uint64_t dm_xxh64(const void *data, size_t len, uint64_t seed)
+{
+	struct xxh64_state s;
+
+	__xxh64_init(&s, seed);
+	__xxh64_update(&s, data, len);
+	return __xxh64_digest(&s, seed);
+}
+
+/**
+ * This function hashes the content of a file.
+ *
+ * @param: fc		A valid cache.
+ * @param: fd		File open for reading.
+ * @param: size		File size when it was opened.
+ * @param: digest	Storage location for the digest.
+ * @return: 0 on success or -1 when the file could not be read whole.
+ */
+static int __digest(struct dm_fpcache *fc, int fd, uint64_t size,
+		    uint64_t *digest)
+{
+	struct xxh64_state s;
+	uint64_t total = 0;
+	ssize_t rc;
+
+	if (fc->buff == NULL) {
+		fc->buff = malloc(FP_BUFF_SIZE);
+		if (fc->buff == NULL) {
+			ERROR("Memory allocation failure.");
+			return -1;
+		}
+	}
+
+	__xxh64_init(&s, 0);
+	for (;;) {
+		rc = read(fd, fc->buff, FP_BUFF_SIZE);
+		if (rc == -1 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			break;
+		__xxh64_update(&s, fc->buff, rc);
+		total += rc;
+	}
+
+	/* Being written again, the next event brings the final content */
+	if (rc != 0 || total != size)
+		return -1;
+	*digest = __xxh64_digest(&s, 0);
+	return 0;
+}
+
+static inline uint64_t __slot_key(uint64_t key)
+{
+	return key ? key : 1;
+}
+
+static struct fp_slot *__lookup(struct dm_fpcache *fc, uint64_t key)
+{
+	size_t i;
+
+	if (!fc->nr_slots)
+		return NULL;
+
+	for (i = key & (fc->nr_slots - 1); fc->slots[i].key;
+	     i = (i + 1) & (fc->nr_slots - 1))
+		if (fc->slots[i].key == key)
+			return &fc->slots[i];
+	return NULL;
+}
+
+static struct fp_slot *__insert(struct dm_fpcache *fc, uint64_t key)
+{
+	size_t i;
+
+	/* Keep load factor under 1/2 */
+	if ((fc->nr_used + 1) * 2 > fc->nr_slots) {
+		size_t nr_slots = fc->nr_slots ? fc->nr_slots * 2 :
+						 FP_MIN_SLOTS;
+		struct fp_slot *slots = calloc(nr_slots, sizeof(*slots));
+
+		if (slots == NULL) {
+			ERROR("Memory allocation failure.");
+			return NULL;
+		}
+		for (i = 0; i < fc->nr_slots; i++) {
+			size_t j;
+
+			if (!fc->slots[i].key)
+				continue;
+			j = fc->slots[i].key & (nr_slots - 1);
+			while (slots[j].key)
+				j = (j + 1) & (nr_slots - 1);
+			slots[j] = fc->slots[i];
+		}
+		free(fc->slots);
+		fc->slots = slots;
+		fc->nr_slots = nr_slots;
+	}
+
+	i = key & (fc->nr_slots - 1);
+	while (fc->slots[i].key)
+		i = (i + 1) & (fc->nr_slots - 1);
+	fc->slots[i].key = key;
+	fc->nr_used++;
+	return &fc->slots[i];
+}
+
+void dm_fpcache_init(struct dm_fpcache *fc, size_t max_size)
+{
+	memset(fc, 0, sizeof(struct dm_fpcache));
+	fc->max_size = max_size;
+}
+
+void dm_fpcache_release(struct dm_fpcache *fc)
+{
+	free(fc->slots);
+	free(fc->buff);
+	dm_fpcache_init(fc, fc->max_size);
+}
+
+int dm_fpcache_update(struct dm_fpcache *fc, const char *path, uint64_t key)
+{
+	struct fp_slot *slot;
+	struct stat st;
+	uint64_t mtime, digest = 0;
+	int fd, hashed = 0, changed;
+
+	fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+	if (fd == -1)
+		return errno == ENOENT ? -1 : 1;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return 1;
+	}
+	mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ull +
+		st.st_mtim.tv_nsec;
+
+	/*
+	 * A new size tells the file changed without reading it, so files
+	 * growing by appends are never read. mtime has the granularity of the
+	 * kernel tick, so two rewrites in a row may share it: content of a
+	 * file of the same size is compared whenever it can be.
+	 */
+	key = __slot_key(key);
+	slot = __lookup(fc, key);
+	if (slot && slot->size == (uint64_t)st.st_size &&
+	    (uint64_t)st.st_size <= fc->max_size)
+		hashed = __digest(fc, fd, st.st_size, &digest) == 0;
+	close(fd);
+
+	if (slot == NULL) {
+		changed = 1;
+		slot = __insert(fc, key);
+		if (slot == NULL)
+			return 1;
+	} else if (slot->size != (uint64_t)st.st_size) {
+		changed = 1;
+	} else if (hashed) {
+		changed = !slot->hashed || slot->digest != digest;
+	} else {
+		changed = slot->hashed || slot->ino != st.st_ino ||
+			  slot->size != (uint64_t)st.st_size ||
+			  slot->mtime != mtime;
+	}
+
+	slot->ino = st.st_ino;
+	slot->size = st.st_size;
+	slot->mtime = mtime;
+	slot->digest = digest;
+	slot->hashed = hashed;
+	return changed;
+}
+
+void dm_fpcache_remove(struct dm_fpcache *fc, uint64_t key)
+{
+	struct fp_slot *slot = __lookup(fc, __slot_key(key));
+	size_t i, j, home;
+
+	if (slot == NULL)
+		return;
+
+	/* Shift back the entries of the probe sequence behind the hole */
+	i = slot - fc->slots;
+	for (j = (i + 1) & (fc->nr_slots - 1); fc->slots[j].key;
+	     j = (j + 1) & (fc->nr_slots - 1)) {
+		home = fc->slots[j].key & (fc->nr_slots - 1);
+		/* Entry stays if its home lies cyclically in (i, j] */
+		if (i <= j ? (i < home && home <= j) :
+			     (i < home || home <= j))
+			continue;
+		fc->slots[i] = fc->slots[j];
+		i = j;
+	}
+	memset(&fc->slots[i], 0, sizeof(struct fp_slot));
+	fc->nr_used--;
+}
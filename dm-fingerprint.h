@@ -0,0 +1,63 @@
+#ifndef DM_FINGERPRINT_H_INCLUDED
+#define DM_FINGERPRINT_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct fp_slot;
+
+/**
+ * Fingerprints of the files reported by a monitor: inode, size and mtime,
+ * plus a digest of the content for files up to a size limit. A file whose
+ * fingerprint did not change since it was last reported is left out, so
+ * rewriting the same content publishes nothing. Content is only read when
+ * the size is the same as last time, which the size alone cannot decide;
+ * the first such rewrite after a new size is reported, as there is no
+ * digest to compare it with yet. Entries are indexed by name hash with
+ * open addressing.
+ */
+struct dm_fpcache {
+	struct fp_slot *slots;
+	size_t nr_slots;
+	size_t nr_used;
+	/* Content of files up to this size is hashed, 0 = never */
+	size_t max_size;
+	/* Read buffer of the digest, allocated on first use */
+	char *buff;
+};
+
+void dm_fpcache_init(struct dm_fpcache *fc, size_t max_size);
+
+void dm_fpcache_release(struct dm_fpcache *fc);
+
+/**
+ * This function fingerprints a file and records the result.
+ *
+ * @param: fc	A valid cache.
+ * @param: path	Path of the file.
+ * @param: key	Hash of the name reported for the file.
+ * @return: 1 if the file changed or was not known, 0 if it did not change,
+ *	    -1 if it cannot be read any more.
+ */
+int dm_fpcache_update(struct dm_fpcache *fc, const char *path, uint64_t key);
+
+/**
+ * This function forgets a file, e.g. because it was deleted.
+ *
+ * @param: fc	A valid cache.
+ * @param: key	Hash of the name reported for the file.
+ * @return: No return.
+ */
+void dm_fpcache_remove(struct dm_fpcache *fc, uint64_t key);
+
+/**
+ * This function computes the XXH64 digest of a buffer.
+ *
+ * @param: data	Data to hash.
+ * @param: len	Data length in bytes.
+ * @param: seed	Seed of the digest.
+ * @return: Digest.
+ */
+uint64_t dm_xxh64(const void *data, size_t len, uint64_t seed);
+
+#endif /* DM_FINGERPRINT_H_INCLUDED */
@@ -0,0 +1,820 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dm-journal.h"
+#include "dm-stats.h"
+#include "internals.h"
+#include "debug.h"
+
+
+/* Records start after a header block of the segment */
+#define JOURNAL_HEADER_SIZE	64
+/* Smallest segment */
+#define JOURNAL_MIN_SEG_SIZE	(64 * 1024)
+#define CURSOR_FILE		"cursor"
+
+#define journal_len(len) \
+	(((len) + DM_JOURNAL_ALIGN - 1) & ~(size_t)(DM_JOURNAL_ALIGN - 1))
+
+/* Slot of the cursor file; two slots are written in turn */
+struct cursor_slot {
+	uint32_t magic;
+	/* CRC32C of seg, off and seq */
+	uint32_t crc;
+	uint64_t seg;
+	uint64_t off;
+	uint64_t seq;
+};
+
+struct segment {
+	uint64_t id;
+	uint64_t first_seq;
+	int fd;
+	char *base;
+	size_t size;
+	/* Offset following the last record */
+	size_t end;
+	/* Written since the last sync */
+	unsigned int dirty : 1;
+};
+
+struct dm_journal {
+	int dir_fd;
+	int cursor_fd;
+	/* Oldest segment first */
+	struct segment *segs;
+	unsigned int nr_segs;
+	unsigned int max_segs;
+	size_t seg_size;
+	unsigned int fsync;
+	unsigned int fsync_ms;
+	/* Sequence number of the next record */
+	uint64_t next_seq;
+	struct dm_journal_pos cursor;
+	unsigned int cursor_slot;
+	/* Protects all of the above */
+	pthread_mutex_t lock;
+	/* Background sync of DM_FSYNC_INTERVAL */
+	pthread_t tid;
+	pthread_cond_t cond;
+	unsigned int cursor_dirty : 1;
+	unsigned int stop : 1;
+	unsigned int flusher : 1;
+};
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static int crc_hw;
+
+static void __crc_init(void)
+{
+	uint32_t c;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c >> 1) ^ (0x82f63b78 & -(c & 1));
+		crc_table[0][i] = c;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^
+					  crc_table[0][crc_table[j - 1][i] & 0xff];
+#if defined(__x86_64__)
+	crc_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t __crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t c = crc;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		uint64_t v;
+
+		memcpy(&v, p, 8);
+		c = __builtin_ia32_crc32di(c, v);
+	}
+	crc = c;
+	while (len--)
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+	return crc;
+}
+#endif
+
+/* CRC32C (Castagnoli), slicing by 8 or SSE4.2 where available */
+static uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	pthread_once(&crc_once, __crc_init);
+	crc = ~crc;
+#if defined(__x86_64__)
+	if (crc_hw)
+		return ~__crc32c_hw(crc, p, len);
+#endif
+	for (; len >= 8; p += 8, len -= 8) {
+		uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 |
+				     (uint32_t)p[3] << 24);
+
+		crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+		      crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+		      crc_table[3][p[4]] ^ crc_table[2][p[5]] ^
+		      crc_table[1][p[6]] ^ crc_table[0][p[7]];
+	}
+	while (len--)
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+	return ~crc;
+}
+
+static uint32_t __record_crc(const struct dm_journal_record *rec)
+{
+	size_t len = sizeof(*rec) - offsetof(struct dm_journal_record, len);
+
+	return crc32c(0, &rec->len, len + rec->topic_len + rec->payload_len);
+}
+
+static uint64_t __time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t __now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static struct segment *__segment(struct dm_journal *j, uint64_t id)
+{
+	if (!j->nr_segs || id < j->segs[0].id ||
+	    id - j->segs[0].id >= j->nr_segs)
+		return NULL;
+	return &j->segs[id - j->segs[0].id];
+}
+
+static void __segment_name(char *name, size_t size, uint64_t id)
+{
+	snprintf(name, size, "%016llx.seg", (unsigned long long)id);
+}
+
+/**
+ * This function finds the end of the records of a mapped segment. Records
+ * must carry a valid CRC and consecutive sequence numbers.
+ *
+ * @param: seg	Mapped segment.
+ * @return: Sequence number following the last record.
+ */
+static uint64_t __segment_scan(struct segment *seg)
+{
+	uint64_t seq = seg->first_seq;
+	size_t off = JOURNAL_HEADER_SIZE;
+
+	while (off + sizeof(struct dm_journal_record) <= seg->size) {
+		struct dm_journal_record *rec =
+			(struct dm_journal_record *)(seg->base + off);
+
+		if (rec->len < sizeof(*rec) || rec->len > seg->size - off ||
+		    rec->seq != seq ||
+		    sizeof(*rec) + (size_t)rec->topic_len + rec->payload_len >
+		    rec->len || __record_crc(rec) != rec->crc)
+			break;
+		off += rec->len;
+		seq++;
+	}
+	seg->end = off;
+	return seq;
+}
+
+static int __segment_map(struct dm_journal *j, struct segment *seg,
+			 const char *name)
+{
+	struct dm_journal_segment *hdr;
+	struct stat st;
+
+	seg->fd = openat(j->dir_fd, name, O_RDWR | O_CLOEXEC);
+	if (seg->fd == -1) {
+		SYSERR("Failed to open journal segment '%s'.", name);
+		return -1;
+	}
+	if (fstat(seg->fd, &st) == -1 || st.st_size < JOURNAL_MIN_SEG_SIZE) {
+		ERROR("Journal segment '%s' too short.", name);
+		goto exit_close;
+	}
+	seg->size = st.st_size;
+	seg->base = mmap(NULL, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			 seg->fd, 0);
+	if (seg->base == MAP_FAILED) {
+		SYSERR("Failed to map journal segment '%s'.", name);
+		goto exit_close;
+	}
+	hdr = (struct dm_journal_segment *)seg->base;
+	if (hdr->magic != DM_JOURNAL_MAGIC ||
+	    hdr->version != DM_JOURNAL_VERSION || hdr->id != seg->id) {
+		ERROR("Journal segment '%s' invalid.", name);
+		munmap(seg->base, seg->size);
+		goto exit_close;
+	}
+	seg->first_seq = hdr->first_seq;
+	return 0;
+
+ exit_close:
+	close(seg->fd);
+	return -1;
+}
+
+static void __segment_unmap(struct segment *seg)
+{
+	munmap(seg->base, seg->size);
+	close(seg->fd);
+}
+
+/* Create the segment following the newest one; lock held */
+static int __segment_create(struct dm_journal *j, uint64_t id)
+{
+	struct segment *seg = &j->segs[j->nr_segs];
+	struct dm_journal_segment *hdr;
+	char name[32];
+	int rc;
+
+	__segment_name(name, sizeof(name), id);
+	seg->fd = openat(j->dir_fd, name, O_RDWR | O_CREAT | O_TRUNC |
+			 O_CLOEXEC, 0644);
+	if (seg->fd == -1) {
+		SYSERR("Failed to create journal segment '%s'.", name);
+		return -1;
+	}
+	/* Allocate blocks now, not on page faults of the writers */
+	rc = posix_fallocate(seg->fd, 0, j->seg_size);
+	if (rc != 0 && ftruncate(seg->fd, j->seg_size) == -1) {
+		SYSERR("Failed to size journal segment '%s'.", name);
+		goto exit_unlink;
+	}
+	seg->size = j->seg_size;
+	seg->base = mmap(NULL, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			 seg->fd, 0);
+	if (seg->base == MAP_FAILED) {
+		SYSERR("Failed to map journal segment '%s'.", name);
+		goto exit_unlink;
+	}
+
+	hdr = (struct dm_journal_segment *)seg->base;
+	hdr->magic = DM_JOURNAL_MAGIC;
+	hdr->version = DM_JOURNAL_VERSION;
+	hdr->id = id;
+	hdr->first_seq = j->next_seq;
+	seg->id = id;
+	seg->first_seq = j->next_seq;
+	seg->end = JOURNAL_HEADER_SIZE;
+	seg->dirty = 1;
+	j->nr_segs++;
+
+	if (j->fsync != DM_FSYNC_NONE)
+		fsync(j->dir_fd);
+	return 0;
+
+ exit_unlink:
+	close(seg->fd);
+	unlinkat(j->dir_fd, name, 0);
+	return -1;
+}
+
+/* Delete the oldest segment; lock held */
+static void __segment_remove(struct dm_journal *j)
+{
+	char name[32];
+
+	__segment_name(name, sizeof(name), j->segs[0].id);
+	__segment_unmap(&j->segs[0]);
+	if (unlinkat(j->dir_fd, name, 0) == -1)
+		SYSERR("Failed to remove journal segment '%s'.", name);
+	j->nr_segs--;
+	memmove(j->segs, j->segs + 1, j->nr_segs * sizeof(struct segment));
+}
+
+static void __cursor_write(struct dm_journal *j)
+{
+	struct cursor_slot slot;
+
+	slot.magic = DM_JOURNAL_MAGIC;
+	slot.seg = j->cursor.seg;
+	slot.off = j->cursor.off;
+	slot.seq = j->cursor.seq;
+	slot.crc = crc32c(0, &slot.seg, 3 * sizeof(uint64_t));
+
+	j->cursor_slot ^= 1;
+	if (pwrite(j->cursor_fd, &slot, sizeof(slot),
+		   j->cursor_slot * sizeof(slot)) != sizeof(slot))
+		SYSERR("Failed to write journal cursor.");
+	if (j->fsync == DM_FSYNC_ALWAYS)
+		fdatasync(j->cursor_fd);
+	else
+		j->cursor_dirty = 1;
+}
+
+/* Newest valid slot of the cursor file, 0 if none */
+static int __cursor_read(struct dm_journal *j)
+{
+	struct cursor_slot slots[2];
+	ssize_t n;
+	int i, found = 0;
+
+	n = pread(j->cursor_fd, slots, sizeof(slots), 0);
+	for (i = 0; i < 2 && n >= (ssize_t)((i + 1) * sizeof(slots[0])); i++) {
+		if (slots[i].magic != DM_JOURNAL_MAGIC ||
+		    slots[i].crc != crc32c(0, &slots[i].seg,
+					   3 * sizeof(uint64_t)))
+			continue;
+		if (found && slots[i].seq <= j->cursor.seq)
+			continue;
+		j->cursor.seg = slots[i].seg;
+		j->cursor.off = slots[i].off;
+		j->cursor.seq = slots[i].seq;
+		j->cursor_slot = i;
+		found = 1;
+	}
+	return found;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * This function maps the segments found in the journal directory and
+ * finds where the records end. Segments beyond the allowed number and
+ * segments not following their predecessor are deleted. A segment cut
+ * short by a crash leaves a gap in the sequence numbers only.
+ *
+ * @param: j	Journal with directory opened.
+ * @return: 0 on success or -1 on failure.
+ */
+static int __recover(struct dm_journal *j)
+{
+	uint64_t *ids = NULL;
+	size_t nr_ids = 0, size = 0, i;
+	struct dirent *de;
+	DIR *dir;
+	int fd;
+
+	fd = dup(j->dir_fd);
+	if (fd == -1 || (dir = fdopendir(fd)) == NULL) {
+		SYSERR("Failed to list journal directory.");
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		unsigned long long id;
+		int len = 0;
+
+		if (sscanf(de->d_name, "%16llx.seg%n", &id, &len) != 1 ||
+		    len != 20 || de->d_name[len] != '\0')
+			continue;
+		if (nr_ids == size) {
+			uint64_t *tmp;
+
+			size = size ? size * 2 : 16;
+			tmp = realloc(ids, size * sizeof(uint64_t));
+			if (tmp == NULL) {
+				ERROR("Memory allocation failure.");
+				break;
+			}
+			ids = tmp;
+		}
+		ids[nr_ids++] = id;
+	}
+	closedir(dir);
+	qsort(ids, nr_ids, sizeof(uint64_t), cmp_u64);
+
+	for (i = 0; i < nr_ids; i++) {
+		struct segment *seg = &j->segs[j->nr_segs];
+		char name[32];
+
+		__segment_name(name, sizeof(name), ids[i]);
+		seg->id = ids[i];
+		/* Keep the newest ones, and those without gap only */
+		if (nr_ids - i > j->max_segs ||
+		    (j->nr_segs && ids[i] != seg[-1].id + 1) ||
+		    __segment_map(j, seg, name) != 0) {
+			WARN("Dropping journal segment '%s'.", name);
+			unlinkat(j->dir_fd, name, 0);
+			continue;
+		}
+		if (j->nr_segs && seg->first_seq < j->next_seq) {
+			WARN("Dropping journal segment '%s'.", name);
+			__segment_unmap(seg);
+			unlinkat(j->dir_fd, name, 0);
+			continue;
+		}
+		j->next_seq = __segment_scan(seg);
+		j->nr_segs++;
+	}
+	free(ids);
+	return 0;
+}
+
+static void *flusher_thread(void *arg)
+{
+	struct dm_journal *j = (struct dm_journal *)arg;
+	struct timespec ts;
+	int fds[64];
+	unsigned int i, n;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	pthread_mutex_lock(&j->lock);
+	while (!j->stop) {
+		ts.tv_sec += j->fsync_ms / 1000;
+		ts.tv_nsec += (j->fsync_ms % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		while (!j->stop &&
+		       pthread_cond_timedwait(&j->cond, &j->lock, &ts) !=
+		       ETIMEDOUT)
+			;
+		if (j->stop)
+			break;
+
+		/* Sync outside the lock, through descriptors of our own */
+		n = 0;
+		for (i = 0; i < j->nr_segs && n < 63; i++) {
+			if (!j->segs[i].dirty)
+				continue;
+			fds[n] = dup(j->segs[i].fd);
+			if (fds[n] != -1)
+				n++;
+			j->segs[i].dirty = 0;
+		}
+		if (j->cursor_dirty && (fds[n] = dup(j->cursor_fd)) != -1)
+			n++;
+		j->cursor_dirty = 0;
+		pthread_mutex_unlock(&j->lock);
+
+		for (i = 0; i < n; i++) {
+			fdatasync(fds[i]);
+			close(fds[i]);
+		}
+		pthread_mutex_lock(&j->lock);
+	}
+	pthread_mutex_unlock(&j->lock);
+	return NULL;
+}
+
+int dm_journal_open(struct dm_journal **out, const char *dir, size_t seg_size,
+		    unsigned int max_segs, unsigned int fsync,
+		    unsigned int fsync_ms)
+{
+	struct dm_journal *j;
+	pthread_condattr_t attr;
+	struct segment *seg;
+
+	j = calloc(1, sizeof(struct dm_journal));
+	if (j == NULL) {
+		ERROR("Memory allocation failure.");
+		return -1;
+	}
+	j->seg_size = seg_size < JOURNAL_MIN_SEG_SIZE ? JOURNAL_MIN_SEG_SIZE :
+		      (seg_size + 4095) & ~(size_t)4095;
+	j->max_segs = max_segs < 2 ? 2 : max_segs;
+	j->fsync = fsync;
+	j->fsync_ms = fsync_ms ? fsync_ms : 1;
+	j->cursor_fd = -1;
+	pthread_mutex_init(&j->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&j->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+		SYSERR("Failed to create journal directory '%s'.", dir);
+		goto exit_free;
+	}
+	j->dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (j->dir_fd == -1) {
+		SYSERR("Failed to open journal directory '%s'.", dir);
+		goto exit_free;
+	}
+	j->cursor_fd = openat(j->dir_fd, CURSOR_FILE,
+			      O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (j->cursor_fd == -1) {
+		SYSERR("Failed to open journal cursor.");
+		goto exit_close;
+	}
+
+	/* One more for the segment created while the oldest is dropped */
+	j->segs = calloc(j->max_segs + 1, sizeof(struct segment));
+	if (j->segs == NULL) {
+		ERROR("Memory allocation failure.");
+		goto exit_close;
+	}
+	if (__recover(j) != 0)
+		goto exit_unmap;
+
+	if (!__cursor_read(j) && j->nr_segs) {
+		j->cursor.seg = j->segs[0].id;
+		j->cursor.off = JOURNAL_HEADER_SIZE;
+		j->cursor.seq = j->segs[0].first_seq;
+	}
+	if (!j->nr_segs) {
+		/* Sequence numbers go on where the last run stopped */
+		j->next_seq = j->cursor.seq;
+		if (__segment_create(j, j->cursor.seg) != 0)
+			goto exit_unmap;
+		j->cursor.off = JOURNAL_HEADER_SIZE;
+	}
+
+	/* Cursor must point into a segment we have */
+	seg = __segment(j, j->cursor.seg);
+	if (j->cursor.seg < j->segs[0].id ||
+	    j->cursor.seq < j->segs[0].first_seq) {
+		/* Everything kept is unacknowledged */
+		j->cursor.seg = j->segs[0].id;
+		j->cursor.off = JOURNAL_HEADER_SIZE;
+		j->cursor.seq = j->segs[0].first_seq;
+	} else if (seg == NULL || j->cursor.off > seg->end ||
+		   j->cursor.seq > j->next_seq) {
+		/* Acknowledged records are gone */
+		seg = &j->segs[j->nr_segs - 1];
+		j->cursor.seg = seg->id;
+		j->cursor.off = seg->end;
+		j->cursor.seq = j->next_seq;
+	}
+	__cursor_write(j);
+
+	if (j->next_seq != j->cursor.seq)
+		INFO("Journal holds %llu messages to replay",
+		     (unsigned long long)(j->next_seq - j->cursor.seq));
+
+	if (j->fsync == DM_FSYNC_INTERVAL) {
+		if (pthread_create(&j->tid, NULL, flusher_thread, j) != 0) {
+			ERROR("Failed to create thread.");
+			goto exit_unmap;
+		}
+		j->flusher = 1;
+	}
+
+	*out = j;
+	return 0;
+
+ exit_unmap:
+	while (j->nr_segs--)
+		__segment_unmap(&j->segs[j->nr_segs]);
+	free(j->segs);
+ exit_close:
+	if (j->cursor_fd != -1)
+		close(j->cursor_fd);
+	close(j->dir_fd);
+ exit_free:
+	pthread_cond_destroy(&j->cond);
+	pthread_mutex_destroy(&j->lock);
+	free(j);
+	return -1;
+}
+
+void dm_journal_close(struct dm_journal *j)
+{
+	unsigned int i;
+
+	if (j == NULL)
+		return;
+
+	if (j->flusher) {
+		pthread_mutex_lock(&j->lock);
+		j->stop = 1;
+		pthread_cond_signal(&j->cond);
+		pthread_mutex_unlock(&j->lock);
+		pthread_join(j->tid, NULL);
+	}
+
+	for (i = 0; i < j->nr_segs; i++) {
+		if (j->fsync != DM_FSYNC_NONE && j->segs[i].dirty)
+			fdatasync(j->segs[i].fd);
+		__segment_unmap(&j->segs[i]);
+	}
+	if (j->fsync != DM_FSYNC_NONE)
+		fdatasync(j->cursor_fd);
+	close(j->cursor_fd);
+	close(j->dir_fd);
+	free(j->segs);
+	pthread_cond_destroy(&j->cond);
+	pthread_mutex_destroy(&j->lock);
+	free(j);
+}
+
+/**
+ * This function starts a new segment. When the journal is at its size
+ * limit the oldest segment goes, along with the records in it which were
+ * not acknowledged.
+ *
+ * @param: j	A valid journal, lock held.
+ * @return: 0 on success or -1 on failure.
+ */
+static int __roll(struct dm_journal *j)
+{
+	struct segment *last = &j->segs[j->nr_segs - 1];
+	uint64_t id = last->id + 1;
+
+	if (j->fsync == DM_FSYNC_ALWAYS)
+		fdatasync(last->fd);
+	if (__segment_create(j, id) != 0)
+		return -1;
+
+	if (j->nr_segs > j->max_segs) {
+		if (j->cursor.seg <= j->segs[0].id) {
+			uint64_t lost = j->segs[1].first_seq - j->cursor.seq;
+
+			if (lost) {
+				WARN("Journal full, %llu messages lost",
+				     (unsigned long long)lost);
+				dm_stat_add(DM_STAT_JOURNAL_DROPS, lost);
+			}
+			j->cursor.seg = j->segs[1].id;
+			j->cursor.off = JOURNAL_HEADER_SIZE;
+			j->cursor.seq = j->segs[1].first_seq;
+			__cursor_write(j);
+		}
+		__segment_remove(j);
+	}
+	return 0;
+}
+
+int dm_journal_append(struct dm_journal *j, const char *topic,
+		      const void *payload, size_t len)
+{
+	size_t topic_len = strlen(topic);
+	size_t rlen = journal_len(sizeof(struct dm_journal_record) +
+				  topic_len + len);
+	struct dm_journal_record *rec;
+	struct segment *seg;
+	uint64_t start = __now_us();
+
+	/* Room for the record and the zero word ending the segment */
+	if (rlen + JOURNAL_HEADER_SIZE + DM_JOURNAL_ALIGN > j->seg_size ||
+	    rlen > UINT32_MAX) {
+		ERROR("Message too large for the journal.");
+		return -1;
+	}
+
+	pthread_mutex_lock(&j->lock);
+	seg = &j->segs[j->nr_segs - 1];
+	if (seg->end + rlen + DM_JOURNAL_ALIGN > seg->size) {
+		if (__roll(j) != 0) {
+			pthread_mutex_unlock(&j->lock);
+			return -1;
+		}
+		seg = &j->segs[j->nr_segs - 1];
+	}
+
+	/* End mark first, so the record is never followed by stale data */
+	*(uint64_t *)(seg->base + seg->end + rlen) = 0;
+
+	rec = (struct dm_journal_record *)(seg->base + seg->end);
+	rec->len = rlen;
+	rec->seq = j->next_seq;
+	rec->time_us = __time_us();
+	rec->topic_len = topic_len;
+	rec->payload_len = len;
+	memcpy(rec->data, topic, topic_len);
+	memcpy(rec->data + topic_len, payload, len);
+	rec->crc = __record_crc(rec);
+
+	seg->end += rlen;
+	seg->dirty = 1;
+	j->next_seq++;
+	if (j->fsync == DM_FSYNC_ALWAYS)
+		fdatasync(seg->fd);
+	pthread_mutex_unlock(&j->lock);
+
+	dm_hist_add(DM_HIST_JOURNAL_APPEND_US, __now_us() - start);
+	return 0;
+}
+
+struct dm_journal_entry *dm_journal_read(struct dm_journal *j,
+					 struct dm_journal_pos *pos)
+{
+	struct dm_journal_entry *e = NULL;
+	struct dm_journal_record *rec;
+	struct segment *seg;
+
+	pthread_mutex_lock(&j->lock);
+	if (pos->seg < j->segs[0].id || pos->seq < j->segs[0].first_seq) {
+		pos->seg = j->segs[0].id;
+		pos->off = JOURNAL_HEADER_SIZE;
+		pos->seq = j->segs[0].first_seq;
+	}
+	while ((seg = __segment(j, pos->seg)) != NULL && pos->off >= seg->end) {
+		if (seg == &j->segs[j->nr_segs - 1])
+			goto exit;
+		pos->seg++;
+		pos->off = JOURNAL_HEADER_SIZE;
+		pos->seq = seg[1].first_seq;
+	}
+	if (seg == NULL)
+		goto exit;
+
+	rec = (struct dm_journal_record *)(seg->base + pos->off);
+	e = malloc(sizeof(struct dm_journal_entry) + rec->topic_len + 1 +
+		   rec->payload_len);
+	if (e == NULL) {
+		ERROR("Memory allocation failure.");
+		goto exit;
+	}
+	memcpy(e->topic, rec->data, rec->topic_len);
+	e->topic[rec->topic_len] = '\0';
+	e->payload = e->topic + rec->topic_len + 1;
+	memcpy(e->payload, rec->data + rec->topic_len, rec->payload_len);
+	e->len = rec->payload_len;
+	e->seq = rec->seq;
+	e->time_us = rec->time_us;
+
+	pos->off += rec->len;
+	pos->seq = rec->seq + 1;
+	e->next = *pos;
+ exit:
+	pthread_mutex_unlock(&j->lock);
+	return e;
+}
+
+int dm_journal_readable(struct dm_journal *j, const struct dm_journal_pos *pos)
+{
+	int rc;
+
+	pthread_mutex_lock(&j->lock);
+	rc = pos->seq < j->next_seq;
+	pthread_mutex_unlock(&j->lock);
+	return rc;
+}
+
+void dm_journal_cursor(struct dm_journal *j, struct dm_journal_pos *pos)
+{
+	pthread_mutex_lock(&j->lock);
+	*pos = j->cursor;
+	pthread_mutex_unlock(&j->lock);
+}
+
+void dm_journal_commit(struct dm_journal *j, const struct dm_journal_pos *pos)
+{
+	pthread_mutex_lock(&j->lock);
+	if (pos->seq > j->cursor.seq) {
+		j->cursor = *pos;
+		while (j->nr_segs > 1 && j->segs[0].id < pos->seg)
+			__segment_remove(j);
+		__cursor_write(j);
+	}
+	pthread_mutex_unlock(&j->lock);
+}
+
+size_t dm_journal_pending(struct dm_journal *j)
+{
+	size_t count;
+
+	pthread_mutex_lock(&j->lock);
+	count = j->next_seq - j->cursor.seq;
+	pthread_mutex_unlock(&j->lock);
+	return count;
+}
+
+int dm_journal_parse_fsync(const char *str, unsigned int *fsync,
+			   unsigned int *fsync_ms)
+{
+	char *end;
+	unsigned long ms;
+
+	if (!strcmp(str, "none")) {
+		*fsync = DM_FSYNC_NONE;
+	} else if (!strcmp(str, "always")) {
+		*fsync = DM_FSYNC_ALWAYS;
+	} else {
+		ms = strtoul(str, &end, 0);
+		if (end == str || *end != '\0' || !ms) {
+			ERROR("Invalid fsync policy '%s'.", str);
+			return -1;
+		}
+		*fsync = DM_FSYNC_INTERVAL;
+		*fsync_ms = ms;
+	}
+	return 0;
+}
@@ -0,0 +1,184 @@
+#ifndef DM_JOURNAL_H_INCLUDED
+#define DM_JOURNAL_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Durable journal of outgoing messages.
+ *
+ * The journal is a directory of fixed size segment files named after their
+ * number, "<16 hex digits>.seg", each mapped shared and filled with records
+ * from the front. A record which does not fit starts the next segment.
+ * Every record carries a CRC32C and a sequence number, and is followed by
+ * a zero length word, so a scan after a crash stops at the first record
+ * which was not written completely.
+ *
+ * The cursor file holds the position of the first record not acknowledged
+ * yet. Segments wholly before the cursor are deleted; when more than the
+ * allowed number of segments would exist, the oldest one is deleted anyway
+ * and its unacknowledged records are lost.
+ */
+
+#define DM_JOURNAL_MAGIC	0x4c4e524a	/* "JRNL" */
+#define DM_JOURNAL_VERSION	1
+/* Records are aligned to this many bytes */
+#define DM_JOURNAL_ALIGN	8
+
+/* When appended records are forced to disk */
+enum dm_fsync_policy {
+	/* Left to the kernel */
+	DM_FSYNC_NONE,
+	/* By a background thread every interval */
+	DM_FSYNC_INTERVAL,
+	/* On every append and cursor update */
+	DM_FSYNC_ALWAYS,
+};
+
+/* Head of a segment file */
+struct dm_journal_segment {
+	uint32_t magic;
+	uint32_t version;
+	/* Segment number */
+	uint64_t id;
+	/* Sequence number of the first record */
+	uint64_t first_seq;
+};
+
+struct dm_journal_record {
+	/* CRC32C of the record from len to the end of the payload */
+	uint32_t crc;
+	/* Record length including this header, 0 ends the segment */
+	uint32_t len;
+	uint64_t seq;
+	/* Append time in microseconds since the epoch */
+	uint64_t time_us;
+	/* Topic length; topic follows without terminator */
+	uint32_t topic_len;
+	/* Payload length; payload follows the topic */
+	uint32_t payload_len;
+	char data[];
+};
+
+/* Position of a record */
+struct dm_journal_pos {
+	/* Segment number and byte offset in the segment */
+	uint64_t seg;
+	uint64_t off;
+	/* Sequence number of the record */
+	uint64_t seq;
+};
+
+/* Copy of a record */
+struct dm_journal_entry {
+	uint64_t seq;
+	uint64_t time_us;
+	/* Position following the record */
+	struct dm_journal_pos next;
+	size_t len;
+	/* Payload follows topic string */
+	char *payload;
+	char topic[];
+};
+
+struct dm_journal;
+
+/**
+ * This function opens the journal in the given directory, creating it if
+ * needed, and recovers records and cursor left by a previous run.
+ *
+ * @param: out		Storage location to keep allocated journal.
+ * @param: dir		Journal directory.
+ * @param: seg_size	Size of new segments in bytes.
+ * @param: max_segs	Number of segments kept at most, at least 2.
+ * @param: fsync	enum dm_fsync_policy.
+ * @param: fsync_ms	Interval of DM_FSYNC_INTERVAL in milliseconds.
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_journal_open(struct dm_journal **out, const char *dir, size_t seg_size,
+		    unsigned int max_segs, unsigned int fsync,
+		    unsigned int fsync_ms);
+
+/**
+ * This function forces what was written to disk and closes the journal.
+ *
+ * @param: j	A valid journal.
+ * @return: No return.
+ */
+void dm_journal_close(struct dm_journal *j);
+
+/**
+ * This function appends a message. Safe to call from any thread.
+ *
+ * @param: j		A valid journal.
+ * @param: topic	Topic of the message.
+ * @param: payload	Message payload.
+ * @param: len		Payload length in bytes.
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_journal_append(struct dm_journal *j, const char *topic,
+		      const void *payload, size_t len);
+
+/**
+ * This function copies the record at the position and moves the position
+ * past it. A position in a deleted segment moves to the oldest record.
+ *
+ * @param: j	A valid journal.
+ * @param: pos	Position to read from.
+ * @return: Allocated entry, to be freed by the caller, or NULL when there
+ *	    is no record at the position.
+ */
+struct dm_journal_entry *dm_journal_read(struct dm_journal *j,
+					 struct dm_journal_pos *pos);
+
+/**
+ * This function tells whether records follow the position.
+ *
+ * @param: j	A valid journal.
+ * @param: pos	Position.
+ * @return: 1 if so, 0 otherwise.
+ */
+int dm_journal_readable(struct dm_journal *j, const struct dm_journal_pos *pos);
+
+/**
+ * This function returns the cursor, the position of the first record not
+ * acknowledged yet.
+ *
+ * @param: j	A valid journal.
+ * @param: pos	Storage location for the cursor.
+ * @return: No return.
+ */
+void dm_journal_cursor(struct dm_journal *j, struct dm_journal_pos *pos);
+
+/**
+ * This function moves the cursor forward to the position, persists it and
+ * deletes the segments left wholly behind. Positions before the cursor
+ * are ignored.
+ *
+ * @param: j	A valid journal.
+ * @param: pos	Position following the last acknowledged record.
+ * @return: No return.
+ */
+void dm_journal_commit(struct dm_journal *j, const struct dm_journal_pos *pos);
+
+/**
+ * This function returns the number of records not acknowledged yet.
+ *
+ * @param: j	A valid journal.
+ * @return: Number of records.
+ */
+size_t dm_journal_pending(struct dm_journal *j);
+
+/**
+ * This function parses a fsync policy: "none", "always" or an interval in
+ * milliseconds.
+ *
+ * @param: str		Policy.
+ * @param: fsync	Storage location for enum dm_fsync_policy.
+ * @param: fsync_ms	Storage location for the interval.
+ * @return: 0 on success or -1 when the policy is invalid.
+ */
+int dm_journal_parse_fsync(const char *str, unsigned int *fsync,
+			   unsigned int *fsync_ms);
+
+#endif /* DM_JOURNAL_H_INCLUDED */
@@ -1,5 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
 #include <libgen.h>
 #include <pthread.h>
 #include <json-c/json.h>
@@ -7,44 +11,909 @@
 
 #include "dm-manager.h"
 #include "dir-monitor.h"
+#include "dm-config.h"
+#include "dm-payload.h"
+#include "dm-sink.h"
+#include "dm-stats.h"
+#include "dm-filter.h"
+#include "dm-metadata.h"
 #include "internals.h"
 #include "debug.h"
 
 
+/* Names returned by a query unless it asks for another limit */
+#define LIST_DEFAULT_LIMIT	1000
+/* Most names returned by a query */
+#define LIST_MAX_LIMIT		100000
+
+/* Operations of control tasks */
+enum dm_op {
+	DM_OP_START,
+	DM_OP_STOP,
+	DM_OP_RESCAN,
+	DM_OP_LIST_FILES,
+	DM_OP_LIST_DIRS,
+	DM_OP_STATS,
+};
+
+/**
+ * Command taken from the config topic. Its directories are queued as tasks
+ * to the control workers; whoever finishes the last reference publishes
+ * the acknowledgement and frees the command.
+ */
+struct dm_command {
+	/* Parsed message, paths of the tasks point into it; may be NULL */
+	json_object *root;
+	const char *cmd_code;
+	/* "done", "unknown" or "cancelled" */
+	const char *status;
+	/* Queued tasks plus the reference of the submitter */
+	unsigned int nr_refs;
+	unsigned int nr_ok;
+	unsigned int nr_failed;
+	/* Paths of failed tasks */
+	json_object *failed;
+	/* Arrival time in microseconds */
+	uint64_t start_us;
+};
+
+/* One directory of a command */
+struct dm_task {
+	struct dm_command *cmd;
+	enum dm_op op;
+	/* Directory or NULL for all of them */
+	const char *path;
+	struct dir_monitor_config cfg;
+	struct dm_task *next;
+};
+
+/* Control worker with its own FIFO of tasks */
+struct dm_worker {
+	struct dm_manager *dmm;
+	pthread_t tid;
+	pthread_cond_t cond;
+	struct dm_task *head;
+	struct dm_task **tail;
+};
+
 struct dm_manager {
 	/* Maintain list of directory monitoring agent */
 	struct dir_monitor_list *dm_list;
 	/* Mosquitto subscriber to receive commands */
 	struct mosquitto *mosq;
+	/* Settings of directories started without own settings */
+	struct dir_monitor_config defaults;
+	/* Thread publishing statistics periodically */
+	pthread_t stats_tid;
+	pthread_mutex_t stats_lock;
+	pthread_cond_t stats_cond;
+	unsigned int stats_interval_ms;
+	const char *stats_file;
+	unsigned int stats_stop : 1;
+	unsigned int stats_running : 1;
+	/* Workers executing commands; queues are protected by ctl_lock */
+	struct dm_worker *workers;
+	unsigned int nr_workers;
+	pthread_mutex_t ctl_lock;
+	unsigned int ctl_stop : 1;
 };
 
+static uint64_t __now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/* Value of a json string, NULL for null or any other type */
+static inline const char *__json_string(json_object *obj)
+{
+	return json_object_is_type(obj, json_type_string) ?
+	       json_object_get_string(obj) : NULL;
+}
+
+/* Array under the key of an object, NULL if absent or not an array */
+static json_object *__json_array(json_object *obj, const char *key)
+{
+	json_object *arr;
+
+	if (!json_object_object_get_ex(obj, key, &arr))
+		return NULL;
+	if (!json_object_is_type(arr, json_type_array)) {
+		WARN("'%s' is not an array", key);
+		return NULL;
+	}
+	return arr;
+}
+
+/* List rules of a filter object */
+static const struct {
+	const char *key;
+	unsigned int type;
+} filter_lists[] = {
+	{ "exclude", DM_RULE_EXCLUDE },
+	{ "exclude_regex", DM_RULE_EXCLUDE_REGEX },
+	{ "include", DM_RULE_INCLUDE },
+	{ "include_regex", DM_RULE_INCLUDE_REGEX },
+};
+
+/**
+ * This function compiles a filter object:
+ *	{"exclude":[..],"exclude_regex":[..],"include":[..],
+ *	 "include_regex":[..],"min_size":n,"max_size":n,"types":[..]}
+ * Invalid rules are skipped.
+ *
+ * @param: obj	json_object holding the rules.
+ * @return: Filter or NULL when it has no rules or on failure.
+ */
+static struct dm_filter *__parse_filter(json_object *obj)
+{
+	struct dm_filter *filter;
+	json_object *tmp;
+	char buff[64];
+	size_t i;
+	int j;
+
+	if (!json_object_is_type(obj, json_type_object) ||
+	    dm_filter_create(&filter) != 0)
+		return NULL;
+
+	for (i = 0; i < ARRAY_SIZE(filter_lists); i++) {
+		tmp = __json_array(obj, filter_lists[i].key);
+		for (j = 0; tmp && j < (int)json_object_array_length(tmp);
+		     j++) {
+			const char *arg = __json_string(
+				json_object_array_get_idx(tmp, j));
+
+			if (arg == NULL ||
+			    dm_filter_add(filter, filter_lists[i].type,
+					  arg) != 0)
+				WARN("Filter rule skipped");
+		}
+	}
+
+	if (json_object_object_get_ex(obj, "min_size", &tmp)) {
+		snprintf(buff, sizeof(buff), "%lld",
+			 (long long)json_object_get_int64(tmp));
+		dm_filter_add(filter, DM_RULE_MIN_SIZE, buff);
+	}
+	if (json_object_object_get_ex(obj, "max_size", &tmp)) {
+		snprintf(buff, sizeof(buff), "%lld",
+			 (long long)json_object_get_int64(tmp));
+		dm_filter_add(filter, DM_RULE_MAX_SIZE, buff);
+	}
+	tmp = __json_array(obj, "types");
+	if (tmp) {
+		size_t len = 0;
+
+		/* Array of type names, kept as one rule */
+		buff[0] = '\0';
+		for (j = 0; j < (int)json_object_array_length(tmp); j++) {
+			const char *type = __json_string(
+				json_object_array_get_idx(tmp, j));
+
+			if (type)
+				len += snprintf(buff + len, sizeof(buff) - len,
+						"%s%s", len ? "," : "", type);
+			if (len >= sizeof(buff))
+				break;
+		}
+		if (len >= sizeof(buff) ||
+		    dm_filter_add(filter, DM_RULE_TYPES, buff) != 0)
+			WARN("Filter rule skipped");
+	}
+
+	if (!dm_filter_nr_rules(filter)) {
+		dm_filter_put(filter);
+		return NULL;
+	}
+	return filter;
+}
 
 /**
- * This function fetches directories from the json list object and modifies the
- * directory monitor agent list depending on the flag passed.
+ * This function reads per-directory settings from a json object. Keys
+ * which are not present keep their current value.
  *
- * @param: obj		json_object array type.
- * @param: do_remove	Flag to control modification of list. 0-add,1-remove.
- * @param: dm_list	List containing monitoring agents.
+ * @param: obj	json_object holding the settings.
+ * @param: cfg	Settings to update.
  * @return: No return.
  */
-static void __modify_dir_monitor_list(json_object *obj, unsigned int do_remove,
-				      struct dir_monitor_list *dm_list)
+static void __parse_dir_options(json_object *obj, struct dir_monitor_config *cfg)
 {
-	int len = json_object_array_length(obj);
+	json_object *batch, *debounce, *fingerprint, *moves, *metadata, *rate;
+	json_object *tmp;
+
+	if (json_object_object_get_ex(obj, "recursive", &tmp))
+		cfg->recursive = json_object_get_boolean(tmp);
+	if (json_object_object_get_ex(obj, "coalesce", &tmp))
+		cfg->coalesce = json_object_get_boolean(tmp);
+	if (json_object_object_get_ex(obj, "backend", &tmp)) {
+		const char *backend = __json_string(tmp);
+
+		if (backend == NULL)
+			WARN("Backend is not a string");
+		else if (!strcmp(backend, "fanotify"))
+			cfg->backend = DM_BACKEND_FANOTIFY;
+		else if (!strcmp(backend, "inotify"))
+			cfg->backend = DM_BACKEND_INOTIFY;
+		else
+			WARN("Unknown backend '%s'", backend);
+	}
+	if (json_object_object_get_ex(obj, "encoding", &tmp)) {
+		const char *encoding = __json_string(tmp);
+
+		if (encoding == NULL)
+			WARN("Encoding is not a string");
+		else if (!strcmp(encoding, "binary"))
+			cfg->format = DM_PAYLOAD_BINARY;
+		else if (!strcmp(encoding, "json"))
+			cfg->format = DM_PAYLOAD_JSON;
+		else
+			WARN("Unknown encoding '%s'", encoding);
+	}
+	if (json_object_object_get_ex(obj, "snapshot", &tmp))
+		cfg->snapshot = json_object_get_boolean(tmp);
+	if (json_object_object_get_ex(obj, "completed", &tmp))
+		cfg->completed = json_object_get_boolean(tmp);
+	tmp = __json_array(obj, "sinks");
+	if (tmp) {
+		unsigned int sinks = 0;
+		int i, type, len = json_object_array_length(tmp);
+
+		/* Array of sink names; unknown names are skipped */
+		for (i = 0; i < len; i++) {
+			const char *name = __json_string(
+				json_object_array_get_idx(tmp, i));
+
+			type = name ? dm_sink_type(name) : -1;
+			if (type < 0)
+				WARN("Unknown sink '%s'", name ? name : "");
+			else
+				sinks |= DM_SINK_BIT(type);
+		}
+		if (sinks)
+			cfg->sinks = sinks;
+	}
+
+	if (json_object_object_get_ex(obj, "batch", &batch)) {
+		if (json_object_object_get_ex(batch, "quiet_ms", &tmp))
+			cfg->quiet_ms = json_object_get_int(tmp);
+		if (json_object_object_get_ex(batch, "max_delay_ms", &tmp))
+			cfg->max_delay_ms = json_object_get_int(tmp);
+		if (json_object_object_get_ex(batch, "max_events", &tmp))
+			cfg->max_events = json_object_get_int(tmp);
+		if (json_object_object_get_ex(batch, "max_bytes", &tmp))
+			cfg->max_bytes = json_object_get_int(tmp);
+		if (json_object_object_get_ex(batch, "max_payload", &tmp))
+			cfg->max_payload = json_object_get_int(tmp);
+	}
+
+	if (json_object_object_get_ex(obj, "debounce", &debounce)) {
+		if (json_object_object_get_ex(debounce, "window_ms", &tmp))
+			cfg->debounce_ms = json_object_get_int(tmp);
+		if (json_object_object_get_ex(debounce, "max_ms", &tmp))
+			cfg->debounce_max_ms = json_object_get_int(tmp);
+	}
+
+	/* Replaces the filter of the defaults; null drops it */
+	if (json_object_object_get_ex(obj, "filter", &tmp)) {
+		dm_filter_put(cfg->filter);
+		cfg->filter = __parse_filter(tmp);
+	}
+
+	/* true, false or the settings of move pairing */
+	if (json_object_object_get_ex(obj, "moves", &moves)) {
+		if (json_object_is_type(moves, json_type_object)) {
+			cfg->moves = 1;
+			if (json_object_object_get_ex(moves, "timeout_ms", &tmp))
+				cfg->move_timeout_ms = json_object_get_int(tmp);
+		} else {
+			cfg->moves = json_object_get_boolean(moves);
+		}
+	}
+
+	/* true, false or the settings of the fingerprint */
+	if (json_object_object_get_ex(obj, "fingerprint", &fingerprint)) {
+		if (json_object_is_type(fingerprint, json_type_object)) {
+			cfg->fingerprint = 1;
+			if (json_object_object_get_ex(fingerprint, "max_size",
+						      &tmp))
+				cfg->fingerprint_max_size =
+					json_object_get_int(tmp);
+		} else {
+			cfg->fingerprint = json_object_get_boolean(fingerprint);
+		}
+	}
+
+	/* true, false or the settings of the file metadata */
+	if (json_object_object_get_ex(obj, "metadata", &metadata)) {
+		if (json_object_is_type(metadata, json_type_object)) {
+			cfg->metadata = 1;
+			if (json_object_object_get_ex(metadata, "ttl_ms", &tmp))
+				cfg->metadata_ttl_ms = json_object_get_int(tmp);
+		} else {
+			cfg->metadata = json_object_get_boolean(metadata);
+		}
+	}
+
+	/* Names per second, 0 = off, or the settings of the rate limit */
+	if (json_object_object_get_ex(obj, "rate_limit", &rate)) {
+		if (json_object_is_type(rate, json_type_object)) {
+			if (json_object_object_get_ex(rate, "per_sec", &tmp))
+				cfg->rate_limit = json_object_get_int(tmp);
+			if (json_object_object_get_ex(rate, "burst", &tmp))
+				cfg->rate_burst = json_object_get_int(tmp);
+			if (json_object_object_get_ex(rate, "sample", &tmp))
+				cfg->summary_sample = json_object_get_int(tmp);
+		} else {
+			cfg->rate_limit = json_object_get_int(rate);
+		}
+	}
+}
+
+/**
+ * This function publishes the acknowledgement of a finished command:
+ *	{"cmd_code":..,"id":..,"status":..,"ok":n,"failed":n,
+ *	 "failed_dirs":[..],"elapsed_us":n}
+ * "id" is copied from the command when it has one.
+ *
+ * @param: dmm	A valid dm manager object.
+ * @param: cmd	Finished command.
+ * @return: No return.
+ */
+static void __command_ack(struct dm_manager *dmm, struct dm_command *cmd)
+{
+	json_object *ack, *id;
+	const char *s;
+
+	ack = json_object_new_object();
+	if (ack == NULL)
+		return;
+	json_object_object_add(ack, "cmd_code",
+			       json_object_new_string(cmd->cmd_code));
+	if (cmd->root && json_object_object_get_ex(cmd->root, "id", &id))
+		json_object_object_add(ack, "id", json_object_get(id));
+	json_object_object_add(ack, "status",
+			       json_object_new_string(cmd->status));
+	json_object_object_add(ack, "ok", json_object_new_int64(cmd->nr_ok));
+	json_object_object_add(ack, "failed",
+			       json_object_new_int64(cmd->nr_failed));
+	json_object_object_add(ack, "failed_dirs",
+			       json_object_get(cmd->failed));
+	json_object_object_add(ack, "elapsed_us",
+			       json_object_new_int64(__now_us() -
+						     cmd->start_us));
+
+	s = json_object_to_json_string(ack);
+	if (dir_monitor_list_publish(dmm->dm_list, TOPIC_ACK, s,
+				     strlen(s)) != 0)
+		DEBUG("Acknowledgement dropped");
+	json_object_put(ack);
+}
+
+static struct dm_command *__command_new(json_object *root,
+					const char *cmd_code)
+{
+	struct dm_command *cmd = calloc(1, sizeof(struct dm_command));
+
+	if (cmd == NULL) {
+		ERROR("Memory allocation failure.");
+		return NULL;
+	}
+	cmd->failed = json_object_new_array();
+	if (cmd->failed == NULL) {
+		ERROR("Memory allocation failure.");
+		free(cmd);
+		return NULL;
+	}
+	cmd->root = root;
+	cmd->cmd_code = cmd_code;
+	cmd->status = "done";
+	cmd->nr_refs = 1;
+	cmd->start_us = __now_us();
+	return cmd;
+}
+
+/**
+ * This function drops a reference of the command. The last one publishes
+ * the acknowledgement and frees the command along with its message.
+ *
+ * @param: dmm	A valid dm manager object.
+ * @param: cmd	Command.
+ * @return: No return.
+ */
+static void __command_put(struct dm_manager *dmm, struct dm_command *cmd)
+{
+	unsigned int refs;
+
+	pthread_mutex_lock(&dmm->ctl_lock);
+	refs = --cmd->nr_refs;
+	pthread_mutex_unlock(&dmm->ctl_lock);
+	if (refs)
+		return;
+
+	__command_ack(dmm, cmd);
+	json_object_put(cmd->failed);
+	json_object_put(cmd->root);
+	free(cmd);
+}
+
+/**
+ * This function records the result of a task of the command.
+ *
+ * @param: dmm	A valid dm manager object.
+ * @param: cmd	Command.
+ * @param: path	Directory of the task, may be NULL.
+ * @param: rc	0 when the task succeeded.
+ * @return: No return.
+ */
+static void __command_result(struct dm_manager *dmm, struct dm_command *cmd,
+			     const char *path, int rc)
+{
+	pthread_mutex_lock(&dmm->ctl_lock);
+	if (rc == 0) {
+		cmd->nr_ok++;
+	} else {
+		cmd->nr_failed++;
+		if (path)
+			json_object_array_add(cmd->failed,
+					      json_object_new_string(path));
+	}
+	pthread_mutex_unlock(&dmm->ctl_lock);
+}
+
+/**
+ * This function queues a task to a control worker. Tasks of the same path
+ * always go to the same worker, so commands on one directory are executed
+ * in the order they arrived while different directories run in parallel.
+ *
+ * @param: dmm	A valid dm manager object.
+ * @param: cmd	Command the task belongs to.
+ * @param: op	Operation.
+ * @param: path	Directory or NULL for all of them.
+ * @param: cfg	Settings of the directory, may be NULL.
+ * @return: No return.
+ */
+static void __queue_task(struct dm_manager *dmm, struct dm_command *cmd,
+			 enum dm_op op, const char *path,
+			 const struct dir_monitor_config *cfg)
+{
+	struct dm_task *task = malloc(sizeof(struct dm_task));
+	struct dm_worker *w;
+
+	if (task == NULL) {
+		ERROR("Memory allocation failure.");
+		__command_result(dmm, cmd, path, -1);
+		return;
+	}
+	task->cmd = cmd;
+	task->op = op;
+	task->path = path;
+	task->cfg = cfg ? *cfg : dmm->defaults;
+	dm_filter_get(task->cfg.filter);
+	task->next = NULL;
+
+	w = &dmm->workers[path ? hash_str64(path, strlen(path)) %
+			  dmm->nr_workers : 0];
+
+	pthread_mutex_lock(&dmm->ctl_lock);
+	cmd->nr_refs++;
+	*w->tail = task;
+	w->tail = &task->next;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&dmm->ctl_lock);
+}
+
+/**
+ * This function answers a list_files or list_dirs query, listing names in
+ * order from the in-memory snapshots. The reply goes to the "reply_to"
+ * topic of the command, DIR_MONITOR/response by default:
+ *	{"cmd_code":..,"id":..,"directory":..,"files":[..],"next":..}
+ * with "dirs" instead of "files" for list_dirs. "next" is present when
+ * names were left out for the limit; given as "after" in the next query,
+ * it continues the listing.
+ *
+ * @param: dmm	A valid dm manager object.
+ * @param: cmd	Command carrying the query.
+ * @param: path	Directory of list_files, NULL for list_dirs.
+ * @return: 0 on success or -1 on failure.
+ */
+static int __list_reply(struct dm_manager *dmm, struct dm_command *cmd,
+			const char *path)
+{
+	const char *prefix = NULL, *after = NULL, *topic = TOPIC_RESPONSE;
+	unsigned int limit = LIST_DEFAULT_LIMIT;
+	struct dm_namelist names;
+	json_object *msg, *tmp, *reply, *arr;
+	const char *s, *name = NULL;
+	int more = 0, rc;
+	unsigned int i;
+
+	if (json_object_object_get_ex(cmd->root, "msg", &msg)) {
+		if (json_object_object_get_ex(msg, "prefix", &tmp))
+			prefix = __json_string(tmp);
+		if (json_object_object_get_ex(msg, "after", &tmp))
+			after = __json_string(tmp);
+		if (json_object_object_get_ex(msg, "limit", &tmp) &&
+		    json_object_get_int(tmp) > 0)
+			limit = json_object_get_int(tmp);
+	}
+	if (limit > LIST_MAX_LIMIT)
+		limit = LIST_MAX_LIMIT;
+	if (json_object_object_get_ex(cmd->root, "reply_to", &tmp) &&
+	    __json_string(tmp))
+		topic = __json_string(tmp);
+
+	memset(&names, 0, sizeof(names));
+	if (path)
+		rc = dir_monitor_list_files(dmm->dm_list, path, prefix, after,
+					    limit, &names, &more);
+	else
+		rc = dir_monitor_list_dirs(dmm->dm_list, prefix, after, limit,
+					   &names, &more);
+	if (rc != 0)
+		goto exit;
+
+	rc = -1;
+	reply = json_object_new_object();
+	arr = json_object_new_array();
+	if (reply == NULL || arr == NULL) {
+		ERROR("Memory allocation failure.");
+		json_object_put(reply);
+		json_object_put(arr);
+		goto exit;
+	}
+	json_object_object_add(reply, "cmd_code",
+			       json_object_new_string(cmd->cmd_code));
+	if (json_object_object_get_ex(cmd->root, "id", &tmp))
+		json_object_object_add(reply, "id", json_object_get(tmp));
+	if (path)
+		json_object_object_add(reply, "directory",
+				       json_object_new_string(path));
+	for (i = 0, s = names.buff; i < names.nr; i++, s += strlen(s) + 1) {
+		json_object_array_add(arr, json_object_new_string(s));
+		name = s;
+	}
+	json_object_object_add(reply, path ? "files" : "dirs", arr);
+	if (more && name)
+		json_object_object_add(reply, "next",
+				       json_object_new_string(name));
+
+	s = json_object_to_json_string(reply);
+	rc = dir_monitor_list_publish(dmm->dm_list, topic, s, strlen(s));
+	if (rc != 0)
+		DEBUG("Reply to '%s' dropped", cmd->cmd_code);
+	json_object_put(reply);
+exit:
+	dm_namelist_release(&names);
+	return rc;
+}
+
+/**
+ * This function publishes the statistics on DIR_MONITOR/stats and, when
+ * asked for, writes them to the Prometheus text file.
+ *
+ * @param: dmm		A valid dm manager object.
+ * @param: to_file	Write the text file as well.
+ * @return: 0 on success or -1 on failure.
+ */
+static int __publish_stats(struct dm_manager *dmm, int to_file)
+{
+	struct dm_stats st;
+	char *json;
+	int rc = -1;
+
+	memset(&st, 0, sizeof(st));
+	if (dir_monitor_list_stats(dmm->dm_list, &st) != 0)
+		goto exit;
+
+	json = dm_stats_json(&st);
+	if (json == NULL ||
+	    dir_monitor_list_publish(dmm->dm_list, TOPIC_STATS, json,
+				     strlen(json)) != 0)
+		DEBUG("Statistics message dropped");
+	else
+		rc = 0;
+	free(json);
+
+	if (to_file && dmm->stats_file)
+		dm_stats_prometheus(&st, dmm->stats_file);
+ exit:
+	dm_stats_release(&st);
+	return rc;
+}
+
+static void __run_task(struct dm_manager *dmm, struct dm_task *task)
+{
+	int rc = -1;
+
+	switch (task->op) {
+	case DM_OP_START:
+		rc = dir_monitor_list_add(dmm->dm_list, task->path,
+					  &task->cfg);
+		break;
+	case DM_OP_STOP:
+		rc = dir_monitor_list_remove(dmm->dm_list, task->path);
+		break;
+	case DM_OP_RESCAN:
+		rc = dir_monitor_list_rescan(dmm->dm_list, task->path);
+		break;
+	case DM_OP_LIST_FILES:
+	case DM_OP_LIST_DIRS:
+		rc = __list_reply(dmm, task->cmd, task->path);
+		break;
+	case DM_OP_STATS:
+		rc = __publish_stats(dmm, 0);
+		break;
+	}
+	__command_result(dmm, task->cmd, task->path, rc);
+	__command_put(dmm, task->cmd);
+	dm_filter_put(task->cfg.filter);
+	free(task);
+}
+
+static void *control_thread(void *arg)
+{
+	struct dm_worker *w = (struct dm_worker *)arg;
+	struct dm_manager *dmm = w->dmm;
+	struct dm_task *task;
+
+	pthread_mutex_lock(&dmm->ctl_lock);
+	for (;;) {
+		while (!dmm->ctl_stop && w->head == NULL)
+			pthread_cond_wait(&w->cond, &dmm->ctl_lock);
+		if (dmm->ctl_stop)
+			break;
+
+		task = w->head;
+		w->head = task->next;
+		if (w->head == NULL)
+			w->tail = &w->head;
+		pthread_mutex_unlock(&dmm->ctl_lock);
+
+		__run_task(dmm, task);
+
+		pthread_mutex_lock(&dmm->ctl_lock);
+	}
+	pthread_mutex_unlock(&dmm->ctl_lock);
+	return NULL;
+}
+
+static int __control_start(struct dm_manager *dmm, unsigned int nr_workers)
+{
+	unsigned int i;
+
+	dmm->ctl_stop = 0;
+	dmm->nr_workers = 0;
+	pthread_mutex_init(&dmm->ctl_lock, NULL);
+
+	if (!nr_workers)
+		nr_workers = 1;
+	dmm->workers = calloc(nr_workers, sizeof(struct dm_worker));
+	if (dmm->workers == NULL) {
+		ERROR("Memory allocation failure.");
+		return -1;
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		struct dm_worker *w = &dmm->workers[i];
+
+		w->dmm = dmm;
+		w->tail = &w->head;
+		pthread_cond_init(&w->cond, NULL);
+		if (pthread_create(&w->tid, NULL, control_thread, w) != 0) {
+			ERROR("Failed to create thread.");
+			pthread_cond_destroy(&w->cond);
+			break;
+		}
+		dmm->nr_workers++;
+	}
+	return dmm->nr_workers ? 0 : -1;
+}
+
+/**
+ * This function stops the control workers once their current task is
+ * done. Tasks still queued are not executed and their commands are
+ * acknowledged as cancelled.
+ *
+ * @param: dmm	A valid dm manager object.
+ * @return: No return.
+ */
+static void __control_stop(struct dm_manager *dmm)
+{
+	struct dm_task *task;
+	unsigned int i;
+
+	pthread_mutex_lock(&dmm->ctl_lock);
+	dmm->ctl_stop = 1;
+	for (i = 0; i < dmm->nr_workers; i++)
+		pthread_cond_signal(&dmm->workers[i].cond);
+	pthread_mutex_unlock(&dmm->ctl_lock);
+
+	for (i = 0; i < dmm->nr_workers; i++)
+		pthread_join(dmm->workers[i].tid, NULL);
+
+	for (i = 0; i < dmm->nr_workers; i++) {
+		struct dm_worker *w = &dmm->workers[i];
+
+		while ((task = w->head) != NULL) {
+			w->head = task->next;
+			task->cmd->status = "cancelled";
+			__command_result(dmm, task->cmd, task->path, -1);
+			__command_put(dmm, task->cmd);
+			dm_filter_put(task->cfg.filter);
+			free(task);
+		}
+		pthread_cond_destroy(&w->cond);
+	}
+	free(dmm->workers);
+	pthread_mutex_destroy(&dmm->ctl_lock);
+}
+
+/**
+ * This function fetches directories from the json message object and queues
+ * a task per directory to add it to or remove it from the directory monitor
+ * list. Directories are given either by name or as object with "path" and
+ * own settings which override the settings given for the whole message.
+ *
+ * @param: msg	json_object holding "directories" array.
+ * @param: op	DM_OP_START or DM_OP_STOP.
+ * @param: cmd	Command the tasks belong to.
+ * @param: dmm	A valid dm manager object.
+ * @return: No return.
+ */
+static void __modify_dir_monitor_list(json_object *msg, enum dm_op op,
+				      struct dm_command *cmd,
+				      struct dm_manager *dmm)
+{
+	struct dir_monitor_config msg_cfg = dmm->defaults;
+	json_object *dirs;
 	register int i;
+	int len;
+
+	if (!json_object_object_get_ex(msg, "directories", &dirs))
+		return;
+	if (!json_object_is_type(dirs, json_type_array)) {
+		DEBUG("Directories are not an array");
+		__command_result(dmm, cmd, NULL, -1);
+		return;
+	}
+	len = json_object_array_length(dirs);
+
+	/* Copies own a reference to their filter */
+	dm_filter_get(msg_cfg.filter);
+	__parse_dir_options(msg, &msg_cfg);
 
 	for (i = 0; i < len; i++) {
-		json_object *tmp = json_object_array_get_idx(obj, i);
-		if (do_remove)
-			dir_monitor_list_remove(dm_list,
-						json_object_get_string(tmp));
+		json_object *tmp = json_object_array_get_idx(dirs, i);
+		struct dir_monitor_config cfg = msg_cfg;
+		const char *path = __json_string(tmp);
+
+		dm_filter_get(cfg.filter);
+
+		if (json_object_is_type(tmp, json_type_object)) {
+			json_object *obj;
+
+			path = json_object_object_get_ex(tmp, "path", &obj) ?
+			       __json_string(obj) : NULL;
+			__parse_dir_options(tmp, &cfg);
+		}
+
+		if (path == NULL) {
+			DEBUG("Directory without path");
+			__command_result(dmm, cmd, NULL, -1);
+		} else {
+			__queue_task(dmm, cmd, op, path, &cfg);
+		}
+		dm_filter_put(cfg.filter);
+	}
+	dm_filter_put(msg_cfg.filter);
+}
+
+/**
+ * This function queues a rescan of the directories listed in the json
+ * message object, or of all of them when no list is given.
+ *
+ * @param: msg	json_object holding "directories" array, may be NULL.
+ * @param: cmd	Command the tasks belong to.
+ * @param: dmm	A valid dm manager object.
+ * @return: No return.
+ */
+static void __rescan_dir_monitors(json_object *msg, struct dm_command *cmd,
+				  struct dm_manager *dmm)
+{
+	json_object *dirs;
+	int i, len;
+
+	if (msg == NULL || !json_object_object_get_ex(msg, "directories", &dirs)) {
+		__queue_task(dmm, cmd, DM_OP_RESCAN, NULL, NULL);
+		return;
+	}
+	if (!json_object_is_type(dirs, json_type_array)) {
+		DEBUG("Directories are not an array");
+		__command_result(dmm, cmd, NULL, -1);
+		return;
+	}
+
+	len = json_object_array_length(dirs);
+	for (i = 0; i < len; i++) {
+		const char *path = __json_string(
+			json_object_array_get_idx(dirs, i));
+
+		/* NULL would rescan them all */
+		if (path == NULL)
+			__command_result(dmm, cmd, NULL, -1);
 		else
-			dir_monitor_list_add(dm_list,
-					     json_object_get_string(tmp));
+			__queue_task(dmm, cmd, DM_OP_RESCAN, path, NULL);
 	}
 }
 
+static void *stats_thread(void *arg)
+{
+	struct dm_manager *dmm = (struct dm_manager *)arg;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	pthread_mutex_lock(&dmm->stats_lock);
+	while (!dmm->stats_stop) {
+		ts.tv_sec += dmm->stats_interval_ms / 1000;
+		ts.tv_nsec += (dmm->stats_interval_ms % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		while (!dmm->stats_stop &&
+		       pthread_cond_timedwait(&dmm->stats_cond,
+					      &dmm->stats_lock, &ts) != ETIMEDOUT)
+			;
+		if (dmm->stats_stop)
+			break;
+
+		pthread_mutex_unlock(&dmm->stats_lock);
+		__publish_stats(dmm, 1);
+		pthread_mutex_lock(&dmm->stats_lock);
+	}
+	pthread_mutex_unlock(&dmm->stats_lock);
+	return NULL;
+}
+
+static int __stats_start(struct dm_manager *dmm)
+{
+	pthread_condattr_t attr;
+
+	dmm->stats_stop = 0;
+	dmm->stats_running = 0;
+	pthread_mutex_init(&dmm->stats_lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&dmm->stats_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (!dmm->stats_interval_ms)
+		return 0;
+	if (pthread_create(&dmm->stats_tid, NULL, stats_thread, dmm) != 0) {
+		ERROR("Failed to create thread.");
+		return -1;
+	}
+	dmm->stats_running = 1;
+	return 0;
+}
+
+static void __stats_stop(struct dm_manager *dmm)
+{
+	if (dmm->stats_running) {
+		pthread_mutex_lock(&dmm->stats_lock);
+		dmm->stats_stop = 1;
+		pthread_cond_signal(&dmm->stats_cond);
+		pthread_mutex_unlock(&dmm->stats_lock);
+		pthread_join(dmm->stats_tid, NULL);
+	}
+	pthread_cond_destroy(&dmm->stats_cond);
+	pthread_mutex_destroy(&dmm->stats_lock);
+}
+
 /**
  * This function disconnect from the subscriber to kill
  * the infinite subscriber loop.
@@ -60,7 +929,9 @@ static void __kill_dm_manager(struct dm_manager *dmm)
 
 /**
  * This function parses the MQTT message command and control the
- * directory monitoring manager behavior based on that.
+ * directory monitoring manager behavior based on that. Work on directories
+ * is queued to the control workers, so that the subscriber loop is never
+ * held up; an acknowledgement is published once the command is done.
  *
  * @param: user_data	Userdata to pass to the function.
  * @param: msg		MQTT message.
@@ -68,9 +939,10 @@ static void __kill_dm_manager(struct dm_manager *dmm)
  */
 static int parse_message(void *user_data, const char *msg)
 {
-	const char *cmd_code = NULL;
+	const char *cmd_code = "";
 	json_object *tmp, *root = NULL;
 	struct dm_manager *dmm = (struct dm_manager *)user_data;
+	struct dm_command *cmd;
 
 	root = json_tokener_parse(msg);
 	if (!root) {
@@ -78,25 +950,56 @@ static int parse_message(void *user_data, const char *msg)
 		return -1;
 	}
 
-	if (json_object_object_get_ex(root, "cmd_code", &tmp))
-		cmd_code = json_object_get_string(tmp);
+	if (json_object_object_get_ex(root, "cmd_code", &tmp) &&
+	    __json_string(tmp))
+		cmd_code = __json_string(tmp);
+
+	cmd = __command_new(root, cmd_code);
+	if (cmd == NULL) {
+		json_object_put(root);
+		return -1;
+	}
 
 	if (!strcmp(cmd_code, "start_dir_monitoring")) {
-		if (!json_pointer_get(root, "/msg/directories", &tmp))
-			__modify_dir_monitor_list(tmp, 0, dmm->dm_list);
+		if (json_object_object_get_ex(root, "msg", &tmp))
+			__modify_dir_monitor_list(tmp, DM_OP_START, cmd, dmm);
 
 	} else if (!strcmp(cmd_code, "stop_dir_monitoring")) {
-		if (!json_pointer_get(root, "/msg/directories", &tmp))
-			__modify_dir_monitor_list(tmp, 1, dmm->dm_list);
+		if (json_object_object_get_ex(root, "msg", &tmp))
+			__modify_dir_monitor_list(tmp, DM_OP_STOP, cmd, dmm);
+
+	} else if (!strcmp(cmd_code, "rescan_dir_monitoring")) {
+		__rescan_dir_monitors(json_object_object_get_ex(root, "msg",
+								&tmp) ?
+				      tmp : NULL, cmd, dmm);
+
+	} else if (!strcmp(cmd_code, "list_files")) {
+		/* NULL path would list the directories */
+		if (json_object_object_get_ex(root, "msg", &tmp) &&
+		    json_object_object_get_ex(tmp, "directory", &tmp) &&
+		    __json_string(tmp))
+			__queue_task(dmm, cmd, DM_OP_LIST_FILES,
+				     __json_string(tmp), NULL);
+		else
+			cmd->nr_failed++;
+
+	} else if (!strcmp(cmd_code, "list_dirs")) {
+		__queue_task(dmm, cmd, DM_OP_LIST_DIRS, NULL, NULL);
+
+	} else if (!strcmp(cmd_code, "get_stats")) {
+		/* Walks every monitor, kept off the subscriber loop */
+		__queue_task(dmm, cmd, DM_OP_STATS, NULL, NULL);
 
 	} else if (!strcmp(cmd_code, "kill_dir_monitoring")) {
 		__kill_dm_manager(dmm);
 
 	} else {
 		DEBUG("Unknown message format");
+		cmd->status = "unknown";
 	}
 
-	json_object_put(root);
+	/* Acknowledged here unless tasks are still queued */
+	__command_put(dmm, cmd);
 	return 0;
 }
 
@@ -107,29 +1010,41 @@ static void on_message_callback(struct mosquitto *mosq, void *obj,
 	parse_message(obj, msg->payload);
 }
 
-int dm_manager_start(struct dm_manager **out, int argc, char **argv)
+int dm_manager_start(struct dm_manager **out, const struct dm_config *cfg,
+		     int argc, char **argv)
 {
 	register int i;
 	char topic[64] = "";
 	struct dm_manager *dmm = NULL;
+	struct dm_command *cmd;
 
 	if ((dmm = malloc(sizeof(struct dm_manager))) == NULL) {
 		SYSERR("Memory allocation failure");
 		goto exit;
 	}
+	dmm->defaults = cfg->monitor;
+	dm_filter_get(dmm->defaults.filter);
+	dmm->stats_interval_ms = cfg->stats_interval_ms;
+	dmm->stats_file = cfg->stats_file;
 
 	/* Create List for directory monitor agents */
-	dmm->dm_list = dir_monitor_list_create();
+	dmm->dm_list = dir_monitor_list_create(cfg);
 	if (dmm->dm_list == NULL) {
 		DEBUG("Failed to create dir monitor list");
 		goto exit_free;
 	}
 
+	if (__control_start(dmm, cfg->control_workers) != 0)
+		goto exit_stop_control;
+
+	if (__stats_start(dmm) != 0)
+		goto exit_stop_stats;
+
 	/* Initiate a mosquitto subscriber for manager */
 	dmm->mosq = mosquitto_new("Directory Monitoring System", true, dmm);
 	if (dmm->mosq == NULL) {
 		ERROR("mosquitto_new() failed.");
-		goto exit_destroy_list;
+		goto exit_stop_stats;
 	}
 
 	/* Add message receive callback */
@@ -145,13 +1060,12 @@ int dm_manager_start(struct dm_manager **out, int argc, char **argv)
 	snprintf(topic, 64, "%s%s", TOPIC_PREFIX, "config");
 	mosquitto_subscribe(dmm->mosq, NULL, topic, 0);
 
-	/* Create all monitor threads and add to the list */
-	for (i = 0; i < argc - 1; i++) {
-		char *dir = argv[i + 1];
-		if (!dir_monitor_list_add(dmm->dm_list, dir))
-			INFO("Started monitoring %s directory.", dir);
-		else
-			WARN("Failed to monitor %s directory.", dir);
+	/* Directories of the command line are started like a command */
+	cmd = argc ? __command_new(NULL, "start_dir_monitoring") : NULL;
+	if (cmd) {
+		for (i = 0; i < argc; i++)
+			__queue_task(dmm, cmd, DM_OP_START, argv[i], NULL);
+		__command_put(dmm, cmd);
 	}
 
 	*out = dmm;
@@ -159,9 +1073,13 @@ int dm_manager_start(struct dm_manager **out, int argc, char **argv)
 
  exit_destroy_mosq:
 	mosquitto_destroy(dmm->mosq);
- exit_destroy_list:
+ exit_stop_stats:
+	__stats_stop(dmm);
+ exit_stop_control:
+	__control_stop(dmm);
 	dir_monitor_list_destroy(dmm->dm_list);
  exit_free:
+	dm_filter_put(dmm->defaults.filter);
 	free(dmm);
  exit:
 	return -1;
@@ -178,7 +1096,10 @@ void dm_manager_stop(struct dm_manager *dmm)
 	if (dmm) {
 		/* Must not call from callback function ..!! */
 		mosquitto_destroy(dmm->mosq);
+		__control_stop(dmm);
+		__stats_stop(dmm);
 		dir_monitor_list_destroy(dmm->dm_list);
+		dm_filter_put(dmm->defaults.filter);
 		free(dmm);
 	}
 }
@@ -2,6 +2,7 @@
 #define DM_MANAGER_H_INCLUDED
 
 struct dm_manager;
+struct dm_config;
 
 /**
  * This function creates and starts lists of directory monitoring agents.
@@ -10,12 +11,14 @@ struct dm_manager;
  * topic which this function subscribes to.
  *
  * @param: out	Storage location to keep allocated dm_manager object.
- * @param: argc	Number of command line arguments.
+ * @param: cfg	Global settings.
+ * @param: argc	Number of directories passed through command line.
  * @param: argv	List of directories passed through command line.
  *
  * @return: 0 on success or -1 on failure.
  */
-int dm_manager_start(struct dm_manager **out, int argc, char **argv);
+int dm_manager_start(struct dm_manager **out, const struct dm_config *cfg,
+		     int argc, char **argv);
 
 /**
  * This function runs directory monitoring manager in infinite
@@ -0,0 +1,244 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "dm-metadata.h"
+#include "dm-stats.h"
+#include "internals.h"
+#include "debug.h"
+
+
+/* Initial number of slots of a cache (power of 2) */
+#define META_MIN_SLOTS	64
+/* First allocation of a name list */
+#define NAMELIST_MIN_SIZE	1024
+
+#define META_STATX_MASK	(STATX_TYPE | STATX_MODE | STATX_INO | \
+			 STATX_SIZE | STATX_MTIME)
+
+struct meta_slot {
+	/* Name hash, 0 marks a free slot */
+	uint64_t key;
+	/* Time of the lookup in milliseconds */
+	uint64_t stamp;
+	struct dm_file_meta meta;
+};
+
+static inline uint64_t __slot_key(const char *name)
+{
+	uint64_t key = hash_str64(name, strlen(name));
+
+	return key ? key : 1;
+}
+
+static struct meta_slot *__lookup(struct dm_metacache *mc, uint64_t key)
+{
+	size_t i;
+
+	if (!mc->nr_slots)
+		return NULL;
+
+	for (i = key & (mc->nr_slots - 1); mc->slots[i].key;
+	     i = (i + 1) & (mc->nr_slots - 1))
+		if (mc->slots[i].key == key)
+			return &mc->slots[i];
+	return NULL;
+}
+
+static struct meta_slot *__insert(struct dm_metacache *mc, uint64_t key,
+				  uint64_t now)
+{
+	size_t i;
+
+	/* Keep load factor under 1/2; expired entries are dropped */
+	if ((mc->nr_used + 1) * 2 > mc->nr_slots) {
+		size_t nr_slots = mc->nr_slots ? mc->nr_slots : META_MIN_SLOTS;
+		struct meta_slot *slots;
+		size_t live = 0;
+
+		for (i = 0; i < mc->nr_slots; i++)
+			if (mc->slots[i].key &&
+			    mc->slots[i].stamp + mc->ttl_ms > now)
+				live++;
+		while ((live + 1) * 2 > nr_slots)
+			nr_slots *= 2;
+
+		slots = calloc(nr_slots, sizeof(*slots));
+		if (slots == NULL) {
+			ERROR("Memory allocation failure.");
+			return NULL;
+		}
+		for (i = 0; i < mc->nr_slots; i++) {
+			size_t j;
+
+			if (!mc->slots[i].key ||
+			    mc->slots[i].stamp + mc->ttl_ms <= now)
+				continue;
+			j = mc->slots[i].key & (nr_slots - 1);
+			while (slots[j].key)
+				j = (j + 1) & (nr_slots - 1);
+			slots[j] = mc->slots[i];
+		}
+		free(mc->slots);
+		mc->slots = slots;
+		mc->nr_slots = nr_slots;
+		mc->nr_used = live;
+	}
+
+	i = key & (mc->nr_slots - 1);
+	while (mc->slots[i].key)
+		i = (i + 1) & (mc->nr_slots - 1);
+	mc->slots[i].key = key;
+	mc->nr_used++;
+	return &mc->slots[i];
+}
+
+static int __statx(int dirfd, const char *name, struct dm_file_meta *meta)
+{
+	struct statx stx;
+	struct stat st;
+
+	dm_stat_inc(DM_STAT_STATX);
+	if (statx(dirfd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+		  META_STATX_MASK, &stx) == 0) {
+		meta->ino = stx.stx_ino;
+		meta->size = stx.stx_size;
+		meta->mtime_ns = (uint64_t)stx.stx_mtime.tv_sec * 1000000000ull +
+				 stx.stx_mtime.tv_nsec;
+		meta->mode = stx.stx_mode;
+		return 0;
+	}
+	if (errno != ENOSYS)
+		return -1;
+
+	/* Kernels before 4.11 */
+	if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+		return -1;
+	meta->ino = st.st_ino;
+	meta->size = st.st_size;
+	meta->mtime_ns = (uint64_t)st.st_mtim.tv_sec * 1000000000ull +
+			 st.st_mtim.tv_nsec;
+	meta->mode = st.st_mode;
+	return 0;
+}
+
+int dm_metacache_init(struct dm_metacache *mc, const char *dir_path,
+		      unsigned int ttl_ms)
+{
+	memset(mc, 0, sizeof(struct dm_metacache));
+	mc->ttl_ms = ttl_ms;
+	mc->dirfd = open(dir_path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (mc->dirfd == -1) {
+		SYSERR("Failed to open '%s'", dir_path);
+		return -1;
+	}
+	return 0;
+}
+
+void dm_metacache_release(struct dm_metacache *mc)
+{
+	if (mc->dirfd != -1)
+		close(mc->dirfd);
+	free(mc->slots);
+	memset(mc, 0, sizeof(struct dm_metacache));
+	mc->dirfd = -1;
+}
+
+int dm_metacache_get(struct dm_metacache *mc, const char *name, uint64_t now,
+		     struct dm_file_meta *meta)
+{
+	uint64_t key;
+	struct meta_slot *slot;
+
+	if (!mc->ttl_ms)
+		return __statx(mc->dirfd, name, meta);
+
+	key = __slot_key(name);
+	slot = __lookup(mc, key);
+	if (slot && slot->stamp + mc->ttl_ms > now) {
+		dm_stat_inc(DM_STAT_METADATA_CACHED);
+		*meta = slot->meta;
+		return 0;
+	}
+
+	if (__statx(mc->dirfd, name, meta) != 0) {
+		dm_metacache_remove(mc, name);
+		return -1;
+	}
+
+	if (slot == NULL)
+		slot = __insert(mc, key, now);
+	if (slot) {
+		slot->stamp = now;
+		slot->meta = *meta;
+	}
+	return 0;
+}
+
+void dm_metacache_remove(struct dm_metacache *mc, const char *name)
+{
+	struct meta_slot *slot;
+	size_t i, j, home;
+
+	if (!mc->nr_used)
+		return;
+	slot = __lookup(mc, __slot_key(name));
+	if (slot == NULL)
+		return;
+
+	/* Shift back the entries of the probe sequence behind the hole */
+	i = slot - mc->slots;
+	for (j = (i + 1) & (mc->nr_slots - 1); mc->slots[j].key;
+	     j = (j + 1) & (mc->nr_slots - 1)) {
+		home = mc->slots[j].key & (mc->nr_slots - 1);
+		/* Entry stays if its home lies cyclically in (i, j] */
+		if (i <= j ? (i < home && home <= j) :
+			     (i < home || home <= j))
+			continue;
+		mc->slots[i] = mc->slots[j];
+		i = j;
+	}
+	memset(&mc->slots[i], 0, sizeof(struct meta_slot));
+	mc->nr_used--;
+}
+
+int dm_namelist_add(struct dm_namelist *nl, const char *name, const char *to)
+{
+	size_t len = strlen(name) + 1;
+	size_t to_len = to ? strlen(to) + 1 : 0;
+
+	if (nl->len + len + to_len > nl->size) {
+		size_t size = nl->size ? nl->size : NAMELIST_MIN_SIZE;
+		char *buff;
+
+		while (size < nl->len + len + to_len)
+			size *= 2;
+		buff = realloc(nl->buff, size);
+		if (buff == NULL) {
+			ERROR("Memory allocation failure.");
+			return -1;
+		}
+		nl->buff = buff;
+		nl->size = size;
+	}
+
+	memcpy(nl->buff + nl->len, name, len);
+	nl->len += len;
+	if (to) {
+		memcpy(nl->buff + nl->len, to, to_len);
+		nl->len += to_len;
+	}
+	nl->nr++;
+	return 0;
+}
+
+void dm_namelist_release(struct dm_namelist *nl)
+{
+	free(nl->buff);
+	memset(nl, 0, sizeof(struct dm_namelist));
+}
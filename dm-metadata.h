@@ -0,0 +1,94 @@
+#ifndef DM_METADATA_H_INCLUDED
+#define DM_METADATA_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dm-payload.h"
+
+struct meta_slot;
+
+/**
+ * Metadata of the files named in the messages of a monitor. Files are
+ * looked up with statx() relative to an O_PATH descriptor of the monitored
+ * directory, so no path is built or resolved from the root for each one.
+ * Results are kept for a short while, indexed by name hash with open
+ * addressing, so a file named in several messages of a batch or in
+ * batches following each other closely is looked up once.
+ */
+struct dm_metacache {
+	struct meta_slot *slots;
+	size_t nr_slots;
+	size_t nr_used;
+	/* Results are used for this long (ms), 0 = not kept */
+	unsigned int ttl_ms;
+	/* O_PATH descriptor of the monitored directory */
+	int dirfd;
+};
+
+/**
+ * Names waiting for their metadata till the batch is published: each
+ * entry is a NUL terminated name, or two for a move record.
+ */
+struct dm_namelist {
+	char *buff;
+	size_t len;
+	size_t size;
+	unsigned int nr;
+};
+
+/**
+ * This function opens the directory and initializes an empty cache.
+ *
+ * @param: mc		Cache to initialize.
+ * @param: dir_path	Monitored directory.
+ * @param: ttl_ms	Time results are used for.
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_metacache_init(struct dm_metacache *mc, const char *dir_path,
+		      unsigned int ttl_ms);
+
+void dm_metacache_release(struct dm_metacache *mc);
+
+/**
+ * This function returns the metadata of a file, from the cache when it
+ * was looked up less than ttl_ms ago.
+ *
+ * @param: mc	A valid cache.
+ * @param: name	File name relative to the directory.
+ * @param: now	Current time in milliseconds.
+ * @param: meta	Storage location for the metadata.
+ * @return: 0 on success or -1 when the file is gone.
+ */
+int dm_metacache_get(struct dm_metacache *mc, const char *name, uint64_t now,
+		     struct dm_file_meta *meta);
+
+/**
+ * This function forgets a file, e.g. because it was deleted.
+ *
+ * @param: mc	A valid cache.
+ * @param: name	File name relative to the directory.
+ * @return: No return.
+ */
+void dm_metacache_remove(struct dm_metacache *mc, const char *name);
+
+/**
+ * This function appends an entry to the list.
+ *
+ * @param: nl	A valid list.
+ * @param: name	File name.
+ * @param: to	New name of a move record, or NULL.
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_namelist_add(struct dm_namelist *nl, const char *name, const char *to);
+
+/* Forget the entries; memory is kept */
+static inline void dm_namelist_clear(struct dm_namelist *nl)
+{
+	nl->len = 0;
+	nl->nr = 0;
+}
+
+void dm_namelist_release(struct dm_namelist *nl);
+
+#endif /* DM_METADATA_H_INCLUDED */
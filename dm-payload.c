@@ -0,0 +1,523 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "dm-payload.h"
+#include "debug.h"
+
+
+/* First allocation of a writer */
+#define PAYLOAD_MIN_SIZE	4096
+/* Closing "]}" */
+#define TRAILER_LEN		2
+
+#define MSG_HEAD	"{\"DirName\":\""
+#define MSG_STATUS	"\",\"Status\":\""
+#define MSG_FILES	"\",\"Files\":["
+/* Summary: "Count":n between status and files */
+#define MSG_COUNT	"\",\"Count\":"
+#define MSG_SAMPLE	",\"Files\":["
+/* Move record, {"from":"<from>","to":"<to>"} */
+#define MOVE_FROM	"{\"from\":\""
+#define MOVE_TO		"\",\"to\":\""
+/* Name with metadata, {"name":"<name>","size":n,...} */
+#define META_NAME	"{\"name\":\""
+#define META_SIZE	",\"size\":"
+#define META_MTIME	",\"mtime_ns\":"
+#define META_INO	",\"ino\":"
+#define META_MODE	",\"mode\":"
+/* Keys and numbers of the metadata */
+#define META_MAX_LEN	(sizeof(META_SIZE) + sizeof(META_MTIME) + \
+			 sizeof(META_INO) + sizeof(META_MODE) + 4 * 20)
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/* Longest varint of a size_t */
+#define VARINT_MAX		10
+
+/* Name collected for the binary encoding */
+struct payload_name {
+	uint32_t off;
+	uint32_t len;
+};
+
+/* Replacement character U+FFFD for invalid UTF-8 */
+#define REPLACEMENT	"\\ufffd"
+
+/* Length of a valid UTF-8 sequence at s, 0 if invalid */
+static size_t __utf8_seq_len(const unsigned char *s, size_t len)
+{
+	unsigned int c = s[0];
+	size_t i, n;
+
+	if (c >= 0xc2 && c <= 0xdf)
+		n = 2;
+	else if (c >= 0xe0 && c <= 0xef)
+		n = 3;
+	else if (c >= 0xf0 && c <= 0xf4)
+		n = 4;
+	else
+		return 0;
+
+	if (n > len)
+		return 0;
+	for (i = 1; i < n; i++)
+		if ((s[i] & 0xc0) != 0x80)
+			return 0;
+
+	/* Overlong, surrogate and out of range forms */
+	if ((c == 0xe0 && s[1] < 0xa0) || (c == 0xed && s[1] > 0x9f) ||
+	    (c == 0xf0 && s[1] < 0x90) || (c == 0xf4 && s[1] > 0x8f))
+		return 0;
+	return n;
+}
+
+size_t dm_json_escape(char *out, const char *in, size_t len)
+{
+	const unsigned char *s = (const unsigned char *)in;
+	char *p = out;
+	size_t i = 0;
+
+	while (i < len) {
+		unsigned int c = s[i];
+		size_t n;
+
+		if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\') {
+			*p++ = c;
+			i++;
+			continue;
+		}
+
+		if (c >= 0x80) {
+			n = __utf8_seq_len(s + i, len - i);
+			if (n) {
+				memcpy(p, s + i, n);
+				p += n;
+				i += n;
+			} else {
+				memcpy(p, REPLACEMENT, sizeof(REPLACEMENT) - 1);
+				p += sizeof(REPLACEMENT) - 1;
+				i++;
+			}
+			continue;
+		}
+
+		*p++ = '\\';
+		switch (c) {
+		case '"':
+		case '\\':
+			*p++ = c;
+			break;
+		case '\n':
+			*p++ = 'n';
+			break;
+		case '\t':
+			*p++ = 't';
+			break;
+		case '\r':
+			*p++ = 'r';
+			break;
+		default:
+			*p++ = 'u';
+			*p++ = '0';
+			*p++ = '0';
+			*p++ = hex_digits[c >> 4];
+			*p++ = hex_digits[c & 0xf];
+			break;
+		}
+		i++;
+	}
+	return p - out;
+}
+
+static int __reserve(struct dm_payload *pl, size_t need)
+{
+	size_t size = pl->size ? pl->size : PAYLOAD_MIN_SIZE;
+	char *buff;
+
+	if (pl->len + need <= pl->size)
+		return 0;
+
+	while (size < pl->len + need)
+		size *= 2;
+
+	buff = realloc(pl->buff, size);
+	if (buff == NULL) {
+		ERROR("Memory allocation failure.");
+		return -1;
+	}
+	pl->buff = buff;
+	pl->size = size;
+	return 0;
+}
+
+static inline void __append(struct dm_payload *pl, const char *s, size_t len)
+{
+	memcpy(pl->buff + pl->len, s, len);
+	pl->len += len;
+}
+
+/* Decimal form of val at p */
+static size_t __decimal(char *p, uint64_t val)
+{
+	char tmp[20];
+	size_t n = 0, i;
+
+	do {
+		tmp[n++] = '0' + val % 10;
+		val /= 10;
+	} while (val);
+	for (i = 0; i < n; i++)
+		p[i] = tmp[n - 1 - i];
+	return n;
+}
+
+static char *__write_meta(char *p, const struct dm_file_meta *meta)
+{
+	memcpy(p, META_SIZE, sizeof(META_SIZE) - 1);
+	p += sizeof(META_SIZE) - 1;
+	p += __decimal(p, meta->size);
+	memcpy(p, META_MTIME, sizeof(META_MTIME) - 1);
+	p += sizeof(META_MTIME) - 1;
+	p += __decimal(p, meta->mtime_ns);
+	memcpy(p, META_INO, sizeof(META_INO) - 1);
+	p += sizeof(META_INO) - 1;
+	p += __decimal(p, meta->ino);
+	memcpy(p, META_MODE, sizeof(META_MODE) - 1);
+	p += sizeof(META_MODE) - 1;
+	p += __decimal(p, meta->mode);
+	return p;
+}
+
+static inline size_t __varint_size(uint64_t val)
+{
+	size_t n = 1;
+
+	while (val >= 0x80) {
+		val >>= 7;
+		n++;
+	}
+	return n;
+}
+
+static inline size_t __varint(char *p, uint64_t val)
+{
+	size_t n = 0;
+
+	while (val >= 0x80) {
+		p[n++] = (char)(val | 0x80);
+		val >>= 7;
+	}
+	p[n++] = (char)val;
+	return n;
+}
+
+void dm_payload_init(struct dm_payload *pl, size_t cap, unsigned int format)
+{
+	pl->buff = NULL;
+	pl->len = 0;
+	pl->size = 0;
+	pl->cap = cap;
+	pl->nr_names = 0;
+	pl->format = format;
+	pl->names = NULL;
+	pl->names_size = 0;
+	pl->bin_len = 0;
+	pl->out = NULL;
+	pl->out_size = 0;
+}
+
+void dm_payload_release(struct dm_payload *pl)
+{
+	free(pl->buff);
+	free(pl->names);
+	free(pl->out);
+	dm_payload_init(pl, pl->cap, pl->format);
+}
+
+size_t dm_payload_footprint(const struct dm_payload *pl)
+{
+	return pl->size + pl->names_size * sizeof(struct payload_name) +
+	       pl->out_size;
+}
+
+/* Summary carries count, others pass NULL */
+static int __binary_begin(struct dm_payload *pl, const char *dir_name,
+			  size_t dir_len, const char *status,
+			  size_t status_len, const uint64_t *count)
+{
+	if (__reserve(pl, 1 + 3 * VARINT_MAX + dir_len + status_len) != 0)
+		return -1;
+
+	pl->buff[pl->len++] = count ? DM_PAYLOAD_BINARY_SUMMARY :
+				      DM_PAYLOAD_BINARY_VERSION;
+	pl->len += __varint(pl->buff + pl->len, dir_len);
+	__append(pl, dir_name, dir_len);
+	pl->len += __varint(pl->buff + pl->len, status_len);
+	__append(pl, status, status_len);
+	if (count)
+		pl->len += __varint(pl->buff + pl->len, *count);
+
+	/* Header and the file count */
+	pl->bin_len = pl->len + VARINT_MAX;
+	return 0;
+}
+
+/* Second part, if any, follows the name after a NUL byte */
+static int __binary_add(struct dm_payload *pl, const char *name, size_t len,
+			const char *name2, size_t len2)
+{
+	size_t total = name2 ? len + 1 + len2 : len;
+	/* Worst case: nothing shared with the previous name */
+	size_t need = pl->bin_len + 2 * __varint_size(total) + total;
+
+	if (need > pl->cap && pl->nr_names)
+		return 1;
+
+	if (pl->nr_names == pl->names_size) {
+		size_t size = pl->names_size ? pl->names_size * 2 : 64;
+		struct payload_name *names;
+
+		names = realloc(pl->names, size * sizeof(*names));
+		if (names == NULL) {
+			ERROR("Memory allocation failure.");
+			return -1;
+		}
+		pl->names = names;
+		pl->names_size = size;
+	}
+
+	if (__reserve(pl, total) != 0)
+		return -1;
+
+	pl->names[pl->nr_names].off = pl->len;
+	pl->names[pl->nr_names].len = total;
+	pl->nr_names++;
+	__append(pl, name, len);
+	if (name2) {
+		pl->buff[pl->len++] = '\0';
+		__append(pl, name2, len2);
+	}
+	pl->bin_len = need;
+	return 0;
+}
+
+static int __name_cmp(const void *a, const void *b, void *arg)
+{
+	const struct payload_name *x = (const struct payload_name *)a;
+	const struct payload_name *y = (const struct payload_name *)b;
+	const char *buff = (const char *)arg;
+	int rc = memcmp(buff + x->off, buff + y->off,
+			x->len < y->len ? x->len : y->len);
+
+	if (rc)
+		return rc;
+	return (x->len > y->len) - (x->len < y->len);
+}
+
+static const char *__binary_finish(struct dm_payload *pl, size_t *len)
+{
+	const struct payload_name *names = pl->names;
+	const char *prev = NULL;
+	size_t i, prev_len = 0;
+	/* Header is what precedes the first name added */
+	size_t header = names && pl->nr_names ? names[0].off : pl->len;
+	char *p;
+
+	if (pl->out_size < pl->bin_len) {
+		char *out = realloc(pl->out, pl->bin_len);
+
+		if (out == NULL) {
+			ERROR("Memory allocation failure.");
+			*len = 0;
+			return NULL;
+		}
+		pl->out = out;
+		pl->out_size = pl->bin_len;
+	}
+
+	/* Renames are applied in order */
+	if (!pl->moves)
+		qsort_r(pl->names, pl->nr_names, sizeof(*names), __name_cmp,
+			pl->buff);
+
+	p = pl->out;
+	memcpy(p, pl->buff, header);
+	p += header;
+	p += __varint(p, pl->nr_names);
+
+	for (i = 0; i < pl->nr_names; i++) {
+		const char *name = pl->buff + names[i].off;
+		size_t n = names[i].len;
+		size_t shared = 0;
+
+		while (shared < n && shared < prev_len &&
+		       name[shared] == prev[shared])
+			shared++;
+
+		p += __varint(p, shared);
+		p += __varint(p, n - shared);
+		memcpy(p, name + shared, n - shared);
+		p += n - shared;
+
+		prev = name;
+		prev_len = n;
+	}
+
+	*len = p - pl->out;
+	return pl->out;
+}
+
+static int __begin(struct dm_payload *pl, const char *dir_name,
+		   const char *status, const uint64_t *count)
+{
+	size_t dir_len = strlen(dir_name);
+	size_t status_len = strlen(status);
+
+	dm_payload_reset(pl);
+	if (pl->format == DM_PAYLOAD_BINARY)
+		return __binary_begin(pl, dir_name, dir_len, status,
+				      status_len, count);
+
+	if (__reserve(pl, sizeof(MSG_HEAD) + sizeof(MSG_STATUS) +
+		      sizeof(MSG_COUNT) + sizeof(MSG_SAMPLE) + 20 +
+		      escaped_len_max(dir_len) +
+		      escaped_len_max(status_len) + TRAILER_LEN) != 0)
+		return -1;
+
+	__append(pl, MSG_HEAD, sizeof(MSG_HEAD) - 1);
+	pl->len += dm_json_escape(pl->buff + pl->len, dir_name, dir_len);
+	__append(pl, MSG_STATUS, sizeof(MSG_STATUS) - 1);
+	pl->len += dm_json_escape(pl->buff + pl->len, status, status_len);
+	if (count) {
+		__append(pl, MSG_COUNT, sizeof(MSG_COUNT) - 1);
+		pl->len += __decimal(pl->buff + pl->len, *count);
+		__append(pl, MSG_SAMPLE, sizeof(MSG_SAMPLE) - 1);
+	} else {
+		__append(pl, MSG_FILES, sizeof(MSG_FILES) - 1);
+	}
+	return 0;
+}
+
+int dm_payload_begin(struct dm_payload *pl, const char *dir_name,
+		     const char *status)
+{
+	return __begin(pl, dir_name, status, NULL);
+}
+
+int dm_payload_begin_summary(struct dm_payload *pl, const char *dir_name,
+			     const char *status, uint64_t count)
+{
+	return __begin(pl, dir_name, status, &count);
+}
+
+int dm_payload_add(struct dm_payload *pl, const char *name, size_t len)
+{
+	char *start, *p;
+
+	if (pl->format == DM_PAYLOAD_BINARY)
+		return __binary_add(pl, name, len, NULL, 0);
+
+	/* Comma, quotes and the trailer of the message */
+	if (__reserve(pl, escaped_len_max(len) + 3 + TRAILER_LEN) != 0)
+		return -1;
+
+	start = p = pl->buff + pl->len;
+	if (pl->nr_names)
+		*p++ = ',';
+	*p++ = '"';
+	p += dm_json_escape(p, name, len);
+	*p++ = '"';
+
+	/* Leave it out unless it is the only name, which has to go anyway */
+	if (pl->len + (p - start) + TRAILER_LEN > pl->cap && pl->nr_names)
+		return 1;
+
+	pl->len += p - start;
+	pl->nr_names++;
+	return 0;
+}
+
+int dm_payload_add_meta(struct dm_payload *pl, const char *name, size_t len,
+			const struct dm_file_meta *meta)
+{
+	char *start, *p;
+
+	if (pl->format == DM_PAYLOAD_BINARY)
+		return __binary_add(pl, name, len, NULL, 0);
+
+	/* Comma, brace, key, quotes, metadata and the trailer */
+	if (__reserve(pl, escaped_len_max(len) + sizeof(META_NAME) + 3 +
+		      META_MAX_LEN + TRAILER_LEN) != 0)
+		return -1;
+
+	start = p = pl->buff + pl->len;
+	if (pl->nr_names)
+		*p++ = ',';
+	memcpy(p, META_NAME, sizeof(META_NAME) - 1);
+	p += sizeof(META_NAME) - 1;
+	p += dm_json_escape(p, name, len);
+	*p++ = '"';
+	if (meta)
+		p = __write_meta(p, meta);
+	*p++ = '}';
+
+	if (pl->len + (p - start) + TRAILER_LEN > pl->cap && pl->nr_names)
+		return 1;
+
+	pl->len += p - start;
+	pl->nr_names++;
+	return 0;
+}
+
+int dm_payload_add_move(struct dm_payload *pl, const char *from,
+			size_t from_len, const char *to, size_t to_len,
+			const struct dm_file_meta *meta)
+{
+	char *start, *p;
+
+	if (pl->format == DM_PAYLOAD_BINARY) {
+		pl->moves = 1;
+		return __binary_add(pl, from, from_len, to, to_len);
+	}
+
+	/* Comma, braces, keys, quotes, metadata and the trailer */
+	if (__reserve(pl, escaped_len_max(from_len + to_len) +
+		      sizeof(MOVE_FROM) + sizeof(MOVE_TO) + 4 +
+		      (meta ? META_MAX_LEN : 0) + TRAILER_LEN) != 0)
+		return -1;
+
+	start = p = pl->buff + pl->len;
+	if (pl->nr_names)
+		*p++ = ',';
+	memcpy(p, MOVE_FROM, sizeof(MOVE_FROM) - 1);
+	p += sizeof(MOVE_FROM) - 1;
+	p += dm_json_escape(p, from, from_len);
+	memcpy(p, MOVE_TO, sizeof(MOVE_TO) - 1);
+	p += sizeof(MOVE_TO) - 1;
+	p += dm_json_escape(p, to, to_len);
+	*p++ = '"';
+	if (meta)
+		p = __write_meta(p, meta);
+	*p++ = '}';
+
+	if (pl->len + (p - start) + TRAILER_LEN > pl->cap && pl->nr_names)
+		return 1;
+
+	pl->len += p - start;
+	pl->nr_names++;
+	return 0;
+}
+
+const char *dm_payload_finish(struct dm_payload *pl, size_t *len)
+{
+	if (pl->format == DM_PAYLOAD_BINARY)
+		return __binary_finish(pl, len);
+
+	/* Room for trailer is always reserved */
+	__append(pl, "]}", TRAILER_LEN);
+	*len = pl->len;
+	return pl->buff;
+}
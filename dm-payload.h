@@ -0,0 +1,220 @@
+#ifndef DM_PAYLOAD_H_INCLUDED
+#define DM_PAYLOAD_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Message encodings.
+ *
+ * DM_PAYLOAD_BINARY is a compact form of the same content, all integers
+ * unsigned LEB128 varints, strings raw bytes without terminator:
+ *	u8	version (1)
+ *	varint	length of the directory name, followed by the name
+ *	varint	length of the status, followed by the status
+ *	varint	number of files
+ *	per file, sorted bytewise:
+ *	varint	length of the prefix shared with the previous name
+ *	varint	length of the rest, followed by the rest
+ * A move record is the old name, a NUL byte and the new name. Move records
+ * are not sorted but kept in the order of the moves, which a chain of
+ * renames such as "b" to "c" then "a" to "b" depends on.
+ *
+ * A summary message has version byte 2 and the number of files it stands
+ * for as a varint right after the status; its files are a sample.
+ */
+enum dm_payload_format {
+	DM_PAYLOAD_JSON,
+	DM_PAYLOAD_BINARY,
+};
+
+/* Version byte of the binary encoding */
+#define DM_PAYLOAD_BINARY_VERSION	1
+/* Version byte of a binary summary message */
+#define DM_PAYLOAD_BINARY_SUMMARY	2
+
+struct payload_name;
+
+/* File metadata optionally carried by a message */
+struct dm_file_meta {
+	uint64_t ino;
+	uint64_t size;
+	/* Modification time in nanoseconds since the epoch */
+	uint64_t mtime_ns;
+	/* st_mode: type and permissions */
+	uint32_t mode;
+};
+
+/**
+ * Event message under construction:
+ *	{"DirName":"<dir>","Status":"<status>","Files":["<name>",...]}
+ *
+ * A summary of many files, of which Files holds a sample, reads:
+ *	{"DirName":"<dir>","Status":"<status>","Count":n,"Files":[...]}
+ *
+ * A name with metadata is written as an object instead of a string:
+ *	{"name":"<name>","size":n,"mtime_ns":n,"ino":n,"mode":n}
+ *
+ * Names are appended at a cursor and escaped for JSON. The buffer is kept
+ * across messages and grows on demand up to the payload cap, so a warmed up
+ * writer neither allocates nor clears memory.
+ *
+ * In binary format the names are collected raw and front coded when the
+ * message is finished; metadata is left out.
+ */
+struct dm_payload {
+	char *buff;
+	/* Append cursor */
+	size_t len;
+	/* Allocated bytes */
+	size_t size;
+	/* Maximum size of a finished message */
+	size_t cap;
+	/* Number of names in the message */
+	unsigned int nr_names;
+	/* enum dm_payload_format */
+	unsigned int format;
+	/* Binary format: names in the buffer */
+	struct payload_name *names;
+	size_t names_size;
+	/* Binary format: encoded size if no name shared a prefix */
+	size_t bin_len;
+	/* Binary format: move records were added, names keep their order */
+	unsigned int moves;
+	/* Binary format: finished message */
+	char *out;
+	size_t out_size;
+};
+
+/**
+ * This function initializes an empty payload writer. No memory is
+ * allocated until the first message is started.
+ *
+ * @param: pl		Writer to initialize.
+ * @param: cap		Maximum size of a finished message in bytes.
+ * @param: format	Encoding, enum dm_payload_format.
+ * @return: No return.
+ */
+void dm_payload_init(struct dm_payload *pl, size_t cap, unsigned int format);
+
+/**
+ * This function releases the writer memory.
+ *
+ * @param: pl	A valid writer.
+ * @return: No return.
+ */
+void dm_payload_release(struct dm_payload *pl);
+
+/**
+ * This function starts a new message, dropping any previous content.
+ *
+ * @param: pl		A valid writer.
+ * @param: dir_name	Directory name of the message.
+ * @param: status	Status of the files in the message.
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_payload_begin(struct dm_payload *pl, const char *dir_name,
+		     const char *status);
+
+/**
+ * This function starts a summary message standing for count files of
+ * the given status. Names added to it are a sample of them.
+ *
+ * @param: pl		A valid writer.
+ * @param: dir_name	Directory name of the message.
+ * @param: status	Status of the files.
+ * @param: count	Number of files summarized.
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_payload_begin_summary(struct dm_payload *pl, const char *dir_name,
+			     const char *status, uint64_t count);
+
+/**
+ * This function appends a file name to the started message.
+ *
+ * @param: pl	A valid writer with a started message.
+ * @param: name	File name, need not be NUL terminated; copied.
+ * @param: len	Length of the file name.
+ * @return: 0 on success, 1 when the name does not fit under the payload
+ *	    cap (message has to be finished and a new one started) or -1
+ *	    on failure.
+ */
+int dm_payload_add(struct dm_payload *pl, const char *name, size_t len);
+
+/**
+ * This function appends a file name with its metadata to the started
+ * message.
+ *
+ * @param: pl	A valid writer with a started message.
+ * @param: name	File name, need not be NUL terminated; copied.
+ * @param: len	Length of the file name.
+ * @param: meta	Metadata, or NULL when the file is gone: only the name
+ *		is written, still as an object.
+ * @return: As dm_payload_add().
+ */
+int dm_payload_add_meta(struct dm_payload *pl, const char *name, size_t len,
+			const struct dm_file_meta *meta);
+
+/**
+ * This function appends a move record, {"from":"<from>","to":"<to>"}, to
+ * the started message. Metadata of the file goes into the record as well.
+ *
+ * @param: pl		A valid writer with a started message.
+ * @param: from		Old file name, need not be NUL terminated; copied.
+ * @param: from_len	Length of the old name.
+ * @param: to		New file name, need not be NUL terminated; copied.
+ * @param: to_len	Length of the new name.
+ * @param: meta		Metadata of the file or NULL.
+ * @return: As dm_payload_add().
+ */
+int dm_payload_add_move(struct dm_payload *pl, const char *from,
+			size_t from_len, const char *to, size_t to_len,
+			const struct dm_file_meta *meta);
+
+/**
+ * This function closes the started message.
+ *
+ * @param: pl	A valid writer with a started message.
+ * @param: len	Storage location for the message length.
+ * @return: The message, valid till the next call on the writer, or NULL
+ *	    on failure.
+ */
+const char *dm_payload_finish(struct dm_payload *pl, size_t *len);
+
+/* Forget the message under construction; memory is kept */
+static inline void dm_payload_reset(struct dm_payload *pl)
+{
+	pl->len = 0;
+	pl->nr_names = 0;
+	pl->bin_len = 0;
+	pl->moves = 0;
+}
+
+/* Reuse an empty writer with other settings; memory is kept */
+static inline void dm_payload_reuse(struct dm_payload *pl, size_t cap,
+				    unsigned int format)
+{
+	dm_payload_reset(pl);
+	pl->cap = cap;
+	pl->format = format;
+}
+
+/* Bytes allocated by the writer */
+size_t dm_payload_footprint(const struct dm_payload *pl);
+
+/**
+ * This function writes the JSON escaped form of a string, without quotes.
+ * Control characters are escaped and invalid UTF-8 bytes are replaced by
+ * U+FFFD so the output is always valid JSON.
+ *
+ * @param: out	Destination with room for escaped_len_max(len) bytes.
+ * @param: in	String to escape.
+ * @param: len	Length of the string.
+ * @return: Number of bytes written.
+ */
+size_t dm_json_escape(char *out, const char *in, size_t len);
+
+/* Worst case length of an escaped string: every byte as \u00XX */
+#define escaped_len_max(len)	((len) * 6)
+
+#endif /* DM_PAYLOAD_H_INCLUDED */
@@ -0,0 +1,895 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <mosquitto.h>
+
+#include "dm-publisher.h"
+#include "dm-journal.h"
+#include "dm-stats.h"
+#include "internals.h"
+#include "debug.h"
+
+
+/* Messages taken off the queue per dispatcher lock round */
+#define DISPATCH_BATCH		64
+/* Reconnect back-off in seconds */
+#define RECONNECT_DELAY		1
+#define RECONNECT_DELAY_MAX	30
+/* Journaled messages in flight, waiting for their acknowledgement */
+#define JOURNAL_WINDOW		1024
+/* Time given to acknowledgements of journaled messages at exit */
+#define JOURNAL_DRAIN_MS	2000
+/* Submitting threads getting a lane of their own, others share the queue */
+#define PUB_MAX_LANES		64
+#define CACHE_LINE		64
+
+struct pub_msg {
+	/* Payload length in bytes */
+	size_t len;
+	/* Submit time in microseconds */
+	uint64_t queued_us;
+	/* Topic hash to pin a topic to a connection */
+	unsigned int hash;
+	/* Payload follows topic string */
+	char *payload;
+	char topic[];
+};
+
+struct pub_conn {
+	struct dm_publisher *pub;
+	struct mosquitto *mosq;
+	/* Connection up flag, protected by publisher lock */
+	unsigned int connected : 1;
+	/* Network loop thread running */
+	unsigned int loop_started : 1;
+	/* Messages handed to the network loop and not written out yet,
+	 * protected by publisher lock
+	 */
+	unsigned int inflight;
+};
+
+/**
+ * Single producer, single consumer ring of one submitting thread. The
+ * thread only moves tail and the dispatcher only moves head, so neither
+ * waits for the other; each index has its own cache line.
+ */
+struct pub_lane {
+	unsigned int tail __attribute__((aligned(CACHE_LINE)));
+	/* Lane full, drops are being reported */
+	unsigned int overflow;
+	unsigned int head __attribute__((aligned(CACHE_LINE)));
+	struct pub_msg **ring;
+};
+
+/* Journaled message handed to a connection */
+struct pub_inflight {
+	struct pub_conn *conn;
+	int mid;
+	unsigned int acked : 1;
+	/* Journal position following the message */
+	struct dm_journal_pos next;
+};
+
+struct dm_publisher {
+	struct pub_conn *conns;
+	unsigned int nr_conns;
+	unsigned int nr_connected;
+	/* Bounded ring of queued messages protected by lock */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct pub_msg **ring;
+	unsigned int ring_size;
+	unsigned int head;
+	unsigned int count;
+	/* Messages dropped on full queue */
+	unsigned long nr_dropped;
+	/* Messages in flight on all connections, and their limit (0 = none) */
+	unsigned int inflight;
+	unsigned int max_inflight;
+	/* Lanes of the submitting threads, published by nr_lanes */
+	struct pub_lane *lanes[PUB_MAX_LANES];
+	unsigned int nr_lanes;
+	/* Threads getting a lane, up to PUB_MAX_LANES */
+	unsigned int max_lanes;
+	/* Slots of a lane (power of 2) */
+	unsigned int lane_size;
+	/* Lane the dispatcher looks at first */
+	unsigned int next_lane;
+	/* Tells the lanes' threads to signal cond */
+	unsigned int sleeping;
+	/* Identifies the publisher in the lane cache of the threads */
+	uint64_t id;
+	unsigned int overflow : 1;
+	unsigned int stop : 1;
+	/* Dispatcher thread ID */
+	pthread_t tid;
+	/* Journal taking the place of the ring, may be NULL */
+	struct dm_journal *journal;
+	/* Next journal record to hand out */
+	struct dm_journal_pos send_pos;
+	/* Messages in flight in journal order, ring of JOURNAL_WINDOW */
+	struct pub_inflight *window;
+	unsigned int win_head;
+	unsigned int win_count;
+	/* Records in flight at most, JOURNAL_WINDOW or less */
+	unsigned int win_max;
+	/* Acknowledged journal prefix waiting to be committed */
+	struct dm_journal_pos ack_pos;
+	unsigned int commit : 1;
+	/* Connection lost; hand out again from the journal cursor */
+	unsigned int rewind : 1;
+};
+
+static uint64_t pub_ids;
+/* Lane of the thread in the publisher of the given ID */
+static __thread struct pub_lane *tls_lane;
+static __thread uint64_t tls_pub_id;
+/* Set by the threads given a lane, see dm_publisher_claim_lane() */
+static __thread int tls_lane_claimed;
+
+static uint64_t __now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t __time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void on_connect_callback(struct mosquitto *mosq, void *obj, int rc)
+{
+	struct pub_conn *conn = (struct pub_conn *)obj;
+	struct dm_publisher *pub = conn->pub;
+
+	if (rc != 0) {
+		dm_stat_inc(DM_STAT_BROKER_ERRORS);
+		WARN("Broker refused connection : %s",
+		     mosquitto_connack_string(rc));
+		return;
+	}
+
+	pthread_mutex_lock(&pub->lock);
+	if (!conn->connected) {
+		conn->connected = 1;
+		pub->nr_connected++;
+	}
+	pthread_cond_broadcast(&pub->cond);
+	pthread_mutex_unlock(&pub->lock);
+	DEBUG("Publisher connection %ld up", (long)(conn - pub->conns));
+}
+
+static void on_disconnect_callback(struct mosquitto *mosq, void *obj, int rc)
+{
+	struct pub_conn *conn = (struct pub_conn *)obj;
+	struct dm_publisher *pub = conn->pub;
+
+	pthread_mutex_lock(&pub->lock);
+	if (conn->connected) {
+		conn->connected = 0;
+		pub->nr_connected--;
+	}
+	/* Messages in flight may be lost along with the connection */
+	if (pub->journal && pub->win_count) {
+		pub->rewind = 1;
+		pthread_cond_signal(&pub->cond);
+	}
+	/* Packets queued on the connection are dropped on reconnect */
+	if (conn->inflight) {
+		pub->inflight -= conn->inflight;
+		conn->inflight = 0;
+		pthread_cond_signal(&pub->cond);
+	}
+	pthread_mutex_unlock(&pub->lock);
+
+	/* rc 0 means disconnect was requested */
+	if (rc != 0) {
+		dm_stat_inc(DM_STAT_BROKER_DISCONNECTS);
+		WARN("Publisher connection %ld lost, reconnecting...",
+		     (long)(conn - pub->conns));
+	}
+}
+
+/* Pass the acknowledged head of the window to the dispatcher; lock held */
+static void __window_advance(struct dm_publisher *pub)
+{
+	while (pub->win_count && pub->window[pub->win_head].acked) {
+		pub->ack_pos = pub->window[pub->win_head].next;
+		pub->win_head = (pub->win_head + 1) % JOURNAL_WINDOW;
+		pub->win_count--;
+		pub->commit = 1;
+	}
+}
+
+/* Message left the network loop or never got in; lock held */
+static void __inflight_done(struct dm_publisher *pub, struct pub_conn *conn,
+			    unsigned int n)
+{
+	/* Counts were dropped with a lost connection */
+	if (n > conn->inflight)
+		n = conn->inflight;
+	if (pub->max_inflight && pub->inflight >= pub->max_inflight && n)
+		pthread_cond_signal(&pub->cond);
+	conn->inflight -= n;
+	pub->inflight -= n;
+}
+
+static inline int __inflight_full(const struct dm_publisher *pub)
+{
+	return pub->max_inflight && pub->inflight >= pub->max_inflight;
+}
+
+/*
+ * Called once a QoS 0 message was written to the socket, or once a QoS 1
+ * one was acknowledged by the broker.
+ */
+static void on_publish_callback(struct mosquitto *mosq, void *obj, int mid)
+{
+	struct pub_conn *conn = (struct pub_conn *)obj;
+	struct dm_publisher *pub = conn->pub;
+	unsigned int i;
+
+	pthread_mutex_lock(&pub->lock);
+	if (!pub->journal) {
+		__inflight_done(pub, conn, 1);
+		pthread_mutex_unlock(&pub->lock);
+		return;
+	}
+	for (i = 0; i < pub->win_count; i++) {
+		struct pub_inflight *f =
+			&pub->window[(pub->win_head + i) % JOURNAL_WINDOW];
+
+		if (f->conn == conn && f->mid == mid && !f->acked) {
+			f->acked = 1;
+			break;
+		}
+	}
+	__window_advance(pub);
+	if (pub->commit)
+		pthread_cond_signal(&pub->cond);
+	pthread_mutex_unlock(&pub->lock);
+}
+
+/* Pick the connection of the topic or any live one; lock held */
+static struct pub_conn *__pick_conn(struct dm_publisher *pub,
+				    unsigned int hash)
+{
+	unsigned int i, idx = hash % pub->nr_conns;
+
+	for (i = 0; i < pub->nr_conns; i++) {
+		struct pub_conn *conn = &pub->conns[(idx + i) % pub->nr_conns];
+		if (conn->connected)
+			return conn;
+	}
+	return NULL;
+}
+
+/*
+ * Put unsent messages back in front of the queue in original order; the
+ * connection of the first one is down.
+ */
+static void __requeue(struct dm_publisher *pub, struct pub_conn **conns,
+		      struct pub_msg **msgs, unsigned int n)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&pub->lock);
+	if (conns[0]->connected) {
+		conns[0]->connected = 0;
+		pub->nr_connected--;
+	}
+	for (i = 0; i < n; i++)
+		__inflight_done(pub, conns[i], 1);
+	while (n--) {
+		if (pub->count == pub->ring_size) {
+			pub->nr_dropped++;
+			dm_stat_inc(DM_STAT_QUEUE_DROPS);
+			free(msgs[n]);
+			continue;
+		}
+		pub->head = (pub->head + pub->ring_size - 1) % pub->ring_size;
+		pub->ring[pub->head] = msgs[n];
+		pub->count++;
+	}
+	pthread_mutex_unlock(&pub->lock);
+}
+
+/**
+ * This function hands a batch of journal records to the connections at
+ * QoS 1. Records stay in the window until the broker acknowledged them.
+ * The lock is held throughout, so that acknowledgements cannot overtake
+ * the window entries.
+ *
+ * @param: pub	A valid publisher object, lock held.
+ * @return: No return.
+ */
+static void __journal_send(struct dm_publisher *pub)
+{
+	struct dm_journal_entry *batch[DISPATCH_BATCH];
+	struct dm_journal_pos pos = pub->send_pos;
+	unsigned int i, n = 0;
+
+	while (n < DISPATCH_BATCH && n < pub->win_max - pub->win_count &&
+	       (batch[n] = dm_journal_read(pub->journal, &pos)) != NULL)
+		n++;
+
+	for (i = 0; i < n; i++) {
+		struct dm_journal_entry *e = batch[i];
+		struct pub_conn *conn;
+		struct pub_inflight *f;
+		int rc, mid = 0;
+
+		conn = __pick_conn(pub, hash_str64(e->topic, strlen(e->topic)));
+		if (conn == NULL)
+			break;
+		rc = mosquitto_publish(conn->mosq, &mid, e->topic, e->len,
+				       e->payload, 1, false);
+		if (rc != MOSQ_ERR_SUCCESS)
+			dm_stat_inc(DM_STAT_BROKER_ERRORS);
+		if (rc == MOSQ_ERR_NO_CONN || rc == MOSQ_ERR_CONN_LOST) {
+			/* Retry after reconnect */
+			if (conn->connected) {
+				conn->connected = 0;
+				pub->nr_connected--;
+			}
+			pub->rewind = 1;
+			break;
+		}
+		if (rc != MOSQ_ERR_SUCCESS)
+			ERROR("Failed to send to broker : %s",
+			      mosquitto_strerror(rc));
+		else
+			dm_hist_add(DM_HIST_PUBLISH_US, __time_us() - e->time_us);
+
+		/* Messages the broker will never take count as done */
+		f = &pub->window[(pub->win_head + pub->win_count) %
+				 JOURNAL_WINDOW];
+		f->conn = conn;
+		f->mid = mid;
+		f->acked = rc != MOSQ_ERR_SUCCESS;
+		f->next = e->next;
+		pub->win_count++;
+		pub->send_pos = e->next;
+	}
+	for (i = 0; i < n; i++)
+		free(batch[i]);
+	__window_advance(pub);
+}
+
+/**
+ * This function is the dispatcher loop of a journaled publisher. Records
+ * are handed out from the journal cursor on, so everything written while
+ * the broker was away or before a restart goes out in order once it is
+ * back. On exit, acknowledgements are waited for a short while; records
+ * not acknowledged are sent again by the next run.
+ *
+ * @param: pub	A valid publisher object.
+ * @return: No return.
+ */
+static void __journal_dispatch(struct dm_publisher *pub)
+{
+	struct dm_journal_pos pos;
+	struct timespec ts;
+	uint64_t deadline = 0;
+
+	pthread_mutex_lock(&pub->lock);
+	for (;;) {
+		if (pub->commit) {
+			pos = pub->ack_pos;
+			pub->commit = 0;
+			pthread_mutex_unlock(&pub->lock);
+			dm_journal_commit(pub->journal, &pos);
+			pthread_mutex_lock(&pub->lock);
+			continue;
+		}
+		if (pub->rewind) {
+			pub->rewind = 0;
+			pub->win_count = 0;
+			dm_journal_cursor(pub->journal, &pub->send_pos);
+		}
+
+		if (pub->stop) {
+			if (!deadline)
+				deadline = __now_us() + JOURNAL_DRAIN_MS * 1000;
+			if (!pub->nr_connected || __now_us() >= deadline ||
+			    (!pub->win_count &&
+			     !dm_journal_readable(pub->journal, &pub->send_pos)))
+				break;
+		}
+
+		if (pub->nr_connected && pub->win_count < pub->win_max &&
+		    dm_journal_readable(pub->journal, &pub->send_pos)) {
+			__journal_send(pub);
+			continue;
+		}
+
+		if (!pub->stop) {
+			pthread_cond_wait(&pub->cond, &pub->lock);
+			continue;
+		}
+		ts.tv_sec = deadline / 1000000;
+		ts.tv_nsec = (deadline % 1000000) * 1000;
+		pthread_cond_timedwait(&pub->cond, &pub->lock, &ts);
+	}
+	pthread_mutex_unlock(&pub->lock);
+}
+
+/* Messages waiting in the lanes */
+static size_t __lanes_pending(struct dm_publisher *pub)
+{
+	unsigned int i, nr = __atomic_load_n(&pub->nr_lanes, __ATOMIC_ACQUIRE);
+	size_t count = 0;
+
+	for (i = 0; i < nr; i++)
+		count += __atomic_load_n(&pub->lanes[i]->tail,
+					 __ATOMIC_ACQUIRE) -
+			 pub->lanes[i]->head;
+	return count;
+}
+
+/* Take up to max messages off the lanes, in turn; lock held */
+static unsigned int __lanes_take(struct dm_publisher *pub,
+				 struct pub_msg **batch,
+				 struct pub_conn **conns, unsigned int max)
+{
+	unsigned int i, n = 0, nr = __atomic_load_n(&pub->nr_lanes,
+						    __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < nr && n < max; i++) {
+		struct pub_lane *lane = pub->lanes[(pub->next_lane + i) % nr];
+		unsigned int head = lane->head;
+		unsigned int tail = __atomic_load_n(&lane->tail,
+						    __ATOMIC_ACQUIRE);
+
+		while (head != tail && n < max) {
+			batch[n] = lane->ring[head & (pub->lane_size - 1)];
+			conns[n] = __pick_conn(pub, batch[n]->hash);
+			head++;
+			n++;
+		}
+		__atomic_store_n(&lane->head, head, __ATOMIC_RELEASE);
+	}
+	if (nr)
+		pub->next_lane = (pub->next_lane + 1) % nr;
+	return n;
+}
+
+/**
+ * This function waits for messages and a connection to send them on, and
+ * for room under the in-flight limit, also while stopping. The threads
+ * submitting to lanes do not take the lock, they signal cond only after
+ * seeing sleeping set, which is set before the lanes are looked at a last
+ * time.
+ *
+ * @param: pub	A valid publisher object, lock held.
+ * @return: No return.
+ */
+static void __dispatch_wait(struct dm_publisher *pub)
+{
+	int full = 0;
+
+	while ((pub->nr_connected && __inflight_full(pub)) ||
+	       (!pub->stop && (!pub->nr_connected ||
+			       (!pub->count && !__lanes_pending(pub))))) {
+		if (__inflight_full(pub)) {
+			if (!full++)
+				dm_stat_inc(DM_STAT_INFLIGHT_WAITS);
+			pthread_cond_wait(&pub->cond, &pub->lock);
+			continue;
+		}
+		__atomic_store_n(&pub->sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (pub->nr_connected && __lanes_pending(pub))
+			break;
+		pthread_cond_wait(&pub->cond, &pub->lock);
+	}
+	__atomic_store_n(&pub->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+static void *dispatcher_thread(void *arg)
+{
+	struct dm_publisher *pub = (struct dm_publisher *)arg;
+
+	if (pub->journal) {
+		__journal_dispatch(pub);
+		return NULL;
+	}
+
+	for (;;) {
+		struct pub_msg *batch[DISPATCH_BATCH];
+		struct pub_conn *conns[DISPATCH_BATCH];
+		unsigned int i, n = 0, max = DISPATCH_BATCH;
+
+		pthread_mutex_lock(&pub->lock);
+		__dispatch_wait(pub);
+
+		/* Nothing left to send or nobody to send to */
+		if (pub->stop && (!pub->nr_connected ||
+				  (!pub->count && !__lanes_pending(pub)))) {
+			pthread_mutex_unlock(&pub->lock);
+			break;
+		}
+
+		if (pub->max_inflight &&
+		    pub->max_inflight - pub->inflight < max)
+			max = pub->max_inflight - pub->inflight;
+
+		/* Messages put back after a lost connection go first */
+		while (pub->count && n < max) {
+			batch[n] = pub->ring[pub->head];
+			conns[n] = __pick_conn(pub, batch[n]->hash);
+			pub->head = (pub->head + 1) % pub->ring_size;
+			pub->count--;
+			n++;
+		}
+		n += __lanes_take(pub, batch + n, conns + n, max - n);
+		/* Counted before the network loop can report them written */
+		for (i = 0; i < n; i++)
+			conns[i]->inflight++;
+		pub->inflight += n;
+		pthread_mutex_unlock(&pub->lock);
+
+		/* Hand over to network loops; this only queues packets */
+		for (i = 0; i < n; i++) {
+			int rc = mosquitto_publish(conns[i]->mosq, NULL,
+						   batch[i]->topic,
+						   batch[i]->len,
+						   batch[i]->payload, 0, false);
+			if (rc != MOSQ_ERR_SUCCESS)
+				dm_stat_inc(DM_STAT_BROKER_ERRORS);
+			if (rc == MOSQ_ERR_NO_CONN || rc == MOSQ_ERR_CONN_LOST) {
+				/* Retry the rest after reconnect */
+				__requeue(pub, conns + i, batch + i, n - i);
+				break;
+			}
+			if (rc != MOSQ_ERR_SUCCESS) {
+				ERROR("Failed to send to broker : %s",
+				      mosquitto_strerror(rc));
+				pthread_mutex_lock(&pub->lock);
+				__inflight_done(pub, conns[i], 1);
+				pthread_mutex_unlock(&pub->lock);
+			} else {
+				dm_hist_add(DM_HIST_PUBLISH_US,
+					    __now_us() - batch[i]->queued_us);
+			}
+			free(batch[i]);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Lane of the calling thread, created on its first message; only threads
+ * which claimed one get it, all others use the shared ring.
+ */
+static struct pub_lane *__lane(struct dm_publisher *pub)
+{
+	struct pub_lane *lane;
+
+	if (!tls_lane_claimed)
+		return NULL;
+	if (tls_pub_id == pub->id)
+		return tls_lane;
+
+	tls_pub_id = pub->id;
+	tls_lane = NULL;
+	pthread_mutex_lock(&pub->lock);
+	if (pub->nr_lanes == pub->max_lanes)
+		goto exit_unlock;
+	lane = calloc(1, sizeof(struct pub_lane));
+	if (lane == NULL)
+		goto exit_unlock;
+	lane->ring = calloc(pub->lane_size, sizeof(struct pub_msg *));
+	if (lane->ring == NULL) {
+		free(lane);
+		goto exit_unlock;
+	}
+	pub->lanes[pub->nr_lanes] = lane;
+	__atomic_store_n(&pub->nr_lanes, pub->nr_lanes + 1, __ATOMIC_RELEASE);
+	tls_lane = lane;
+ exit_unlock:
+	pthread_mutex_unlock(&pub->lock);
+	return tls_lane;
+}
+
+static int __lane_submit(struct dm_publisher *pub, struct pub_lane *lane,
+			 struct pub_msg *msg)
+{
+	unsigned int tail = lane->tail;
+	unsigned int depth = tail - __atomic_load_n(&lane->head,
+						    __ATOMIC_ACQUIRE);
+
+	dm_hist_add(DM_HIST_QUEUE_DEPTH, depth);
+	if (depth == pub->lane_size) {
+		__atomic_add_fetch(&pub->nr_dropped, 1, __ATOMIC_RELAXED);
+		dm_stat_inc(DM_STAT_QUEUE_DROPS);
+		if (!lane->overflow)
+			WARN("Publish queue full, dropping messages...");
+		lane->overflow = 1;
+		free(msg);
+		return -1;
+	}
+	lane->ring[tail & (pub->lane_size - 1)] = msg;
+	lane->overflow = 0;
+	__atomic_store_n(&lane->tail, tail + 1, __ATOMIC_RELEASE);
+
+	/* Pairs with __dispatch_wait(): either it sees the message or we
+	 * see it going to sleep
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&pub->sleeping, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&pub->lock);
+		pthread_cond_signal(&pub->cond);
+		pthread_mutex_unlock(&pub->lock);
+	}
+	return 0;
+}
+
+void dm_publisher_claim_lane(void)
+{
+	tls_lane_claimed = 1;
+}
+
+int dm_publisher_submit(struct dm_publisher *pub, const char *topic,
+			const void *payload, size_t len)
+{
+	size_t topic_len = strlen(topic) + 1;
+	struct pub_msg *msg;
+
+	if (pub->journal) {
+		if (dm_journal_append(pub->journal, topic, payload, len) != 0)
+			return -1;
+		pthread_mutex_lock(&pub->lock);
+		pthread_cond_signal(&pub->cond);
+		pthread_mutex_unlock(&pub->lock);
+		return 0;
+	}
+
+	msg = malloc(sizeof(struct pub_msg) + topic_len + len);
+	if (msg == NULL) {
+		ERROR("Memory allocation failure.");
+		return -1;
+	}
+	memcpy(msg->topic, topic, topic_len);
+	msg->payload = msg->topic + topic_len;
+	memcpy(msg->payload, payload, len);
+	msg->len = len;
+	msg->hash = hash_str64(topic, topic_len - 1);
+	msg->queued_us = __now_us();
+
+	if (__lane(pub) != NULL)
+		return __lane_submit(pub, tls_lane, msg);
+
+	pthread_mutex_lock(&pub->lock);
+	dm_hist_add(DM_HIST_QUEUE_DEPTH, pub->count);
+	if (pub->count == pub->ring_size) {
+		pub->nr_dropped++;
+		dm_stat_inc(DM_STAT_QUEUE_DROPS);
+		if (!pub->overflow)
+			WARN("Publish queue full, dropping messages...");
+		pub->overflow = 1;
+		pthread_mutex_unlock(&pub->lock);
+		free(msg);
+		return -1;
+	}
+	pub->ring[(pub->head + pub->count) % pub->ring_size] = msg;
+	pub->count++;
+	pub->overflow = 0;
+	pthread_cond_signal(&pub->cond);
+	pthread_mutex_unlock(&pub->lock);
+	return 0;
+}
+
+size_t dm_publisher_pending(struct dm_publisher *pub)
+{
+	size_t count;
+
+	if (pub->journal)
+		return dm_journal_pending(pub->journal);
+
+	pthread_mutex_lock(&pub->lock);
+	count = pub->count + __lanes_pending(pub);
+	pthread_mutex_unlock(&pub->lock);
+	return count;
+}
+
+static int __conn_init(struct dm_publisher *pub, struct pub_conn *conn,
+		       unsigned int idx)
+{
+	char id[64] = "";
+	int rc;
+
+	conn->pub = pub;
+	snprintf(id, sizeof(id), "dir_mon-%d-%u", (int)getpid(), idx);
+
+	conn->mosq = mosquitto_new(id, true, conn);
+	if (conn->mosq == NULL) {
+		ERROR("mosquitto_new() failed.");
+		return -1;
+	}
+
+	mosquitto_connect_callback_set(conn->mosq, on_connect_callback);
+	mosquitto_disconnect_callback_set(conn->mosq, on_disconnect_callback);
+	mosquitto_publish_callback_set(conn->mosq, on_publish_callback);
+	mosquitto_reconnect_delay_set(conn->mosq, RECONNECT_DELAY,
+				      RECONNECT_DELAY_MAX, true);
+
+	/* Network loop keeps retrying if broker is not up yet */
+	rc = mosquitto_connect_async(conn->mosq, HOST_ADDRESS, MQTT_PORT,
+				     MQTT_KEEPALIVE);
+	if (rc != MOSQ_ERR_SUCCESS)
+		WARN("Broker not reachable yet : %s", mosquitto_strerror(rc));
+
+	if (mosquitto_loop_start(conn->mosq) != MOSQ_ERR_SUCCESS) {
+		ERROR("mosquitto_loop_start() failed.");
+		mosquitto_destroy(conn->mosq);
+		conn->mosq = NULL;
+		return -1;
+	}
+	conn->loop_started = 1;
+	return 0;
+}
+
+static void __conn_release(struct pub_conn *conn)
+{
+	if (conn->mosq == NULL)
+		return;
+
+	mosquitto_disconnect(conn->mosq);
+	/* Loop never connected keeps retrying, so cancel it */
+	if (conn->loop_started)
+		mosquitto_loop_stop(conn->mosq, !conn->connected);
+	mosquitto_destroy(conn->mosq);
+	conn->mosq = NULL;
+}
+
+int dm_publisher_create(struct dm_publisher **out,
+			unsigned int nr_connections, unsigned int queue_len,
+			unsigned int nr_lanes, unsigned int max_inflight,
+			struct dm_journal *journal)
+{
+	struct dm_publisher *pub = NULL;
+	pthread_condattr_t attr;
+	unsigned int i, share;
+
+	if (!nr_connections || !queue_len) {
+		ERROR("Invalid publisher settings.");
+		goto exit;
+	}
+
+	pub = calloc(1, sizeof(struct dm_publisher));
+	if (pub == NULL) {
+		ERROR("Memory allocation failure.");
+		goto exit;
+	}
+
+	pthread_mutex_init(&pub->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&pub->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	pub->max_inflight = max_inflight;
+	if (journal) {
+		pub->journal = journal;
+		pub->win_max = max_inflight && max_inflight < JOURNAL_WINDOW ?
+			       max_inflight : JOURNAL_WINDOW;
+		dm_journal_cursor(journal, &pub->send_pos);
+		pub->window = calloc(JOURNAL_WINDOW,
+				     sizeof(struct pub_inflight));
+		if (pub->window == NULL) {
+			ERROR("Memory allocation failure.");
+			goto exit_free;
+		}
+	}
+
+	pub->id = __atomic_add_fetch(&pub_ids, 1, __ATOMIC_RELAXED);
+	/*
+	 * The queue length is split between the lanes and the shared ring,
+	 * which gets one share plus what rounding the lanes down left over;
+	 * threads past the lanes publish through it.
+	 */
+	if (nr_lanes > PUB_MAX_LANES)
+		nr_lanes = PUB_MAX_LANES;
+	share = queue_len / (nr_lanes + 1);
+	if (share) {
+		pub->max_lanes = nr_lanes;
+		for (pub->lane_size = 1; pub->lane_size * 2 <= share; )
+			pub->lane_size *= 2;
+	}
+	pub->ring_size = queue_len - pub->max_lanes * pub->lane_size;
+	pub->ring = calloc(pub->ring_size, sizeof(struct pub_msg *));
+	pub->nr_conns = nr_connections;
+	pub->conns = calloc(nr_connections, sizeof(struct pub_conn));
+	if (pub->ring == NULL || pub->conns == NULL) {
+		ERROR("Memory allocation failure.");
+		goto exit_free;
+	}
+
+	for (i = 0; i < nr_connections; i++)
+		if (__conn_init(pub, &pub->conns[i], i) != 0)
+			goto exit_release;
+
+	if (pthread_create(&pub->tid, NULL, dispatcher_thread, pub) != 0) {
+		ERROR("Failed to create thread.");
+		goto exit_release;
+	}
+
+	*out = pub;
+	return 0;
+
+ exit_release:
+	for (i = 0; i < nr_connections; i++)
+		__conn_release(&pub->conns[i]);
+ exit_free:
+	free(pub->window);
+	free(pub->conns);
+	free(pub->ring);
+	pthread_cond_destroy(&pub->cond);
+	pthread_mutex_destroy(&pub->lock);
+	free(pub);
+ exit:
+	return -1;
+}
+
+void dm_publisher_destroy(struct dm_publisher *pub)
+{
+	unsigned int i;
+
+	if (pub == NULL)
+		return;
+
+	/* Dispatcher drains the queue while any connection is up */
+	pthread_mutex_lock(&pub->lock);
+	pub->stop = 1;
+	pthread_cond_broadcast(&pub->cond);
+	pthread_mutex_unlock(&pub->lock);
+	pthread_join(pub->tid, NULL);
+
+	for (i = 0; i < pub->nr_conns; i++)
+		__conn_release(&pub->conns[i]);
+
+	if (pub->count + __lanes_pending(pub))
+		WARN("%zu queued messages not published",
+		     pub->count + __lanes_pending(pub));
+	while (pub->count) {
+		free(pub->ring[pub->head]);
+		pub->head = (pub->head + 1) % pub->ring_size;
+		pub->count--;
+	}
+	for (i = 0; i < pub->nr_lanes; i++) {
+		struct pub_lane *lane = pub->lanes[i];
+
+		for (; lane->head != lane->tail; lane->head++)
+			free(lane->ring[lane->head & (pub->lane_size - 1)]);
+		free(lane->ring);
+		free(lane);
+	}
+	if (pub->nr_dropped)
+		WARN("%lu messages dropped on full queue", pub->nr_dropped);
+	if (pub->journal) {
+		if (pub->commit)
+			dm_journal_commit(pub->journal, &pub->ack_pos);
+		if (dm_journal_pending(pub->journal))
+			INFO("%zu journaled messages left for the next run",
+			     dm_journal_pending(pub->journal));
+		dm_journal_close(pub->journal);
+	}
+
+	free(pub->window);
+	free(pub->conns);
+	free(pub->ring);
+	pthread_cond_destroy(&pub->cond);
+	pthread_mutex_destroy(&pub->lock);
+	free(pub);
+}
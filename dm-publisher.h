@@ -0,0 +1,81 @@
+#ifndef DM_PUBLISHER_H_INCLUDED
+#define DM_PUBLISHER_H_INCLUDED
+
+#include <stddef.h>
+
+struct dm_publisher;
+struct dm_journal;
+
+/**
+ * This function creates the shared MQTT publisher: a pool of broker
+ * connections each running its own network loop, fed by a bounded queue.
+ * Connections are established and re-established in the background.
+ * Messages handed to the connections and not yet written to the network
+ * are limited; past the limit they wait in the queue, so a slow broker
+ * fills the queue rather than the memory of the network loops.
+ *
+ * With a journal, messages are appended to the journal instead of the
+ * queue and published at QoS 1; the broker's acknowledgements move the
+ * journal cursor. Messages are delivered at least once, also across
+ * broker outages and restarts.
+ *
+ * @param: out			Storage location to keep allocated publisher.
+ * @param: nr_connections	Number of broker connections.
+ * @param: queue_len		Maximum number of queued messages.
+ * @param: nr_lanes		Lanes for the threads which claimed one,
+ *				each lockless with a share of queue_len;
+ *				others share a locked queue.
+ * @param: max_inflight		Messages in flight at most, unacknowledged
+ *				ones when journaled; 0 = no limit.
+ * @param: journal		Journal, owned by the publisher on success,
+ *				or NULL.
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_publisher_create(struct dm_publisher **out,
+			unsigned int nr_connections, unsigned int queue_len,
+			unsigned int nr_lanes, unsigned int max_inflight,
+			struct dm_journal *journal);
+
+/**
+ * This function flushes queued messages while the broker is reachable,
+ * closes the connections and releases the publisher.
+ *
+ * @param: pub	A valid publisher object.
+ * @return: No return.
+ */
+void dm_publisher_destroy(struct dm_publisher *pub);
+
+/**
+ * This function marks the calling thread as one submitting most messages.
+ * Its messages go through a lockless lane of its own, in every publisher,
+ * as long as the publisher has lanes left.
+ *
+ * @return: No return.
+ */
+void dm_publisher_claim_lane(void);
+
+/**
+ * This function queues a copy of the message for publishing. It never
+ * waits for the network; when the queue is full the message is dropped.
+ * A journaled publisher appends the message to the journal instead.
+ * Messages of the same topic are delivered in order.
+ *
+ * @param: pub		A valid publisher object.
+ * @param: topic	MQTT topic.
+ * @param: payload	Message payload.
+ * @param: len		Payload length in bytes.
+ * @return: 0 on success or -1 when the message was dropped.
+ */
+int dm_publisher_submit(struct dm_publisher *pub, const char *topic,
+			const void *payload, size_t len);
+
+/**
+ * This function returns the number of messages waiting in the queue, or
+ * not acknowledged yet when journaled.
+ *
+ * @param: pub	A valid publisher object.
+ * @return: Queue depth.
+ */
+size_t dm_publisher_pending(struct dm_publisher *pub);
+
+#endif /* DM_PUBLISHER_H_INCLUDED */
@@ -0,0 +1,314 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "dm-ring.h"
+#include "dm-sink.h"
+#include "internals.h"
+#include "debug.h"
+
+
+/* Smallest data area */
+#define RING_MIN_SIZE		(64 * 1024)
+/* Header gets a page of its own */
+#define RING_HEADER_SIZE	4096
+
+struct ring_sink {
+	struct dm_sink sink;
+	int fd;
+	/* Wakes consumers of this process */
+	int efd;
+	struct dm_ring_header *hdr;
+	char *data;
+	size_t map_size;
+	/* Serializes writers */
+	pthread_mutex_t lock;
+};
+
+#define ring_len(len) \
+	(((len) + DM_RING_ALIGN - 1) & ~(size_t)(DM_RING_ALIGN - 1))
+
+static inline struct dm_ring_record *__record_at(char *data, uint64_t size,
+						 uint64_t pos)
+{
+	return (struct dm_ring_record *)(data + (pos & (size - 1)));
+}
+
+static long __futex(uint32_t *uaddr, int op, uint32_t val,
+		    const struct timespec *timeout)
+{
+	return syscall(SYS_futex, uaddr, op, val, timeout, NULL, 0);
+}
+
+/* Move the tail past records overlapping [.., end - size) */
+static void __reserve(struct ring_sink *ring, uint64_t end)
+{
+	struct dm_ring_header *hdr = ring->hdr;
+	uint64_t tail = hdr->tail;
+
+	if (end - tail <= hdr->size)
+		return;
+
+	/* Records are at most half the size, so the head is never passed */
+	while (end - tail > hdr->size)
+		tail += __record_at(ring->data, hdr->size, tail)->len;
+
+	__atomic_store_n(&hdr->tail, tail, __ATOMIC_RELAXED);
+	/* Readers must see the tail move before the data changes */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static int ring_write(struct dm_sink *sink, const char *topic,
+		      const void *payload, size_t len)
+{
+	struct ring_sink *ring = container_of(sink, struct ring_sink, sink);
+	struct dm_ring_header *hdr = ring->hdr;
+	struct dm_ring_record *rec;
+	size_t topic_len = strlen(topic);
+	size_t rec_len = ring_len(sizeof(*rec) + topic_len + len);
+	uint64_t head, pad;
+	uint64_t one = 1;
+
+	if (rec_len > hdr->size / 2 || topic_len > UINT16_MAX)
+		return -1;
+
+	pthread_mutex_lock(&ring->lock);
+	head = hdr->head;
+	/* Records never wrap */
+	pad = hdr->size - (head & (hdr->size - 1));
+	if (pad >= rec_len)
+		pad = 0;
+	__reserve(ring, head + pad + rec_len);
+
+	if (pad) {
+		rec = __record_at(ring->data, hdr->size, head);
+		rec->len = pad;
+		rec->topic_len = 0;
+		rec->payload_len = 0;
+		head += pad;
+	}
+
+	rec = __record_at(ring->data, hdr->size, head);
+	rec->len = rec_len;
+	rec->topic_len = topic_len;
+	rec->payload_len = len;
+	memcpy(rec->data, topic, topic_len);
+	memcpy(rec->data + topic_len, payload, len);
+
+	__atomic_store_n(&hdr->head, head + rec_len, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&hdr->futex, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&hdr->waiters, __ATOMIC_SEQ_CST))
+		__futex(&hdr->futex, FUTEX_WAKE, INT_MAX, NULL);
+	pthread_mutex_unlock(&ring->lock);
+
+	if (write(ring->efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		SYSERR("eventfd write() error.");
+	return 0;
+}
+
+static void ring_destroy(struct dm_sink *sink)
+{
+	struct ring_sink *ring = container_of(sink, struct ring_sink, sink);
+
+	munmap(ring->hdr, ring->map_size);
+	close(ring->efd);
+	close(ring->fd);
+	pthread_mutex_destroy(&ring->lock);
+	free(ring);
+}
+
+static const struct dm_sink_ops ring_ops = {
+	.write = ring_write,
+	.destroy = ring_destroy,
+};
+
+int dm_ring_sink_create(struct dm_sink **out, size_t size)
+{
+	struct ring_sink *ring;
+	size_t data_size = RING_MIN_SIZE;
+	void *map;
+
+	while (data_size < size)
+		data_size <<= 1;
+
+	ring = calloc(1, sizeof(struct ring_sink));
+	if (ring == NULL) {
+		ERROR("Memory allocation failure.");
+		goto exit;
+	}
+	ring->sink.ops = &ring_ops;
+	ring->map_size = RING_HEADER_SIZE + data_size;
+
+	ring->fd = memfd_create("dir_mon-ring", MFD_CLOEXEC);
+	if (ring->fd == -1) {
+		SYSERR("memfd_create() failed.");
+		goto exit_free;
+	}
+	if (ftruncate(ring->fd, ring->map_size) != 0) {
+		SYSERR("ftruncate() failed.");
+		goto exit_close;
+	}
+
+	ring->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ring->efd == -1) {
+		SYSERR("eventfd() failed.");
+		goto exit_close;
+	}
+
+	map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   ring->fd, 0);
+	if (map == MAP_FAILED) {
+		SYSERR("mmap() failed.");
+		goto exit_close_efd;
+	}
+	ring->hdr = (struct dm_ring_header *)map;
+	ring->data = (char *)map + RING_HEADER_SIZE;
+	ring->hdr->data_offset = RING_HEADER_SIZE;
+	ring->hdr->size = data_size;
+	ring->hdr->version = DM_RING_VERSION;
+	/* Header complete once the magic shows */
+	__atomic_store_n(&ring->hdr->magic, DM_RING_MAGIC, __ATOMIC_RELEASE);
+
+	pthread_mutex_init(&ring->lock, NULL);
+
+	INFO("Ring sink of %zu KiB at /proc/%d/fd/%d", data_size / 1024,
+	     (int)getpid(), ring->fd);
+	*out = &ring->sink;
+	return 0;
+
+ exit_close_efd:
+	close(ring->efd);
+ exit_close:
+	close(ring->fd);
+ exit_free:
+	free(ring);
+ exit:
+	return -1;
+}
+
+int dm_ring_sink_fd(struct dm_sink *sink, int *efd)
+{
+	struct ring_sink *ring = container_of(sink, struct ring_sink, sink);
+
+	if (efd)
+		*efd = ring->efd;
+	return ring->fd;
+}
+
+int dm_ring_reader_open(struct dm_ring_reader *r, int fd)
+{
+	struct dm_ring_header hdr;
+	void *map;
+
+	memset(r, 0, sizeof(*r));
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    hdr.magic != DM_RING_MAGIC || hdr.version != DM_RING_VERSION) {
+		ERROR("Not a ring of a supported version.");
+		return -1;
+	}
+
+	r->map_size = hdr.data_offset + hdr.size;
+	map = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+		   0);
+	if (map == MAP_FAILED) {
+		SYSERR("mmap() failed.");
+		return -1;
+	}
+	r->hdr = (struct dm_ring_header *)map;
+	r->data = (const char *)map + hdr.data_offset;
+	r->pos = __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+	return 0;
+}
+
+void dm_ring_reader_close(struct dm_ring_reader *r)
+{
+	if (r->hdr)
+		munmap(r->hdr, r->map_size);
+	r->hdr = NULL;
+}
+
+/* Resume from the oldest record after falling behind */
+static void __reader_resync(struct dm_ring_reader *r)
+{
+	r->pos = __atomic_load_n(&r->hdr->tail, __ATOMIC_ACQUIRE);
+	r->nr_lost++;
+}
+
+const struct dm_ring_record *dm_ring_reader_peek(struct dm_ring_reader *r)
+{
+	uint64_t size = r->hdr->size;
+
+	for (;;) {
+		const struct dm_ring_record *rec;
+		uint64_t head = __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+		uint32_t len;
+		uint16_t topic_len;
+
+		if (r->pos == head)
+			return NULL;
+		if (r->pos < __atomic_load_n(&r->hdr->tail, __ATOMIC_ACQUIRE)) {
+			__reader_resync(r);
+			continue;
+		}
+
+		rec = __record_at((char *)r->data, size, r->pos);
+		len = __atomic_load_n(&rec->len, __ATOMIC_RELAXED);
+		topic_len = __atomic_load_n(&rec->topic_len, __ATOMIC_RELAXED);
+
+		/* Garbage read while the record was overwritten */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (r->pos < __atomic_load_n(&r->hdr->tail, __ATOMIC_RELAXED) ||
+		    len < sizeof(*rec) || len > head - r->pos) {
+			__reader_resync(r);
+			continue;
+		}
+
+		r->cur_len = len;
+		if (topic_len)
+			return rec;
+		/* Padding up to the end of the data area */
+		r->pos += len;
+	}
+}
+
+int dm_ring_reader_next(struct dm_ring_reader *r)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (r->pos < __atomic_load_n(&r->hdr->tail, __ATOMIC_RELAXED)) {
+		__reader_resync(r);
+		return -1;
+	}
+	r->pos += r->cur_len;
+	return 0;
+}
+
+int dm_ring_reader_wait(struct dm_ring_reader *r, int timeout_ms)
+{
+	struct dm_ring_header *hdr = r->hdr;
+	struct timespec ts = { timeout_ms / 1000,
+			       (timeout_ms % 1000) * 1000000L };
+	uint32_t seq;
+	int ready;
+
+	seq = __atomic_load_n(&hdr->futex, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE) != r->pos)
+		return 1;
+
+	__atomic_add_fetch(&hdr->waiters, 1, __ATOMIC_SEQ_CST);
+	/* Commit after the load of seq makes the wait return at once */
+	__futex(&hdr->futex, FUTEX_WAIT, seq, timeout_ms < 0 ? NULL : &ts);
+	__atomic_sub_fetch(&hdr->waiters, 1, __ATOMIC_SEQ_CST);
+
+	ready = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE) != r->pos;
+	return ready;
+}
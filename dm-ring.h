@@ -0,0 +1,137 @@
+#ifndef DM_RING_H_INCLUDED
+#define DM_RING_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct dm_sink;
+
+/**
+ * Shared memory ring carrying event messages to local consumers.
+ *
+ * The ring lives in a memfd: a header page followed by the data area.
+ * Messages are appended as records and never wrap; a record which does not
+ * fit before the end of the data area is preceded by a padding record.
+ * Positions are byte counts since creation, the offset in the data area
+ * is the position modulo its size.
+ *
+ * Consumers map the memfd shared (through /proc/<pid>/fd/<fd> from other
+ * processes) and read records in place. The writer never waits for them:
+ * before overwriting old records it moves the tail past them, so a reader
+ * checks after use that its record still lies at or after the tail and
+ * otherwise resumes from the tail.
+ *
+ * Every commit bumps the futex word; readers sleep on it with FUTEX_WAIT
+ * or, in the same process, poll the eventfd of the sink.
+ */
+
+#define DM_RING_MAGIC		0x474e4952	/* "RING" */
+#define DM_RING_VERSION		1
+/* Records are aligned to this many bytes */
+#define DM_RING_ALIGN		16
+
+struct dm_ring_header {
+	uint32_t magic;
+	uint32_t version;
+	/* Offset of the data area in the memfd */
+	uint64_t data_offset;
+	/* Size of the data area, power of 2 */
+	uint64_t size;
+	/* Position following the last committed record */
+	uint64_t head;
+	/* Position of the oldest record not overwritten yet */
+	uint64_t tail;
+	/* Bumped on every commit */
+	uint32_t futex;
+	/* Readers sleeping on the futex word */
+	uint32_t waiters;
+};
+
+struct dm_ring_record {
+	/* Record length including this header, multiple of DM_RING_ALIGN */
+	uint32_t len;
+	/* Topic length, 0 for padding; topic follows without terminator */
+	uint16_t topic_len;
+	uint16_t reserved;
+	/* Payload length; payload follows the topic */
+	uint32_t payload_len;
+	uint32_t reserved2;
+	char data[];
+};
+
+/* Reader of a mapped ring */
+struct dm_ring_reader {
+	struct dm_ring_header *hdr;
+	const char *data;
+	size_t map_size;
+	/* Position of the next record */
+	uint64_t pos;
+	/* Length of the record at pos once peeked */
+	uint32_t cur_len;
+	/* Times the reader fell behind and records were overwritten */
+	unsigned long nr_lost;
+};
+
+/**
+ * This function creates the ring sink.
+ *
+ * @param: out	Storage location to keep allocated sink.
+ * @param: size	Size of the data area in bytes, rounded up to a power of 2.
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_ring_sink_create(struct dm_sink **out, size_t size);
+
+/**
+ * This function returns the descriptors of the ring sink.
+ *
+ * @param: sink		A ring sink.
+ * @param: efd		Storage location for the eventfd, may be NULL.
+ * @return: The memfd of the ring.
+ */
+int dm_ring_sink_fd(struct dm_sink *sink, int *efd);
+
+/**
+ * This function maps a ring for reading, starting at the current head.
+ *
+ * @param: r	Reader to initialize.
+ * @param: fd	Descriptor of the ring memfd.
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_ring_reader_open(struct dm_ring_reader *r, int fd);
+
+/**
+ * This function unmaps the ring.
+ *
+ * @param: r	A valid reader.
+ * @return: No return.
+ */
+void dm_ring_reader_close(struct dm_ring_reader *r);
+
+/**
+ * This function returns the next record without consuming it. The record
+ * may be overwritten any time; check with dm_ring_reader_next() after use.
+ *
+ * @param: r	A valid reader.
+ * @return: The record or NULL when there is none.
+ */
+const struct dm_ring_record *dm_ring_reader_peek(struct dm_ring_reader *r);
+
+/**
+ * This function consumes the record returned by dm_ring_reader_peek().
+ *
+ * @param: r	A valid reader.
+ * @return: 0 when the record was intact while used or -1 when it was
+ *	    overwritten; the reader then continues with the oldest record.
+ */
+int dm_ring_reader_next(struct dm_ring_reader *r);
+
+/**
+ * This function waits for a record to read.
+ *
+ * @param: r		A valid reader.
+ * @param: timeout_ms	Maximum wait in milliseconds, negative for no limit.
+ * @return: 1 when a record is available, 0 on timeout.
+ */
+int dm_ring_reader_wait(struct dm_ring_reader *r, int timeout_ms);
+
+#endif /* DM_RING_H_INCLUDED */
@@ -0,0 +1,304 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "dm-sink.h"
+#include "dm-ring.h"
+#include "dm-journal.h"
+#include "dm-publisher.h"
+#include "dm-config.h"
+#include "internals.h"
+#include "debug.h"
+
+
+static const char *const sink_names[DM_SINK_MAX] = {
+	[DM_SINK_MQTT] = "mqtt",
+	[DM_SINK_FILE] = "file",
+	[DM_SINK_STDOUT] = "stdout",
+	[DM_SINK_RING] = "ring",
+};
+
+struct dm_sinks {
+	struct dm_config cfg;
+	/* Protects creation of sinks */
+	pthread_mutex_t lock;
+	struct dm_sink *sinks[DM_SINK_MAX];
+};
+
+struct mqtt_sink {
+	struct dm_sink sink;
+	struct dm_publisher *pub;
+};
+
+/* Append-only file or standard output */
+struct fd_sink {
+	struct dm_sink sink;
+	int fd;
+	/* Descriptor is owned by the sink */
+	unsigned int owned : 1;
+};
+
+static int mqtt_write(struct dm_sink *sink, const char *topic,
+		      const void *payload, size_t len)
+{
+	struct mqtt_sink *ms = container_of(sink, struct mqtt_sink, sink);
+
+	return dm_publisher_submit(ms->pub, topic, payload, len);
+}
+
+static void mqtt_destroy(struct dm_sink *sink)
+{
+	struct mqtt_sink *ms = container_of(sink, struct mqtt_sink, sink);
+
+	dm_publisher_destroy(ms->pub);
+	free(ms);
+}
+
+static size_t mqtt_pending(struct dm_sink *sink)
+{
+	struct mqtt_sink *ms = container_of(sink, struct mqtt_sink, sink);
+
+	return dm_publisher_pending(ms->pub);
+}
+
+static const struct dm_sink_ops mqtt_ops = {
+	.write = mqtt_write,
+	.destroy = mqtt_destroy,
+	.pending = mqtt_pending,
+};
+
+static int __mqtt_create(struct dm_sink **out, const struct dm_config *cfg)
+{
+	struct mqtt_sink *ms = calloc(1, sizeof(struct mqtt_sink));
+	struct dm_journal *journal = NULL;
+
+	if (ms == NULL) {
+		ERROR("Memory allocation failure.");
+		return -1;
+	}
+	if (cfg->journal_dir &&
+	    dm_journal_open(&journal, cfg->journal_dir,
+			    cfg->journal_segment_size, cfg->journal_segments,
+			    cfg->journal_fsync, cfg->journal_fsync_ms) != 0) {
+		ERROR("Failed to open journal");
+		free(ms);
+		return -1;
+	}
+	/* A lane for each engine, claimed by its thread at startup */
+	if (dm_publisher_create(&ms->pub, cfg->mqtt_connections,
+				cfg->mqtt_queue_len, cfg->workers,
+				cfg->mqtt_max_inflight, journal) != 0) {
+		ERROR("Failed to create publisher");
+		if (journal)
+			dm_journal_close(journal);
+		free(ms);
+		return -1;
+	}
+	ms->sink.ops = &mqtt_ops;
+	*out = &ms->sink;
+	return 0;
+}
+
+/**
+ * Messages are written as one line each, "<topic>\t<length>\t<payload>\n".
+ * The length lets readers skip binary payloads. One writev() per message
+ * keeps lines whole when several writers share the file.
+ */
+static int fd_write(struct dm_sink *sink, const char *topic,
+		    const void *payload, size_t len)
+{
+	struct fd_sink *fs = container_of(sink, struct fd_sink, sink);
+	char prefix[32];
+	struct iovec iov[4];
+	ssize_t total, rc;
+
+	iov[0].iov_base = (void *)topic;
+	iov[0].iov_len = strlen(topic);
+	iov[1].iov_base = prefix;
+	iov[1].iov_len = snprintf(prefix, sizeof(prefix), "\t%zu\t", len);
+	iov[2].iov_base = (void *)payload;
+	iov[2].iov_len = len;
+	iov[3].iov_base = "\n";
+	iov[3].iov_len = 1;
+	total = iov[0].iov_len + iov[1].iov_len + len + 1;
+
+	do {
+		rc = writev(fs->fd, iov, 4);
+	} while (rc == -1 && errno == EINTR);
+
+	if (rc != total) {
+		SYSERR("Failed to write message.");
+		return -1;
+	}
+	return 0;
+}
+
+static void fd_destroy(struct dm_sink *sink)
+{
+	struct fd_sink *fs = container_of(sink, struct fd_sink, sink);
+
+	if (fs->owned)
+		close(fs->fd);
+	free(fs);
+}
+
+static const struct dm_sink_ops fd_ops = {
+	.write = fd_write,
+	.destroy = fd_destroy,
+};
+
+static int __fd_create(struct dm_sink **out, const char *path)
+{
+	struct fd_sink *fs = calloc(1, sizeof(struct fd_sink));
+
+	if (fs == NULL) {
+		ERROR("Memory allocation failure.");
+		return -1;
+	}
+
+	if (path == NULL) {
+		fs->fd = STDOUT_FILENO;
+	} else {
+		fs->fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+			      0644);
+		if (fs->fd == -1) {
+			SYSERR("Failed to open '%s'.", path);
+			free(fs);
+			return -1;
+		}
+		fs->owned = 1;
+	}
+	fs->sink.ops = &fd_ops;
+	*out = &fs->sink;
+	return 0;
+}
+
+int dm_sink_type(const char *name)
+{
+	int i;
+
+	for (i = 0; i < DM_SINK_MAX; i++)
+		if (!strcmp(name, sink_names[i]))
+			return i;
+	return -1;
+}
+
+int dm_sink_parse(const char *list, unsigned int *mask)
+{
+	unsigned int bits = 0;
+	const char *p = list;
+
+	while (*p) {
+		size_t len = strcspn(p, ",");
+		char name[16];
+		int type;
+
+		if (len >= sizeof(name))
+			goto exit_invalid;
+		memcpy(name, p, len);
+		name[len] = '\0';
+		type = dm_sink_type(name);
+		if (type < 0)
+			goto exit_invalid;
+		bits |= DM_SINK_BIT(type);
+
+		p += len;
+		if (*p == ',')
+			p++;
+	}
+	if (!bits)
+		goto exit_invalid;
+
+	*mask = bits;
+	return 0;
+
+ exit_invalid:
+	ERROR("Invalid sink list '%s'.", list);
+	return -1;
+}
+
+int dm_sinks_create(struct dm_sinks **out, const struct dm_config *cfg)
+{
+	struct dm_sinks *set = calloc(1, sizeof(struct dm_sinks));
+
+	if (set == NULL) {
+		ERROR("Memory allocation failure.");
+		return -1;
+	}
+	set->cfg = *cfg;
+	pthread_mutex_init(&set->lock, NULL);
+
+	/* Replay what a previous run left in the journal right away */
+	if (cfg->journal_dir && dm_sinks_get(set, DM_SINK_MQTT) == NULL) {
+		dm_sinks_destroy(set);
+		return -1;
+	}
+	*out = set;
+	return 0;
+}
+
+struct dm_sink *dm_sinks_get(struct dm_sinks *set, unsigned int type)
+{
+	struct dm_sink *sink;
+	int rc = 0;
+
+	if (type >= DM_SINK_MAX)
+		return NULL;
+
+	pthread_mutex_lock(&set->lock);
+	sink = set->sinks[type];
+	if (sink == NULL) {
+		switch (type) {
+		case DM_SINK_MQTT:
+			rc = __mqtt_create(&sink, &set->cfg);
+			break;
+		case DM_SINK_FILE:
+			rc = __fd_create(&sink, set->cfg.sink_file);
+			break;
+		case DM_SINK_STDOUT:
+			rc = __fd_create(&sink, NULL);
+			break;
+		case DM_SINK_RING:
+			rc = dm_ring_sink_create(&sink, set->cfg.ring_size);
+			break;
+		}
+		if (rc == 0)
+			set->sinks[type] = sink;
+		else
+			sink = NULL;
+	}
+	pthread_mutex_unlock(&set->lock);
+	return sink;
+}
+
+size_t dm_sinks_pending(struct dm_sinks *set)
+{
+	size_t count = 0;
+	int i;
+
+	pthread_mutex_lock(&set->lock);
+	for (i = 0; i < DM_SINK_MAX; i++)
+		if (set->sinks[i] && set->sinks[i]->ops->pending)
+			count += set->sinks[i]->ops->pending(set->sinks[i]);
+	pthread_mutex_unlock(&set->lock);
+	return count;
+}
+
+void dm_sinks_destroy(struct dm_sinks *set)
+{
+	int i;
+
+	if (set == NULL)
+		return;
+
+	for (i = 0; i < DM_SINK_MAX; i++)
+		if (set->sinks[i])
+			set->sinks[i]->ops->destroy(set->sinks[i]);
+	pthread_mutex_destroy(&set->lock);
+	free(set);
+}
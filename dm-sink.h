@@ -0,0 +1,114 @@
+#ifndef DM_SINK_H_INCLUDED
+#define DM_SINK_H_INCLUDED
+
+#include <stddef.h>
+
+struct dm_config;
+struct dm_sink;
+struct dm_sinks;
+
+/* Destinations of event messages */
+enum dm_sink_type {
+	/* MQTT broker, through the shared publisher */
+	DM_SINK_MQTT,
+	/* Append-only file */
+	DM_SINK_FILE,
+	/* Standard output */
+	DM_SINK_STDOUT,
+	/* Shared memory ring read in place by local consumers */
+	DM_SINK_RING,
+	DM_SINK_MAX,
+};
+
+/* Bit of a sink type in a sink mask */
+#define DM_SINK_BIT(type)	(1u << (type))
+
+struct dm_sink_ops {
+	/* Deliver one message; may be called from several threads at once */
+	int (*write)(struct dm_sink *sink, const char *topic,
+		     const void *payload, size_t len);
+	/* Deliver what is pending and release the sink */
+	void (*destroy)(struct dm_sink *sink);
+	/* Messages accepted but not delivered yet; optional */
+	size_t (*pending)(struct dm_sink *sink);
+};
+
+/* Embedded by every sink implementation */
+struct dm_sink {
+	const struct dm_sink_ops *ops;
+};
+
+/**
+ * This function hands a message over to the sink. It does not wait for a
+ * remote peer; a sink which cannot keep up drops the message.
+ *
+ * @param: sink		A valid sink.
+ * @param: topic	Topic of the message.
+ * @param: payload	Message payload.
+ * @param: len		Payload length in bytes.
+ * @return: 0 on success or -1 when the message was dropped.
+ */
+static inline int dm_sink_write(struct dm_sink *sink, const char *topic,
+				const void *payload, size_t len)
+{
+	return sink->ops->write(sink, topic, payload, len);
+}
+
+/**
+ * This function looks up a sink type by name: "mqtt", "file", "stdout" or
+ * "ring".
+ *
+ * @param: name	Sink name.
+ * @return: enum dm_sink_type or -1 when the name is unknown.
+ */
+int dm_sink_type(const char *name);
+
+/**
+ * This function parses a comma separated list of sink names.
+ *
+ * @param: list	Sink names, e.g. "mqtt,ring".
+ * @param: mask	Storage location for the mask of DM_SINK_BIT()s.
+ * @return: 0 on success or -1 on an unknown or missing name.
+ */
+int dm_sink_parse(const char *list, unsigned int *mask);
+
+/**
+ * This function creates the set of sinks shared by all monitors. Sinks
+ * are created the first time a monitor asks for them, so that the MQTT
+ * publisher for instance does not exist unless a directory uses it. With
+ * a journal, the MQTT publisher is created at once to replay it.
+ *
+ * @param: out	Storage location to keep allocated set.
+ * @param: cfg	Global settings of the sinks.
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_sinks_create(struct dm_sinks **out, const struct dm_config *cfg);
+
+/**
+ * This function returns the sink of the given type, creating it on first
+ * use. Safe to call from any thread.
+ *
+ * @param: set	A valid sink set.
+ * @param: type	enum dm_sink_type.
+ * @return: The sink or NULL on failure.
+ */
+struct dm_sink *dm_sinks_get(struct dm_sinks *set, unsigned int type);
+
+/**
+ * This function sums the messages waiting in the sinks of the set.
+ *
+ * @param: set	A valid sink set.
+ * @return: Number of messages.
+ */
+size_t dm_sinks_pending(struct dm_sinks *set);
+
+/**
+ * This function releases the set and all the sinks created by it. No
+ * message may be written anymore.
+ *
+ * @param: set	A valid sink set.
+ * @return: No return.
+ */
+void dm_sinks_destroy(struct dm_sinks *set);
+
+#endif /* DM_SINK_H_INCLUDED */
@@ -0,0 +1,716 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "dm-snapshot.h"
+#include "internals.h"
+#include "debug.h"
+
+
+/* Bytes of directory entries fetched per getdents64() */
+#define SCAN_BUFF_SIZE		(64 * 1024)
+/* Initial sizes (index is a power of 2) */
+#define SNAP_MIN_ENTRIES	64
+#define SNAP_MIN_ARENA		4096
+
+/* Saved index: header, entries, then names */
+#define INDEX_MAGIC	0x58494d44	/* "DMIX" */
+#define INDEX_VERSION	1
+
+/* Entry flags */
+#define SNAP_REMOVED	0x1
+#define SNAP_SEEN	0x2
+
+struct snap_entry {
+	uint64_t hash;
+	uint64_t ino;
+	int64_t size;
+	/* Modification time in nanoseconds */
+	int64_t mtime;
+	/* Name in the arena */
+	uint32_t name_off;
+	uint16_t name_len;
+	uint16_t flags;
+};
+
+struct index_header {
+	uint32_t magic;
+	uint32_t version;
+	/* sizeof(struct snap_entry), catches a file of another build */
+	uint32_t entry_size;
+	uint32_t reserved;
+	uint64_t nr_entries;
+	uint64_t arena_len;
+};
+
+/* Kernel record returned by getdents64() */
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+void dm_snapshot_init(struct dm_snapshot *snap)
+{
+	memset(snap, 0, sizeof(*snap));
+}
+
+void dm_snapshot_release(struct dm_snapshot *snap)
+{
+	free(snap->arena);
+	free(snap->entries);
+	free(snap->index);
+	free(snap->order);
+	dm_snapshot_init(snap);
+}
+
+static inline int __name_eq(const struct dm_snapshot *snap,
+			    const struct snap_entry *e, const char *name,
+			    size_t len)
+{
+	return e->name_len == len &&
+	       !memcmp(snap->arena + e->name_off, name, len);
+}
+
+/* Index slot holding the name or the free slot it would go to */
+static uint32_t *__index_find(const struct dm_snapshot *snap, uint64_t hash,
+			      const char *name, size_t len)
+{
+	size_t mask = snap->nr_index - 1;
+	size_t i = hash & mask;
+
+	while (snap->index[i]) {
+		const struct snap_entry *e = &snap->entries[snap->index[i] - 1];
+
+		if (e->hash == hash && __name_eq(snap, e, name, len))
+			break;
+		i = (i + 1) & mask;
+	}
+	return &snap->index[i];
+}
+
+/* Rebuild the index for the entries, sized for them */
+static int __index_build(struct dm_snapshot *snap)
+{
+	size_t nr_index = SNAP_MIN_ENTRIES * 2;
+	uint32_t *index;
+	size_t i;
+
+	while ((snap->nr_entries + 1) * 2 > nr_index)
+		nr_index *= 2;
+	index = calloc(nr_index, sizeof(uint32_t));
+	if (index == NULL)
+		return -1;
+	free(snap->index);
+	snap->index = index;
+	snap->nr_index = nr_index;
+	for (i = 0; i < snap->nr_entries; i++) {
+		size_t j = snap->entries[i].hash & (nr_index - 1);
+
+		while (index[j])
+			j = (j + 1) & (nr_index - 1);
+		index[j] = i + 1;
+	}
+	return 0;
+}
+
+/* Make room for one more entry of the given name length */
+static int __reserve(struct dm_snapshot *snap, size_t len)
+{
+	if (snap->arena_len + len > snap->arena_size) {
+		size_t size = snap->arena_size ? snap->arena_size :
+						 SNAP_MIN_ARENA;
+		char *arena;
+
+		while (size < snap->arena_len + len)
+			size *= 2;
+		if (size > UINT32_MAX)
+			return -1;
+		arena = realloc(snap->arena, size);
+		if (arena == NULL)
+			return -1;
+		snap->arena = arena;
+		snap->arena_size = size;
+	}
+
+	if (snap->nr_entries == snap->nr_alloc) {
+		size_t nr = snap->nr_alloc ? snap->nr_alloc * 2 :
+					     SNAP_MIN_ENTRIES;
+		struct snap_entry *entries;
+
+		entries = realloc(snap->entries, nr * sizeof(*entries));
+		if (entries == NULL)
+			return -1;
+		snap->entries = entries;
+		snap->nr_alloc = nr;
+	}
+
+	/* Keep load factor under 1/2 */
+	if ((snap->nr_entries + 1) * 2 > snap->nr_index)
+		return __index_build(snap);
+	return 0;
+}
+
+static inline void __fill(struct snap_entry *e, const struct stat *st)
+{
+	e->ino = st->st_ino;
+	e->size = st->st_size;
+	e->mtime = (int64_t)st->st_mtim.tv_sec * 1000000000 +
+		   st->st_mtim.tv_nsec;
+	e->flags = 0;
+}
+
+static int __set(struct dm_snapshot *snap, const char *name, size_t len,
+		 const struct stat *st)
+{
+	uint64_t hash = hash_str64(name, len);
+	struct snap_entry *e;
+	uint32_t *slot;
+
+	if (len >= PATH_MAX)
+		return -1;
+
+	if (snap->nr_index) {
+		slot = __index_find(snap, hash, name, len);
+		if (*slot) {
+			e = &snap->entries[*slot - 1];
+			if (e->flags & SNAP_REMOVED)
+				snap->nr_removed--;
+			__fill(e, st);
+			return 0;
+		}
+	}
+
+	if (__reserve(snap, len) != 0) {
+		ERROR("Memory allocation failure.");
+		return -1;
+	}
+
+	e = &snap->entries[snap->nr_entries++];
+	e->hash = hash;
+	e->name_off = snap->arena_len;
+	e->name_len = len;
+	__fill(e, st);
+	memcpy(snap->arena + snap->arena_len, name, len);
+	snap->arena_len += len;
+
+	*__index_find(snap, hash, name, len) = snap->nr_entries;
+	return 0;
+}
+
+int dm_snapshot_set(struct dm_snapshot *snap, const char *name,
+		    const struct stat *st)
+{
+	return __set(snap, name, strlen(name), st);
+}
+
+/**
+ * This function drops the removed entries, moving the names of the others
+ * down the arena, and shrinks the arrays. Entries keep their relative
+ * order, so the name order is only renumbered.
+ *
+ * @param: snap	A valid snapshot.
+ * @return: No return.
+ */
+static void __compact(struct dm_snapshot *snap)
+{
+	size_t i, n = 0, arena_len = 0, size;
+	uint32_t *renum = NULL;
+	void *tmp;
+
+	if (snap->nr_order) {
+		renum = malloc(snap->nr_entries * sizeof(uint32_t));
+		if (renum == NULL) {
+			ERROR("Memory allocation failure.");
+			return;
+		}
+	}
+
+	/* Names are in entry order, a name never moves up */
+	for (i = 0; i < snap->nr_entries; i++) {
+		struct snap_entry *e = &snap->entries[i];
+
+		if (e->flags & SNAP_REMOVED) {
+			if (renum)
+				renum[i] = UINT32_MAX;
+			continue;
+		}
+		memmove(snap->arena + arena_len, snap->arena + e->name_off,
+			e->name_len);
+		e->name_off = arena_len;
+		arena_len += e->name_len;
+		if (renum)
+			renum[i] = n;
+		snap->entries[n++] = *e;
+	}
+
+	if (renum) {
+		size_t k = 0;
+
+		for (i = 0; i < snap->nr_order; i++)
+			if (renum[snap->order[i]] != UINT32_MAX)
+				snap->order[k++] = renum[snap->order[i]];
+		/* Live entries past the order still follow it */
+		snap->nr_order = k;
+		free(renum);
+	}
+	snap->nr_entries = n;
+	snap->arena_len = arena_len;
+	snap->nr_removed = 0;
+
+	/* Shrinking never fails for good, the old block is kept */
+	for (size = SNAP_MIN_ARENA; size < arena_len; )
+		size *= 2;
+	if (size < snap->arena_size && (tmp = realloc(snap->arena, size))) {
+		snap->arena = tmp;
+		snap->arena_size = size;
+	}
+	for (size = SNAP_MIN_ENTRIES; size < n; )
+		size *= 2;
+	if (size < snap->nr_alloc &&
+	    (tmp = realloc(snap->entries, size * sizeof(struct snap_entry)))) {
+		snap->entries = tmp;
+		snap->nr_alloc = size;
+	}
+	if (__index_build(snap) != 0) {
+		/* Old index points at entries which moved */
+		ERROR("Memory allocation failure.");
+		memset(snap->index, 0, snap->nr_index * sizeof(uint32_t));
+		for (i = 0; i < n; i++) {
+			size_t j = snap->entries[i].hash & (snap->nr_index - 1);
+
+			while (snap->index[j])
+				j = (j + 1) & (snap->nr_index - 1);
+			snap->index[j] = i + 1;
+		}
+	}
+}
+
+void dm_snapshot_remove(struct dm_snapshot *snap, const char *name)
+{
+	size_t len = strlen(name);
+	struct snap_entry *e;
+	uint32_t *slot;
+
+	if (!snap->nr_index)
+		return;
+
+	slot = __index_find(snap, hash_str64(name, len), name, len);
+	if (!*slot)
+		return;
+	e = &snap->entries[*slot - 1];
+	if (e->flags & SNAP_REMOVED)
+		return;
+	e->flags |= SNAP_REMOVED;
+
+	/* Names coming and going for good would grow it without end */
+	if (++snap->nr_removed >= SNAP_MIN_ENTRIES &&
+	    snap->nr_removed * 2 >= snap->nr_entries)
+		__compact(snap);
+}
+
+int dm_snapshot_scan(struct dm_snapshot *snap, int dirfd, const char *prefix,
+		     dm_snap_dir_fn dir_fn, void *arg)
+{
+	size_t prefix_len = strlen(prefix);
+	char path[PATH_MAX];
+	char *buff;
+	int rc = 0;
+
+	if (prefix_len + 2 >= sizeof(path))
+		return -1;
+	memcpy(path, prefix, prefix_len);
+	if (prefix_len)
+		path[prefix_len++] = '/';
+
+	buff = malloc(SCAN_BUFF_SIZE);
+	if (buff == NULL) {
+		ERROR("Memory allocation failure.");
+		return -1;
+	}
+
+	for (;;) {
+		long i, n = syscall(SYS_getdents64, dirfd, buff, SCAN_BUFF_SIZE);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			DEBUG("getdents64() failed : %s", strerror(errno));
+			rc = -1;
+			break;
+		}
+		if (n == 0)
+			break;
+
+		for (i = 0; i < n; ) {
+			struct linux_dirent64 *de =
+				(struct linux_dirent64 *)(buff + i);
+			const char *name = de->d_name;
+			size_t len = strlen(name);
+			struct stat st;
+
+			i += de->d_reclen;
+
+			if (name[0] == '.' && (name[1] == '\0' ||
+			    (name[1] == '.' && name[2] == '\0')))
+				continue;
+			if (prefix_len + len >= sizeof(path))
+				continue;
+			memcpy(path + prefix_len, name, len + 1);
+
+			if (de->d_type == DT_DIR) {
+				if (dir_fn)
+					dir_fn(arg, path);
+				continue;
+			}
+
+			/* Gone since listed */
+			if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+				continue;
+			if (S_ISDIR(st.st_mode)) {
+				if (dir_fn)
+					dir_fn(arg, path);
+				continue;
+			}
+
+			if (__set(snap, path, prefix_len + len, &st) != 0) {
+				rc = -1;
+				goto exit;
+			}
+		}
+	}
+
+ exit:
+	free(buff);
+	return rc;
+}
+
+static const char *__name(const struct dm_snapshot *snap,
+			  const struct snap_entry *e, char *buff)
+{
+	memcpy(buff, snap->arena + e->name_off, e->name_len);
+	buff[e->name_len] = '\0';
+	return buff;
+}
+
+void dm_snapshot_diff(struct dm_snapshot *old, const struct dm_snapshot *cur,
+		      void (*fn)(void *arg, const char *name,
+				 enum dm_snap_change change),
+		      void *arg)
+{
+	char name[PATH_MAX];
+	size_t i;
+
+	for (i = 0; i < cur->nr_entries; i++) {
+		const struct snap_entry *e = &cur->entries[i];
+		struct snap_entry *prev = NULL;
+		uint32_t *slot;
+
+		if (e->flags & SNAP_REMOVED)
+			continue;
+
+		if (old->nr_index) {
+			slot = __index_find(old, e->hash,
+					    cur->arena + e->name_off,
+					    e->name_len);
+			if (*slot)
+				prev = &old->entries[*slot - 1];
+		}
+
+		if (prev == NULL || (prev->flags & SNAP_REMOVED)) {
+			fn(arg, __name(cur, e, name), DM_SNAP_CREATED);
+			continue;
+		}
+
+		prev->flags |= SNAP_SEEN;
+		if (prev->ino != e->ino || prev->size != e->size ||
+		    prev->mtime != e->mtime)
+			fn(arg, __name(cur, e, name), DM_SNAP_MODIFIED);
+	}
+
+	for (i = 0; i < old->nr_entries; i++) {
+		const struct snap_entry *e = &old->entries[i];
+
+		if (!(e->flags & (SNAP_SEEN | SNAP_REMOVED)))
+			fn(arg, __name(old, e, name), DM_SNAP_DELETED);
+	}
+}
+
+/* Bytewise order of two names of a snapshot */
+static int __name_cmp(const struct dm_snapshot *snap, uint32_t a, uint32_t b)
+{
+	const struct snap_entry *x = &snap->entries[a];
+	const struct snap_entry *y = &snap->entries[b];
+	int rc = memcmp(snap->arena + x->name_off, snap->arena + y->name_off,
+			x->name_len < y->name_len ? x->name_len : y->name_len);
+
+	if (rc)
+		return rc;
+	return (x->name_len > y->name_len) - (x->name_len < y->name_len);
+}
+
+static int __order_cmp(const void *a, const void *b, void *arg)
+{
+	return __name_cmp((const struct dm_snapshot *)arg, *(const uint32_t *)a,
+			  *(const uint32_t *)b);
+}
+
+/* Merge the entries added since the last listing into the order */
+static int __order_update(struct dm_snapshot *snap)
+{
+	size_t nr_new = snap->nr_entries - snap->nr_order;
+	size_t i, j, k;
+	uint32_t *order;
+
+	if (!nr_new)
+		return 0;
+
+	order = malloc(snap->nr_entries * sizeof(uint32_t));
+	if (order == NULL) {
+		ERROR("Memory allocation failure.");
+		return -1;
+	}
+
+	/* New ones sorted at the end, then merged with the old ones */
+	for (i = 0; i < nr_new; i++)
+		order[snap->nr_order + i] = snap->nr_order + i;
+	qsort_r(order + snap->nr_order, nr_new, sizeof(uint32_t), __order_cmp,
+		snap);
+	if (snap->nr_order) {
+		uint32_t *added = order + snap->nr_order;
+
+		/* Writes stay below the new ones not read yet */
+		for (i = j = k = 0; j < nr_new; k++) {
+			if (i < snap->nr_order &&
+			    __name_cmp(snap, snap->order[i], added[j]) <= 0)
+				order[k] = snap->order[i++];
+			else
+				order[k] = added[j++];
+		}
+		memcpy(order + k, snap->order + i,
+		       (snap->nr_order - i) * sizeof(uint32_t));
+	}
+
+	free(snap->order);
+	snap->order = order;
+	snap->nr_order = snap->nr_entries;
+	return 0;
+}
+
+/* First position of the order whose name is not below name (or is above
+ * it when strict)
+ */
+static size_t __order_search(const struct dm_snapshot *snap, const char *name,
+			     int strict)
+{
+	size_t lo = 0, hi = snap->nr_order, len = strlen(name);
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const struct snap_entry *e = &snap->entries[snap->order[mid]];
+		int rc = memcmp(snap->arena + e->name_off, name,
+				e->name_len < len ? e->name_len : len);
+
+		if (!rc)
+			rc = (e->name_len > len) - (e->name_len < len);
+		if (rc < 0 || (strict && rc == 0))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+int dm_snapshot_list(struct dm_snapshot *snap, const char *prefix,
+		     const char *after, dm_snap_list_fn fn, void *arg)
+{
+	size_t prefix_len = prefix ? strlen(prefix) : 0;
+	size_t i;
+
+	if (__order_update(snap) != 0)
+		return -1;
+
+	i = prefix_len ? __order_search(snap, prefix, 0) : 0;
+	if (after && (!prefix_len || strcmp(after, prefix) >= 0))
+		i = __order_search(snap, after, 1);
+
+	for (; i < snap->nr_order; i++) {
+		const struct snap_entry *e = &snap->entries[snap->order[i]];
+		const char *name = snap->arena + e->name_off;
+
+		if (prefix_len && (e->name_len < prefix_len ||
+				   memcmp(name, prefix, prefix_len)))
+			break;
+		if (e->flags & SNAP_REMOVED)
+			continue;
+		if (fn(arg, name, e->name_len))
+			break;
+	}
+	return 0;
+}
+
+int dm_snapshot_save(const struct dm_snapshot *snap, const char *path)
+{
+	struct index_header *hdr;
+	struct snap_entry *entries;
+	char tmp[PATH_MAX], *base, *arena;
+	size_t i, n = 0, arena_len = 0, size;
+	int fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+		return -1;
+
+	/* Removed entries are left out */
+	for (i = 0; i < snap->nr_entries; i++) {
+		if (snap->entries[i].flags & SNAP_REMOVED)
+			continue;
+		n++;
+		arena_len += snap->entries[i].name_len;
+	}
+	size = sizeof(*hdr) + n * sizeof(*entries) + arena_len;
+
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		SYSERR("Failed to create index '%s'.", tmp);
+		return -1;
+	}
+	if (ftruncate(fd, size) == -1) {
+		SYSERR("Failed to size index '%s'.", tmp);
+		goto exit_unlink;
+	}
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		SYSERR("Failed to map index '%s'.", tmp);
+		goto exit_unlink;
+	}
+
+	hdr = (struct index_header *)base;
+	entries = (struct snap_entry *)(hdr + 1);
+	arena = (char *)(entries + n);
+	hdr->magic = INDEX_MAGIC;
+	hdr->version = INDEX_VERSION;
+	hdr->entry_size = sizeof(*entries);
+	hdr->reserved = 0;
+	hdr->nr_entries = n;
+	hdr->arena_len = arena_len;
+
+	for (i = 0, n = 0, arena_len = 0; i < snap->nr_entries; i++) {
+		const struct snap_entry *e = &snap->entries[i];
+
+		if (e->flags & SNAP_REMOVED)
+			continue;
+		entries[n] = *e;
+		entries[n].name_off = arena_len;
+		entries[n].flags = 0;
+		memcpy(arena + arena_len, snap->arena + e->name_off,
+		       e->name_len);
+		arena_len += e->name_len;
+		n++;
+	}
+	munmap(base, size);
+
+	/* Whole file on disk before it replaces the previous one */
+	if (fdatasync(fd) == -1 || rename(tmp, path) == -1) {
+		SYSERR("Failed to write index '%s'.", path);
+		goto exit_unlink;
+	}
+	close(fd);
+	return 0;
+
+ exit_unlink:
+	close(fd);
+	unlink(tmp);
+	return -1;
+}
+
+int dm_snapshot_load(struct dm_snapshot *snap, const char *path)
+{
+	const struct index_header *hdr;
+	const struct snap_entry *entries;
+	const char *arena;
+	struct stat st;
+	size_t i, n;
+	char *base;
+	int fd, rc = -1;
+
+	dm_snapshot_init(snap);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			SYSERR("Failed to open index '%s'.", path);
+		return -1;
+	}
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*hdr)) {
+		ERROR("Index '%s' too short.", path);
+		goto exit_close;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+		    fd, 0);
+	if (base == MAP_FAILED) {
+		SYSERR("Failed to map index '%s'.", path);
+		goto exit_close;
+	}
+
+	hdr = (const struct index_header *)base;
+	entries = (const struct snap_entry *)(hdr + 1);
+	arena = (const char *)(entries + hdr->nr_entries);
+	n = hdr->nr_entries;
+	if (hdr->magic != INDEX_MAGIC || hdr->version != INDEX_VERSION ||
+	    hdr->entry_size != sizeof(*entries) || n > UINT32_MAX / 2 ||
+	    hdr->arena_len > UINT32_MAX ||
+	    (size_t)st.st_size != sizeof(*hdr) + n * sizeof(*entries) +
+				  hdr->arena_len) {
+		ERROR("Index '%s' invalid.", path);
+		goto exit_unmap;
+	}
+	for (i = 0; i < n; i++) {
+		if ((uint64_t)entries[i].name_off + entries[i].name_len >
+		    hdr->arena_len) {
+			ERROR("Index '%s' invalid.", path);
+			goto exit_unmap;
+		}
+	}
+
+	/* Sized once; stored hashes spare hashing the names again */
+	snap->nr_alloc = n ? n : 1;
+	snap->arena_size = hdr->arena_len ? hdr->arena_len : 1;
+	for (snap->nr_index = SNAP_MIN_ENTRIES * 2; snap->nr_index < n * 2; )
+		snap->nr_index *= 2;
+	snap->entries = malloc(snap->nr_alloc * sizeof(*entries));
+	snap->arena = malloc(snap->arena_size);
+	snap->index = calloc(snap->nr_index, sizeof(uint32_t));
+	if (snap->entries == NULL || snap->arena == NULL ||
+	    snap->index == NULL) {
+		ERROR("Memory allocation failure.");
+		dm_snapshot_release(snap);
+		goto exit_unmap;
+	}
+	memcpy(snap->entries, entries, n * sizeof(*entries));
+	memcpy(snap->arena, arena, hdr->arena_len);
+	snap->nr_entries = n;
+	snap->arena_len = hdr->arena_len;
+	for (i = 0; i < n; i++) {
+		size_t j = snap->entries[i].hash & (snap->nr_index - 1);
+
+		while (snap->index[j])
+			j = (j + 1) & (snap->nr_index - 1);
+		snap->index[j] = i + 1;
+	}
+	rc = 0;
+
+ exit_unmap:
+	munmap(base, st.st_size);
+ exit_close:
+	close(fd);
+	return rc;
+}
@@ -0,0 +1,158 @@
+#ifndef DM_SNAPSHOT_H_INCLUDED
+#define DM_SNAPSHOT_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+struct snap_entry;
+
+/**
+ * Compact image of the files of a directory: name, inode, size and mtime.
+ * Names live back to back in one arena and entries in one array, indexed
+ * by name hash. Removed entries stay in place, to be revived under the
+ * same number, till they make up half of the entries; then the entries and
+ * the arena are compacted.
+ *
+ * For listings the entries are also kept in name order, as an array of
+ * entry numbers. New names only ever go to the end of the entries, so the
+ * order is brought up to date by sorting the ones added since and merging
+ * them in; removed entries keep their place, they come back under the
+ * same number. Compacting renumbers the order without sorting it again.
+ */
+struct dm_snapshot {
+	/* Names, not NUL terminated */
+	char *arena;
+	size_t arena_len;
+	size_t arena_size;
+	struct snap_entry *entries;
+	size_t nr_entries;
+	size_t nr_alloc;
+	/* Entries flagged removed */
+	size_t nr_removed;
+	/* Open addressing index of entry number + 1, 0 marks a free slot */
+	uint32_t *index;
+	size_t nr_index;
+	/* Entry numbers of the first nr_order entries in name order */
+	uint32_t *order;
+	size_t nr_order;
+};
+
+/* Differences found by dm_snapshot_diff() */
+enum dm_snap_change {
+	DM_SNAP_CREATED,
+	DM_SNAP_MODIFIED,
+	DM_SNAP_DELETED,
+};
+
+void dm_snapshot_init(struct dm_snapshot *snap);
+
+void dm_snapshot_release(struct dm_snapshot *snap);
+
+/**
+ * This function records the current state of a file.
+ *
+ * @param: snap	A valid snapshot.
+ * @param: name	File name, relative to the monitored directory.
+ * @param: st	File status.
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_snapshot_set(struct dm_snapshot *snap, const char *name,
+		    const struct stat *st);
+
+/**
+ * This function forgets a file.
+ *
+ * @param: snap	A valid snapshot.
+ * @param: name	File name, relative to the monitored directory.
+ * @return: No return.
+ */
+void dm_snapshot_remove(struct dm_snapshot *snap, const char *name);
+
+/**
+ * Called by dm_snapshot_scan() for every subdirectory found.
+ *
+ * @param: arg		Argument given to dm_snapshot_scan().
+ * @param: relpath	Path of the subdirectory relative to the monitored one.
+ */
+typedef void (*dm_snap_dir_fn)(void *arg, const char *relpath);
+
+/**
+ * This function adds all the non-directory entries of a directory to the
+ * snapshot. Entries are listed with getdents64() and looked up with
+ * fstatat() relative to the directory, so no path is resolved twice.
+ *
+ * @param: snap		A valid snapshot.
+ * @param: dirfd	Open directory.
+ * @param: prefix	Path of the directory relative to the monitored one,
+ *			"" for the monitored directory itself.
+ * @param: dir_fn	Callback for subdirectories, may be NULL.
+ * @param: arg		Argument passed to the callback.
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_snapshot_scan(struct dm_snapshot *snap, int dirfd, const char *prefix,
+		     dm_snap_dir_fn dir_fn, void *arg);
+
+/**
+ * This function compares two snapshots of the same directory and calls fn
+ * for every file created, modified or deleted between them.
+ *
+ * @param: old	Earlier snapshot; its entries are marked while comparing.
+ * @param: cur	Later snapshot.
+ * @param: fn	Callback receiving the file name and the change.
+ * @param: arg	Argument passed to the callback.
+ * @return: No return.
+ */
+void dm_snapshot_diff(struct dm_snapshot *old, const struct dm_snapshot *cur,
+		      void (*fn)(void *arg, const char *name,
+				 enum dm_snap_change change),
+		      void *arg);
+
+/**
+ * Called by dm_snapshot_list() for every file listed.
+ *
+ * @param: arg	Argument given to dm_snapshot_list().
+ * @param: name	File name, not NUL terminated.
+ * @param: len	Length of the name.
+ * @return: 0 to go on, non-zero to stop the listing.
+ */
+typedef int (*dm_snap_list_fn)(void *arg, const char *name, size_t len);
+
+/**
+ * This function lists the files of the snapshot in bytewise name order,
+ * starting after a given name, for paging through a large directory.
+ *
+ * @param: snap		A valid snapshot.
+ * @param: prefix	Only names starting with it are listed, may be NULL.
+ * @param: after	Listing starts after this name, may be NULL.
+ * @param: fn		Callback receiving the names.
+ * @param: arg		Argument passed to the callback.
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_snapshot_list(struct dm_snapshot *snap, const char *prefix,
+		     const char *after, dm_snap_list_fn fn, void *arg);
+
+/**
+ * This function writes the snapshot to a file, to be compared with the
+ * directory after a restart. The file is filled through a shared mapping
+ * under a temporary name and renamed over the previous one once on disk,
+ * so a crash leaves either the old or the new index.
+ *
+ * @param: snap	A valid snapshot.
+ * @param: path	Index file.
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_snapshot_save(const struct dm_snapshot *snap, const char *path);
+
+/**
+ * This function reads a snapshot written by dm_snapshot_save(). The file
+ * is mapped and copied in a few blocks; the name index is rebuilt from
+ * the saved hashes without looking at the names.
+ *
+ * @param: snap	Snapshot to initialize, left empty on failure.
+ * @param: path	Index file.
+ * @return: 0 on success or -1 when the file is missing or invalid.
+ */
+int dm_snapshot_load(struct dm_snapshot *snap, const char *path);
+
+#endif /* DM_SNAPSHOT_H_INCLUDED */
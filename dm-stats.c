@@ -0,0 +1,490 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <json-c/json.h>
+
+#include "dm-stats.h"
+#include "debug.h"
+
+
+static const char *const stat_names[DM_STAT_MAX] = {
+	[DM_STAT_READS] = "reads",
+	[DM_STAT_READ_BYTES] = "read_bytes",
+	[DM_STAT_SYSCALLS] = "syscalls",
+	[DM_STAT_EV_MODIFY] = "events_modify",
+	[DM_STAT_EV_DELETE] = "events_delete",
+	[DM_STAT_EV_CREATE] = "events_create",
+	[DM_STAT_EV_MOVED_FROM] = "events_moved_from",
+	[DM_STAT_EV_MOVED_TO] = "events_moved_to",
+	[DM_STAT_EV_DELETE_SELF] = "events_delete_self",
+	[DM_STAT_EV_CLOSE_WRITE] = "events_close_write",
+	[DM_STAT_EV_OTHER] = "events_other",
+	[DM_STAT_OVERFLOWS] = "overflows",
+	[DM_STAT_RESCANS] = "rescans",
+	[DM_STAT_BATCHES] = "batches",
+	[DM_STAT_MESSAGES] = "messages",
+	[DM_STAT_MESSAGE_BYTES] = "message_bytes",
+	[DM_STAT_SINK_DROPS] = "sink_drops",
+	[DM_STAT_QUEUE_DROPS] = "queue_drops",
+	[DM_STAT_BROKER_ERRORS] = "broker_errors",
+	[DM_STAT_BROKER_DISCONNECTS] = "broker_disconnects",
+	[DM_STAT_JOURNAL_DROPS] = "journal_drops",
+	[DM_STAT_UNCHANGED] = "unchanged",
+	[DM_STAT_FILTERED] = "filtered",
+	[DM_STAT_STATX] = "statx",
+	[DM_STAT_METADATA_CACHED] = "metadata_cached",
+	[DM_STAT_STORMS] = "storms",
+	[DM_STAT_SUMMARIZED] = "summarized",
+	[DM_STAT_INFLIGHT_WAITS] = "inflight_waits",
+};
+
+static const char *const hist_names[DM_HIST_MAX] = {
+	[DM_HIST_READ_BYTES] = "read_bytes",
+	[DM_HIST_BATCH_EVENTS] = "batch_events",
+	[DM_HIST_BATCH_DELAY_US] = "batch_delay_us",
+	[DM_HIST_BATCH_BUILD_US] = "batch_build_us",
+	[DM_HIST_PUBLISH_US] = "publish_us",
+	[DM_HIST_QUEUE_DEPTH] = "queue_depth",
+	[DM_HIST_JOURNAL_APPEND_US] = "journal_append_us",
+};
+
+__thread struct dm_stats_block *dm_stats_self;
+
+/* Blocks of all threads ever seen, and those of exited threads */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dm_stats_block *stats_blocks;
+static struct dm_stats_block **stats_free;
+static size_t stats_nr_free;
+static size_t stats_free_size;
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+/* Thread exit: the block keeps counting for the next thread */
+static void __block_retire(void *arg)
+{
+	struct dm_stats_block *b = (struct dm_stats_block *)arg;
+
+	pthread_mutex_lock(&stats_lock);
+	if (stats_nr_free == stats_free_size) {
+		size_t size = stats_free_size ? stats_free_size * 2 : 16;
+		struct dm_stats_block **tmp;
+
+		tmp = realloc(stats_free, size * sizeof(*tmp));
+		if (tmp == NULL) {
+			/* Counts stay in the totals, the block is not reused */
+			pthread_mutex_unlock(&stats_lock);
+			return;
+		}
+		stats_free = tmp;
+		stats_free_size = size;
+	}
+	stats_free[stats_nr_free++] = b;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static void __key_init(void)
+{
+	pthread_key_create(&stats_key, __block_retire);
+}
+
+struct dm_stats_block *dm_stats_register(void)
+{
+	struct dm_stats_block *b = NULL;
+
+	pthread_once(&stats_once, __key_init);
+
+	pthread_mutex_lock(&stats_lock);
+	if (stats_nr_free) {
+		b = stats_free[--stats_nr_free];
+	} else {
+		b = calloc(1, sizeof(struct dm_stats_block));
+		if (b != NULL) {
+			b->next = stats_blocks;
+			stats_blocks = b;
+		}
+	}
+	pthread_mutex_unlock(&stats_lock);
+
+	if (b == NULL)
+		return NULL;
+	pthread_setspecific(stats_key, b);
+	dm_stats_self = b;
+	return b;
+}
+
+void dm_stats_event(uint32_t mask)
+{
+	enum dm_stat id;
+
+	if (mask & IN_MODIFY)
+		id = DM_STAT_EV_MODIFY;
+	else if (mask & IN_DELETE)
+		id = DM_STAT_EV_DELETE;
+	else if (mask & IN_CREATE)
+		id = DM_STAT_EV_CREATE;
+	else if (mask & IN_MOVED_FROM)
+		id = DM_STAT_EV_MOVED_FROM;
+	else if (mask & IN_MOVED_TO)
+		id = DM_STAT_EV_MOVED_TO;
+	else if (mask & IN_DELETE_SELF)
+		id = DM_STAT_EV_DELETE_SELF;
+	else if (mask & IN_CLOSE_WRITE)
+		id = DM_STAT_EV_CLOSE_WRITE;
+	else
+		id = DM_STAT_EV_OTHER;
+	dm_stat_inc(id);
+}
+
+void dm_stats_collect(struct dm_stats *st)
+{
+	struct dm_stats_block *b;
+	int i, j;
+
+	memset(st->counters, 0, sizeof(st->counters));
+	memset(st->buckets, 0, sizeof(st->buckets));
+	memset(st->sums, 0, sizeof(st->sums));
+
+	pthread_mutex_lock(&stats_lock);
+	for (b = stats_blocks; b; b = b->next) {
+		for (i = 0; i < DM_STAT_MAX; i++)
+			st->counters[i] += __atomic_load_n(&b->counters[i],
+							   __ATOMIC_RELAXED);
+		for (i = 0; i < DM_HIST_MAX; i++) {
+			for (j = 0; j < DM_HIST_BUCKETS; j++)
+				st->buckets[i][j] += __atomic_load_n(
+					&b->buckets[i][j], __ATOMIC_RELAXED);
+			st->sums[i] += __atomic_load_n(&b->sums[i],
+						       __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+int dm_stats_add_monitor(struct dm_stats *st, const char *path,
+			 const struct dm_monitor_stats *ms)
+{
+	const uint64_t *src;
+	uint64_t *dst;
+	size_t i;
+
+	if (st->nr_monitors == st->size) {
+		size_t size = st->size ? st->size * 2 : 16;
+		struct dm_monitor_stats *monitors;
+		char **paths;
+
+		monitors = realloc(st->monitors, size * sizeof(*monitors));
+		if (monitors == NULL)
+			goto exit_nomem;
+		st->monitors = monitors;
+		paths = realloc(st->paths, size * sizeof(*paths));
+		if (paths == NULL)
+			goto exit_nomem;
+		st->paths = paths;
+		st->size = size;
+	}
+
+	st->paths[st->nr_monitors] = strdup(path);
+	if (st->paths[st->nr_monitors] == NULL)
+		goto exit_nomem;
+	/* Counters are being written by the engine thread */
+	src = (const uint64_t *)ms;
+	dst = (uint64_t *)&st->monitors[st->nr_monitors++];
+	for (i = 0; i < sizeof(*ms) / sizeof(uint64_t); i++)
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+	return 0;
+
+ exit_nomem:
+	ERROR("Memory allocation failure.");
+	return -1;
+}
+
+int dm_stats_add_rule(struct dm_stats *st, const char *rule, uint64_t drops)
+{
+	struct dm_rule_stats *rs;
+
+	if (st->nr_rules == st->rules_size) {
+		size_t size = st->rules_size ? st->rules_size * 2 : 16;
+
+		rs = realloc(st->rules, size * sizeof(*rs));
+		if (rs == NULL)
+			goto exit_nomem;
+		st->rules = rs;
+		st->rules_size = size;
+	}
+
+	rs = &st->rules[st->nr_rules];
+	rs->rule = strdup(rule);
+	if (rs->rule == NULL)
+		goto exit_nomem;
+	rs->monitor = st->nr_monitors - 1;
+	rs->drops = drops;
+	st->nr_rules++;
+	return 0;
+
+ exit_nomem:
+	ERROR("Memory allocation failure.");
+	return -1;
+}
+
+void dm_stats_release(struct dm_stats *st)
+{
+	size_t i;
+
+	for (i = 0; i < st->nr_monitors; i++)
+		free(st->paths[i]);
+	for (i = 0; i < st->nr_rules; i++)
+		free(st->rules[i].rule);
+	free(st->paths);
+	free(st->monitors);
+	free(st->rules);
+	st->paths = NULL;
+	st->monitors = NULL;
+	st->rules = NULL;
+	st->nr_monitors = st->size = 0;
+	st->nr_rules = st->rules_size = 0;
+}
+
+static uint64_t __hist_count(const struct dm_stats *st, int id)
+{
+	uint64_t count = 0;
+	int j;
+
+	for (j = 0; j < DM_HIST_BUCKETS; j++)
+		count += st->buckets[id][j];
+	return count;
+}
+
+static json_object *__json_u64(uint64_t val)
+{
+	return json_object_new_int64((int64_t)val);
+}
+
+char *dm_stats_json(const struct dm_stats *st)
+{
+	json_object *root, *counters, *hists, *monitors;
+	char *out = NULL;
+	size_t m, r = 0;
+	int i, j;
+
+	root = json_object_new_object();
+	counters = json_object_new_object();
+	hists = json_object_new_object();
+	monitors = json_object_new_array();
+	if (root == NULL || counters == NULL || hists == NULL ||
+	    monitors == NULL) {
+		ERROR("Memory allocation failure.");
+		goto exit;
+	}
+
+	for (i = 0; i < DM_STAT_MAX; i++)
+		json_object_object_add(counters, stat_names[i],
+				       __json_u64(st->counters[i]));
+
+	for (i = 0; i < DM_HIST_MAX; i++) {
+		json_object *hist = json_object_new_object();
+		json_object *buckets = json_object_new_array();
+		int last = 0;
+
+		for (j = 0; j < DM_HIST_BUCKETS; j++)
+			if (st->buckets[i][j])
+				last = j + 1;
+		for (j = 0; j < last; j++)
+			json_object_array_add(buckets,
+					      __json_u64(st->buckets[i][j]));
+		json_object_object_add(hist, "count",
+				       __json_u64(__hist_count(st, i)));
+		json_object_object_add(hist, "sum", __json_u64(st->sums[i]));
+		json_object_object_add(hist, "buckets", buckets);
+		json_object_object_add(hists, hist_names[i], hist);
+	}
+
+	for (m = 0; m < st->nr_monitors; m++) {
+		const struct dm_monitor_stats *ms = &st->monitors[m];
+		json_object *obj = json_object_new_object();
+
+		json_object_object_add(obj, "dir",
+				       json_object_new_string(st->paths[m]));
+		json_object_object_add(obj, "events", __json_u64(ms->events));
+		json_object_object_add(obj, "batches", __json_u64(ms->batches));
+		json_object_object_add(obj, "messages",
+				       __json_u64(ms->messages));
+		json_object_object_add(obj, "drops", __json_u64(ms->drops));
+		json_object_object_add(obj, "overflows",
+				       __json_u64(ms->overflows));
+		json_object_object_add(obj, "filtered",
+				       __json_u64(ms->filtered));
+		json_object_object_add(obj, "storms", __json_u64(ms->storms));
+		json_object_object_add(obj, "summarized",
+				       __json_u64(ms->summarized));
+		json_object_object_add(obj, "rate_limit",
+				       __json_u64(ms->rate_limit));
+		json_object_object_add(obj, "summary", __json_u64(ms->summary));
+		/* Rules come in the order of their monitors */
+		if (r < st->nr_rules && st->rules[r].monitor == m) {
+			json_object *filters = json_object_new_object();
+
+			for (; r < st->nr_rules && st->rules[r].monitor == m;
+			     r++)
+				json_object_object_add(filters,
+						       st->rules[r].rule,
+						       __json_u64(st->rules[r].drops));
+			json_object_object_add(obj, "filters", filters);
+		}
+		json_object_array_add(monitors, obj);
+	}
+
+	json_object_object_add(root, "counters", counters);
+	json_object_object_add(root, "histograms", hists);
+	json_object_object_add(root, "queued", __json_u64(st->queued));
+	json_object_object_add(root, "monitors", monitors);
+	counters = hists = monitors = NULL;
+
+	out = strdup(json_object_to_json_string(root));
+	if (out == NULL)
+		ERROR("Memory allocation failure.");
+ exit:
+	json_object_put(counters);
+	json_object_put(hists);
+	json_object_put(monitors);
+	json_object_put(root);
+	return out;
+}
+
+/* Label value with backslash, quote and newline escaped */
+static void __prom_label(FILE *fp, const char *s)
+{
+	for (; *s; s++) {
+		if (*s == '\\' || *s == '"')
+			fputc('\\', fp);
+		if (*s == '\n')
+			fputs("\\n", fp);
+		else
+			fputc(*s, fp);
+	}
+}
+
+static void __prom_monitor(FILE *fp, const struct dm_stats *st,
+			   const char *name, size_t offset)
+{
+	size_t m;
+
+	fprintf(fp, "# TYPE dir_mon_monitor_%s_total counter\n", name);
+	for (m = 0; m < st->nr_monitors; m++) {
+		const char *ms = (const char *)&st->monitors[m];
+
+		fprintf(fp, "dir_mon_monitor_%s_total{dir=\"", name);
+		__prom_label(fp, st->paths[m]);
+		fprintf(fp, "\"} %llu\n",
+			(unsigned long long)*(const uint64_t *)(ms + offset));
+	}
+}
+
+static void __prom_monitor_gauge(FILE *fp, const struct dm_stats *st,
+				 const char *name, size_t offset)
+{
+	size_t m;
+
+	fprintf(fp, "# TYPE dir_mon_monitor_%s gauge\n", name);
+	for (m = 0; m < st->nr_monitors; m++) {
+		const char *ms = (const char *)&st->monitors[m];
+
+		fprintf(fp, "dir_mon_monitor_%s{dir=\"", name);
+		__prom_label(fp, st->paths[m]);
+		fprintf(fp, "\"} %llu\n",
+			(unsigned long long)*(const uint64_t *)(ms + offset));
+	}
+}
+
+int dm_stats_prometheus(const struct dm_stats *st, const char *path)
+{
+	char tmp[4096];
+	FILE *fp;
+	int i, j;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+		ERROR("Path too long '%s'", path);
+		return -1;
+	}
+
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		SYSERR("Failed to open '%s'.", tmp);
+		return -1;
+	}
+
+	for (i = 0; i < DM_STAT_MAX; i++)
+		fprintf(fp, "# TYPE dir_mon_%s_total counter\n"
+			"dir_mon_%s_total %llu\n", stat_names[i],
+			stat_names[i], (unsigned long long)st->counters[i]);
+
+	/* Bucket j holds values up to 2^j - 1 */
+	for (i = 0; i < DM_HIST_MAX; i++) {
+		uint64_t cumulative = 0;
+
+		fprintf(fp, "# TYPE dir_mon_%s histogram\n", hist_names[i]);
+		for (j = 0; j < DM_HIST_BUCKETS - 1; j++) {
+			cumulative += st->buckets[i][j];
+			fprintf(fp, "dir_mon_%s_bucket{le=\"%llu\"} %llu\n",
+				hist_names[i], (1ull << j) - 1,
+				(unsigned long long)cumulative);
+		}
+		cumulative += st->buckets[i][j];
+		fprintf(fp, "dir_mon_%s_bucket{le=\"+Inf\"} %llu\n"
+			"dir_mon_%s_sum %llu\n"
+			"dir_mon_%s_count %llu\n", hist_names[i],
+			(unsigned long long)cumulative, hist_names[i],
+			(unsigned long long)st->sums[i], hist_names[i],
+			(unsigned long long)cumulative);
+	}
+
+	fprintf(fp, "# TYPE dir_mon_queued gauge\ndir_mon_queued %llu\n",
+		(unsigned long long)st->queued);
+	fprintf(fp, "# TYPE dir_mon_monitors gauge\ndir_mon_monitors %zu\n",
+		st->nr_monitors);
+
+	__prom_monitor(fp, st, "events",
+		       offsetof(struct dm_monitor_stats, events));
+	__prom_monitor(fp, st, "batches",
+		       offsetof(struct dm_monitor_stats, batches));
+	__prom_monitor(fp, st, "messages",
+		       offsetof(struct dm_monitor_stats, messages));
+	__prom_monitor(fp, st, "drops",
+		       offsetof(struct dm_monitor_stats, drops));
+	__prom_monitor(fp, st, "overflows",
+		       offsetof(struct dm_monitor_stats, overflows));
+	__prom_monitor(fp, st, "filtered",
+		       offsetof(struct dm_monitor_stats, filtered));
+	__prom_monitor(fp, st, "storms",
+		       offsetof(struct dm_monitor_stats, storms));
+	__prom_monitor(fp, st, "summarized",
+		       offsetof(struct dm_monitor_stats, summarized));
+	__prom_monitor_gauge(fp, st, "rate_limit",
+			     offsetof(struct dm_monitor_stats, rate_limit));
+	__prom_monitor_gauge(fp, st, "summary",
+			     offsetof(struct dm_monitor_stats, summary));
+
+	fprintf(fp, "# TYPE dir_mon_monitor_filter_drops_total counter\n");
+	for (i = 0; i < (int)st->nr_rules; i++) {
+		fprintf(fp, "dir_mon_monitor_filter_drops_total{dir=\"");
+		__prom_label(fp, st->paths[st->rules[i].monitor]);
+		fprintf(fp, "\",rule=\"");
+		__prom_label(fp, st->rules[i].rule);
+		fprintf(fp, "\"} %llu\n",
+			(unsigned long long)st->rules[i].drops);
+	}
+
+	if (fclose(fp) != 0) {
+		SYSERR("Failed to write '%s'.", tmp);
+		remove(tmp);
+		return -1;
+	}
+	if (rename(tmp, path) != 0) {
+		SYSERR("Failed to rename '%s'.", tmp);
+		remove(tmp);
+		return -1;
+	}
+	return 0;
+}
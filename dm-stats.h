@@ -0,0 +1,247 @@
+#ifndef DM_STATS_H_INCLUDED
+#define DM_STATS_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Global counters */
+enum dm_stat {
+	/* read() calls returning kernel events, and their bytes */
+	DM_STAT_READS,
+	DM_STAT_READ_BYTES,
+	/* System calls of the engine waiting for and reading kernel events */
+	DM_STAT_SYSCALLS,
+	/* Events by type */
+	DM_STAT_EV_MODIFY,
+	DM_STAT_EV_DELETE,
+	DM_STAT_EV_CREATE,
+	DM_STAT_EV_MOVED_FROM,
+	DM_STAT_EV_MOVED_TO,
+	DM_STAT_EV_DELETE_SELF,
+	DM_STAT_EV_CLOSE_WRITE,
+	DM_STAT_EV_OTHER,
+	/* Kernel event queue overflows */
+	DM_STAT_OVERFLOWS,
+	/* Directory rescans */
+	DM_STAT_RESCANS,
+	/* Batches flushed, messages handed to sinks and their bytes */
+	DM_STAT_BATCHES,
+	DM_STAT_MESSAGES,
+	DM_STAT_MESSAGE_BYTES,
+	/* Messages a sink did not take */
+	DM_STAT_SINK_DROPS,
+	/* Messages dropped on a full publish queue */
+	DM_STAT_QUEUE_DROPS,
+	/* Failed publish calls and lost broker connections */
+	DM_STAT_BROKER_ERRORS,
+	DM_STAT_BROKER_DISCONNECTS,
+	/* Journaled messages lost to the journal size limit */
+	DM_STAT_JOURNAL_DROPS,
+	/* Files left out because their fingerprint did not change */
+	DM_STAT_UNCHANGED,
+	/* Events dropped by include/exclude filters */
+	DM_STAT_FILTERED,
+	/* File metadata looked up for messages, and served from the cache */
+	DM_STAT_STATX,
+	DM_STAT_METADATA_CACHED,
+	/* Event storms of directories, and names folded into summaries */
+	DM_STAT_STORMS,
+	DM_STAT_SUMMARIZED,
+	/* Times the publisher held messages back at the in-flight limit */
+	DM_STAT_INFLIGHT_WAITS,
+	DM_STAT_MAX,
+};
+
+/* Histograms; bucket i counts values below 2^i, the last one the rest */
+enum dm_hist {
+	/* Bytes returned by a read() of kernel events */
+	DM_HIST_READ_BYTES,
+	/* Events in a flushed batch */
+	DM_HIST_BATCH_EVENTS,
+	/* Time from first event to flush of a batch, microseconds */
+	DM_HIST_BATCH_DELAY_US,
+	/* Time spent encoding and handing out a batch, microseconds */
+	DM_HIST_BATCH_BUILD_US,
+	/* Time a message waited in the publish queue, microseconds */
+	DM_HIST_PUBLISH_US,
+	/* Publish queue depth seen by a new message */
+	DM_HIST_QUEUE_DEPTH,
+	/* Time spent appending a message to the journal, microseconds */
+	DM_HIST_JOURNAL_APPEND_US,
+	DM_HIST_MAX,
+};
+
+#define DM_HIST_BUCKETS		32
+
+/**
+ * Counters of one thread. Only the owning thread writes them, so updates
+ * are plain increments; readers sum the blocks of all threads. A block of
+ * an exited thread is kept and handed to the next new thread.
+ */
+struct dm_stats_block {
+	uint64_t counters[DM_STAT_MAX];
+	uint64_t buckets[DM_HIST_MAX][DM_HIST_BUCKETS];
+	uint64_t sums[DM_HIST_MAX];
+	struct dm_stats_block *next;
+};
+
+extern __thread struct dm_stats_block *dm_stats_self;
+
+/* Block of the calling thread, registered on first use; NULL on failure */
+struct dm_stats_block *dm_stats_register(void);
+
+static inline struct dm_stats_block *__stats_block(void)
+{
+	struct dm_stats_block *b = dm_stats_self;
+
+	return b ? b : dm_stats_register();
+}
+
+/* Single writer: relaxed stores keep readers from seeing torn values */
+static inline void __stats_add(uint64_t *p, uint64_t val)
+{
+	__atomic_store_n(p, *p + val, __ATOMIC_RELAXED);
+}
+
+static inline void dm_stat_add(enum dm_stat id, uint64_t val)
+{
+	struct dm_stats_block *b = __stats_block();
+
+	if (b)
+		__stats_add(&b->counters[id], val);
+}
+
+static inline void dm_stat_inc(enum dm_stat id)
+{
+	dm_stat_add(id, 1);
+}
+
+static inline void dm_hist_add(enum dm_hist id, uint64_t val)
+{
+	struct dm_stats_block *b = __stats_block();
+	unsigned int i;
+
+	if (b == NULL)
+		return;
+	i = val ? 64 - __builtin_clzll(val) : 0;
+	if (i >= DM_HIST_BUCKETS)
+		i = DM_HIST_BUCKETS - 1;
+	__stats_add(&b->buckets[id][i], 1);
+	__stats_add(&b->sums[id], val);
+}
+
+/**
+ * This function counts an event by type.
+ *
+ * @param: mask	inotify event mask.
+ * @return: No return.
+ */
+void dm_stats_event(uint32_t mask);
+
+/*
+ * Counters of one monitor, written by its engine thread only with relaxed
+ * stores, read from other threads with relaxed loads; all are uint64_t.
+ */
+struct dm_monitor_stats {
+	uint64_t events;
+	uint64_t batches;
+	uint64_t messages;
+	uint64_t drops;
+	uint64_t overflows;
+	uint64_t filtered;
+	/* Event storms, and names reported in summaries only */
+	uint64_t storms;
+	uint64_t summarized;
+	/* Names per second before summaries, 0 = no limit */
+	uint64_t rate_limit;
+	/* 1 while a storm is summarized */
+	uint64_t summary;
+};
+
+/* Drops counted for a filter rule of a monitor */
+struct dm_rule_stats {
+	/* Index of the monitor in struct dm_stats */
+	size_t monitor;
+	char *rule;
+	uint64_t drops;
+};
+
+/* Totals of all threads plus per-monitor counters */
+struct dm_stats {
+	uint64_t counters[DM_STAT_MAX];
+	uint64_t buckets[DM_HIST_MAX][DM_HIST_BUCKETS];
+	uint64_t sums[DM_HIST_MAX];
+	/* Messages waiting in sinks */
+	uint64_t queued;
+	/* Per-monitor counters and directory paths */
+	struct dm_monitor_stats *monitors;
+	char **paths;
+	size_t nr_monitors;
+	size_t size;
+	/* Filter rules of the monitors */
+	struct dm_rule_stats *rules;
+	size_t nr_rules;
+	size_t rules_size;
+};
+
+/**
+ * This function sums the counters of all threads into the totals.
+ *
+ * @param: st	Totals to fill; monitors are left alone.
+ * @return: No return.
+ */
+void dm_stats_collect(struct dm_stats *st);
+
+/**
+ * This function appends a monitor to the totals.
+ *
+ * @param: st	Totals.
+ * @param: path	Directory path; copied.
+ * @param: ms	Counters of the monitor, read with relaxed loads.
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_stats_add_monitor(struct dm_stats *st, const char *path,
+			 const struct dm_monitor_stats *ms);
+
+/**
+ * This function appends a filter rule to the monitor appended last.
+ *
+ * @param: st		Totals with at least one monitor.
+ * @param: rule		Description of the rule; copied.
+ * @param: drops	Events the rule dropped.
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_stats_add_rule(struct dm_stats *st, const char *rule, uint64_t drops);
+
+/**
+ * This function frees the monitors of the totals.
+ *
+ * @param: st	Totals.
+ * @return: No return.
+ */
+void dm_stats_release(struct dm_stats *st);
+
+/**
+ * This function formats the totals as JSON:
+ *	{"counters":{...},"histograms":{"<name>":{"count":n,"sum":n,
+ *	 "buckets":[...]},...},"queued":n,"monitors":[{"dir":..,...,
+ *	 "filters":{"<rule>":n,...}}]}
+ * Bucket i of a histogram counts values below 2^i; trailing empty
+ * buckets are left out.
+ *
+ * @param: st	Totals.
+ * @return: Allocated string, to be freed by the caller, or NULL.
+ */
+char *dm_stats_json(const struct dm_stats *st);
+
+/**
+ * This function writes the totals in Prometheus text format. The file is
+ * replaced atomically.
+ *
+ * @param: st	Totals.
+ * @param: path	File to write.
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_stats_prometheus(const struct dm_stats *st, const char *path);
+
+#endif /* DM_STATS_H_INCLUDED */
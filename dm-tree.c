@@ -0,0 +1,384 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "dm-tree.h"
+#include "internals.h"
+#include "debug.h"
+
+
+/* Initial number of slots in the index (power of 2) */
+#define TREE_MIN_SLOTS		16
+/* Pending directories before helper threads join a walk */
+#define WALK_PARALLEL_MIN	32
+
+struct tree_slot {
+	/* Watch descriptor; 0 marks an empty slot */
+	int wd;
+	char *relpath;
+};
+
+static inline size_t __slot_hash(int wd, size_t nr_slots)
+{
+	return hash_32(wd) & (nr_slots - 1);
+}
+
+static struct tree_slot *__slot_find(const struct dm_tree *tree, int wd)
+{
+	size_t i;
+
+	if (!tree->nr_slots)
+		return NULL;
+
+	i = __slot_hash(wd, tree->nr_slots);
+	while (tree->slots[i].wd) {
+		if (tree->slots[i].wd == wd)
+			return &tree->slots[i];
+		i = (i + 1) & (tree->nr_slots - 1);
+	}
+	return NULL;
+}
+
+static void __slot_place(struct tree_slot *slots, size_t nr_slots,
+			 int wd, char *relpath)
+{
+	size_t i = __slot_hash(wd, nr_slots);
+
+	while (slots[i].wd)
+		i = (i + 1) & (nr_slots - 1);
+	slots[i].wd = wd;
+	slots[i].relpath = relpath;
+}
+
+static void __slot_delete(struct dm_tree *tree, struct tree_slot *slot)
+{
+	size_t mask = tree->nr_slots - 1;
+	size_t i = slot - tree->slots;
+	size_t j = i;
+
+	free(slot->relpath);
+
+	/* Backward shift deletion keeps probe chains intact */
+	for (;;) {
+		size_t home;
+
+		j = (j + 1) & mask;
+		if (!tree->slots[j].wd)
+			break;
+		home = __slot_hash(tree->slots[j].wd, tree->nr_slots);
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			tree->slots[i] = tree->slots[j];
+			i = j;
+		}
+	}
+	tree->slots[i].wd = 0;
+	tree->slots[i].relpath = NULL;
+	tree->nr_used--;
+}
+
+void dm_tree_init(struct dm_tree *tree)
+{
+	tree->slots = NULL;
+	tree->nr_slots = 0;
+	tree->nr_used = 0;
+}
+
+void dm_tree_release(struct dm_tree *tree)
+{
+	size_t i;
+
+	for (i = 0; i < tree->nr_slots; i++)
+		free(tree->slots[i].relpath);
+	free(tree->slots);
+	dm_tree_init(tree);
+}
+
+int dm_tree_insert(struct dm_tree *tree, int wd, const char *relpath)
+{
+	struct tree_slot *slot = __slot_find(tree, wd);
+	char *copy = strdup(relpath);
+
+	if (copy == NULL) {
+		ERROR("Memory allocation failure.");
+		return -1;
+	}
+
+	if (slot) {
+		free(slot->relpath);
+		slot->relpath = copy;
+		return 0;
+	}
+
+	/* Keep load factor under 1/2 */
+	if ((tree->nr_used + 1) * 2 > tree->nr_slots) {
+		size_t i, nr_slots = tree->nr_slots ? tree->nr_slots * 2 :
+						      TREE_MIN_SLOTS;
+		struct tree_slot *slots = calloc(nr_slots, sizeof(*slots));
+
+		if (slots == NULL) {
+			ERROR("Memory allocation failure.");
+			free(copy);
+			return -1;
+		}
+		for (i = 0; i < tree->nr_slots; i++)
+			if (tree->slots[i].wd)
+				__slot_place(slots, nr_slots, tree->slots[i].wd,
+					     tree->slots[i].relpath);
+		free(tree->slots);
+		tree->slots = slots;
+		tree->nr_slots = nr_slots;
+	}
+
+	__slot_place(tree->slots, tree->nr_slots, wd, copy);
+	tree->nr_used++;
+	return 0;
+}
+
+const char *dm_tree_lookup(const struct dm_tree *tree, int wd)
+{
+	struct tree_slot *slot = __slot_find(tree, wd);
+
+	return slot ? slot->relpath : NULL;
+}
+
+void dm_tree_remove(struct dm_tree *tree, int wd)
+{
+	struct tree_slot *slot = __slot_find(tree, wd);
+
+	if (slot)
+		__slot_delete(tree, slot);
+}
+
+static int __in_subtree(const char *path, const char *dir, size_t dir_len)
+{
+	/* Root holds everything */
+	if (!dir_len)
+		return 1;
+	return !strncmp(path, dir, dir_len) &&
+	       (path[dir_len] == '\0' || path[dir_len] == '/');
+}
+
+void dm_tree_remove_subtree(struct dm_tree *tree, const char *relpath,
+			    void (*fn)(int wd, void *arg), void *arg)
+{
+	size_t len = strlen(relpath);
+	size_t i = 0;
+
+	/* Deletion shifts entries back, so rescan the same slot */
+	while (i < tree->nr_slots) {
+		struct tree_slot *slot = &tree->slots[i];
+		int wd = slot->wd;
+
+		if (wd && __in_subtree(slot->relpath, relpath, len)) {
+			__slot_delete(tree, slot);
+			if (fn)
+				fn(wd, arg);
+			continue;
+		}
+		i++;
+	}
+}
+
+void dm_tree_foreach(const struct dm_tree *tree,
+		     void (*fn)(int wd, const char *relpath, void *arg),
+		     void *arg)
+{
+	size_t i;
+
+	for (i = 0; i < tree->nr_slots; i++)
+		if (tree->slots[i].wd)
+			fn(tree->slots[i].wd, tree->slots[i].relpath, arg);
+}
+
+struct walk {
+	const char *root;
+	dm_walk_fn visit;
+	void *arg;
+	/* Stack of directories to list, protected by lock */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char **stack;
+	size_t nr_pending;
+	size_t stack_size;
+	/* Threads listing a directory right now */
+	unsigned int nr_busy;
+	/* Helper threads */
+	pthread_t *tids;
+	unsigned int nr_helpers;
+	unsigned int max_helpers;
+};
+
+static void *walk_thread(void *arg);
+
+/* Queue a directory for listing; lock held */
+static int __walk_push(struct walk *w, char *relpath)
+{
+	if (w->nr_pending == w->stack_size) {
+		size_t size = w->stack_size ? w->stack_size * 2 : 64;
+		char **stack = realloc(w->stack, size * sizeof(char *));
+
+		if (stack == NULL) {
+			ERROR("Memory allocation failure.");
+			return -1;
+		}
+		w->stack = stack;
+		w->stack_size = size;
+	}
+	w->stack[w->nr_pending++] = relpath;
+
+	/* Large tree: bring in helpers */
+	if (w->nr_pending > WALK_PARALLEL_MIN &&
+	    w->nr_helpers < w->max_helpers &&
+	    pthread_create(&w->tids[w->nr_helpers], NULL, walk_thread, w) == 0)
+		w->nr_helpers++;
+
+	pthread_cond_signal(&w->cond);
+	return 0;
+}
+
+static void __walk_dir(struct walk *w, const char *relpath)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	DIR *dir;
+
+	if (*relpath)
+		snprintf(path, sizeof(path), "%s/%s", w->root, relpath);
+	else
+		snprintf(path, sizeof(path), "%s", w->root);
+
+	dir = opendir(path);
+	if (dir == NULL) {
+		DEBUG("opendir('%s') failed : %s", path, strerror(errno));
+		return;
+	}
+
+	while ((de = readdir(dir)) != NULL) {
+		char child_path[PATH_MAX];
+		char *child;
+		int is_dir = (de->d_type == DT_DIR);
+
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		if (de->d_type == DT_UNKNOWN) {
+			struct stat st;
+
+			if (fstatat(dirfd(dir), de->d_name, &st,
+				    AT_SYMLINK_NOFOLLOW) != 0)
+				continue;
+			is_dir = S_ISDIR(st.st_mode);
+		}
+
+		if (snprintf(child_path, sizeof(child_path), "%s/%s",
+			     path, de->d_name) >= (int)sizeof(child_path))
+			continue;
+
+		child = malloc(strlen(relpath) + strlen(de->d_name) + 2);
+		if (child == NULL) {
+			ERROR("Memory allocation failure.");
+			break;
+		}
+		if (*relpath)
+			sprintf(child, "%s/%s", relpath, de->d_name);
+		else
+			strcpy(child, de->d_name);
+
+		if (w->visit(w->arg, child_path, child, is_dir) != 0 ||
+		    !is_dir) {
+			free(child);
+			continue;
+		}
+
+		pthread_mutex_lock(&w->lock);
+		if (__walk_push(w, child) != 0)
+			free(child);
+		pthread_mutex_unlock(&w->lock);
+	}
+	closedir(dir);
+}
+
+static void *walk_thread(void *arg)
+{
+	struct walk *w = (struct walk *)arg;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		char *relpath;
+
+		while (!w->nr_pending && w->nr_busy)
+			pthread_cond_wait(&w->cond, &w->lock);
+
+		/* Nothing pending and nobody to produce more */
+		if (!w->nr_pending)
+			break;
+
+		relpath = w->stack[--w->nr_pending];
+		w->nr_busy++;
+		pthread_mutex_unlock(&w->lock);
+
+		__walk_dir(w, relpath);
+		free(relpath);
+
+		pthread_mutex_lock(&w->lock);
+		if (--w->nr_busy == 0 && !w->nr_pending)
+			pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+int dm_tree_walk(const char *root, const char *relpath,
+		 unsigned int nr_threads, dm_walk_fn visit, void *arg)
+{
+	struct walk w;
+	char *start;
+	unsigned int i;
+
+	memset(&w, 0, sizeof(w));
+	w.root = root;
+	w.visit = visit;
+	w.arg = arg;
+	w.max_helpers = nr_threads > 1 ? nr_threads - 1 : 0;
+
+	if (w.max_helpers) {
+		w.tids = calloc(w.max_helpers, sizeof(pthread_t));
+		if (w.tids == NULL) {
+			ERROR("Memory allocation failure.");
+			return -1;
+		}
+	}
+
+	start = strdup(relpath);
+	if (start == NULL) {
+		ERROR("Memory allocation failure.");
+		free(w.tids);
+		return -1;
+	}
+
+	pthread_mutex_init(&w.lock, NULL);
+	pthread_cond_init(&w.cond, NULL);
+
+	pthread_mutex_lock(&w.lock);
+	if (__walk_push(&w, start) != 0)
+		free(start);
+	pthread_mutex_unlock(&w.lock);
+
+	/* Caller takes part in the walk */
+	walk_thread(&w);
+
+	for (i = 0; i < w.nr_helpers; i++)
+		pthread_join(w.tids[i], NULL);
+
+	pthread_cond_destroy(&w.cond);
+	pthread_mutex_destroy(&w.lock);
+	free(w.stack);
+	free(w.tids);
+	return 0;
+}
@@ -0,0 +1,113 @@
+#ifndef DM_TREE_H_INCLUDED
+#define DM_TREE_H_INCLUDED
+
+#include <stddef.h>
+
+struct tree_slot;
+
+/* Index of the watched subdirectories of a monitored tree */
+struct dm_tree {
+	/* wd -> relative path, open addressing */
+	struct tree_slot *slots;
+	size_t nr_slots;
+	size_t nr_used;
+};
+
+/**
+ * This function initializes an empty index.
+ *
+ * @param: tree	Index to initialize.
+ * @return: No return.
+ */
+void dm_tree_init(struct dm_tree *tree);
+
+/**
+ * This function frees the index and all the paths it holds.
+ *
+ * @param: tree	A valid index.
+ * @return: No return.
+ */
+void dm_tree_release(struct dm_tree *tree);
+
+/**
+ * This function maps a watch descriptor to a path relative to the
+ * monitored root. An existing mapping of the descriptor is replaced.
+ *
+ * @param: tree		A valid index.
+ * @param: wd		Watch descriptor.
+ * @param: relpath	Relative path; the index keeps its own copy.
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_tree_insert(struct dm_tree *tree, int wd, const char *relpath);
+
+/**
+ * This function looks up the relative path of a watch descriptor.
+ *
+ * @param: tree	A valid index.
+ * @param: wd	Watch descriptor.
+ * @return: Relative path or NULL when the descriptor is not indexed.
+ */
+const char *dm_tree_lookup(const struct dm_tree *tree, int wd);
+
+/**
+ * This function removes a watch descriptor from the index.
+ *
+ * @param: tree	A valid index.
+ * @param: wd	Watch descriptor.
+ * @return: No return.
+ */
+void dm_tree_remove(struct dm_tree *tree, int wd);
+
+/**
+ * This function removes the directory and everything below it from the
+ * index, calling fn for every removed watch descriptor.
+ *
+ * @param: tree		A valid index.
+ * @param: relpath	Relative path of the directory.
+ * @param: fn		Callback, may be NULL.
+ * @param: arg		Argument passed to the callback.
+ * @return: No return.
+ */
+void dm_tree_remove_subtree(struct dm_tree *tree, const char *relpath,
+			    void (*fn)(int wd, void *arg), void *arg);
+
+/**
+ * This function calls fn for every indexed watch descriptor.
+ *
+ * @param: tree	A valid index.
+ * @param: fn	Callback.
+ * @param: arg	Argument passed to the callback.
+ * @return: No return.
+ */
+void dm_tree_foreach(const struct dm_tree *tree,
+		     void (*fn)(int wd, const char *relpath, void *arg),
+		     void *arg);
+
+/**
+ * Visitor of dm_tree_walk(). Called for every entry found, possibly from
+ * several threads at once.
+ *
+ * @param: arg		Argument given to dm_tree_walk().
+ * @param: path		Path of the entry.
+ * @param: relpath	Path of the entry relative to the walked root.
+ * @param: is_dir	Entry is a directory (symlinks are not followed).
+ * @return: 0 to descend into a directory, -1 to skip it.
+ */
+typedef int (*dm_walk_fn)(void *arg, const char *path, const char *relpath,
+			  int is_dir);
+
+/**
+ * This function walks the tree below root/relpath and calls visit for
+ * every entry. Large trees are walked by up to nr_threads threads.
+ *
+ * @param: root		Root directory path.
+ * @param: relpath	Directory to start from relative to root, "" for root.
+ * @param: nr_threads	Maximum number of threads including the caller.
+ * @param: visit	Visitor function.
+ * @param: arg		Argument passed to the visitor.
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_tree_walk(const char *root, const char *relpath,
+		 unsigned int nr_threads, dm_walk_fn visit, void *arg);
+
+#endif /* DM_TREE_H_INCLUDED */
@@ -0,0 +1,371 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "dm-uring.h"
+#include "debug.h"
+
+
+/* Submission queue size; the read and the poll are queued at most */
+#define URING_ENTRIES		4
+/* Buffer group of the read */
+#define URING_BGID		0
+/* user_data of the two requests */
+#define URING_READ		1
+#define URING_POLL		2
+/* Opcode added in 6.7, missing in older headers */
+#define URING_OP_READ_MULTISHOT	49
+
+struct dm_uring {
+	/* Ring, descriptor read and descriptor polled */
+	int ring_fd;
+	int fd;
+	int poll_fd;
+	/* Submission queue */
+	void *sq_ring;
+	size_t sq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	/* Completion queue, in the mapping of the submission queue */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* Buffer ring registered with the kernel and buffers */
+	struct io_uring_buf_ring *br;
+	size_t br_size;
+	char *buffs;
+	size_t buffs_size;
+	size_t buff_size;
+	unsigned int nr_buffs;
+	/* Multishot read is supported */
+	unsigned int multishot : 1;
+};
+
+static inline int __setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int __enter(int fd, unsigned int to_submit,
+			  unsigned int min_complete, unsigned int flags,
+			  const struct io_uring_getevents_arg *arg)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			    flags, arg, sizeof(*arg));
+}
+
+static inline int __register(int fd, unsigned int op, void *arg,
+			     unsigned int nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, op, arg, nr_args);
+}
+
+static int __op_supported(int ring_fd, unsigned int op)
+{
+	size_t len = sizeof(struct io_uring_probe) +
+		     256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, len);
+	int ret = 0;
+
+	if (probe == NULL)
+		return 0;
+	if (__register(ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+	    op <= probe->last_op && op < probe->ops_len)
+		ret = !!(probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	return ret;
+}
+
+/* Hand a buffer back to the kernel */
+static inline void __recycle(struct dm_uring *u, unsigned int bid)
+{
+	unsigned short tail = u->br->tail;
+	struct io_uring_buf *buf = &u->br->bufs[tail & (u->nr_buffs - 1)];
+
+	buf->addr = (unsigned long)(u->buffs + bid * u->buff_size);
+	buf->len = u->buff_size;
+	buf->bid = bid;
+	__atomic_store_n(&u->br->tail, (unsigned short)(tail + 1),
+			 __ATOMIC_RELEASE);
+}
+
+static int __map_rings(struct dm_uring *u, const struct io_uring_params *p)
+{
+	size_t cq_size = p->cq_off.cqes +
+			 p->cq_entries * sizeof(struct io_uring_cqe);
+	char *sq;
+
+	/* Both queues share one mapping */
+	u->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+	if (u->sq_ring_size < cq_size)
+		u->sq_ring_size = cq_size;
+
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, u->ring_fd,
+			  IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED) {
+		u->sq_ring = NULL;
+		return -1;
+	}
+
+	u->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		return -1;
+	}
+
+	sq = (char *)u->sq_ring;
+	u->sq_head = (unsigned int *)(sq + p->sq_off.head);
+	u->sq_tail = (unsigned int *)(sq + p->sq_off.tail);
+	u->sq_mask = (unsigned int *)(sq + p->sq_off.ring_mask);
+	u->sq_array = (unsigned int *)(sq + p->sq_off.array);
+	u->cq_head = (unsigned int *)(sq + p->cq_off.head);
+	u->cq_tail = (unsigned int *)(sq + p->cq_off.tail);
+	u->cq_mask = (unsigned int *)(sq + p->cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(sq + p->cq_off.cqes);
+	return 0;
+}
+
+static int __register_buffers(struct dm_uring *u)
+{
+	struct io_uring_buf_reg reg;
+	unsigned int i;
+
+	u->br_size = u->nr_buffs * sizeof(struct io_uring_buf);
+	u->br = mmap(NULL, u->br_size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->br == MAP_FAILED) {
+		u->br = NULL;
+		return -1;
+	}
+
+	u->buffs_size = u->nr_buffs * u->buff_size;
+	u->buffs = mmap(NULL, u->buffs_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->buffs == MAP_FAILED) {
+		u->buffs = NULL;
+		return -1;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)u->br;
+	reg.ring_entries = u->nr_buffs;
+	reg.bgid = URING_BGID;
+	if (__register(u->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+		return -1;
+
+	for (i = 0; i < u->nr_buffs; i++)
+		__recycle(u, i);
+	return 0;
+}
+
+int dm_uring_create(struct dm_uring **out, int fd, int poll_fd,
+		    unsigned int nr_buffs, size_t buff_size)
+{
+	struct io_uring_params p;
+	struct dm_uring *u = NULL;
+
+	u = calloc(1, sizeof(struct dm_uring));
+	if (u == NULL) {
+		ERROR("Memory allocation failure.");
+		return -1;
+	}
+	u->fd = fd;
+	u->poll_fd = poll_fd;
+	u->nr_buffs = nr_buffs;
+	u->buff_size = buff_size;
+
+	/* Completions are run while waiting, no need to interrupt the thread */
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_COOP_TASKRUN;
+	u->ring_fd = __setup(URING_ENTRIES, &p);
+	if (u->ring_fd < 0 && errno == EINVAL) {
+		memset(&p, 0, sizeof(p));
+		u->ring_fd = __setup(URING_ENTRIES, &p);
+	}
+	if (u->ring_fd < 0) {
+		DEBUG("io_uring_setup() failed : %s", strerror(errno));
+		free(u);
+		return -1;
+	}
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || __map_rings(u, &p) != 0) {
+		DEBUG("io_uring ring mapping failed : %s", strerror(errno));
+		goto exit_destroy;
+	}
+
+	if (__register_buffers(u) != 0) {
+		DEBUG("io_uring buffer ring failed : %s", strerror(errno));
+		goto exit_destroy;
+	}
+
+	u->multishot = __op_supported(u->ring_fd, URING_OP_READ_MULTISHOT);
+	*out = u;
+	return 0;
+
+ exit_destroy:
+	dm_uring_destroy(u);
+	return -1;
+}
+
+void dm_uring_destroy(struct dm_uring *u)
+{
+	if (u == NULL)
+		return;
+
+	/* Closing the ring cancels the read and drops the registration */
+	close(u->ring_fd);
+	if (u->sqes)
+		munmap(u->sqes, u->sqes_size);
+	if (u->sq_ring)
+		munmap(u->sq_ring, u->sq_ring_size);
+	if (u->buffs)
+		munmap(u->buffs, u->buffs_size);
+	if (u->br)
+		munmap(u->br, u->br_size);
+	free(u);
+}
+
+/* Queue a request; submitted by the next io_uring_enter() */
+static void __queue(struct dm_uring *u, unsigned long long user_data)
+{
+	unsigned int tail = *u->sq_tail;
+	unsigned int idx = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->user_data = user_data;
+	if (user_data == URING_POLL) {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = u->poll_fd;
+		sqe->poll32_events = EPOLLIN;
+		sqe->len = IORING_POLL_ADD_MULTI;
+	} else {
+		sqe->fd = u->fd;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BGID;
+		/* Not seekable, no position */
+		sqe->off = (__u64)-1;
+		if (u->multishot) {
+			sqe->opcode = URING_OP_READ_MULTISHOT;
+		} else {
+			sqe->opcode = IORING_OP_READ;
+			sqe->len = u->buff_size;
+		}
+	}
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static inline unsigned int __to_submit(const struct dm_uring *u)
+{
+	return *u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+}
+
+int dm_uring_start(struct dm_uring *u)
+{
+	struct io_uring_getevents_arg arg;
+	int ret;
+
+	memset(&arg, 0, sizeof(arg));
+	__queue(u, URING_READ);
+	__queue(u, URING_POLL);
+	do {
+		ret = __enter(u->ring_fd, __to_submit(u), 0,
+			      IORING_ENTER_EXT_ARG, &arg);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0) {
+		SYSERR("io_uring_enter() failed.");
+		return -1;
+	}
+	return 0;
+}
+
+int dm_uring_wait(struct dm_uring *u, int timeout, dm_uring_fn fn, void *arg,
+		  int *ready)
+{
+	struct io_uring_getevents_arg ext;
+	struct __kernel_timespec ts;
+	unsigned int head = *u->cq_head;
+	unsigned int tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	unsigned int submit = __to_submit(u);
+	int calls = 0, failed = 0;
+
+	*ready = 0;
+
+	/* Wait only with nothing to take; submit what was queued again */
+	if (submit || (head == tail && timeout != 0)) {
+		unsigned int flags = IORING_ENTER_EXT_ARG;
+		unsigned int wait = 0;
+
+		memset(&ext, 0, sizeof(ext));
+		if (head == tail && timeout != 0) {
+			flags |= IORING_ENTER_GETEVENTS;
+			wait = 1;
+			if (timeout > 0) {
+				ts.tv_sec = timeout / 1000;
+				ts.tv_nsec = (long long)(timeout % 1000) *
+					     1000000;
+				ext.ts = (unsigned long)&ts;
+			}
+		}
+		calls++;
+		if (__enter(u->ring_fd, submit, wait, flags, &ext) < 0 &&
+		    errno != EINTR && errno != ETIME && errno != EBUSY) {
+			SYSERR("io_uring_enter() failed.");
+			return -1;
+		}
+		tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	}
+
+	for (; head != tail; head++) {
+		const struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+		int more = cqe->flags & IORING_CQE_F_MORE;
+		unsigned int bid;
+
+		if (cqe->user_data == URING_POLL) {
+			if (cqe->res > 0)
+				*ready = 1;
+			else if (cqe->res != -ECANCELED)
+				failed = -cqe->res;
+			if (!more)
+				__queue(u, URING_POLL);
+			continue;
+		}
+
+		if (cqe->flags & IORING_CQE_F_BUFFER) {
+			bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			if (cqe->res > 0)
+				fn(arg, u->buffs + bid * u->buff_size,
+				   cqe->res);
+			__recycle(u, bid);
+		}
+
+		/* Out of buffers or interrupted: queue again */
+		if (cqe->res < 0 && cqe->res != -ENOBUFS &&
+		    cqe->res != -EAGAIN && cqe->res != -EINTR)
+			failed = -cqe->res;
+		if (!more)
+			__queue(u, URING_READ);
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+	if (failed) {
+		errno = failed;
+		SYSERR("io_uring request failed.");
+		return -1;
+	}
+	return calls;
+}
@@ -0,0 +1,72 @@
+#ifndef DM_URING_H_INCLUDED
+#define DM_URING_H_INCLUDED
+
+#include <stddef.h>
+
+struct dm_uring;
+
+/* Called for every completed read with the bytes read into a buffer */
+typedef void (*dm_uring_fn)(void *arg, const char *buff, size_t len);
+
+/**
+ * io_uring reading one descriptor and polling another: a multishot read
+ * (or on kernels before 6.7 a read queued again on completion) stays
+ * queued on the first one and picks its buffer from a ring registered
+ * with the kernel, so data is read straight into a buffer handed to the
+ * caller and recycled once consumed. The second descriptor, typically an
+ * epoll instance serving everything else, is watched by a multishot poll,
+ * so a thread can wait for both in one io_uring_enter() call. Everything
+ * is driven through the raw system calls, no liburing is needed.
+ *
+ * Completions are posted on the thread that queued the requests, so after
+ * creation the object belongs to the thread calling dm_uring_start().
+ */
+
+/**
+ * This function sets up the ring and its buffers. It fails when the kernel
+ * lacks io_uring or provided buffer rings (5.19), or when io_uring is
+ * disabled, and the caller is expected to use plain reads then.
+ *
+ * @param: out		Storage location to keep allocated object.
+ * @param: fd		Descriptor to read, in non-blocking mode.
+ * @param: poll_fd	Descriptor to poll for input.
+ * @param: nr_buffs	Number of buffers (power of 2).
+ * @param: buff_size	Size of a buffer.
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_uring_create(struct dm_uring **out, int fd, int poll_fd,
+		    unsigned int nr_buffs, size_t buff_size);
+
+/**
+ * This function releases the ring, cancelling the queued requests.
+ *
+ * @param: u	A valid object or NULL.
+ * @return: No return.
+ */
+void dm_uring_destroy(struct dm_uring *u);
+
+/**
+ * This function queues the read and the poll. Owning thread only.
+ *
+ * @param: u	A valid object.
+ * @return: 0 on success or -1 on failure.
+ */
+int dm_uring_start(struct dm_uring *u);
+
+/**
+ * This function waits for completions, hands the completed reads to the
+ * callback, recycles their buffers and queues again requests which
+ * stopped. Owning thread only.
+ *
+ * @param: u		A valid object.
+ * @param: timeout	Longest wait in milliseconds, -1 = no limit,
+ *			0 = only take completions already posted.
+ * @param: fn		Callback.
+ * @param: arg		Argument of the callback.
+ * @param: ready	Set to 1 when the polled descriptor has input.
+ * @return: Number of system calls made, or -1 when reads fail for good.
+ */
+int dm_uring_wait(struct dm_uring *u, int timeout, dm_uring_fn fn, void *arg,
+		  int *ready);
+
+#endif /* DM_URING_H_INCLUDED */
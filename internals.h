@@ -1,6 +1,9 @@
 #ifndef INTERNALS_H_INCLUDED
 #define INTERNALS_H_INCLUDED
 
+#include <stddef.h>
+#include <stdint.h>
+
 /* Indirect stringification.  Doing two levels allows the parameter to be a
  * macro itself.  For example, compile with -DFOO=bar, __stringify(FOO)
  * converts to "bar".
@@ -19,7 +22,49 @@
 
 #define TOPIC_PREFIX	stringify(DIR_MONITOR/)
 
+/* Topic of statistics messages */
+#define TOPIC_STATS	TOPIC_PREFIX "stats"
+
+/* Topic of command acknowledgements */
+#define TOPIC_ACK	TOPIC_PREFIX "ack"
+
+/* Default topic of replies to queries */
+#define TOPIC_RESPONSE	TOPIC_PREFIX "response"
+
+/* Appended to the topic of directories publishing binary messages */
+#define TOPIC_SUFFIX_BINARY	"/bin"
+
 /* Connection timeout in seconds */
 #define MQTT_CONNECTION_TIMEOUT	36000
 
+/* Keepalive of publisher connections in seconds */
+#define MQTT_KEEPALIVE	60
+
+/* Multiplicative hash of a 32 bit key */
+static inline unsigned int hash_32(unsigned int val)
+{
+	return val * 2654435761u;
+}
+
+/* FNV-1a hash of a string */
+static inline uint64_t hash_str64(const char *s, size_t len)
+{
+	uint64_t h = 14695981039346656037ull;
+
+	while (len--)
+		h = (h ^ (unsigned char)*s++) * 1099511628211ull;
+	return h;
+}
+
+/* Cast a member of a structure out to the containing structure. */
+#ifndef container_of
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#endif
+
+/* Number of elements of an array */
+#ifndef ARRAY_SIZE
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+#endif
+
 #endif /* INTERNALS_H_INCLUDED */
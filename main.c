@@ -5,12 +5,204 @@
 
 #include "dir-monitor.h"
 #include "dm-manager.h"
+#include "dm-config.h"
+#include "dm-payload.h"
+#include "dm-sink.h"
+#include "dm-journal.h"
+#include "dm-filter.h"
 #include "debug.h"
 
 
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <dir1> <dir2> ... <dirn>\n"
+		"  -c <num>  Number of MQTT publisher connections (default %u)\n"
+		"  -q <num>  Publish queue length in messages (default %u)\n"
+		"  -i <num>  MQTT messages in flight at most, 0 = no limit (default %u)\n"
+		"  -Q <ms>   Batch quiet period (default %u)\n"
+		"  -D <ms>   Batch maximum delay (default %u)\n"
+		"  -E <num>  Batch maximum events (default %u)\n"
+		"  -B <num>  Batch maximum payload bytes (default %u)\n"
+		"  -P <num>  Message size at which batches are split (default %u)\n"
+		"  -d <ms>   Report modified files once quiet this long (default %u)\n"
+		"  -M <ms>   Maximum time a modified file waits to settle (default %u)\n"
+		"  -n        Do not coalesce repeated names within a batch\n"
+		"  -s        Do not keep directory snapshots for overflow recovery\n"
+		"  -b        Publish compact binary messages on DIR_MONITOR/<dir>/bin\n"
+		"  -f        Use fanotify instead of inotify (needs CAP_SYS_ADMIN)\n"
+		"  -r        Monitor directories recursively\n"
+		"  -C        Report files once written and closed or moved in\n"
+		"  -m        Report created files, renames and moves\n"
+		"  -x <glob> Drop events on files matching glob, repeatable\n"
+		"  -A        Include size, mtime, inode and mode of files\n"
+		"  -X <num>  Skip unchanged files, hashing those up to num bytes\n"
+		"  -L <n>[:<burst>] Summarize directories reporting over n files/s\n"
+		"  -o <list> Sinks: mqtt,file,stdout,ring (default mqtt)\n"
+		"  -O <path> File written by the file sink (default %s)\n"
+		"  -S <ms>   Statistics interval, 0 = off (default %u)\n"
+		"  -T <path> Write statistics in Prometheus text format to path\n"
+		"  -J <dir>  Journal MQTT messages in dir, publish at QoS 1\n"
+		"  -Z <num>  Journal segment size in bytes (default %u)\n"
+		"  -R <num>  Journal segments kept at most (default %u)\n"
+		"  -F <pol>  Journal fsync: none, always or interval in ms (default %u)\n"
+		"  -I <dir>  Save directory indexes in dir, catch up on restart\n"
+		"  -K <ms>   Index save interval, 0 = on stop only (default %u)\n"
+		"  -w <num>  Threads walking large trees (default %u)\n"
+		"  -W <num>  Threads executing control commands (default %u)\n"
+		"  -U        Read kernel events through io_uring when available\n"
+		"  -N <num>  Event engines sharing the directories (default %u)\n"
+		"  -p        Pin each event engine to a CPU\n"
+		"  -h        Show this help\n",
+		prog, CONFIG_MQTT_CONNECTIONS, CONFIG_MQTT_QUEUE_LEN,
+		CONFIG_MQTT_MAX_INFLIGHT,
+		CONFIG_BATCH_QUIET_MS, CONFIG_BATCH_MAX_DELAY_MS,
+		CONFIG_BATCH_MAX_EVENTS, CONFIG_BATCH_MAX_BYTES,
+		CONFIG_MAX_PAYLOAD, CONFIG_DEBOUNCE_MS, CONFIG_DEBOUNCE_MAX_MS,
+		CONFIG_SINK_FILE, CONFIG_STATS_INTERVAL_MS,
+		CONFIG_JOURNAL_SEGMENT_SIZE, CONFIG_JOURNAL_SEGMENTS,
+		CONFIG_JOURNAL_FSYNC_MS, CONFIG_INDEX_CHECKPOINT_MS,
+		CONFIG_WALK_THREADS,
+		CONFIG_CONTROL_WORKERS, CONFIG_WORKERS);
+}
+
 int main(int argc, char **argv)
 {
 	struct dm_manager *dmm = NULL;
+	struct dm_config cfg;
+	char *end;
+	int opt;
+
+	dm_config_init(&cfg);
+
+	while ((opt = getopt(argc, argv,
+			     "c:q:i:Q:D:E:B:P:d:M:nsbfrCmX:x:L:Ao:O:S:T:J:Z:R:F:I:K:w:W:UN:ph")) != -1) {
+		switch (opt) {
+		case 'c':
+			cfg.mqtt_connections = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			cfg.mqtt_queue_len = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			cfg.mqtt_max_inflight = strtoul(optarg, NULL, 0);
+			break;
+		case 'Q':
+			cfg.monitor.quiet_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'D':
+			cfg.monitor.max_delay_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'E':
+			cfg.monitor.max_events = strtoul(optarg, NULL, 0);
+			break;
+		case 'B':
+			cfg.monitor.max_bytes = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			cfg.monitor.max_payload = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			cfg.monitor.debounce_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'M':
+			cfg.monitor.debounce_max_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			cfg.monitor.coalesce = 0;
+			break;
+		case 's':
+			cfg.monitor.snapshot = 0;
+			break;
+		case 'b':
+			cfg.monitor.format = DM_PAYLOAD_BINARY;
+			break;
+		case 'f':
+			cfg.monitor.backend = DM_BACKEND_FANOTIFY;
+			break;
+		case 'r':
+			cfg.monitor.recursive = 1;
+			break;
+		case 'C':
+			cfg.monitor.completed = 1;
+			break;
+		case 'm':
+			cfg.monitor.moves = 1;
+			break;
+		case 'A':
+			cfg.monitor.metadata = 1;
+			break;
+		case 'x':
+			if ((cfg.monitor.filter == NULL &&
+			     dm_filter_create(&cfg.monitor.filter) != 0) ||
+			    dm_filter_add(cfg.monitor.filter, DM_RULE_EXCLUDE,
+					  optarg) != 0)
+				exit(EXIT_FAILURE);
+			break;
+		case 'X':
+			cfg.monitor.fingerprint = 1;
+			cfg.monitor.fingerprint_max_size =
+				strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			if (dm_sink_parse(optarg, &cfg.monitor.sinks) != 0)
+				exit(EXIT_FAILURE);
+			break;
+		case 'O':
+			cfg.sink_file = optarg;
+			break;
+		case 'S':
+			cfg.stats_interval_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			cfg.stats_file = optarg;
+			break;
+		case 'J':
+			cfg.journal_dir = optarg;
+			break;
+		case 'Z':
+			cfg.journal_segment_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			cfg.journal_segments = strtoul(optarg, NULL, 0);
+			break;
+		case 'F':
+			if (dm_journal_parse_fsync(optarg, &cfg.journal_fsync,
+						   &cfg.journal_fsync_ms) != 0)
+				exit(EXIT_FAILURE);
+			break;
+		case 'I':
+			cfg.index_dir = optarg;
+			break;
+		case 'K':
+			cfg.index_checkpoint_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			cfg.walk_threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'W':
+			cfg.control_workers = strtoul(optarg, NULL, 0);
+			break;
+		case 'U':
+			cfg.io_uring = 1;
+			break;
+		case 'L':
+			cfg.monitor.rate_limit = strtoul(optarg, &end, 0);
+			if (*end == ':')
+				cfg.monitor.rate_burst = strtoul(end + 1, NULL,
+								 0);
+			break;
+		case 'N':
+			cfg.workers = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			cfg.pin_workers = 1;
+			break;
+		default:
+			usage(argv[0]);
+			exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
 
 	/* Mosquitto lib initialization; Not thread safe..!! */
 	mosquitto_lib_init();
@@ -18,8 +210,9 @@ int main(int argc, char **argv)
 	INFO("Starting Directory monitoring system...");
 
 	/* Create manager thread */
-	if (dm_manager_start(&dmm, argc, argv) != 0) {
+	if (dm_manager_start(&dmm, &cfg, argc - optind, argv + optind) != 0) {
 		WARN("Failed to start Directory monitoring system..!!");
+		dm_filter_put(cfg.monitor.filter);
 		mosquitto_lib_cleanup();
 		exit(EXIT_FAILURE);
 	}
@@ -32,6 +225,7 @@ int main(int argc, char **argv)
 
 	INFO("Directory monitoring system stopped...!!");
 
+	dm_filter_put(cfg.monitor.filter);
 	mosquitto_lib_cleanup();
 	exit(EXIT_SUCCESS);
 }